@@ -669,14 +669,23 @@ ksmbd_build_ntlmssp_challenge_blob(struct challenge_message *chgblob,
 }
 
 #ifdef CONFIG_SMB_SERVER_KERBEROS5
-int ksmbd_krb5_authenticate(struct ksmbd_session *sess, char *in_blob,
-			    int in_len, char *out_blob, int *out_len)
+/**
+ * ksmbd_krb5_authenticate() - finish a krb5 session setup
+ * @sess:	session being set up
+ * @resp:	daemon's answer to the SPNEGO request, freed here; NULL if
+ *		the daemon did not answer
+ * @out_blob:	SPNEGO blob for the client
+ * @out_len:	size of @out_blob, set to the blob length on success
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_krb5_authenticate(struct ksmbd_session *sess,
+			    struct ksmbd_spnego_authen_response *resp,
+			    char *out_blob, int *out_len)
 {
-	struct ksmbd_spnego_authen_response *resp;
 	struct ksmbd_user *user = NULL;
 	int retval;
 
-	resp = ksmbd_ipc_spnego_authen_request(in_blob, in_len);
 	if (!resp) {
 		ksmbd_debug(AUTH, "SPNEGO_AUTHEN_REQUEST failure\n");
 		return -EINVAL;
@@ -719,9 +728,11 @@ out:
 	return retval;
 }
 #else
-int ksmbd_krb5_authenticate(struct ksmbd_session *sess, char *in_blob,
-			    int in_len, char *out_blob, int *out_len)
+int ksmbd_krb5_authenticate(struct ksmbd_session *sess,
+			    struct ksmbd_spnego_authen_response *resp,
+			    char *out_blob, int *out_len)
 {
+	kvfree(resp);
 	return -EOPNOTSUPP;
 }
 #endif
@@ -48,8 +48,10 @@ int ksmbd_decode_ntlmssp_neg_blob(struct negotiate_message *negblob,
 unsigned int
 ksmbd_build_ntlmssp_challenge_blob(struct challenge_message *chgblob,
 				   struct ksmbd_session *sess);
-int ksmbd_krb5_authenticate(struct ksmbd_session *sess, char *in_blob,
-			    int in_len, char *out_blob, int *out_len);
+struct ksmbd_spnego_authen_response;
+int ksmbd_krb5_authenticate(struct ksmbd_session *sess,
+			    struct ksmbd_spnego_authen_response *resp,
+			    char *out_blob, int *out_len);
 #ifdef CONFIG_SMB_INSECURE_SERVER
 int ksmbd_sign_smb1_pdu(struct ksmbd_session *sess, struct kvec *iov, int n_vec,
 			char *sig);
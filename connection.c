@@ -7,8 +7,11 @@
 #include <linux/mutex.h>
 #include <linux/freezer.h>
 #include <linux/module.h>
+#include <linux/version.h>
+#include <linux/rcupdate.h>
 
 #include "server.h"
+#include "ksmbd_netlink.h"
 #include "smb_common.h"
 #ifdef CONFIG_SMB_INSECURE_SERVER
 #include "smb1pdu.h"
@@ -25,6 +28,9 @@ static struct ksmbd_conn_ops default_conn_ops;
 static LIST_HEAD(conn_list);
 static DEFINE_RWLOCK(conn_list_lock);
 
+static void ksmbd_conn_tx_work(struct work_struct *wk);
+static enum hrtimer_restart ksmbd_conn_tx_timer(struct hrtimer *timer);
+
 /**
  * ksmbd_conn_free() - free resources of the connection instance
  *
@@ -39,6 +45,7 @@ void ksmbd_conn_free(struct ksmbd_conn *conn)
 	list_del(&conn->conns_list);
 	write_unlock(&conn_list_lock);
 
+	xa_destroy(&conn->sessions);
 	kvfree(conn->request_buf);
 	kfree(conn->preauth_info);
 	kfree(conn);
@@ -63,15 +70,29 @@ struct ksmbd_conn *ksmbd_conn_alloc(void)
 	if (!conn->local_nls)
 		conn->local_nls = load_nls_default();
 	atomic_set(&conn->req_running, 0);
+	atomic_set(&conn->req_sync_running, 0);
 	atomic_set(&conn->r_count, 0);
 	init_waitqueue_head(&conn->req_running_q);
 	INIT_LIST_HEAD(&conn->conns_list);
-	INIT_LIST_HEAD(&conn->sessions);
+	xa_init(&conn->sessions);
+	spin_lock_init(&conn->chann_lock);
+	INIT_LIST_HEAD(&conn->chann_list);
 	INIT_LIST_HEAD(&conn->requests);
 	INIT_LIST_HEAD(&conn->async_requests);
 	spin_lock_init(&conn->request_lock);
 	spin_lock_init(&conn->credits_lock);
 	ida_init(&conn->async_ida);
+	init_llist_head(&conn->tx_queue);
+	atomic_set(&conn->tx_nr, 0);
+	atomic64_set(&conn->stats.tx_wait_ns, 0);
+	INIT_WORK(&conn->tx_work, ksmbd_conn_tx_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&conn->tx_timer, ksmbd_conn_tx_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&conn->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	conn->tx_timer.function = ksmbd_conn_tx_timer;
+#endif
 
 	write_lock(&conn_list_lock);
 	list_add(&conn->conns_list, &conn_list);
@@ -96,6 +117,55 @@ bool ksmbd_conn_lookup_dialect(struct ksmbd_conn *c)
 	return ret;
 }
 
+/**
+ * ksmbd_conn_tx_show() - print the transmit state of each connection
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int ksmbd_conn_tx_show(char *buf, size_t size)
+{
+	struct ksmbd_conn *conn;
+	int sz = 0;
+
+	read_lock(&conn_list_lock);
+	list_for_each_entry(conn, &conn_list, conns_list) {
+		sz += scnprintf(buf + sz, size - sz,
+				"%pISpc queued %d served %lld wait_us %lld\n",
+				&conn->peer_addr, atomic_read(&conn->tx_nr),
+				atomic64_read(&conn->stats.request_served),
+				div_s64(atomic64_read(&conn->stats.tx_wait_ns),
+					NSEC_PER_USEC));
+	}
+	read_unlock(&conn_list_lock);
+	return sz;
+}
+
+/**
+ * ksmbd_conn_credits_show() - print the SMB2 credit state of each connection
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int ksmbd_conn_credits_show(char *buf, size_t size)
+{
+	struct ksmbd_conn *conn;
+	int sz = 0;
+
+	read_lock(&conn_list_lock);
+	list_for_each_entry(conn, &conn_list, conns_list) {
+		sz += scnprintf(buf + sz, size - sz,
+				"%pISpc window %u granted %u running %d\n",
+				&conn->peer_addr, conn->credit_window,
+				conn->total_credits,
+				atomic_read(&conn->req_running));
+	}
+	read_unlock(&conn_list_lock);
+	return sz;
+}
+
 void ksmbd_conn_enqueue_request(struct ksmbd_work *work)
 {
 	struct ksmbd_conn *conn = work->conn;
@@ -121,6 +191,7 @@ void ksmbd_conn_enqueue_request(struct ksmbd_work *work)
 
 	if (requests_queue) {
 		atomic_inc(&conn->req_running);
+		ksmbd_conn_sync_begin(work);
 		spin_lock(&conn->request_lock);
 		list_add_tail(&work->request_entry, requests_queue);
 		spin_unlock(&conn->request_lock);
@@ -132,6 +203,8 @@ int ksmbd_conn_try_dequeue_request(struct ksmbd_work *work)
 	struct ksmbd_conn *conn = work->conn;
 	int ret = 1;
 
+	/* an interim response means the final one will take a while */
+	ksmbd_conn_sync_done(work);
 	if (list_empty(&work->request_entry) &&
 	    list_empty(&work->async_request_entry))
 		return 0;
@@ -150,14 +223,28 @@ int ksmbd_conn_try_dequeue_request(struct ksmbd_work *work)
 	return ret;
 }
 
-static void ksmbd_conn_lock(struct ksmbd_conn *conn)
+/**
+ * ksmbd_conn_sync_begin() - count a work whose response will follow shortly
+ * @work:	smb work being processed by a worker
+ */
+void ksmbd_conn_sync_begin(struct ksmbd_work *work)
 {
-	mutex_lock(&conn->srv_mutex);
+	if (work->sync_running)
+		return;
+	work->sync_running = true;
+	atomic_inc(&work->conn->req_sync_running);
 }
 
-static void ksmbd_conn_unlock(struct ksmbd_conn *conn)
+/**
+ * ksmbd_conn_sync_done() - stop counting a work towards the sender batching
+ * @work:	smb work that answered, went async or was parked
+ */
+void ksmbd_conn_sync_done(struct ksmbd_work *work)
 {
-	mutex_unlock(&conn->srv_mutex);
+	if (!work->sync_running)
+		return;
+	work->sync_running = false;
+	atomic_dec(&work->conn->req_sync_running);
 }
 
 void ksmbd_conn_wait_idle(struct ksmbd_conn *conn)
@@ -165,84 +252,352 @@ void ksmbd_conn_wait_idle(struct ksmbd_conn *conn)
 	wait_event(conn->req_running_q, atomic_read(&conn->req_running) < 2);
 }
 
-int ksmbd_conn_write(struct ksmbd_work *work)
+/**
+ * ksmbd_conn_rsp_iov() - describe the response of a work as kvecs
+ * @work:	smb work containing response buffer
+ * @iov:	array of at least three kvecs to fill
+ * @len:	length of the response is added here
+ *
+ * Return:	number of kvecs used
+ */
+static int ksmbd_conn_rsp_iov(struct ksmbd_work *work, struct kvec *iov,
+			      size_t *len)
 {
-	struct ksmbd_conn *conn = work->conn;
 	struct smb_hdr *rsp_hdr = work->response_buf;
-	size_t len = 0;
-	int sent;
-	struct kvec iov[3];
 	int iov_idx = 0;
 
-	ksmbd_conn_try_dequeue_request(work);
-	if (!rsp_hdr) {
-		pr_err("NULL response header\n");
-		return -EINVAL;
-	}
-
 	if (work->tr_buf) {
 		iov[iov_idx] = (struct kvec) { work->tr_buf,
 				sizeof(struct smb2_transform_hdr) };
-		len += iov[iov_idx++].iov_len;
+		*len += iov[iov_idx++].iov_len;
 	}
 
 	if (work->aux_payload_sz) {
 		iov[iov_idx] = (struct kvec) { rsp_hdr, work->resp_hdr_sz };
-		len += iov[iov_idx++].iov_len;
+		*len += iov[iov_idx++].iov_len;
 		iov[iov_idx] = (struct kvec) { work->aux_payload_buf, work->aux_payload_sz };
-		len += iov[iov_idx++].iov_len;
+		*len += iov[iov_idx++].iov_len;
 	} else {
 		if (work->tr_buf)
 			iov[iov_idx].iov_len = work->resp_hdr_sz;
 		else
 			iov[iov_idx].iov_len = get_rfc1002_len(rsp_hdr) + 4;
 		iov[iov_idx].iov_base = rsp_hdr;
-		len += iov[iov_idx++].iov_len;
+		*len += iov[iov_idx++].iov_len;
 	}
+	return iov_idx;
+}
 
-	ksmbd_conn_lock(conn);
-	sent = conn->transport->ops->writev(conn->transport, &iov[0],
-					iov_idx, len,
-					work->need_invalidate_rkey,
-					work->remote_key);
-	ksmbd_conn_unlock(conn);
+/**
+ * ksmbd_conn_tx_done() - finish a response the sender has written
+ * @conn:	connection instance
+ * @work:	smb work of the response
+ * @result:	0 on success, otherwise error of the send
+ *
+ * Wake up the writer waiting in ksmbd_conn_write(), or free a work handed
+ * over by ksmbd_conn_write_async() together with its connection reference.
+ */
+static void ksmbd_conn_tx_done(struct ksmbd_conn *conn,
+			       struct ksmbd_work *work, int result)
+{
+	struct completion *done = work->tx_done;
 
-	if (sent < 0) {
+	if (done) {
+		work->tx_result = result;
+		complete(done);
+		return;
+	}
+
+	ksmbd_free_work_struct(work);
+	atomic_dec(&conn->r_count);
+}
+
+static void ksmbd_conn_tx_flush(struct ksmbd_conn *conn, int nr, int niov,
+				size_t len)
+{
+	struct ksmbd_work *last = conn->tx_batch[nr - 1];
+	int sent, i;
+
+	sent = conn->transport->ops->writev(conn->transport, conn->tx_iov,
+					    niov, len,
+					    last->need_invalidate_rkey,
+					    last->remote_key);
+	if (sent < 0)
 		pr_err("Failed to send message: %d\n", sent);
-		return sent;
+
+	for (i = 0; i < nr; i++)
+		ksmbd_conn_tx_done(conn, conn->tx_batch[i],
+				   sent < 0 ? sent : 0);
+}
+
+/*
+ * Sender of the connection. Only one instance runs at a time, so responses
+ * go out in the order they were queued. Transports that can carry several
+ * PDUs in one writev() get up to KSMBD_TX_BATCH_RSPS responses per send.
+ */
+static void ksmbd_conn_tx_work(struct work_struct *wk)
+{
+	struct ksmbd_conn *conn = container_of(wk, struct ksmbd_conn,
+					       tx_work);
+	struct llist_node *node;
+	struct ksmbd_work *work;
+	int nr = 0, niov = 0;
+	size_t len = 0;
+
+	while ((node = llist_del_all(&conn->tx_queue))) {
+		node = llist_reverse_order(node);
+		while (node) {
+			work = llist_entry(node, struct ksmbd_work, tx_node);
+			node = node->next;
+			atomic_dec(&conn->tx_nr);
+
+			conn->tx_batch[nr++] = work;
+			niov += ksmbd_conn_rsp_iov(work, &conn->tx_iov[niov],
+						   &len);
+			if (node && conn->transport->coalesce_tx &&
+			    nr < KSMBD_TX_BATCH_RSPS &&
+			    len < KSMBD_TX_BATCH_BYTES)
+				continue;
+
+			ksmbd_conn_tx_flush(conn, nr, niov, len);
+			nr = 0;
+			niov = 0;
+			len = 0;
+		}
 	}
+}
 
+static enum hrtimer_restart ksmbd_conn_tx_timer(struct hrtimer *timer)
+{
+	struct ksmbd_conn *conn = container_of(timer, struct ksmbd_conn,
+					       tx_timer);
+
+	ksmbd_queue_tx_work(&conn->tx_work);
+	return HRTIMER_NORESTART;
+}
+
+/* fail the responses the sender will not get to anymore */
+static void ksmbd_conn_tx_drain(struct ksmbd_conn *conn)
+{
+	struct ksmbd_work *work, *tmp;
+	struct llist_node *node;
+
+	node = llist_del_all(&conn->tx_queue);
+	llist_for_each_entry_safe(work, tmp, node, tx_node) {
+		atomic_dec(&conn->tx_nr);
+		ksmbd_conn_tx_done(conn, work, -ESHUTDOWN);
+	}
+}
+
+/*
+ * Stop the sender once the handler has no request left. A response
+ * queued afterwards, e.g. an oplock break sent from another connection,
+ * is refused by ksmbd_conn_tx_queue(), and one the sender did not get to
+ * is failed, so no writer waits for a sender which is gone.
+ */
+static void ksmbd_conn_tx_close(struct ksmbd_conn *conn)
+{
+	WRITE_ONCE(conn->tx_closed, true);
+	/* writers which still saw the sender open are done queueing */
+	synchronize_rcu();
+
+	hrtimer_cancel(&conn->tx_timer);
+	cancel_work_sync(&conn->tx_work);
+	ksmbd_conn_tx_drain(conn);
+}
+
+/**
+ * ksmbd_conn_tx_queue() - hand a response to the sender of the connection
+ * @work:	smb work containing response buffer
+ *
+ * Return:	0 on success, -EINVAL if there is no response, otherwise
+ *		-ESHUTDOWN if the sender is gone
+ */
+static int ksmbd_conn_tx_queue(struct ksmbd_work *work)
+{
+	struct ksmbd_conn *conn = work->conn;
+	struct kvec iov[3];
+	size_t len = 0;
+	bool first;
+	int nr;
+
+	ksmbd_conn_try_dequeue_request(work);
+	if (!work->response_buf) {
+		pr_err("NULL response header\n");
+		return -EINVAL;
+	}
+
+	ksmbd_conn_rsp_iov(work, iov, &len);
+
+	rcu_read_lock();
+	if (READ_ONCE(conn->tx_closed)) {
+		rcu_read_unlock();
+		return -ESHUTDOWN;
+	}
+
+	first = llist_add(&work->tx_node, &conn->tx_queue);
+	nr = atomic_inc_return(&conn->tx_nr);
+
+	/*
+	 * While workers are still processing other requests their small
+	 * responses will follow shortly, so give them up to
+	 * KSMBD_TX_BATCH_DELAY to share the send. Pending locks, parked and
+	 * other async works are not waited for, they may take seconds.
+	 * Otherwise wake up the sender right away.
+	 */
+	if (!conn->transport->coalesce_tx || len > KSMBD_TX_COALESCE_SIZE ||
+	    nr >= KSMBD_TX_BATCH_RSPS ||
+	    !atomic_read(&conn->req_sync_running)) {
+		hrtimer_try_to_cancel(&conn->tx_timer);
+		ksmbd_queue_tx_work(&conn->tx_work);
+	} else if (first) {
+		hrtimer_start(&conn->tx_timer, ns_to_ktime(KSMBD_TX_BATCH_DELAY),
+			      HRTIMER_MODE_REL);
+	}
+	rcu_read_unlock();
 	return 0;
 }
 
+/**
+ * ksmbd_conn_write() - send a response and wait until it is written
+ * @work:	smb work containing response buffer
+ *
+ * The work stays owned by the caller, which may reuse it for another
+ * response afterwards (interim responses, oplock breaks, SMB1 echo).
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_conn_write(struct ksmbd_work *work)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct ksmbd_conn *conn = work->conn;
+	ktime_t start = ktime_get();
+	int rc;
+
+	work->tx_done = &done;
+	rc = ksmbd_conn_tx_queue(work);
+	if (!rc) {
+		wait_for_completion(&done);
+		rc = work->tx_result;
+	}
+	work->tx_done = NULL;
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &conn->stats.tx_wait_ns);
+	return rc;
+}
+
+/**
+ * ksmbd_conn_write_async() - hand a response over to the sender
+ * @work:	smb work containing response buffer
+ *
+ * The caller gives up @work and its reference on conn->r_count, both are
+ * dropped once the response is written. The worker returns without waiting
+ * for the transport.
+ */
+void ksmbd_conn_write_async(struct ksmbd_work *work)
+{
+	struct ksmbd_conn *conn = work->conn;
+	ktime_t start = ktime_get();
+
+	work->tx_done = NULL;
+	if (ksmbd_conn_tx_queue(work)) {
+		ksmbd_free_work_struct(work);
+		atomic_dec(&conn->r_count);
+		return;
+	}
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &conn->stats.tx_wait_ns);
+}
+
 int ksmbd_conn_rdma_read(struct ksmbd_conn *conn, void *buf,
-			 unsigned int buflen, u32 remote_key, u64 remote_offset,
-			 u32 remote_len)
+			 unsigned int buflen,
+			 struct smb2_buffer_desc_v1 *desc,
+			 unsigned int desc_len)
 {
 	int ret = -EINVAL;
 
 	if (conn->transport->ops->rdma_read)
 		ret = conn->transport->ops->rdma_read(conn->transport,
 						      buf, buflen,
-						      remote_key, remote_offset,
-						      remote_len);
+						      desc, desc_len);
 	return ret;
 }
 
 int ksmbd_conn_rdma_write(struct ksmbd_conn *conn, void *buf,
-			  unsigned int buflen, u32 remote_key,
-			  u64 remote_offset, u32 remote_len)
+			  unsigned int buflen,
+			  struct smb2_buffer_desc_v1 *desc,
+			  unsigned int desc_len)
 {
 	int ret = -EINVAL;
 
 	if (conn->transport->ops->rdma_write)
 		ret = conn->transport->ops->rdma_write(conn->transport,
 						       buf, buflen,
-						       remote_key, remote_offset,
-						       remote_len);
+						       desc, desc_len);
 	return ret;
 }
 
+/**
+ * ksmbd_conn_rdma_submit() - start an RDMA read/write without waiting
+ * for it, if the transport supports it
+ * @conn:	connection
+ * @buf:	local buffer, must stay valid until ksmbd_conn_rdma_wait()
+ * @buflen:	length of @buf
+ * @desc:	buffer descriptors of the client
+ * @desc_len:	length of @desc in bytes
+ * @desc_off:	offset into the client buffers @buf is transferred at
+ * @is_read:	RDMA read from the client if true, otherwise RDMA write
+ * @nowait:	fail with -EAGAIN instead of waiting for RDMA r/w credits
+ *
+ * Return:	request on success, otherwise error pointer
+ */
+struct ksmbd_rdma_req *
+ksmbd_conn_rdma_submit(struct ksmbd_conn *conn, void *buf, unsigned int buflen,
+		       struct smb2_buffer_desc_v1 *desc, unsigned int desc_len,
+		       unsigned int desc_off, bool is_read, bool nowait)
+{
+	if (!conn->transport->ops->rdma_submit)
+		return ERR_PTR(-EOPNOTSUPP);
+
+	return conn->transport->ops->rdma_submit(conn->transport, buf, buflen,
+						 desc, desc_len, desc_off,
+						 is_read, nowait);
+}
+
+/**
+ * ksmbd_conn_rdma_submit_pages() - start an RDMA write of pages to the
+ * client buffers without copying them, if the transport supports it
+ * @conn:	connection
+ * @pages:	local pages, referenced until ksmbd_conn_rdma_wait()
+ * @offset:	offset of the data into the first page
+ * @len:	length of the data
+ * @desc:	buffer descriptors of the client
+ * @desc_len:	length of @desc in bytes
+ * @desc_off:	offset into the client buffers the data is written at
+ *
+ * Return:	request on success, otherwise error pointer
+ */
+struct ksmbd_rdma_req *
+ksmbd_conn_rdma_submit_pages(struct ksmbd_conn *conn, struct page **pages,
+			     unsigned int offset, unsigned int len,
+			     struct smb2_buffer_desc_v1 *desc,
+			     unsigned int desc_len, unsigned int desc_off)
+{
+	if (!conn->transport->ops->rdma_submit_pages)
+		return ERR_PTR(-EOPNOTSUPP);
+
+	return conn->transport->ops->rdma_submit_pages(conn->transport, pages,
+						       offset, len, desc,
+						       desc_len, desc_off);
+}
+
+int ksmbd_conn_rdma_wait(struct ksmbd_conn *conn, struct ksmbd_rdma_req *req)
+{
+	return conn->transport->ops->rdma_wait(conn->transport, req);
+}
+
 bool ksmbd_conn_alive(struct ksmbd_conn *conn)
 {
 	if (!ksmbd_server_running())
@@ -271,6 +626,40 @@ bool ksmbd_conn_alive(struct ksmbd_conn *conn)
 	return true;
 }
 
+/* move the handler thread to the NUMA node of the NIC of the connection */
+static void ksmbd_conn_steer_handler(struct ksmbd_conn *conn)
+{
+	int cpu = ksmbd_conn_rx_cpu(conn);
+	int node;
+
+	if (cpu < 0)
+		return;
+
+	conn->rx_steered = true;
+	node = cpu_to_node(cpu);
+	if (node == NUMA_NO_NODE || node == numa_node_id())
+		return;
+
+	ksmbd_debug(CONN, "moving connection handler to node %d\n", node);
+	set_cpus_allowed_ptr(current, cpumask_of_node(node));
+}
+
+/**
+ * ksmbd_conn_release_request_buf() - free a request buffer, or give it
+ * back to the transport if it was lent by ->read_pdu()
+ * @conn:	connection instance
+ * @buf:	request buffer
+ * @ctx:	transport context of @buf, NULL if it was allocated
+ */
+void ksmbd_conn_release_request_buf(struct ksmbd_conn *conn, void *buf,
+				    void *ctx)
+{
+	if (ctx)
+		conn->transport->ops->release_pdu(conn->transport, ctx);
+	else
+		kvfree(buf);
+}
+
 /**
  * ksmbd_conn_handler_loop() - session thread to listen on new smb requests
  * @p:		connection instance
@@ -287,7 +676,6 @@ int ksmbd_conn_handler_loop(void *p)
 	char hdr_buf[4] = {0,};
 	int size;
 
-	mutex_init(&conn->srv_mutex);
 	__module_get(THIS_MODULE);
 
 	if (t->ops->prepare && t->ops->prepare(t))
@@ -298,8 +686,10 @@ int ksmbd_conn_handler_loop(void *p)
 		if (try_to_freeze())
 			continue;
 
-		kvfree(conn->request_buf);
+		ksmbd_conn_release_request_buf(conn, conn->request_buf,
+					       conn->request_buf_ctx);
 		conn->request_buf = NULL;
+		conn->request_buf_ctx = NULL;
 
 		size = t->ops->read(t, hdr_buf, sizeof(hdr_buf));
 		if (size != sizeof(hdr_buf))
@@ -315,31 +705,44 @@ int ksmbd_conn_handler_loop(void *p)
 			continue;
 		}
 
-		/* 4 for rfc1002 length field */
-		size = pdu_size + 4;
-		conn->request_buf = kvmalloc(size, GFP_KERNEL);
-		if (!conn->request_buf)
-			continue;
+		/* process the PDU in the transport's buffer if it can lend it */
+		if (t->ops->read_pdu)
+			conn->request_buf = t->ops->read_pdu(t, pdu_size,
+							     &conn->request_buf_ctx);
+
+		if (!conn->request_buf) {
+			/* 4 for rfc1002 length field */
+			size = pdu_size + 4;
+			conn->request_buf = kvmalloc(size, GFP_KERNEL);
+			if (!conn->request_buf)
+				continue;
+		}
 
 		memcpy(conn->request_buf, hdr_buf, sizeof(hdr_buf));
 		if (!ksmbd_smb_request(conn))
 			break;
 
-		/*
-		 * We already read 4 bytes to find out PDU size, now
-		 * read in PDU
-		 */
-		size = t->ops->read(t, conn->request_buf + 4, pdu_size);
-		if (size < 0) {
-			pr_err("sock_read failed: %d\n", size);
-			break;
+		if (!conn->request_buf_ctx) {
+			/*
+			 * We already read 4 bytes to find out PDU size, now
+			 * read in PDU
+			 */
+			size = t->ops->read(t, conn->request_buf + 4, pdu_size);
+			if (size < 0) {
+				pr_err("sock_read failed: %d\n", size);
+				break;
+			}
+
+			if (size != pdu_size) {
+				pr_err("PDU error. Read: %d, Expected: %d\n",
+				       size, pdu_size);
+				continue;
+			}
 		}
 
-		if (size != pdu_size) {
-			pr_err("PDU error. Read: %d, Expected: %d\n",
-			       size, pdu_size);
-			continue;
-		}
+		if (!conn->rx_steered &&
+		    server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL)
+			ksmbd_conn_steer_handler(conn);
 
 		if (!default_conn_ops.process_fn) {
 			pr_err("No connection request callback\n");
@@ -357,9 +760,17 @@ out:
 	while (atomic_read(&conn->r_count) > 0)
 		schedule_timeout(HZ);
 
+	/* the sender may still be running after dropping the last reference */
+	ksmbd_conn_tx_close(conn);
+
 	unload_nls(conn->local_nls);
 	if (default_conn_ops.terminate_fn)
 		default_conn_ops.terminate_fn(conn);
+	/* a lent buffer must go back before the transport is freed */
+	ksmbd_conn_release_request_buf(conn, conn->request_buf,
+				       conn->request_buf_ctx);
+	conn->request_buf = NULL;
+	conn->request_buf_ctx = NULL;
 	t->ops->disconnect(t);
 	module_put(THIS_MODULE);
 	return 0;
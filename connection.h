@@ -13,7 +13,9 @@
 #include <net/inet_connection_sock.h>
 #include <net/request_sock.h>
 #include <linux/kthread.h>
+#include <linux/hrtimer.h>
 #include <linux/nls.h>
+#include <linux/xarray.h>
 
 #include "smb_common.h"
 #include "ksmbd_work.h"
@@ -38,8 +40,17 @@ enum {
 struct ksmbd_stats {
 	atomic_t			open_files_count;
 	atomic64_t			request_served;
+	/* time workers spent handing over or waiting for responses */
+	atomic64_t			tx_wait_ns;
 };
 
+/* responses larger than this wake up the sender right away */
+#define KSMBD_TX_COALESCE_SIZE	4096
+#define KSMBD_TX_BATCH_RSPS	16
+#define KSMBD_TX_BATCH_BYTES	(64 * 1024)
+/* how long the sender waits for more small responses, in ns */
+#define KSMBD_TX_BATCH_DELAY	(200 * NSEC_PER_USEC)
+
 struct ksmbd_transport;
 
 struct ksmbd_conn {
@@ -47,22 +58,43 @@ struct ksmbd_conn {
 	struct smb_version_ops		*ops;
 	struct smb_version_cmds		*cmds;
 	unsigned int			max_cmds;
-	struct mutex			srv_mutex;
 	int				status;
 	unsigned int			cli_cap;
 	char				*request_buf;
+	/* transport buffer that holds request_buf, if it was not copied */
+	void				*request_buf_ctx;
 	struct ksmbd_transport		*transport;
 	struct nls_table		*local_nls;
 	struct list_head		conns_list;
-	/* smb session 1 per user */
-	struct list_head		sessions;
+	/* smb sessions 1 per user, indexed by session id */
+	struct xarray			sessions;
+	/*
+	 * channels this connection bound to sessions, nested inside their
+	 * session's chann_lock, see ksmbd_sessions_deregister()
+	 */
+	spinlock_t			chann_lock;
+	struct list_head		chann_list;
+	/* session of the last lookup, see ksmbd_session_lookup() */
+	struct ksmbd_session		*last_sess;
+	/* tree connection of the last lookup, see ksmbd_tree_conn_lookup() */
+	struct ksmbd_tree_connect	*last_tcon;
 	unsigned long			last_active;
 	/* How many request are running currently */
 	atomic_t			req_running;
+	/*
+	 * Requests a worker is still processing towards their response,
+	 * without the async, parked or multi-response ones.
+	 */
+	atomic_t			req_sync_running;
 	/* References which are made for this Server object*/
 	atomic_t			r_count;
 	unsigned short			total_credits;
 	unsigned short			max_credits;
+	/* most credits the client may hold, see smb2_set_rsp_credits() */
+	unsigned short			credit_window;
+	/* a grant was cut by credit_window since the last adjustment */
+	bool				credit_limited;
+	unsigned long			credit_adjust_time;
 	spinlock_t			credits_lock;
 	wait_queue_head_t		req_running_q;
 	/* Lock to protect requests list*/
@@ -107,6 +139,20 @@ struct ksmbd_conn {
 	__le16				compress_algorithm;
 	bool				posix_ext_supported;
 	bool				binding;
+	/* handler thread was moved to the NUMA node of the NIC */
+	bool				rx_steered;
+
+	/* responses waiting for the sender, see ksmbd_conn_write() */
+	struct llist_head		tx_queue;
+	atomic_t			tx_nr;
+	struct work_struct		tx_work;
+	/* wakes up the sender after KSMBD_TX_BATCH_DELAY */
+	struct hrtimer			tx_timer;
+	/* the sender is gone, see ksmbd_conn_tx_close() */
+	bool				tx_closed;
+	/* batch being built by the sender */
+	struct ksmbd_work		*tx_batch[KSMBD_TX_BATCH_RSPS];
+	struct kvec			tx_iov[KSMBD_TX_BATCH_RSPS * 3];
 };
 
 struct ksmbd_conn_ops {
@@ -114,24 +160,47 @@ struct ksmbd_conn_ops {
 	int	(*terminate_fn)(struct ksmbd_conn *conn);
 };
 
+struct ksmbd_rdma_req;
+
 struct ksmbd_transport_ops {
 	int (*prepare)(struct ksmbd_transport *t);
 	void (*disconnect)(struct ksmbd_transport *t);
 	int (*read)(struct ksmbd_transport *t, char *buf, unsigned int size);
+	char *(*read_pdu)(struct ksmbd_transport *t, unsigned int size,
+			  void **ctx);
+	void (*release_pdu)(struct ksmbd_transport *t, void *ctx);
+	int (*rx_cpu)(struct ksmbd_transport *t);
 	int (*writev)(struct ksmbd_transport *t, struct kvec *iovs, int niov,
 		      int size, bool need_invalidate_rkey,
 		      unsigned int remote_key);
 	int (*rdma_read)(struct ksmbd_transport *t, void *buf, unsigned int len,
-			 u32 remote_key, u64 remote_offset, u32 remote_len);
+			 struct smb2_buffer_desc_v1 *desc,
+			 unsigned int desc_len);
 	int (*rdma_write)(struct ksmbd_transport *t, void *buf,
-			  unsigned int len, u32 remote_key, u64 remote_offset,
-			  u32 remote_len);
+			  unsigned int len, struct smb2_buffer_desc_v1 *desc,
+			  unsigned int desc_len);
+	struct ksmbd_rdma_req *(*rdma_submit)(struct ksmbd_transport *t,
+					      void *buf, unsigned int len,
+					      struct smb2_buffer_desc_v1 *desc,
+					      unsigned int desc_len,
+					      unsigned int desc_off,
+					      bool is_read, bool nowait);
+	struct ksmbd_rdma_req *(*rdma_submit_pages)(struct ksmbd_transport *t,
+						    struct page **pages,
+						    unsigned int offset,
+						    unsigned int len,
+						    struct smb2_buffer_desc_v1 *desc,
+						    unsigned int desc_len,
+						    unsigned int desc_off);
+	int (*rdma_wait)(struct ksmbd_transport *t, struct ksmbd_rdma_req *req);
 };
 
 struct ksmbd_transport {
 	struct ksmbd_conn		*conn;
 	struct ksmbd_transport_ops	*ops;
 	struct task_struct		*handler;
+	/* writev() can carry several PDUs back to back */
+	bool				coalesce_tx;
 };
 
 #define KSMBD_TCP_RECV_TIMEOUT	(7 * HZ)
@@ -143,15 +212,34 @@ void ksmbd_conn_wait_idle(struct ksmbd_conn *conn);
 struct ksmbd_conn *ksmbd_conn_alloc(void);
 void ksmbd_conn_free(struct ksmbd_conn *conn);
 bool ksmbd_conn_lookup_dialect(struct ksmbd_conn *c);
+int ksmbd_conn_credits_show(char *buf, size_t size);
+int ksmbd_conn_tx_show(char *buf, size_t size);
 int ksmbd_conn_write(struct ksmbd_work *work);
+void ksmbd_conn_write_async(struct ksmbd_work *work);
+void ksmbd_conn_release_request_buf(struct ksmbd_conn *conn, void *buf,
+				    void *ctx);
 int ksmbd_conn_rdma_read(struct ksmbd_conn *conn, void *buf,
-			 unsigned int buflen, u32 remote_key, u64 remote_offset,
-			 u32 remote_len);
+			 unsigned int buflen,
+			 struct smb2_buffer_desc_v1 *desc,
+			 unsigned int desc_len);
 int ksmbd_conn_rdma_write(struct ksmbd_conn *conn, void *buf,
-			  unsigned int buflen, u32 remote_key, u64 remote_offset,
-			  u32 remote_len);
+			  unsigned int buflen,
+			  struct smb2_buffer_desc_v1 *desc,
+			  unsigned int desc_len);
+struct ksmbd_rdma_req *
+ksmbd_conn_rdma_submit(struct ksmbd_conn *conn, void *buf, unsigned int buflen,
+		       struct smb2_buffer_desc_v1 *desc, unsigned int desc_len,
+		       unsigned int desc_off, bool is_read, bool nowait);
+struct ksmbd_rdma_req *
+ksmbd_conn_rdma_submit_pages(struct ksmbd_conn *conn, struct page **pages,
+			     unsigned int offset, unsigned int len,
+			     struct smb2_buffer_desc_v1 *desc,
+			     unsigned int desc_len, unsigned int desc_off);
+int ksmbd_conn_rdma_wait(struct ksmbd_conn *conn, struct ksmbd_rdma_req *req);
 void ksmbd_conn_enqueue_request(struct ksmbd_work *work);
 int ksmbd_conn_try_dequeue_request(struct ksmbd_work *work);
+void ksmbd_conn_sync_begin(struct ksmbd_work *work);
+void ksmbd_conn_sync_done(struct ksmbd_work *work);
 void ksmbd_conn_init_server_callbacks(struct ksmbd_conn_ops *ops);
 int ksmbd_conn_handler_loop(void *p);
 int ksmbd_conn_transport_init(void);
@@ -163,6 +251,30 @@ void ksmbd_conn_transport_destroy(void);
  * This is a hack. We will move status to a proper place once we land
  * a multi-sessions support.
  */
+static inline bool ksmbd_conn_rdma_async(struct ksmbd_conn *conn)
+{
+	return conn->transport->ops->rdma_submit;
+}
+
+static inline bool ksmbd_conn_rdma_pages(struct ksmbd_conn *conn)
+{
+	return conn->transport->ops->rdma_submit_pages;
+}
+
+/* cpu that last received data of the connection from the NIC, or -1 */
+static inline int ksmbd_conn_rx_cpu(struct ksmbd_conn *conn)
+{
+	int cpu;
+
+	if (!conn->transport->ops->rx_cpu)
+		return -1;
+
+	cpu = conn->transport->ops->rx_cpu(conn->transport);
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -1;
+	return cpu;
+}
+
 static inline bool ksmbd_conn_good(struct ksmbd_work *work)
 {
 	return work->conn->status == KSMBD_SESS_GOOD;
@@ -0,0 +1,594 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2021 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/fs.h>
+#include <linux/cred.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/iversion.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+#include <linux/dcache.h>
+#include <linux/ctype.h>
+#include <linux/stringhash.h>
+
+#include "glob.h"
+#include "server.h"
+#include "ksmbd_netlink.h"
+#include "dir_cache.h"
+#include "vfs_cache.h"
+
+/*
+ * A snapshot is served only while the directory inode is unchanged and
+ * for a short while after it was read, since attributes of the children
+ * (size, times) can change without touching the directory itself.
+ */
+#define KSMBD_DIR_CACHE_TTL		(2 * HZ)
+#define KSMBD_DIR_CACHE_MAX_SNAPSHOT	(8 * 1024 * 1024)
+#define KSMBD_DIR_CACHE_MAX_BYTES	(64 * 1024 * 1024)
+
+#define DIR_CACHE_HASH_BITS		8
+static DEFINE_HASHTABLE(dir_cache_table, DIR_CACHE_HASH_BITS);
+static LIST_HEAD(dir_cache_lru);
+static DEFINE_SPINLOCK(dir_cache_lock);
+
+static unsigned long dir_cache_nr;
+static unsigned long dir_cache_bytes;
+static atomic_long_t dir_cache_hits;
+static atomic_long_t dir_cache_misses;
+
+/*
+ * Names which a caseless lookup did not find in a directory. An entry is
+ * only trusted while the directory is unchanged, plus a TTL to cover
+ * timestamps too coarse to show a change.
+ */
+#define KSMBD_NEG_CACHE_TTL		(10 * HZ)
+#define KSMBD_NEG_CACHE_MAX_ENTRIES	4096
+
+struct ksmbd_neg_entry {
+	struct hlist_node		hlist;
+	struct list_head		lru;
+	unsigned long			ino;
+	dev_t				dev;
+	u64				iversion;
+	struct timespec64		mtime;
+	struct timespec64		ctime;
+	unsigned long			birth;
+	unsigned int			hash;
+	unsigned int			len;
+	char				name[];
+};
+
+#define NEG_CACHE_HASH_BITS		10
+static DEFINE_HASHTABLE(neg_cache_table, NEG_CACHE_HASH_BITS);
+static LIST_HEAD(neg_cache_lru);
+static DEFINE_SPINLOCK(neg_cache_lock);
+
+static unsigned long neg_cache_nr;
+static atomic_long_t neg_cache_hits;
+static atomic_long_t neg_cache_misses;
+
+static unsigned int dir_cache_hash(unsigned long ino, dev_t dev)
+{
+	return jhash_2words((u32)ino, (u32)dev, 0);
+}
+
+static void dir_snapshot_stamp(struct ksmbd_dir_snapshot *snap,
+			       struct inode *dir)
+{
+	snap->ino = dir->i_ino;
+	snap->dev = dir->i_sb->s_dev;
+	if (IS_I_VERSION(dir))
+		snap->iversion = inode_query_iversion(dir);
+	snap->mtime = dir->i_mtime;
+	snap->ctime = dir->i_ctime;
+	snap->birth = jiffies;
+	snap->fsuid = current_fsuid();
+	snap->fsgid = current_fsgid();
+}
+
+/*
+ * Entries were read with the credentials of the user who built the
+ * snapshot, so it is only served to requests running with the same ones.
+ */
+static bool dir_snapshot_cred_match(struct ksmbd_dir_snapshot *snap)
+{
+	return uid_eq(snap->fsuid, current_fsuid()) &&
+		gid_eq(snap->fsgid, current_fsgid());
+}
+
+static bool dir_snapshot_valid(struct ksmbd_dir_snapshot *snap,
+			       struct inode *dir)
+{
+	if (time_after(jiffies, snap->birth + KSMBD_DIR_CACHE_TTL))
+		return false;
+	if (IS_I_VERSION(dir) && !inode_eq_iversion(dir, snap->iversion))
+		return false;
+	return timespec64_equal(&dir->i_mtime, &snap->mtime) &&
+		timespec64_equal(&dir->i_ctime, &snap->ctime);
+}
+
+/* entries are hashed by directory, so invalidation only walks one bucket */
+static unsigned int neg_cache_name_hash(const char *name, size_t len)
+{
+	unsigned long hash = init_name_hash(NULL);
+
+	while (len--)
+		hash = partial_name_hash(tolower(*name++), hash);
+	return end_name_hash(hash);
+}
+
+static bool neg_entry_valid(struct ksmbd_neg_entry *ne, struct inode *dir)
+{
+	if (time_after(jiffies, ne->birth + KSMBD_NEG_CACHE_TTL))
+		return false;
+	if (IS_I_VERSION(dir) && !inode_eq_iversion(dir, ne->iversion))
+		return false;
+	return timespec64_equal(&dir->i_mtime, &ne->mtime) &&
+		timespec64_equal(&dir->i_ctime, &ne->ctime);
+}
+
+static void __neg_cache_unhash(struct ksmbd_neg_entry *ne)
+{
+	hash_del(&ne->hlist);
+	list_del(&ne->lru);
+	neg_cache_nr--;
+	kfree(ne);
+}
+
+/**
+ * ksmbd_neg_cache_lookup() - check if @name is known to be missing in @dir
+ * @dir:	directory inode
+ * @name:	name to look up, compared case insensitively
+ * @len:	length of @name
+ *
+ * Return:	true if a caseless lookup of @name in @dir recently failed and
+ *		the directory was not modified since
+ */
+bool ksmbd_neg_cache_lookup(struct inode *dir, const char *name, size_t len)
+{
+	struct ksmbd_neg_entry *ne;
+	unsigned int hash;
+	bool found = false;
+
+	if (!(server_conf.flags & KSMBD_GLOBAL_FLAG_NEG_CACHE))
+		return false;
+
+	hash = neg_cache_name_hash(name, len);
+	spin_lock(&neg_cache_lock);
+	hash_for_each_possible(neg_cache_table, ne, hlist,
+			       dir_cache_hash(dir->i_ino, dir->i_sb->s_dev)) {
+		if (ne->hash != hash || ne->len != len ||
+		    ne->ino != dir->i_ino || ne->dev != dir->i_sb->s_dev ||
+		    strncasecmp(ne->name, name, len))
+			continue;
+
+		if (neg_entry_valid(ne, dir)) {
+			list_move(&ne->lru, &neg_cache_lru);
+			found = true;
+		} else {
+			__neg_cache_unhash(ne);
+		}
+		break;
+	}
+	spin_unlock(&neg_cache_lock);
+
+	if (found)
+		atomic_long_inc(&neg_cache_hits);
+	else
+		atomic_long_inc(&neg_cache_misses);
+	return found;
+}
+
+/**
+ * ksmbd_neg_entry_alloc() - prepare a negative entry before scanning @dir
+ * @dir:	directory inode
+ * @name:	name which is about to be looked up
+ * @len:	length of @name
+ *
+ * The directory state is recorded before the scan, so that a name created
+ * while the scan was running is never cached as missing.
+ *
+ * Return:	new entry, or NULL if the cache is disabled or on failure
+ */
+struct ksmbd_neg_entry *ksmbd_neg_entry_alloc(struct inode *dir,
+					      const char *name, size_t len)
+{
+	struct ksmbd_neg_entry *ne;
+
+	if (!(server_conf.flags & KSMBD_GLOBAL_FLAG_NEG_CACHE) ||
+	    len > NAME_MAX)
+		return NULL;
+
+	ne = kmalloc(sizeof(struct ksmbd_neg_entry) + len + 1, GFP_KERNEL);
+	if (!ne)
+		return NULL;
+
+	ne->ino = dir->i_ino;
+	ne->dev = dir->i_sb->s_dev;
+	if (IS_I_VERSION(dir))
+		ne->iversion = inode_query_iversion(dir);
+	ne->mtime = dir->i_mtime;
+	ne->ctime = dir->i_ctime;
+	ne->birth = jiffies;
+	ne->hash = neg_cache_name_hash(name, len);
+	ne->len = len;
+	memcpy(ne->name, name, len);
+	ne->name[len] = '\0';
+	return ne;
+}
+
+/**
+ * ksmbd_neg_cache_insert() - publish a negative entry after a failed scan
+ * @ne:		entry from ksmbd_neg_entry_alloc(), consumed by this call
+ * @dir:	directory inode which was scanned
+ */
+void ksmbd_neg_cache_insert(struct ksmbd_neg_entry *ne, struct inode *dir)
+{
+	struct ksmbd_neg_entry *old;
+	struct hlist_node *tmp;
+	unsigned int key = dir_cache_hash(ne->ino, ne->dev);
+
+	if (!neg_entry_valid(ne, dir)) {
+		kfree(ne);
+		return;
+	}
+
+	spin_lock(&neg_cache_lock);
+	hash_for_each_possible_safe(neg_cache_table, old, tmp, hlist, key) {
+		if (old->hash == ne->hash && old->len == ne->len &&
+		    old->ino == ne->ino && old->dev == ne->dev &&
+		    !strncasecmp(old->name, ne->name, ne->len))
+			__neg_cache_unhash(old);
+	}
+
+	hash_add(neg_cache_table, &ne->hlist, key);
+	list_add(&ne->lru, &neg_cache_lru);
+	neg_cache_nr++;
+
+	if (neg_cache_nr > KSMBD_NEG_CACHE_MAX_ENTRIES)
+		__neg_cache_unhash(list_last_entry(&neg_cache_lru,
+						   struct ksmbd_neg_entry,
+						   lru));
+	spin_unlock(&neg_cache_lock);
+}
+
+void ksmbd_neg_entry_free(struct ksmbd_neg_entry *ne)
+{
+	kfree(ne);
+}
+
+static void neg_cache_invalidate(struct inode *dir)
+{
+	struct ksmbd_neg_entry *ne;
+	struct hlist_node *tmp;
+	dev_t dev = dir->i_sb->s_dev;
+
+	if (!READ_ONCE(neg_cache_nr))
+		return;
+
+	spin_lock(&neg_cache_lock);
+	hash_for_each_possible_safe(neg_cache_table, ne, tmp, hlist,
+				    dir_cache_hash(dir->i_ino, dev)) {
+		if (ne->ino == dir->i_ino && ne->dev == dev)
+			__neg_cache_unhash(ne);
+	}
+	spin_unlock(&neg_cache_lock);
+}
+
+static void neg_cache_flush(void)
+{
+	struct ksmbd_neg_entry *ne, *tmp;
+
+	spin_lock(&neg_cache_lock);
+	list_for_each_entry_safe(ne, tmp, &neg_cache_lru, lru)
+		__neg_cache_unhash(ne);
+	spin_unlock(&neg_cache_lock);
+}
+
+static void dir_snapshot_free(struct ksmbd_dir_snapshot *snap)
+{
+	kvfree(snap->data);
+	kfree(snap);
+}
+
+void ksmbd_dir_snapshot_put(struct ksmbd_dir_snapshot *snap)
+{
+	if (atomic_dec_and_test(&snap->refcount))
+		dir_snapshot_free(snap);
+}
+
+/*
+ * Remove a snapshot from the cache. Called with dir_cache_lock held,
+ * snapshots which lose their last reference are moved to @dispose and
+ * freed by dir_cache_dispose() once the lock is dropped.
+ */
+static void __dir_cache_unhash(struct ksmbd_dir_snapshot *snap,
+			       struct list_head *dispose)
+{
+	hash_del(&snap->hlist);
+	list_del_init(&snap->lru);
+	dir_cache_nr--;
+	dir_cache_bytes -= snap->alloc_size;
+
+	if (atomic_dec_and_test(&snap->refcount))
+		list_add(&snap->lru, dispose);
+}
+
+static void dir_cache_dispose(struct list_head *dispose)
+{
+	struct ksmbd_dir_snapshot *snap, *tmp;
+
+	list_for_each_entry_safe(snap, tmp, dispose, lru) {
+		list_del(&snap->lru);
+		dir_snapshot_free(snap);
+	}
+}
+
+struct ksmbd_dir_snapshot *
+ksmbd_dir_cache_lookup(struct ksmbd_share_config *share, struct inode *dir,
+		       int info_level)
+{
+	struct ksmbd_dir_snapshot *snap, *found = NULL;
+	dev_t dev = dir->i_sb->s_dev;
+	LIST_HEAD(dispose);
+
+	spin_lock(&dir_cache_lock);
+	hash_for_each_possible(dir_cache_table, snap, hlist,
+			       dir_cache_hash(dir->i_ino, dev)) {
+		if (snap->ino != dir->i_ino || snap->dev != dev ||
+		    snap->share != share || snap->info_level != info_level ||
+		    !dir_snapshot_cred_match(snap))
+			continue;
+
+		if (!dir_snapshot_valid(snap, dir)) {
+			__dir_cache_unhash(snap, &dispose);
+			break;
+		}
+
+		atomic_inc(&snap->refcount);
+		list_move(&snap->lru, &dir_cache_lru);
+		found = snap;
+		break;
+	}
+	spin_unlock(&dir_cache_lock);
+	dir_cache_dispose(&dispose);
+
+	if (found)
+		atomic_long_inc(&dir_cache_hits);
+	else
+		atomic_long_inc(&dir_cache_misses);
+	return found;
+}
+
+/**
+ * ksmbd_dir_snapshot_alloc() - start building a snapshot of a directory
+ * @share:	share the directory is enumerated through
+ * @dir:	directory inode
+ * @info_level:	info level the entries are encoded in
+ *
+ * The directory state is recorded now, so that a snapshot which raced
+ * with a directory modification is never published.
+ *
+ * Return:	new snapshot on success, otherwise NULL
+ */
+struct ksmbd_dir_snapshot *
+ksmbd_dir_snapshot_alloc(struct ksmbd_share_config *share, struct inode *dir,
+			 int info_level)
+{
+	struct ksmbd_dir_snapshot *snap;
+
+	snap = kzalloc(sizeof(struct ksmbd_dir_snapshot), GFP_KERNEL);
+	if (!snap)
+		return NULL;
+
+	INIT_HLIST_NODE(&snap->hlist);
+	INIT_LIST_HEAD(&snap->lru);
+	atomic_set(&snap->refcount, 1);
+	snap->share = share;
+	snap->info_level = info_level;
+	dir_snapshot_stamp(snap, dir);
+	return snap;
+}
+
+int ksmbd_dir_snapshot_append(struct ksmbd_dir_snapshot *snap,
+			      const char *buf, unsigned int len)
+{
+	if (!len)
+		return 0;
+
+	if (snap->size + len > KSMBD_DIR_CACHE_MAX_SNAPSHOT)
+		return -E2BIG;
+
+	if (snap->size + len > snap->alloc_size) {
+		unsigned int new_size;
+		char *data;
+
+		new_size = max_t(unsigned int, snap->alloc_size * 2,
+				 snap->size + len);
+		new_size = min_t(unsigned int, new_size,
+				 KSMBD_DIR_CACHE_MAX_SNAPSHOT);
+
+		data = kvmalloc(new_size, GFP_KERNEL);
+		if (!data)
+			return -ENOMEM;
+
+		if (snap->data) {
+			memcpy(data, snap->data, snap->size);
+			kvfree(snap->data);
+		}
+		snap->data = data;
+		snap->alloc_size = new_size;
+	}
+
+	memcpy(snap->data + snap->size, buf, len);
+	snap->size += len;
+	return 0;
+}
+
+/**
+ * ksmbd_dir_cache_insert() - publish a completely built snapshot
+ * @snap:	snapshot built by the caller, the caller keeps its reference
+ * @dir:	directory inode the snapshot was built from
+ */
+void ksmbd_dir_cache_insert(struct ksmbd_dir_snapshot *snap, struct inode *dir)
+{
+	struct ksmbd_dir_snapshot *old;
+	struct hlist_node *tmp;
+	unsigned int key = dir_cache_hash(snap->ino, snap->dev);
+	LIST_HEAD(dispose);
+
+	if (!snap->size || !dir_snapshot_valid(snap, dir))
+		return;
+
+	spin_lock(&dir_cache_lock);
+	hash_for_each_possible_safe(dir_cache_table, old, tmp, hlist, key) {
+		if (old->ino == snap->ino && old->dev == snap->dev &&
+		    old->share == snap->share &&
+		    old->info_level == snap->info_level &&
+		    uid_eq(old->fsuid, snap->fsuid) &&
+		    gid_eq(old->fsgid, snap->fsgid))
+			__dir_cache_unhash(old, &dispose);
+	}
+
+	atomic_inc(&snap->refcount);
+	hash_add(dir_cache_table, &snap->hlist, key);
+	list_add(&snap->lru, &dir_cache_lru);
+	dir_cache_nr++;
+	dir_cache_bytes += snap->alloc_size;
+
+	while (dir_cache_bytes > KSMBD_DIR_CACHE_MAX_BYTES) {
+		old = list_last_entry(&dir_cache_lru,
+				      struct ksmbd_dir_snapshot, lru);
+		__dir_cache_unhash(old, &dispose);
+	}
+	spin_unlock(&dir_cache_lock);
+	dir_cache_dispose(&dispose);
+}
+
+/**
+ * ksmbd_dir_snapshot_detach() - drop the snapshot a directory handle is
+ * serving from or building
+ * @fp:		directory file handle
+ */
+void ksmbd_dir_snapshot_detach(struct ksmbd_file *fp)
+{
+	if (!fp->dir_snap)
+		return;
+
+	ksmbd_dir_snapshot_put(fp->dir_snap);
+	fp->dir_snap = NULL;
+	fp->dir_snap_pos = 0;
+	fp->dir_snap_building = false;
+}
+
+void ksmbd_dir_cache_invalidate(struct inode *dir)
+{
+	struct ksmbd_dir_snapshot *snap;
+	struct hlist_node *tmp;
+	dev_t dev = dir->i_sb->s_dev;
+	LIST_HEAD(dispose);
+
+	neg_cache_invalidate(dir);
+	if (!READ_ONCE(dir_cache_nr))
+		return;
+
+	spin_lock(&dir_cache_lock);
+	hash_for_each_possible_safe(dir_cache_table, snap, tmp, hlist,
+				    dir_cache_hash(dir->i_ino, dev)) {
+		if (snap->ino == dir->i_ino && snap->dev == dev)
+			__dir_cache_unhash(snap, &dispose);
+	}
+	spin_unlock(&dir_cache_lock);
+	dir_cache_dispose(&dispose);
+}
+
+static void __dir_cache_flush(struct ksmbd_share_config *share)
+{
+	struct ksmbd_dir_snapshot *snap;
+	struct hlist_node *tmp;
+	LIST_HEAD(dispose);
+	int i;
+
+	spin_lock(&dir_cache_lock);
+	hash_for_each_safe(dir_cache_table, i, tmp, snap, hlist) {
+		if (!share || snap->share == share)
+			__dir_cache_unhash(snap, &dispose);
+	}
+	spin_unlock(&dir_cache_lock);
+	dir_cache_dispose(&dispose);
+}
+
+void ksmbd_dir_cache_flush_share(struct ksmbd_share_config *share)
+{
+	if (!READ_ONCE(dir_cache_nr))
+		return;
+	__dir_cache_flush(share);
+}
+
+int ksmbd_dir_cache_stats(char *buf, size_t size)
+{
+	unsigned long nr, bytes;
+
+	spin_lock(&dir_cache_lock);
+	nr = dir_cache_nr;
+	bytes = dir_cache_bytes;
+	spin_unlock(&dir_cache_lock);
+
+	return scnprintf(buf, size,
+			 "hits %ld misses %ld entries %lu bytes %lu\n"
+			 "negative hits %ld misses %ld entries %lu\n",
+			 atomic_long_read(&dir_cache_hits),
+			 atomic_long_read(&dir_cache_misses),
+			 nr, bytes,
+			 atomic_long_read(&neg_cache_hits),
+			 atomic_long_read(&neg_cache_misses),
+			 READ_ONCE(neg_cache_nr));
+}
+
+static unsigned long dir_cache_shrink_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	return READ_ONCE(dir_cache_nr);
+}
+
+static unsigned long dir_cache_shrink_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct ksmbd_dir_snapshot *snap;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&dir_cache_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&dir_cache_lru)) {
+		snap = list_last_entry(&dir_cache_lru,
+				       struct ksmbd_dir_snapshot, lru);
+		__dir_cache_unhash(snap, &dispose);
+		freed++;
+	}
+	spin_unlock(&dir_cache_lock);
+	dir_cache_dispose(&dispose);
+	return freed;
+}
+
+static struct shrinker dir_cache_shrinker = {
+	.count_objects	= dir_cache_shrink_count,
+	.scan_objects	= dir_cache_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+int ksmbd_dir_cache_init(void)
+{
+	return register_shrinker(&dir_cache_shrinker);
+}
+
+void ksmbd_dir_cache_destroy(void)
+{
+	unregister_shrinker(&dir_cache_shrinker);
+	__dir_cache_flush(NULL);
+	neg_cache_flush();
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Copyright (C) 2021 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __KSMBD_DIR_CACHE_H__
+#define __KSMBD_DIR_CACHE_H__
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include <linux/uidgid.h>
+
+struct ksmbd_share_config;
+struct ksmbd_file;
+struct ksmbd_neg_entry;
+
+/*
+ * Snapshot of one complete directory enumeration, stored exactly as it
+ * was encoded in the QUERY_DIRECTORY responses for one info level.
+ */
+struct ksmbd_dir_snapshot {
+	struct hlist_node		hlist;
+	struct list_head		lru;
+	atomic_t			refcount;
+
+	struct ksmbd_share_config	*share;
+	unsigned long			ino;
+	dev_t				dev;
+	u64				iversion;
+	struct timespec64		mtime;
+	struct timespec64		ctime;
+	unsigned long			birth;
+	int				info_level;
+	kuid_t				fsuid;
+	kgid_t				fsgid;
+
+	char				*data;
+	unsigned int			size;
+	unsigned int			alloc_size;
+};
+
+struct ksmbd_dir_snapshot *
+ksmbd_dir_cache_lookup(struct ksmbd_share_config *share, struct inode *dir,
+		       int info_level);
+struct ksmbd_dir_snapshot *
+ksmbd_dir_snapshot_alloc(struct ksmbd_share_config *share, struct inode *dir,
+			 int info_level);
+int ksmbd_dir_snapshot_append(struct ksmbd_dir_snapshot *snap,
+			      const char *buf, unsigned int len);
+void ksmbd_dir_cache_insert(struct ksmbd_dir_snapshot *snap, struct inode *dir);
+void ksmbd_dir_snapshot_put(struct ksmbd_dir_snapshot *snap);
+void ksmbd_dir_snapshot_detach(struct ksmbd_file *fp);
+
+bool ksmbd_neg_cache_lookup(struct inode *dir, const char *name, size_t len);
+struct ksmbd_neg_entry *ksmbd_neg_entry_alloc(struct inode *dir,
+					      const char *name, size_t len);
+void ksmbd_neg_cache_insert(struct ksmbd_neg_entry *ne, struct inode *dir);
+void ksmbd_neg_entry_free(struct ksmbd_neg_entry *ne);
+
+void ksmbd_dir_cache_invalidate(struct inode *dir);
+void ksmbd_dir_cache_flush_share(struct ksmbd_share_config *share);
+int ksmbd_dir_cache_stats(char *buf, size_t size);
+
+int ksmbd_dir_cache_init(void);
+void ksmbd_dir_cache_destroy(void);
+#endif /* __KSMBD_DIR_CACHE_H__ */
@@ -51,6 +51,29 @@
  *  - KSMBD_EVENT_SPNEGO_AUTHEN_REQUEST/RESPONSE(ksmbd_spnego_authen_request/response)
  *    This event is to make kerberos authentication to be processed in
  *    userspace.
+ *
+ *  - KSMBD_EVENT_WORKER_REGISTER(ksmbd_worker_register)
+ *    This event is to register an additional user IPC daemon worker after
+ *    startup. Requests are spread over the daemon and its workers.
+ *
+ *  - KSMBD_EVENT_SHARE_CONFIG_PUSH(ksmbd_share_config_push)
+ *    This event is to push share configs from user IPC daemon, either as
+ *    a bulk load at startup or as an update when a share changes. Pushed
+ *    shares stay resident in the kernel.
+ *
+ *  - KSMBD_EVENT_RING_REQUEST/RESPONSE(ksmbd_ring_desc)
+ *    When user IPC daemon has mapped the shared ring (KSMBD_IPC_RING_DEV),
+ *    RPC requests are placed in a ring slot and only the slot descriptor
+ *    goes over netlink. The daemon writes the response in place and sends
+ *    the descriptor back. A response that does not fit in the slot is
+ *    sent as a plain KSMBD_EVENT_RPC_RESPONSE instead.
+ *
+ * Every request that expects a response carries a request id in the
+ * netlink sequence number. The daemon should echo it in the sequence number
+ * of the response, so that several requests on the same handle (e.g. RPC
+ * pipe) can be answered concurrently. A response whose sequence number
+ * matches no waiting request (e.g. one libnl filled in itself) is matched
+ * by handle alone.
  */
 
 #define KSMBD_GENL_NAME		"SMBD_GENL"
@@ -74,6 +97,9 @@ struct ksmbd_heartbeat {
 #define KSMBD_GLOBAL_FLAG_SMB2_LEASES		BIT(0)
 #define KSMBD_GLOBAL_FLAG_SMB2_ENCRYPTION	BIT(1)
 #define KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL	BIT(2)
+#define KSMBD_GLOBAL_FLAG_DIR_CACHE		BIT(3)
+#define KSMBD_GLOBAL_FLAG_NEG_CACHE		BIT(4)
+#define KSMBD_GLOBAL_FLAG_RPC_FASTPATH		BIT(5)
 
 /*
  * IPC request for ksmbd server startup
@@ -109,6 +135,13 @@ struct ksmbd_startup_request {
 
 #define KSMBD_STARTUP_CONFIG_INTERFACES(s)	((s)->____payload)
 
+/*
+ * IPC request to register an additional daemon worker.
+ */
+struct ksmbd_worker_register {
+	__u32	reserved;
+};
+
 /*
  * IPC request to shutdown ksmbd server.
  */
@@ -163,6 +196,25 @@ struct ksmbd_share_config_response {
 
 #define KSMBD_SHARE_CONFIG_VETO_LIST(s)	((s)->____payload)
 
+/*
+ * Share config pushed by the daemon without a request. A push with
+ * KSMBD_SHARE_PUSH_FLAG_BEGIN starts a bulk load and drops every share
+ * pushed before, KSMBD_SHARE_PUSH_FLAG_END marks the share table as
+ * complete; share_name may be empty on either.
+ */
+#define KSMBD_SHARE_PUSH_FLAG_BEGIN	BIT(0)
+#define KSMBD_SHARE_PUSH_FLAG_DELETE	BIT(1)
+#define KSMBD_SHARE_PUSH_FLAG_END	BIT(2)
+
+#define KSMBD_SHARE_PUSH_COMMENT_SZ	256
+
+struct ksmbd_share_config_push {
+	__u32	flags;
+	__s8	share_name[KSMBD_REQ_MAX_SHARE_NAME];
+	__s8	comment[KSMBD_SHARE_PUSH_COMMENT_SZ];
+	struct ksmbd_share_config_response config;
+};
+
 static inline char *
 ksmbd_share_config_path(struct ksmbd_share_config_response *sc)
 {
@@ -224,6 +276,31 @@ struct ksmbd_rpc_command {
 	__u8	payload[];
 };
 
+/*
+ * Shared ring for RPC payloads, mmap()ed by the daemon from
+ * KSMBD_IPC_RING_DEV. Each slot starts with a ksmbd_ring_slot header
+ * followed by a ksmbd_rpc_command; size covers the command and its
+ * payload. gen changes every time a slot is handed out. The daemon must
+ * echo it in the response descriptor and should not write a slot whose
+ * gen no longer matches the request's.
+ */
+#define KSMBD_IPC_RING_DEV		"ksmbd-ipc"
+#define KSMBD_IPC_RING_SLOTS		64
+#define KSMBD_IPC_RING_SLOT_SZ		(64 * 1024)
+
+struct ksmbd_ring_slot {
+	__u32	handle;
+	__u32	gen;
+	__u32	size;
+	__u8	data[];
+};
+
+struct ksmbd_ring_desc {
+	__u32	handle;
+	__u32	slot;
+	__u32	gen;
+};
+
 /*
  * IPC Request Kerberos authentication
  */
@@ -289,6 +366,12 @@ enum ksmbd_event {
 	KSMBD_EVENT_SPNEGO_AUTHEN_REQUEST,
 	KSMBD_EVENT_SPNEGO_AUTHEN_RESPONSE	= 15,
 
+	KSMBD_EVENT_WORKER_REGISTER,
+	KSMBD_EVENT_SHARE_CONFIG_PUSH,
+
+	KSMBD_EVENT_RING_REQUEST,
+	KSMBD_EVENT_RING_RESPONSE,
+
 	KSMBD_EVENT_MAX
 };
 
@@ -336,6 +419,13 @@ enum KSMBD_TREE_CONN_STATUS {
 #define KSMBD_SHARE_FLAG_STREAMS		BIT(11)
 #define KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS	BIT(12)
 #define KSMBD_SHARE_FLAG_ACL_XATTR		BIT(13)
+#define KSMBD_SHARE_FLAG_STREAM_SIDECAR		BIT(14)
+/*
+ * Tree connect decisions only depend on the account, the share and the
+ * peer address, so the kernel may cache them. Not to be set on shares
+ * with a connection limit, the daemon does not see cached connects.
+ */
+#define KSMBD_SHARE_FLAG_TCON_CACHEABLE		BIT(15)
 
 /*
  * Tree connect request flags.
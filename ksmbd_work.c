@@ -6,15 +6,20 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/version.h>
 #include <linux/workqueue.h>
 
 #include "server.h"
+#include "ksmbd_netlink.h"
 #include "connection.h"
 #include "ksmbd_work.h"
 #include "mgmt/ksmbd_ida.h"
 
 static struct kmem_cache *work_cache;
 static struct workqueue_struct *ksmbd_wq;
+/* connection senders, kept apart so that waiting writers cannot stall them */
+static struct workqueue_struct *ksmbd_tx_wq;
 
 struct ksmbd_work *ksmbd_alloc_work_struct(void)
 {
@@ -37,8 +42,10 @@ void ksmbd_free_work_struct(struct ksmbd_work *work)
 
 	kvfree(work->response_buf);
 	kvfree(work->aux_payload_buf);
+	kvfree(work->ipc_resp);
 	kfree(work->tr_buf);
-	kvfree(work->request_buf);
+	ksmbd_conn_release_request_buf(work->conn, work->request_buf,
+				       work->request_buf_ctx);
 	if (work->async_id)
 		ksmbd_release_id(&work->conn->async_ida, work->async_id);
 	kmem_cache_free(work_cache, work);
@@ -61,9 +68,16 @@ int ksmbd_work_pool_init(void)
 
 int ksmbd_workqueue_init(void)
 {
-	ksmbd_wq = alloc_workqueue("ksmbd-io", 0, 0);
+	ksmbd_wq = alloc_workqueue("ksmbd-io", WQ_UNBOUND, 0);
 	if (!ksmbd_wq)
 		return -ENOMEM;
+
+	ksmbd_tx_wq = alloc_workqueue("ksmbd-tx", WQ_MEM_RECLAIM, 0);
+	if (!ksmbd_tx_wq) {
+		destroy_workqueue(ksmbd_wq);
+		ksmbd_wq = NULL;
+		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -72,9 +86,36 @@ void ksmbd_workqueue_destroy(void)
 	flush_workqueue(ksmbd_wq);
 	destroy_workqueue(ksmbd_wq);
 	ksmbd_wq = NULL;
+	destroy_workqueue(ksmbd_tx_wq);
+	ksmbd_tx_wq = NULL;
 }
 
 bool ksmbd_queue_work(struct ksmbd_work *work)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	int cpu;
+
+	/*
+	 * With multichannel, run the work of each channel on the NUMA node
+	 * that received it from its NIC queue, so that channels on different
+	 * NICs stay local to their node while still spreading over its cpus.
+	 */
+	if (server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL &&
+	    work->conn) {
+		cpu = ksmbd_conn_rx_cpu(work->conn);
+		if (cpu >= 0)
+			return queue_work_node(cpu_to_node(cpu), ksmbd_wq,
+					       &work->work);
+	}
+#endif
 	return queue_work(ksmbd_wq, &work->work);
 }
+
+/**
+ * ksmbd_queue_tx_work() - queue work on the sender workqueue
+ * @work:	work to queue
+ */
+void ksmbd_queue_tx_work(struct work_struct *work)
+{
+	queue_work(ksmbd_tx_wq, work);
+}
@@ -7,6 +7,8 @@
 #define __KSMBD_WORK_H__
 
 #include <linux/ctype.h>
+#include <linux/completion.h>
+#include <linux/llist.h>
 #include <linux/workqueue.h>
 
 struct ksmbd_conn;
@@ -26,8 +28,13 @@ struct ksmbd_work {
 	struct ksmbd_session            *sess;
 	struct ksmbd_tree_connect       *tcon;
 
+	/* Time the request was queued for a worker */
+	ktime_t                         queued_time;
+
 	/* Pointer to received SMB header */
 	void                            *request_buf;
+	/* Transport buffer holding request_buf, see ksmbd_conn */
+	void                            *request_buf_ctx;
 	/* Response buffer */
 	void                            *response_buf;
 
@@ -70,6 +77,8 @@ struct ksmbd_work {
 	/* Is this SYNC or ASYNC ksmbd_work */
 	bool                            syncronous:1;
 	bool                            need_invalidate_rkey:1;
+	/* Counted in conn->req_sync_running */
+	bool                            sync_running:1;
 
 	unsigned int                    remote_key;
 	/* cancel works */
@@ -84,6 +93,19 @@ struct ksmbd_work {
 	struct list_head                async_request_entry;
 	struct list_head                fp_entry;
 	struct list_head                interim_entry;
+	/* Node at conn->tx_queue until the sender wrote the response */
+	struct llist_node               tx_node;
+	/* Writer waiting for the send, NULL if the sender frees the work */
+	struct completion               *tx_done;
+	int                             tx_result;
+
+	/* Daemon request the handler parked the work on, not sent yet */
+	void                            *ipc_msg;
+	/* Type of the parked request and the response it was resumed with */
+	unsigned int                    ipc_type;
+	void                            *ipc_resp;
+	/* Handler state kept while the work is parked */
+	void                            *ipc_ctx;
 };
 
 /**
@@ -104,6 +126,20 @@ static inline void *ksmbd_req_buf_next(struct ksmbd_work *work)
 	return work->request_buf + work->next_smb2_rcv_hdr_off;
 }
 
+/**
+ * ksmbd_work_ipc_response - Take the daemon response a parked work was
+ * resumed with, NULL if the daemon did not answer.
+ * @work: smb work resumed by ksmbd_ipc_park_work()
+ */
+static inline void *ksmbd_work_ipc_response(struct ksmbd_work *work)
+{
+	void *resp = work->ipc_resp;
+
+	work->ipc_resp = NULL;
+	work->ipc_type = 0;
+	return resp;
+}
+
 struct ksmbd_work *ksmbd_alloc_work_struct(void);
 void ksmbd_free_work_struct(struct ksmbd_work *work);
 
@@ -113,5 +149,6 @@ int ksmbd_work_pool_init(void);
 int ksmbd_workqueue_init(void);
 void ksmbd_workqueue_destroy(void);
 bool ksmbd_queue_work(struct ksmbd_work *work);
+void ksmbd_queue_tx_work(struct work_struct *work);
 
 #endif /* __KSMBD_WORK_H__ */
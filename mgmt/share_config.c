@@ -15,14 +15,20 @@
 #include "share_config.h"
 #include "user_config.h"
 #include "user_session.h"
+#include "tree_connect.h"
 #include "../transport_ipc.h"
+#include "../misc.h"
+#include "../dir_cache.h"
 
-#define SHARE_HASH_BITS		3
+#define SHARE_HASH_BITS		10
 static DEFINE_HASHTABLE(shares_table, SHARE_HASH_BITS);
 static DECLARE_RWSEM(shares_table_lock);
+/* the daemon finished a bulk load, the table holds every share */
+static bool shares_loaded;
 
 struct ksmbd_veto_pattern {
 	char			*pattern;
+	struct ksmbd_pattern	matcher;
 	struct list_head	list;
 };
 
@@ -33,6 +39,8 @@ static unsigned int share_name_hash(char *name)
 
 static void kill_share(struct ksmbd_share_config *share)
 {
+	ksmbd_dir_cache_flush_share(share);
+
 	while (!list_empty(&share->veto_list)) {
 		struct ksmbd_veto_pattern *p;
 
@@ -48,6 +56,7 @@ static void kill_share(struct ksmbd_share_config *share)
 		path_put(&share->vfs_path);
 	kfree(share->name);
 	kfree(share->path);
+	kfree(share->comment);
 	kfree(share);
 }
 
@@ -106,7 +115,16 @@ static int parse_veto_list(struct ksmbd_share_config *share,
 			return -ENOMEM;
 		}
 
-		list_add(&p->list, &share->veto_list);
+		ksmbd_compile_pattern(&p->matcher, p->pattern, false);
+		/*
+		 * Keep the cheap matchers in front, so that a name vetoed
+		 * by a literal or suffix pattern never reaches the generic
+		 * wildcard engine.
+		 */
+		if (p->matcher.type == KSMBD_PATTERN_WILDCARD)
+			list_add_tail(&p->list, &share->veto_list);
+		else
+			list_add(&p->list, &share->veto_list);
 
 		veto_list += sz + 1;
 		veto_list_sz -= (sz + 1);
@@ -115,27 +133,20 @@ static int parse_veto_list(struct ksmbd_share_config *share,
 	return 0;
 }
 
-static struct ksmbd_share_config *share_config_request(char *name)
+static struct ksmbd_share_config *
+share_config_build(char *name, struct ksmbd_share_config_response *resp)
 {
-	struct ksmbd_share_config_response *resp;
-	struct ksmbd_share_config *share = NULL;
-	struct ksmbd_share_config *lookup;
+	struct ksmbd_share_config *share;
 	int ret;
 
-	resp = ksmbd_ipc_share_config_request(name);
-	if (!resp)
-		return NULL;
-
-	if (resp->flags == KSMBD_SHARE_FLAG_INVALID)
-		goto out;
-
 	share = kzalloc(sizeof(struct ksmbd_share_config), GFP_KERNEL);
 	if (!share)
-		goto out;
+		return NULL;
 
 	share->flags = resp->flags;
 	atomic_set(&share->refcount, 1);
 	INIT_LIST_HEAD(&share->veto_list);
+	INIT_HLIST_NODE(&share->hlist);
 	share->name = kstrdup(name, GFP_KERNEL);
 
 	if (!test_share_config_flag(share, KSMBD_SHARE_FLAG_PIPE)) {
@@ -164,10 +175,31 @@ static struct ksmbd_share_config *share_config_request(char *name)
 		}
 		if (ret || !share->name) {
 			kill_share(share);
-			share = NULL;
-			goto out;
+			return NULL;
 		}
 	}
+	return share;
+}
+
+static struct ksmbd_share_config *share_config_request(char *name)
+{
+	struct ksmbd_share_config_response *resp;
+	struct ksmbd_share_config *share = NULL;
+	struct ksmbd_share_config *lookup;
+
+	resp = ksmbd_ipc_share_config_request(name);
+	if (!resp)
+		return NULL;
+
+	if (resp->flags == KSMBD_SHARE_FLAG_INVALID)
+		goto out;
+
+	share = share_config_build(name, resp);
+	if (!share)
+		goto out;
+
+	/* cached tree connect decisions may rest on the old config */
+	ksmbd_tree_conn_cache_flush();
 
 	down_write(&shares_table_lock);
 	lookup = __share_lookup(name);
@@ -211,18 +243,235 @@ struct ksmbd_share_config *ksmbd_share_config_get(char *name)
 	return share_config_request(name);
 }
 
+/**
+ * ksmbd_share_config_lookup() - find a share without asking the daemon
+ * @name:	share name, lower cased in place
+ *
+ * Return:	referenced share config, or NULL if it is not in the table
+ */
+struct ksmbd_share_config *ksmbd_share_config_lookup(char *name)
+{
+	struct ksmbd_share_config *share;
+
+	strtolower(name);
+
+	down_read(&shares_table_lock);
+	share = __share_lookup(name);
+	if (share)
+		share = __get_share_config(share);
+	up_read(&shares_table_lock);
+	return share;
+}
+
+/**
+ * ksmbd_share_configs_for_each() - call @fn on every share in the table
+ * @fn:		callback, a non-zero return stops the walk
+ * @arg:	argument passed to @fn
+ *
+ * @fn runs under the shares table lock and must not take it again.
+ *
+ * Return:	the last value returned by @fn
+ */
+int ksmbd_share_configs_for_each(int (*fn)(struct ksmbd_share_config *,
+					   void *),
+				 void *arg)
+{
+	struct ksmbd_share_config *share;
+	int i, ret = 0;
+
+	down_read(&shares_table_lock);
+	hash_for_each(shares_table, i, share, hlist) {
+		ret = fn(share, arg);
+		if (ret)
+			break;
+	}
+	up_read(&shares_table_lock);
+	return ret;
+}
+
+bool ksmbd_share_configs_loaded(void)
+{
+	return READ_ONCE(shares_loaded);
+}
+
+static bool ksmbd_share_stream_dir(struct ksmbd_share_config *share,
+				   const char *filename)
+{
+	size_t len = sizeof(KSMBD_SHARE_STREAM_DIR) - 1;
+
+	if (!strncmp(filename, share->path, share->path_sz))
+		filename += share->path_sz;
+	while (*filename == '/')
+		filename++;
+
+	/* client names are resolved caselessly, so compare the same way */
+	return !strncasecmp(filename, KSMBD_SHARE_STREAM_DIR, len) &&
+		(filename[len] == '\0' || filename[len] == '/');
+}
+
 bool ksmbd_share_veto_filename(struct ksmbd_share_config *share,
 			       const char *filename)
 {
 	struct ksmbd_veto_pattern *p;
+	size_t len;
+
+	if (test_share_config_flag(share, KSMBD_SHARE_FLAG_STREAM_SIDECAR) &&
+	    ksmbd_share_stream_dir(share, filename))
+		return true;
 
+	if (list_empty(&share->veto_list))
+		return false;
+
+	len = strlen(filename);
 	list_for_each_entry(p, &share->veto_list, list) {
-		if (match_wildcard(p->pattern, filename))
+		if (ksmbd_match_compiled_pattern(&p->matcher, filename, len))
 			return true;
 	}
 	return false;
 }
 
+/**
+ * ksmbd_share_veto_path() - check whether a resolved path lies in the
+ * sidecar stream directory of @share
+ * @share:	share config
+ * @path:	path resolved from a client supplied name
+ *
+ * The name check of ksmbd_share_veto_filename() cannot see every way a
+ * name resolves (e.g. caseless lookups or symlinks), so opens check the
+ * path they actually reached as well.
+ *
+ * Return:	true if @path must not be accessed, otherwise false
+ */
+bool ksmbd_share_veto_path(struct ksmbd_share_config *share,
+			   const struct path *path)
+{
+	struct dentry *streams;
+	bool ret;
+
+	if (!test_share_config_flag(share, KSMBD_SHARE_FLAG_STREAM_SIDECAR) ||
+	    !share->path || path->mnt != share->vfs_path.mnt)
+		return false;
+
+	streams = lookup_one_len_unlocked(KSMBD_SHARE_STREAM_DIR,
+					  share->vfs_path.dentry,
+					  sizeof(KSMBD_SHARE_STREAM_DIR) - 1);
+	if (IS_ERR(streams))
+		return true;
+
+	ret = d_really_is_positive(streams) &&
+		is_subdir(path->dentry, streams);
+	dput(streams);
+	return ret;
+}
+
+/*
+ * Shares pushed by the daemon stay resident: the table itself holds a
+ * reference on them, so they survive tree connect refcounts dropping to
+ * zero and never need a SHARE_CONFIG_REQUEST round-trip.
+ */
+static void share_config_unpin(struct ksmbd_share_config *share,
+			       struct hlist_head *dispose)
+{
+	hash_del(&share->hlist);
+	if (share->pinned)
+		hlist_add_head(&share->hlist, dispose);
+}
+
+static void share_config_dispose(struct hlist_head *dispose)
+{
+	struct ksmbd_share_config *share;
+	struct hlist_node *tmp;
+
+	hlist_for_each_entry_safe(share, tmp, dispose, hlist) {
+		hlist_del_init(&share->hlist);
+		ksmbd_share_config_put(share);
+	}
+}
+
+/**
+ * ksmbd_share_config_push() - install a share config sent by the daemon
+ * @name:	share name
+ * @comment:	share comment, may be empty
+ * @resp:	share config, laid out as a share config response
+ * @sz:		size of @resp including its payload
+ * @flags:	KSMBD_SHARE_PUSH_FLAG_*
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_share_config_push(char *name, char *comment,
+			    struct ksmbd_share_config_response *resp,
+			    size_t sz, unsigned int flags)
+{
+	struct ksmbd_share_config *share = NULL, *old;
+	size_t payload_sz = sz - sizeof(*resp);
+	HLIST_HEAD(dispose);
+
+	ksmbd_tree_conn_cache_flush();
+	if (flags & KSMBD_SHARE_PUSH_FLAG_BEGIN)
+		ksmbd_share_configs_unpin();
+
+	if (!name[0])
+		goto out;
+
+	strtolower(name);
+
+	if (!(flags & KSMBD_SHARE_PUSH_FLAG_DELETE) &&
+	    resp->flags != KSMBD_SHARE_FLAG_INVALID) {
+		if (resp->veto_list_sz >= payload_sz ||
+		    !memchr(ksmbd_share_config_path(resp), '\0',
+			    payload_sz - (ksmbd_share_config_path(resp) -
+					  resp->____payload)))
+			return -EINVAL;
+
+		share = share_config_build(name, resp);
+		if (!share)
+			return -ENOMEM;
+		share->pinned = true;
+		if (comment[0])
+			share->comment = kstrdup(comment, GFP_KERNEL);
+	}
+
+	down_write(&shares_table_lock);
+	old = __share_lookup(name);
+	if (old)
+		share_config_unpin(old, &dispose);
+	if (share)
+		hash_add(shares_table, &share->hlist, share_name_hash(name));
+	up_write(&shares_table_lock);
+
+	share_config_dispose(&dispose);
+	ksmbd_debug(SMB, "share '%s' %s by daemon\n", name,
+		    share ? "pushed" : "removed");
+out:
+	if (flags & KSMBD_SHARE_PUSH_FLAG_END)
+		WRITE_ONCE(shares_loaded, true);
+	return 0;
+}
+
+/**
+ * ksmbd_share_configs_unpin() - drop the table references on pushed shares
+ *
+ * Shares in use by tree connects stay alive until their last put; the
+ * next lookup of any of them goes to the daemon again.
+ */
+void ksmbd_share_configs_unpin(void)
+{
+	struct ksmbd_share_config *share;
+	struct hlist_node *tmp;
+	HLIST_HEAD(dispose);
+	int i;
+
+	down_write(&shares_table_lock);
+	WRITE_ONCE(shares_loaded, false);
+	hash_for_each_safe(shares_table, i, tmp, share, hlist) {
+		if (share->pinned)
+			share_config_unpin(share, &dispose);
+	}
+	up_write(&shares_table_lock);
+
+	share_config_dispose(&dispose);
+}
+
 void ksmbd_share_configs_cleanup(void)
 {
 	struct ksmbd_share_config *share;
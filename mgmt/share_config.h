@@ -10,9 +10,13 @@
 #include <linux/hashtable.h>
 #include <linux/path.h>
 
+struct ksmbd_share_config_response;
+
 struct ksmbd_share_config {
 	char			*name;
 	char			*path;
+	/* only known for shares pushed by the daemon */
+	char			*comment;
 
 	unsigned int		path_sz;
 	unsigned int		flags;
@@ -22,6 +26,8 @@ struct ksmbd_share_config {
 
 	atomic_t		refcount;
 	struct hlist_node	hlist;
+	/* pushed by the daemon, the shares table holds a reference */
+	bool			pinned;
 	unsigned short		create_mask;
 	unsigned short		directory_mask;
 	unsigned short		force_create_mode;
@@ -33,6 +39,9 @@ struct ksmbd_share_config {
 #define KSMBD_SHARE_INVALID_UID	((__u16)-1)
 #define KSMBD_SHARE_INVALID_GID	((__u16)-1)
 
+/* per-share directory holding large streams, see KSMBD_SHARE_FLAG_STREAM_SIDECAR */
+#define KSMBD_SHARE_STREAM_DIR	".ksmbd-streams"
+
 static inline int share_config_create_mode(struct ksmbd_share_config *share,
 					   umode_t posix_mode)
 {
@@ -76,6 +85,17 @@ static inline void ksmbd_share_config_put(struct ksmbd_share_config *share)
 struct ksmbd_share_config *ksmbd_share_config_get(char *name);
 bool ksmbd_share_veto_filename(struct ksmbd_share_config *share,
 			       const char *filename);
+bool ksmbd_share_veto_path(struct ksmbd_share_config *share,
+			   const struct path *path);
+struct ksmbd_share_config *ksmbd_share_config_lookup(char *name);
+int ksmbd_share_configs_for_each(int (*fn)(struct ksmbd_share_config *,
+					   void *),
+				 void *arg);
+bool ksmbd_share_configs_loaded(void);
+int ksmbd_share_config_push(char *name, char *comment,
+			    struct ksmbd_share_config_response *resp,
+			    size_t sz, unsigned int flags);
+void ksmbd_share_configs_unpin(void);
 void ksmbd_share_configs_cleanup(void);
 
 #endif /* __SHARE_CONFIG_MANAGEMENT_H__ */
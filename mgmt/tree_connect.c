@@ -5,6 +5,9 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include <linux/in6.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
 #include <linux/xarray.h>
@@ -18,18 +21,310 @@
 #include "share_config.h"
 #include "user_session.h"
 
+/*
+ * On shares the daemon marked KSMBD_SHARE_FLAG_TCON_CACHEABLE, tree-connect
+ * decisions are a pure function of the account, the share configuration
+ * and the peer address, so successful ones are remembered for a short
+ * while to spare clients that reconnect constantly the daemon round-trip.
+ * Only KSMBD_TREE_CONN_STATUS_OK is cached; denials always go to the
+ * daemon. The cache is flushed whenever a share config is (re)loaded.
+ */
+#define TCON_CACHE_HASH_BITS	7
+#define TCON_CACHE_MAX_ENTRIES	1024
+
+struct tcon_cache_entry {
+	struct hlist_node	hlist;
+	struct list_head	lru;
+	unsigned int		key;
+	unsigned long		expires;
+
+	unsigned short		account_flags;
+	unsigned short		req_flags;
+	unsigned short		connection_flags;
+	unsigned short		family;
+	u8			addr[sizeof(struct in6_addr)];
+
+	char			account[KSMBD_REQ_MAX_ACCOUNT_NAME_SZ];
+	char			share[KSMBD_REQ_MAX_SHARE_NAME];
+};
+
+static DEFINE_HASHTABLE(tcon_cache, TCON_CACHE_HASH_BITS);
+static LIST_HEAD(tcon_cache_lru);
+static DEFINE_SPINLOCK(tcon_cache_lock);
+static unsigned int tcon_cache_nr;
+static unsigned int tcon_cache_ttl = 30;
+static atomic_long_t tcon_cache_hits;
+static atomic_long_t tcon_cache_misses;
+
+static unsigned int tcon_peer_addr(struct sockaddr *sa, u8 *addr)
+{
+	if (sa->sa_family == AF_INET6) {
+		memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr,
+		       sizeof(struct in6_addr));
+		return sizeof(struct in6_addr);
+	}
+
+	memset(addr, 0, sizeof(struct in6_addr));
+	memcpy(addr, &((struct sockaddr_in *)sa)->sin_addr,
+	       sizeof(struct in_addr));
+	return sizeof(struct in_addr);
+}
+
+static unsigned short tcon_req_flags(struct ksmbd_session *sess,
+				     struct sockaddr *peer_addr)
+{
+	unsigned short flags = 0;
+
+	if (peer_addr->sa_family == AF_INET6)
+		flags |= KSMBD_TREE_CONN_FLAG_REQUEST_IPV6;
+	if (test_session_flag(sess, CIFDS_SESSION_FLAG_SMB2))
+		flags |= KSMBD_TREE_CONN_FLAG_REQUEST_SMB2;
+	return flags;
+}
+
+static unsigned int tcon_cache_key(const char *account, const char *share,
+				   const u8 *addr, unsigned int addr_len)
+{
+	unsigned int key;
+
+	key = jhash(account, strlen(account), 0);
+	key = jhash(share, strlen(share), key);
+	return jhash(addr, addr_len, key);
+}
+
+static void __tcon_cache_unhash(struct tcon_cache_entry *ent)
+{
+	hash_del(&ent->hlist);
+	list_del(&ent->lru);
+	tcon_cache_nr--;
+}
+
+/**
+ * tcon_cache_lookup() - look up a cached tree connect decision
+ * @sess:	session requesting the tree connect
+ * @sc:		share config of the requested share
+ * @peer_addr:	peer address of the session's connection
+ * @connection_flags:	filled with the cached connection flags on hit
+ *
+ * Return:	true if an unexpired decision was found
+ */
+static bool tcon_cache_lookup(struct ksmbd_session *sess,
+			      struct ksmbd_share_config *sc,
+			      struct sockaddr *peer_addr,
+			      unsigned short *connection_flags)
+{
+	struct tcon_cache_entry *ent;
+	const char *account = user_name(sess->user);
+	u8 addr[sizeof(struct in6_addr)];
+	unsigned int addr_len, key;
+	bool found = false;
+
+	if (!READ_ONCE(tcon_cache_ttl) ||
+	    !test_share_config_flag(sc, KSMBD_SHARE_FLAG_TCON_CACHEABLE))
+		return false;
+
+	addr_len = tcon_peer_addr(peer_addr, addr);
+	key = tcon_cache_key(account, sc->name, addr, addr_len);
+
+	spin_lock(&tcon_cache_lock);
+	hash_for_each_possible(tcon_cache, ent, hlist, key) {
+		if (ent->key != key ||
+		    ent->family != peer_addr->sa_family ||
+		    memcmp(ent->addr, addr, sizeof(addr)) ||
+		    strcmp(ent->account, account) ||
+		    strcmp(ent->share, sc->name))
+			continue;
+
+		if (time_after(jiffies, ent->expires) ||
+		    ent->account_flags != sess->user->flags ||
+		    ent->req_flags != tcon_req_flags(sess, peer_addr)) {
+			__tcon_cache_unhash(ent);
+			kfree(ent);
+			break;
+		}
+
+		list_move(&ent->lru, &tcon_cache_lru);
+		*connection_flags = ent->connection_flags;
+		found = true;
+		break;
+	}
+	spin_unlock(&tcon_cache_lock);
+
+	if (found)
+		atomic_long_inc(&tcon_cache_hits);
+	else
+		atomic_long_inc(&tcon_cache_misses);
+	return found;
+}
+
+static void tcon_cache_insert(struct ksmbd_session *sess,
+			      struct ksmbd_share_config *sc,
+			      struct sockaddr *peer_addr,
+			      unsigned short connection_flags)
+{
+	struct tcon_cache_entry *ent, *old, *victim = NULL;
+	const char *account = user_name(sess->user);
+	unsigned int ttl = READ_ONCE(tcon_cache_ttl);
+	unsigned int addr_len;
+
+	if (!ttl || !test_share_config_flag(sc, KSMBD_SHARE_FLAG_TCON_CACHEABLE))
+		return;
+
+	ent = kzalloc(sizeof(struct tcon_cache_entry), GFP_KERNEL);
+	if (!ent)
+		return;
+
+	addr_len = tcon_peer_addr(peer_addr, ent->addr);
+	ent->family = peer_addr->sa_family;
+	ent->account_flags = sess->user->flags;
+	ent->req_flags = tcon_req_flags(sess, peer_addr);
+	ent->connection_flags = connection_flags;
+	ent->expires = jiffies + ttl * HZ;
+	strscpy(ent->account, account, KSMBD_REQ_MAX_ACCOUNT_NAME_SZ);
+	strscpy(ent->share, sc->name, KSMBD_REQ_MAX_SHARE_NAME);
+	ent->key = tcon_cache_key(ent->account, ent->share, ent->addr,
+				  addr_len);
+
+	spin_lock(&tcon_cache_lock);
+	hash_for_each_possible(tcon_cache, old, hlist, ent->key) {
+		if (old->key == ent->key &&
+		    old->family == ent->family &&
+		    !memcmp(old->addr, ent->addr, sizeof(ent->addr)) &&
+		    !strcmp(old->account, ent->account) &&
+		    !strcmp(old->share, ent->share)) {
+			__tcon_cache_unhash(old);
+			victim = old;
+			break;
+		}
+	}
+	if (!victim && tcon_cache_nr >= TCON_CACHE_MAX_ENTRIES) {
+		victim = list_last_entry(&tcon_cache_lru,
+					 struct tcon_cache_entry, lru);
+		__tcon_cache_unhash(victim);
+	}
+	hash_add(tcon_cache, &ent->hlist, ent->key);
+	list_add(&ent->lru, &tcon_cache_lru);
+	tcon_cache_nr++;
+	spin_unlock(&tcon_cache_lock);
+
+	kfree(victim);
+}
+
+/**
+ * ksmbd_tree_conn_cache_flush() - drop all cached tree connect decisions
+ *
+ * Called when the daemon goes away, since a restarted daemon may come
+ * back with a different configuration, and whenever a share config is
+ * pushed or fetched again from the daemon.
+ */
+void ksmbd_tree_conn_cache_flush(void)
+{
+	struct tcon_cache_entry *ent, *tmp;
+	LIST_HEAD(dispose);
+
+	spin_lock(&tcon_cache_lock);
+	list_for_each_entry_safe(ent, tmp, &tcon_cache_lru, lru) {
+		hash_del(&ent->hlist);
+		list_move(&ent->lru, &dispose);
+	}
+	tcon_cache_nr = 0;
+	spin_unlock(&tcon_cache_lock);
+
+	list_for_each_entry_safe(ent, tmp, &dispose, lru)
+		kfree(ent);
+}
+
+int ksmbd_tree_conn_cache_show(char *buf, size_t size)
+{
+	return scnprintf(buf, size,
+			 "ttl %u hits %ld misses %ld entries %u\n",
+			 READ_ONCE(tcon_cache_ttl),
+			 atomic_long_read(&tcon_cache_hits),
+			 atomic_long_read(&tcon_cache_misses),
+			 READ_ONCE(tcon_cache_nr));
+}
+
+int ksmbd_tree_conn_cache_store(const char *buf)
+{
+	unsigned int v;
+
+	if (sscanf(buf, "ttl=%u", &v) == 1) {
+		WRITE_ONCE(tcon_cache_ttl, v);
+		if (!v)
+			ksmbd_tree_conn_cache_flush();
+		return 0;
+	}
+	if (sysfs_streq(buf, "flush")) {
+		ksmbd_tree_conn_cache_flush();
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static unsigned int tcon_fast_flags(struct ksmbd_share_config *sc,
+				    unsigned int connection_flags)
+{
+	static const struct {
+		int		share_flag;
+		unsigned int	fast_flag;
+	} map[] = {
+		{ KSMBD_SHARE_FLAG_PIPE,		KSMBD_TCON_PIPE },
+		{ KSMBD_SHARE_FLAG_STORE_DOS_ATTRS,	KSMBD_TCON_STORE_DOS_ATTRS },
+		{ KSMBD_SHARE_FLAG_OPLOCKS,		KSMBD_TCON_OPLOCKS },
+		{ KSMBD_SHARE_FLAG_HIDE_DOT_FILES,	KSMBD_TCON_HIDE_DOT_FILES },
+		{ KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS,	KSMBD_TCON_FOLLOW_SYMLINKS },
+		{ KSMBD_SHARE_FLAG_ACL_XATTR,		KSMBD_TCON_ACL_XATTR },
+		{ KSMBD_SHARE_FLAG_STREAMS,		KSMBD_TCON_STREAMS },
+		{ KSMBD_SHARE_FLAG_INHERIT_OWNER,	KSMBD_TCON_INHERIT_OWNER },
+	};
+	unsigned int flags = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(map); i++)
+		if (test_share_config_flag(sc, map[i].share_flag))
+			flags |= map[i].fast_flag;
+	if (connection_flags & KSMBD_TREE_CONN_FLAG_WRITABLE)
+		flags |= KSMBD_TCON_WRITABLE;
+	return flags;
+}
+
+/**
+ * ksmbd_tree_conn_connect() - connect a session to a share
+ * @work:	smb work to park on the daemon request, or NULL to wait for
+ *		the daemon in place
+ * @sess:	session to connect
+ * @share_name:	share to connect to, unused when @work is resumed
+ *
+ * If the decision is not cached and @work is given, the daemon request is
+ * queued on @work and -EINPROGRESS is returned. The handler is called
+ * again with the response once the daemon answered and picks the half
+ * built tree connection up from @work.
+ *
+ * Return:	tree connection status
+ */
 struct ksmbd_tree_conn_status
-ksmbd_tree_conn_connect(struct ksmbd_session *sess, char *share_name)
+ksmbd_tree_conn_connect(struct ksmbd_work *work, struct ksmbd_session *sess,
+			char *share_name)
 {
 	struct ksmbd_tree_conn_status status = {-EINVAL, NULL};
 	struct ksmbd_tree_connect_response *resp = NULL;
 	struct ksmbd_share_config *sc;
 	struct ksmbd_tree_connect *tree_conn = NULL;
 	struct sockaddr *peer_addr;
+	unsigned short connection_flags;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
 	int ret;
 #endif
 
+	peer_addr = KSMBD_TCP_PEER_SOCKADDR(sess->conn);
+	if (work && work->ipc_type == KSMBD_EVENT_TREE_CONNECT_REQUEST) {
+		tree_conn = work->ipc_ctx;
+		work->ipc_ctx = NULL;
+		sc = tree_conn->share_conf;
+		resp = ksmbd_work_ipc_response(work);
+		goto check_resp;
+	}
+
 	sc = ksmbd_share_config_get(share_name);
 	if (!sc)
 		return status;
@@ -45,12 +340,21 @@ ksmbd_tree_conn_connect(struct ksmbd_session *sess, char *share_name)
 		status.ret = -EINVAL;
 		goto out_error;
 	}
+	tree_conn->share_conf = sc;
 
-	peer_addr = KSMBD_TCP_PEER_SOCKADDR(sess->conn);
-	resp = ksmbd_ipc_tree_connect_request(sess,
-					      sc,
-					      tree_conn,
-					      peer_addr);
+	if (tcon_cache_lookup(sess, sc, peer_addr, &connection_flags))
+		goto connected;
+
+	if (work && !ksmbd_ipc_tree_connect_request_async(work, sess, sc,
+							   tree_conn,
+							   peer_addr)) {
+		work->ipc_ctx = tree_conn;
+		status.ret = -EINPROGRESS;
+		return status;
+	}
+
+	resp = ksmbd_ipc_tree_connect_request(sess, sc, tree_conn, peer_addr);
+check_resp:
 	if (!resp) {
 		status.ret = -EINVAL;
 		goto out_error;
@@ -60,9 +364,15 @@ ksmbd_tree_conn_connect(struct ksmbd_session *sess, char *share_name)
 	if (status.ret != KSMBD_TREE_CONN_STATUS_OK)
 		goto out_error;
 
-	tree_conn->flags = resp->connection_flags;
+	connection_flags = resp->connection_flags;
+	tcon_cache_insert(sess, sc, peer_addr, connection_flags);
+
+connected:
+	status.ret = KSMBD_TREE_CONN_STATUS_OK;
+	tree_conn->flags = connection_flags;
+	tree_conn->fast_flags = tcon_fast_flags(sc, connection_flags);
+	tree_conn->sess = sess;
 	tree_conn->user = sess->user;
-	tree_conn->share_conf = sc;
 	status.tree_conn = tree_conn;
 
 	ret = xa_err(xa_store(&sess->tree_conns, tree_conn->id, tree_conn,
@@ -91,15 +401,54 @@ int ksmbd_tree_conn_disconnect(struct ksmbd_session *sess,
 	ret = ksmbd_ipc_tree_disconnect_request(sess->id, tree_conn->id);
 	ksmbd_release_tree_conn_id(sess, tree_conn->id);
 	xa_erase(&sess->tree_conns, tree_conn->id);
+	if (sess->conn)
+		cmpxchg(&sess->conn->last_tcon, tree_conn, NULL);
 	ksmbd_share_config_put(tree_conn->share_conf);
-	kfree(tree_conn);
+	kfree_rcu(tree_conn, rcu);
 	return ret;
 }
 
+/**
+ * ksmbd_tree_conn_lookup() - find a tree connection of a session
+ * @sess:	session
+ * @id:		tree id
+ *
+ * Requests mostly keep hitting the tree they hit last, so the connection
+ * that owns @sess remembers the last tree connection looked up on it.
+ *
+ * Return:	tree connection, NULL if @id is not connected on @sess
+ */
 struct ksmbd_tree_connect *ksmbd_tree_conn_lookup(struct ksmbd_session *sess,
 						  unsigned int id)
 {
-	return xa_load(&sess->tree_conns, id);
+	struct ksmbd_conn *conn = sess->conn;
+	struct ksmbd_tree_connect *tcon;
+
+	if (!conn)
+		return xa_load(&sess->tree_conns, id);
+
+	rcu_read_lock();
+	tcon = READ_ONCE(conn->last_tcon);
+	if (tcon && tcon->id == id && tcon->sess == sess)
+		goto out;
+
+	tcon = xa_load(&sess->tree_conns, id);
+	if (tcon) {
+		WRITE_ONCE(conn->last_tcon, tcon);
+		/*
+		 * ksmbd_tree_conn_disconnect() may have removed the tree
+		 * connection right before it was cached, do not leave it
+		 * behind in the cache.
+		 */
+		smp_mb();
+		if (xa_load(&sess->tree_conns, id) != tcon) {
+			cmpxchg(&conn->last_tcon, tcon, NULL);
+			tcon = NULL;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return tcon;
 }
 
 struct ksmbd_share_config *ksmbd_tree_conn_share(struct ksmbd_session *sess,
@@ -7,24 +7,43 @@
 #define __TREE_CONNECT_MANAGEMENT_H__
 
 #include <linux/hashtable.h>
+#include <linux/cache.h>
+#include <linux/rcupdate.h>
 
 #include "../ksmbd_netlink.h"
 
 struct ksmbd_share_config;
+struct ksmbd_session;
 struct ksmbd_user;
 
+/*
+ * Share and connection properties the request paths test, folded into
+ * ksmbd_tree_connect->fast_flags at connect time, see tcon_fast_flags().
+ */
+#define KSMBD_TCON_PIPE			BIT(0)
+#define KSMBD_TCON_WRITABLE		BIT(1)
+#define KSMBD_TCON_POSIX		BIT(2)
+#define KSMBD_TCON_STORE_DOS_ATTRS	BIT(3)
+#define KSMBD_TCON_OPLOCKS		BIT(4)
+#define KSMBD_TCON_HIDE_DOT_FILES	BIT(5)
+#define KSMBD_TCON_FOLLOW_SYMLINKS	BIT(6)
+#define KSMBD_TCON_ACL_XATTR		BIT(7)
+#define KSMBD_TCON_STREAMS		BIT(8)
+#define KSMBD_TCON_INHERIT_OWNER	BIT(9)
+
 struct ksmbd_tree_connect {
+	/* read by every request, keep them in the first cache line */
 	int				id;
-
+	unsigned int			fast_flags;
 	unsigned int			flags;
+	int				maximal_access;
 	struct ksmbd_share_config	*share_conf;
-	struct ksmbd_user		*user;
+	struct ksmbd_session		*sess;
 
+	struct ksmbd_user		*user;
 	struct list_head		list;
-
-	int				maximal_access;
-	bool				posix_extensions;
-};
+	struct rcu_head			rcu;
+} ____cacheline_aligned;
 
 struct ksmbd_tree_conn_status {
 	unsigned int			ret;
@@ -37,10 +56,17 @@ static inline int test_tree_conn_flag(struct ksmbd_tree_connect *tree_conn,
 	return tree_conn->flags & flag;
 }
 
-struct ksmbd_session;
+static inline bool test_tree_conn_fast_flag(struct ksmbd_tree_connect *tree_conn,
+					    unsigned int flag)
+{
+	return tree_conn->fast_flags & flag;
+}
+
+struct ksmbd_work;
 
 struct ksmbd_tree_conn_status
-ksmbd_tree_conn_connect(struct ksmbd_session *sess, char *share_name);
+ksmbd_tree_conn_connect(struct ksmbd_work *work, struct ksmbd_session *sess,
+			char *share_name);
 
 int ksmbd_tree_conn_disconnect(struct ksmbd_session *sess,
 			       struct ksmbd_tree_connect *tree_conn);
@@ -53,4 +79,8 @@ struct ksmbd_share_config *ksmbd_tree_conn_share(struct ksmbd_session *sess,
 
 int ksmbd_tree_conn_session_logoff(struct ksmbd_session *sess);
 
+void ksmbd_tree_conn_cache_flush(void);
+int ksmbd_tree_conn_cache_show(char *buf, size_t size);
+int ksmbd_tree_conn_cache_store(const char *buf);
+
 #endif /* __TREE_CONNECT_MANAGEMENT_H__ */
@@ -5,7 +5,7 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
-#include <linux/rwsem.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
 #include <linux/xarray.h>
 
@@ -14,30 +14,63 @@
 #include "user_config.h"
 #include "tree_connect.h"
 #include "../transport_ipc.h"
+#include "../rpc.h"
 #include "../connection.h"
 #include "../vfs_cache.h"
 
 static DEFINE_IDA(session_ida);
 
-#define SESSION_HASH_BITS		3
-static DEFINE_HASHTABLE(sessions_table, SESSION_HASH_BITS);
-static DECLARE_RWSEM(sessions_table_lock);
+/*
+ * SMB2 sessions indexed by session id. Lookups only take the RCU read lock,
+ * sessions are freed after a grace period.
+ */
+static DEFINE_XARRAY(sessions_table);
 
 struct ksmbd_session_rpc {
 	int			id;
 	unsigned int		method;
+	struct ksmbd_rpc_pipe	*pipe;
 	struct list_head	list;
 };
 
+/*
+ * A channel is on the list of its session and on the list of the
+ * connection that bound it. The connection lock nests inside the session
+ * lock, and the binding connection stays alive while its channels are on
+ * a session list, see ksmbd_sessions_deregister().
+ */
+static void channel_free(struct channel *chann)
+{
+	spin_lock(&chann->conn->chann_lock);
+	list_del(&chann->conn_list);
+	spin_unlock(&chann->conn->chann_lock);
+	list_del(&chann->chann_list);
+	kfree(chann);
+}
+
 static void free_channel_list(struct ksmbd_session *sess)
 {
 	struct channel *chann, *tmp;
 
+	spin_lock(&sess->chann_lock);
 	list_for_each_entry_safe(chann, tmp, &sess->ksmbd_chann_list,
-				 chann_list) {
-		list_del(&chann->chann_list);
-		kfree(chann);
-	}
+				 chann_list)
+		channel_free(chann);
+	spin_unlock(&sess->chann_lock);
+}
+
+void ksmbd_session_add_channel(struct ksmbd_session *sess,
+			       struct channel *chann)
+{
+	struct ksmbd_conn *conn = chann->conn;
+
+	chann->sess = sess;
+	spin_lock(&sess->chann_lock);
+	list_add(&chann->chann_list, &sess->ksmbd_chann_list);
+	spin_lock(&conn->chann_lock);
+	list_add(&chann->conn_list, &conn->chann_list);
+	spin_unlock(&conn->chann_lock);
+	spin_unlock(&sess->chann_lock);
 }
 
 static void __session_rpc_close(struct ksmbd_session *sess,
@@ -51,6 +84,7 @@ static void __session_rpc_close(struct ksmbd_session *sess,
 
 	kvfree(resp);
 	ksmbd_rpc_id_free(entry->id);
+	ksmbd_rpc_pipe_free(entry->pipe);
 	kfree(entry);
 }
 
@@ -114,6 +148,7 @@ int ksmbd_session_rpc_open(struct ksmbd_session *sess, char *rpc_name)
 		goto error;
 
 	kvfree(resp);
+	entry->pipe = ksmbd_rpc_pipe_alloc(method);
 	return entry->id;
 error:
 	list_del(&entry->list);
@@ -145,6 +180,18 @@ int ksmbd_session_rpc_method(struct ksmbd_session *sess, int id)
 	return 0;
 }
 
+struct ksmbd_rpc_pipe *ksmbd_session_rpc_pipe(struct ksmbd_session *sess,
+					      int id)
+{
+	struct ksmbd_session_rpc *entry;
+
+	list_for_each_entry(entry, &sess->rpc_handle_list, list) {
+		if (entry->id == id)
+			return entry->pipe;
+	}
+	return NULL;
+}
+
 void ksmbd_session_destroy(struct ksmbd_session *sess)
 {
 	if (!sess)
@@ -153,19 +200,14 @@ void ksmbd_session_destroy(struct ksmbd_session *sess)
 	if (!atomic_dec_and_test(&sess->refcnt))
 		return;
 
-	list_del(&sess->sessions_entry);
-
-#ifdef CONFIG_SMB_INSECURE_SERVER
-	if (IS_SMB2(sess->conn)) {
-		down_write(&sessions_table_lock);
-		hash_del(&sess->hlist);
-		up_write(&sessions_table_lock);
+	if (sess->conn) {
+		xa_cmpxchg(&sess->conn->sessions, sess->id, sess, NULL,
+			   GFP_KERNEL);
+		cmpxchg(&sess->conn->last_sess, sess, NULL);
 	}
-#else
-	down_write(&sessions_table_lock);
-	hash_del(&sess->hlist);
-	up_write(&sessions_table_lock);
-#endif
+
+	/* SMB1 sessions and ones that failed to set up are not in the table */
+	xa_cmpxchg(&sessions_table, sess->id, sess, NULL, GFP_KERNEL);
 
 	if (sess->user)
 		ksmbd_free_user(sess->user);
@@ -176,56 +218,96 @@ void ksmbd_session_destroy(struct ksmbd_session *sess)
 	free_channel_list(sess);
 	kfree(sess->Preauth_HashValue);
 	ksmbd_release_id(&session_ida, sess->id);
-	kfree(sess);
-}
-
-static struct ksmbd_session *__session_lookup(unsigned long long id)
-{
-	struct ksmbd_session *sess;
-
-	hash_for_each_possible(sessions_table, sess, hlist, id) {
-		if (id == sess->id)
-			return sess;
-	}
-	return NULL;
+	kfree_rcu(sess, rcu_head);
 }
 
-void ksmbd_session_register(struct ksmbd_conn *conn,
-			    struct ksmbd_session *sess)
+int ksmbd_session_register(struct ksmbd_conn *conn,
+			   struct ksmbd_session *sess)
 {
 	sess->conn = conn;
-	list_add(&sess->sessions_entry, &conn->sessions);
+	return xa_err(xa_store(&conn->sessions, sess->id, sess, GFP_KERNEL));
 }
 
 void ksmbd_sessions_deregister(struct ksmbd_conn *conn)
 {
 	struct ksmbd_session *sess;
-
-	while (!list_empty(&conn->sessions)) {
-		sess = list_entry(conn->sessions.next,
-				  struct ksmbd_session,
-				  sessions_entry);
-
-		ksmbd_session_destroy(sess);
+	struct channel *chann;
+	unsigned long id;
+
+	/*
+	 * Channels bound from this connection live on sessions owned by
+	 * other connections, drop them before the connection goes away.
+	 * The session lock is taken first, so the connection lock is
+	 * dropped meanwhile: the session may free the channel, but is
+	 * itself only freed after a grace period.
+	 */
+	rcu_read_lock();
+	spin_lock(&conn->chann_lock);
+	while ((chann = list_first_entry_or_null(&conn->chann_list,
+						 struct channel, conn_list))) {
+		sess = chann->sess;
+		spin_unlock(&conn->chann_lock);
+
+		spin_lock(&sess->chann_lock);
+		spin_lock(&conn->chann_lock);
+		if (chann == list_first_entry_or_null(&conn->chann_list,
+						      struct channel,
+						      conn_list) &&
+		    chann->sess == sess) {
+			list_del(&chann->conn_list);
+			list_del(&chann->chann_list);
+			kfree(chann);
+		}
+		spin_unlock(&conn->chann_lock);
+		spin_unlock(&sess->chann_lock);
+		spin_lock(&conn->chann_lock);
 	}
-}
+	spin_unlock(&conn->chann_lock);
+	rcu_read_unlock();
 
-static bool ksmbd_session_id_match(struct ksmbd_session *sess,
-				   unsigned long long id)
-{
-	return sess->id == id;
+	xa_for_each(&conn->sessions, id, sess)
+		ksmbd_session_destroy(sess);
 }
 
+/**
+ * ksmbd_session_lookup() - find a session registered on a connection
+ * @conn:	connection instance
+ * @id:		session id
+ *
+ * The session used last on the connection is checked first, most requests
+ * on a connection belong to the same session.
+ *
+ * Return:	session, NULL if @id is not registered on @conn
+ */
 struct ksmbd_session *ksmbd_session_lookup(struct ksmbd_conn *conn,
 					   unsigned long long id)
 {
-	struct ksmbd_session *sess = NULL;
+	struct ksmbd_session *sess;
 
-	list_for_each_entry(sess, &conn->sessions, sessions_entry) {
-		if (ksmbd_session_id_match(sess, id))
-			return sess;
+	if (id > ULONG_MAX)
+		return NULL;
+
+	rcu_read_lock();
+	sess = READ_ONCE(conn->last_sess);
+	if (sess && sess->id == id)
+		goto out;
+
+	sess = xa_load(&conn->sessions, id);
+	if (sess) {
+		WRITE_ONCE(conn->last_sess, sess);
+		/*
+		 * ksmbd_session_destroy() may have removed the session right
+		 * before it was cached, do not leave it behind in the cache.
+		 */
+		smp_mb();
+		if (xa_load(&conn->sessions, id) != sess) {
+			cmpxchg(&conn->last_sess, sess, NULL);
+			sess = NULL;
+		}
 	}
-	return NULL;
+out:
+	rcu_read_unlock();
+	return sess;
 }
 
 int get_session(struct ksmbd_session *sess)
@@ -243,13 +325,14 @@ struct ksmbd_session *ksmbd_session_lookup_slowpath(unsigned long long id)
 {
 	struct ksmbd_session *sess;
 
-	down_read(&sessions_table_lock);
-	sess = __session_lookup(id);
-	if (sess) {
-		if (!get_session(sess))
-			sess = NULL;
-	}
-	up_read(&sessions_table_lock);
+	if (id > ULONG_MAX)
+		return NULL;
+
+	rcu_read_lock();
+	sess = xa_load(&sessions_table, id);
+	if (sess && !get_session(sess))
+		sess = NULL;
+	rcu_read_unlock();
 
 	return sess;
 }
@@ -335,8 +418,8 @@ static struct ksmbd_session *__session_create(int protocol)
 		goto error;
 
 	set_session_flag(sess, protocol);
-	INIT_LIST_HEAD(&sess->sessions_entry);
 	xa_init(&sess->tree_conns);
+	spin_lock_init(&sess->chann_lock);
 	INIT_LIST_HEAD(&sess->ksmbd_chann_list);
 	INIT_LIST_HEAD(&sess->rpc_handle_list);
 	sess->sequence_number = 1;
@@ -361,11 +444,9 @@ static struct ksmbd_session *__session_create(int protocol)
 
 	ida_init(&sess->tree_conn_ida);
 
-	if (protocol == CIFDS_SESSION_FLAG_SMB2) {
-		down_write(&sessions_table_lock);
-		hash_add(sessions_table, &sess->hlist, sess->id);
-		up_write(&sessions_table_lock);
-	}
+	if (protocol == CIFDS_SESSION_FLAG_SMB2 &&
+	    xa_err(xa_store(&sessions_table, sess->id, sess, GFP_KERNEL)))
+		goto error;
 	return sess;
 
 error:
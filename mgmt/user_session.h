@@ -25,7 +25,11 @@ struct ksmbd_file_table;
 struct channel {
 	__u8			smb3signingkey[SMB3_SIGN_KEY_SIZE];
 	struct ksmbd_conn	*conn;
+	struct ksmbd_session	*sess;
+	/* on ksmbd_session->ksmbd_chann_list */
 	struct list_head	chann_list;
+	/* on ksmbd_conn->chann_list */
+	struct list_head	conn_list;
 };
 
 struct preauth_session {
@@ -52,7 +56,8 @@ struct ksmbd_session {
 	struct ntlmssp_auth		ntlmssp;
 	char				sess_key[CIFS_KEY_SIZE];
 
-	struct hlist_node		hlist;
+	/* protects ksmbd_chann_list against binding and channel teardown */
+	spinlock_t			chann_lock;
 	struct list_head		ksmbd_chann_list;
 	struct xarray			tree_conns;
 	struct ida			tree_conn_ida;
@@ -62,9 +67,9 @@ struct ksmbd_session {
 	__u8				smb3decryptionkey[SMB3_ENC_DEC_KEY_SIZE];
 	__u8				smb3signingkey[SMB3_SIGN_KEY_SIZE];
 
-	struct list_head		sessions_entry;
 	struct ksmbd_file_table		file_table;
 	atomic_t			refcnt;
+	struct rcu_head			rcu_head;
 };
 
 static inline int test_session_flag(struct ksmbd_session *sess, int bit)
@@ -92,9 +97,11 @@ void ksmbd_session_destroy(struct ksmbd_session *sess);
 struct ksmbd_session *ksmbd_session_lookup_slowpath(unsigned long long id);
 struct ksmbd_session *ksmbd_session_lookup(struct ksmbd_conn *conn,
 					   unsigned long long id);
-void ksmbd_session_register(struct ksmbd_conn *conn,
-			    struct ksmbd_session *sess);
+int ksmbd_session_register(struct ksmbd_conn *conn,
+			   struct ksmbd_session *sess);
 void ksmbd_sessions_deregister(struct ksmbd_conn *conn);
+void ksmbd_session_add_channel(struct ksmbd_session *sess,
+			       struct channel *chann);
 struct ksmbd_session *ksmbd_session_lookup_all(struct ksmbd_conn *conn,
 					       unsigned long long id);
 struct preauth_session *ksmbd_preauth_session_alloc(struct ksmbd_conn *conn,
@@ -108,6 +115,8 @@ void ksmbd_release_tree_conn_id(struct ksmbd_session *sess, int id);
 int ksmbd_session_rpc_open(struct ksmbd_session *sess, char *rpc_name);
 void ksmbd_session_rpc_close(struct ksmbd_session *sess, int id);
 int ksmbd_session_rpc_method(struct ksmbd_session *sess, int id);
+struct ksmbd_rpc_pipe *ksmbd_session_rpc_pipe(struct ksmbd_session *sess,
+					      int id);
 int get_session(struct ksmbd_session *sess);
 void put_session(struct ksmbd_session *sess);
 #endif /* __USER_SESSION_MANAGEMENT_H__ */
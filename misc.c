@@ -8,6 +8,7 @@
 #include <linux/version.h>
 #include <linux/xattr.h>
 #include <linux/fs.h>
+#include <linux/parser.h>
 
 #include "misc.h"
 #include "smb_common.h"
@@ -68,6 +69,75 @@ int match_pattern(const char *str, size_t len, const char *pattern)
 	return !*p;
 }
 
+/**
+ * ksmbd_compile_pattern() - classify a wildcard pattern once so that
+ * matching against many names can skip the generic wildcard engine
+ * @p:		compiled pattern to fill
+ * @pattern:	pattern string, must outlive @p
+ * @icase:	compare case-insensitively (search pattern) or not (veto list)
+ */
+void ksmbd_compile_pattern(struct ksmbd_pattern *p, const char *pattern,
+			   bool icase)
+{
+	p->pattern = pattern;
+	p->icase = icase;
+	p->str = pattern;
+	p->len = strlen(pattern);
+
+	if (!strpbrk(pattern, "*?")) {
+		p->type = KSMBD_PATTERN_LITERAL;
+		return;
+	}
+
+	if (pattern[0] == '*' && !strpbrk(pattern + 1, "*?")) {
+		p->str = pattern + 1;
+		p->len--;
+		if (p->len)
+			p->type = KSMBD_PATTERN_SUFFIX;
+		else
+			p->type = KSMBD_PATTERN_MATCH_ALL;
+		return;
+	}
+
+	p->type = KSMBD_PATTERN_WILDCARD;
+}
+
+static bool pattern_str_equal(const struct ksmbd_pattern *p, const char *str)
+{
+	if (p->icase)
+		return !strncasecmp(str, p->str, p->len);
+	return !memcmp(str, p->str, p->len);
+}
+
+/**
+ * ksmbd_match_compiled_pattern() - match a name against compiled pattern
+ * @p:		pattern compiled by ksmbd_compile_pattern()
+ * @str:	name to compare with the pattern
+ * @len:	name length
+ *
+ * Return:	true if the name matches the pattern, otherwise false
+ */
+bool ksmbd_match_compiled_pattern(const struct ksmbd_pattern *p,
+				  const char *str, size_t len)
+{
+	switch (p->type) {
+	case KSMBD_PATTERN_MATCH_ALL:
+		return true;
+	case KSMBD_PATTERN_SUFFIX:
+		if (len < p->len)
+			return false;
+		return pattern_str_equal(p, str + len - p->len);
+	case KSMBD_PATTERN_LITERAL:
+		if (len != p->len)
+			return false;
+		return pattern_str_equal(p, str);
+	default:
+		if (p->icase)
+			return match_pattern(str, len, p->pattern);
+		return match_wildcard(p->pattern, str);
+	}
+}
+
 /*
  * is_char_allowed() - check for valid character
  * @ch:		input character to be checked
@@ -103,6 +173,11 @@ int ksmbd_validate_filename(char *filename)
 
 static int ksmbd_validate_stream_name(char *stream_name)
 {
+	if (!strcmp(stream_name, ".") || !strcmp(stream_name, "..")) {
+		pr_err("Stream name validation failed: %s\n", stream_name);
+		return -ENOENT;
+	}
+
 	while (*stream_name) {
 		char c = *stream_name;
 
@@ -129,12 +204,6 @@ int parse_stream_name(char *filename, char **stream_name, int *s_type)
 		stream_type = s_name;
 		s_name = strsep(&stream_type, ":");
 
-		rc = ksmbd_validate_stream_name(s_name);
-		if (rc < 0) {
-			rc = -ENOENT;
-			goto out;
-		}
-
 		ksmbd_debug(SMB, "stream name : %s, stream type : %s\n", s_name,
 			    stream_type);
 		if (!strncasecmp("$data", stream_type, 5))
@@ -143,8 +212,14 @@ int parse_stream_name(char *filename, char **stream_name, int *s_type)
 			*s_type = DIR_STREAM;
 		else
 			rc = -ENOENT;
+		if (rc)
+			goto out;
 	}
 
+	rc = ksmbd_validate_stream_name(s_name);
+	if (rc < 0)
+		goto out;
+
 	*stream_name = s_name;
 out:
 	return rc;
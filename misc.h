@@ -12,6 +12,26 @@ struct kstat;
 struct ksmbd_file;
 
 int match_pattern(const char *str, size_t len, const char *pattern);
+
+enum ksmbd_pattern_type {
+	KSMBD_PATTERN_MATCH_ALL,	/* "*" */
+	KSMBD_PATTERN_SUFFIX,		/* "*.ext" */
+	KSMBD_PATTERN_LITERAL,		/* no wildcard at all */
+	KSMBD_PATTERN_WILDCARD,		/* anything else */
+};
+
+struct ksmbd_pattern {
+	int		type;
+	bool		icase;
+	const char	*pattern;
+	const char	*str;
+	size_t		len;
+};
+
+void ksmbd_compile_pattern(struct ksmbd_pattern *p, const char *pattern,
+			   bool icase);
+bool ksmbd_match_compiled_pattern(const struct ksmbd_pattern *p,
+				  const char *str, size_t len);
 int ksmbd_validate_filename(char *filename);
 int parse_stream_name(char *filename, char **stream_name, int *s_type);
 char *convert_to_nt_pathname(char *filename, char *sharepath);
@@ -1460,8 +1460,7 @@ void smb_break_all_levII_oplock(struct ksmbd_work *work, struct ksmbd_file *fp,
 	struct ksmbd_inode *ci;
 	struct ksmbd_conn *conn = work->sess->conn;
 
-	if (!test_share_config_flag(work->tcon->share_conf,
-				    KSMBD_SHARE_FLAG_OPLOCKS))
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS))
 		return;
 
 	ci = fp->f_ci;
@@ -1547,8 +1546,7 @@ next:
  */
 void smb_break_all_oplock(struct ksmbd_work *work, struct ksmbd_file *fp)
 {
-	if (!test_share_config_flag(work->tcon->share_conf,
-				    KSMBD_SHARE_FLAG_OPLOCKS))
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS))
 		return;
 
 	smb_break_all_write_oplock(work, fp, 1);
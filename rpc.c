@@ -0,0 +1,754 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2021 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <asm/unaligned.h>
+
+#include "glob.h"
+#include "ndr.h"
+#include "rpc.h"
+#include "server.h"
+#include "unicode.h"
+#include "connection.h"
+#include "ksmbd_netlink.h"
+#include "mgmt/user_config.h"
+#include "mgmt/user_session.h"
+#include "mgmt/share_config.h"
+
+/*
+ * In-kernel responder for the read-only DCE/RPC calls file browsers issue
+ * all the time: srvsvc NetShareEnumAll/NetShareGetInfo and wkssvc
+ * NetWkstaGetInfo. Binds and every call not understood here still go to
+ * the daemon, which keeps owning the pipe; the kernel only watches the
+ * binds and the daemon's acks to learn which presentation contexts use
+ * plain NDR.
+ */
+
+#define DCERPC_PTYPE_REQUEST		0
+#define DCERPC_PTYPE_RESPONSE		2
+#define DCERPC_PTYPE_BIND		11
+#define DCERPC_PTYPE_BIND_ACK		12
+#define DCERPC_PTYPE_ALTER_CONTEXT	14
+#define DCERPC_PTYPE_ALTER_CONTEXT_RESP	15
+
+#define DCERPC_PFC_FIRST_FRAG		0x01
+#define DCERPC_PFC_LAST_FRAG		0x02
+#define DCERPC_PFC_OBJECT_UUID		0x80
+
+#define DCERPC_DREP_LE			0x10
+
+#define DCERPC_HDR_SIZE			16
+#define DCERPC_BIND_HDR_SIZE		28
+#define DCERPC_REQ_HDR_SIZE		24
+#define DCERPC_RSP_HDR_SIZE		24
+#define DCERPC_ACK_HDR_SIZE		26
+#define DCERPC_SYNTAX_SIZE		20
+#define DCERPC_RESULT_SIZE		(4 + DCERPC_SYNTAX_SIZE)
+/* smaller fragments are left to the daemon */
+#define DCERPC_MIN_FRAG			1024
+#define DCERPC_MAX_FRAG			4280
+
+#define SRVSVC_OPNUM_SHARE_ENUM_ALL	15
+#define SRVSVC_OPNUM_SHARE_GET_INFO	16
+#define WKSSVC_OPNUM_WKSTA_GET_INFO	0
+
+#define SHARE_TYPE_DISKTREE		0
+#define SHARE_TYPE_IPC			3
+#define SHARE_TYPE_HIDDEN		0x80000000
+
+#define WKSTA_PLATFORM_ID_NT		500
+#define WKSTA_VERSION_MAJOR		2
+#define WKSTA_VERSION_MINOR		1
+
+#define WERR_OK				0
+#define WERR_NET_NAME_NOT_FOUND		0x00000906
+
+#define RPC_PIPE_MAX_CONTEXTS		4
+#define RPC_REF_ID_BASE			0x00020000
+
+/* 4b324fc8-1670-01d3-1278-5a47bf6ee188 version 3.0 */
+static const u8 srvsvc_syntax[DCERPC_SYNTAX_SIZE] = {
+	0xc8, 0x4f, 0x32, 0x4b, 0x70, 0x16, 0xd3, 0x01,
+	0x12, 0x78, 0x5a, 0x47, 0xbf, 0x6e, 0xe1, 0x88,
+	0x03, 0x00, 0x00, 0x00,
+};
+
+/* 6bffd098-a112-3610-9833-46c3f87e345a version 1.0 */
+static const u8 wkssvc_syntax[DCERPC_SYNTAX_SIZE] = {
+	0x98, 0xd0, 0xff, 0x6b, 0x12, 0xa1, 0x10, 0x36,
+	0x98, 0x33, 0x46, 0xc3, 0xf8, 0x7e, 0x34, 0x5a,
+	0x01, 0x00, 0x00, 0x00,
+};
+
+/* 8a885d04-1ceb-11c9-9fe8-08002b104860 version 2 */
+static const u8 ndr_transfer_syntax[DCERPC_SYNTAX_SIZE] = {
+	0x04, 0x5d, 0x88, 0x8a, 0xeb, 0x1c, 0xc9, 0x11,
+	0x9f, 0xe8, 0x08, 0x00, 0x2b, 0x10, 0x48, 0x60,
+	0x02, 0x00, 0x00, 0x00,
+};
+
+struct ksmbd_rpc_pipe {
+	struct mutex			lock;
+	unsigned int			method;
+	const u8			*syntax;
+	/* the daemon owes the client a response, stay out of the way */
+	bool				daemon_pending;
+	unsigned int			max_frag;
+	int				nr_contexts;
+	u16				contexts[RPC_PIPE_MAX_CONTEXTS];
+	/* NDR contexts of a bind the daemon has not acked yet */
+	u8				bind_ptype;
+	unsigned int			bind_max_frag;
+	int				nr_bind_contexts;
+	u16				bind_contexts[RPC_PIPE_MAX_CONTEXTS];
+	/* index of each of them in the bind's context list */
+	u8				bind_items[RPC_PIPE_MAX_CONTEXTS];
+	/* response built here and not read yet */
+	struct ksmbd_rpc_command	*rsp;
+};
+
+struct rpc_reply {
+	struct ndr		*out;
+	struct nls_table	*nls;
+	u32			ref_id;
+};
+
+static atomic_long_t rpc_fast_hits;
+static atomic_long_t rpc_fast_fallbacks;
+
+/* whether @n has @sz more bytes, offset and length are plain ints */
+static bool rpc_ndr_room(struct ndr *n, size_t sz)
+{
+	return n->offset >= 0 && n->offset <= n->length &&
+	       sz <= (size_t)(n->length - n->offset);
+}
+
+static int rpc_pull_u32(struct ndr *n, u32 *v)
+{
+	n->offset = ALIGN(n->offset, 4);
+	if (!rpc_ndr_room(n, sizeof(*v)))
+		return -EINVAL;
+
+	*v = get_unaligned_le32(n->data + n->offset);
+	n->offset += sizeof(*v);
+	return 0;
+}
+
+/* conformant varying UTF-16 string, @str may be NULL to skip it */
+static int rpc_pull_unistr(struct ndr *n, char **str, struct nls_table *nls)
+{
+	u32 max_count, offset, actual_count;
+	char *s;
+
+	if (rpc_pull_u32(n, &max_count) || rpc_pull_u32(n, &offset) ||
+	    rpc_pull_u32(n, &actual_count))
+		return -EINVAL;
+
+	if (offset || actual_count > max_count ||
+	    !rpc_ndr_room(n, (size_t)actual_count * 2))
+		return -EINVAL;
+
+	if (str) {
+		s = smb_strndup_from_utf16(n->data + n->offset,
+					   actual_count * 2, true, nls);
+		if (IS_ERR(s))
+			return PTR_ERR(s);
+		*str = s;
+	}
+	n->offset += actual_count * 2;
+	return 0;
+}
+
+static int rpc_pull_unique_unistr(struct ndr *n, char **str,
+				  struct nls_table *nls)
+{
+	u32 ref_id;
+
+	if (rpc_pull_u32(n, &ref_id))
+		return -EINVAL;
+	if (!ref_id)
+		return 0;
+	return rpc_pull_unistr(n, str, nls);
+}
+
+static int rpc_push_u32(struct ndr *n, u32 v)
+{
+	n->offset = ALIGN(n->offset, 4);
+	if (!rpc_ndr_room(n, sizeof(v)))
+		return -ENOSPC;
+
+	put_unaligned_le32(v, n->data + n->offset);
+	n->offset += sizeof(v);
+	return 0;
+}
+
+static int rpc_push_unistr(struct ndr *n, const char *str,
+			   struct nls_table *nls)
+{
+	int len = strlen(str), count;
+
+	n->offset = ALIGN(n->offset, 4);
+	if (!rpc_ndr_room(n, 3 * sizeof(u32) + ((size_t)len + 1) * 2))
+		return -ENOSPC;
+
+	count = smb_strtoUTF16((__le16 *)(n->data + n->offset +
+					  3 * sizeof(u32)),
+			       str, len, nls) + 1;
+	rpc_push_u32(n, count);
+	rpc_push_u32(n, 0);
+	rpc_push_u32(n, count);
+	n->offset += count * 2;
+	return 0;
+}
+
+static u32 rpc_ref_id(struct rpc_reply *rep)
+{
+	rep->ref_id += 4;
+	return rep->ref_id;
+}
+
+static u32 srvsvc_share_type(struct ksmbd_share_config *share)
+{
+	u32 type = SHARE_TYPE_DISKTREE;
+	size_t len = strlen(share->name);
+
+	if (test_share_config_flag(share, KSMBD_SHARE_FLAG_PIPE))
+		type = SHARE_TYPE_IPC;
+	if (len && share->name[len - 1] == '$')
+		type |= SHARE_TYPE_HIDDEN;
+	return type;
+}
+
+/*
+ * Push a srvsvc_NetShareInfo0/1. The fixed part goes to rep->out, the
+ * deferred strings to @strings, which may be rep->out itself.
+ */
+static int srvsvc_push_share_info(struct rpc_reply *rep, struct ndr *strings,
+				  struct ksmbd_share_config *share, u32 level)
+{
+	const char *comment = share->comment ? share->comment : "";
+
+	if (rpc_push_u32(rep->out, rpc_ref_id(rep)))
+		return -ENOSPC;
+	if (level == 1 &&
+	    (rpc_push_u32(rep->out, srvsvc_share_type(share)) ||
+	     rpc_push_u32(rep->out, rpc_ref_id(rep))))
+		return -ENOSPC;
+
+	if (rpc_push_unistr(strings, share->name, rep->nls))
+		return -ENOSPC;
+	if (level == 1 && rpc_push_unistr(strings, comment, rep->nls))
+		return -ENOSPC;
+	return 0;
+}
+
+struct srvsvc_share_enum {
+	struct rpc_reply	*rep;
+	struct ndr		strings;
+	u32			level;
+	u32			count;
+};
+
+static int srvsvc_enum_one_share(struct ksmbd_share_config *share, void *arg)
+{
+	struct srvsvc_share_enum *e = arg;
+
+	if (!test_share_config_flag(share, KSMBD_SHARE_FLAG_BROWSEABLE) &&
+	    !test_share_config_flag(share, KSMBD_SHARE_FLAG_PIPE))
+		return 0;
+
+	if (srvsvc_push_share_info(e->rep, &e->strings, share, e->level))
+		return -ENOSPC;
+	e->count++;
+	return 0;
+}
+
+static int srvsvc_share_enum_all(struct ndr *req, struct rpc_reply *rep)
+{
+	struct ndr *out = rep->out;
+	struct srvsvc_share_enum e = { .rep = rep };
+	u32 sw, ctr_ptr, count, array_ptr, max_buffer;
+	u32 resume_ptr, resume_handle = 0;
+	int count_off, ret;
+
+	/* without a complete bulk load only the daemon knows every share */
+	if (!ksmbd_share_configs_loaded())
+		return -EOPNOTSUPP;
+
+	if (rpc_pull_unique_unistr(req, NULL, rep->nls) ||
+	    rpc_pull_u32(req, &e.level) || rpc_pull_u32(req, &sw) ||
+	    rpc_pull_u32(req, &ctr_ptr))
+		return -EINVAL;
+
+	if (e.level > 1 || sw != e.level)
+		return -EOPNOTSUPP;
+
+	if (ctr_ptr) {
+		if (rpc_pull_u32(req, &count) || rpc_pull_u32(req, &array_ptr))
+			return -EINVAL;
+		if (array_ptr)
+			return -EOPNOTSUPP;
+	}
+
+	if (rpc_pull_u32(req, &max_buffer) || rpc_pull_u32(req, &resume_ptr))
+		return -EINVAL;
+	if (resume_ptr && rpc_pull_u32(req, &resume_handle))
+		return -EINVAL;
+	if (resume_handle)
+		return -EOPNOTSUPP;
+
+	if (rpc_push_u32(out, e.level) || rpc_push_u32(out, e.level) ||
+	    rpc_push_u32(out, rpc_ref_id(rep)))
+		return -ENOSPC;
+
+	count_off = out->offset;
+	if (rpc_push_u32(out, 0) || rpc_push_u32(out, rpc_ref_id(rep)) ||
+	    rpc_push_u32(out, 0))
+		return -ENOSPC;
+
+	e.strings.length = out->length;
+	e.strings.offset = 0;
+	e.strings.data = kvzalloc(e.strings.length, GFP_KERNEL);
+	if (!e.strings.data)
+		return -ENOMEM;
+
+	ret = ksmbd_share_configs_for_each(srvsvc_enum_one_share, &e);
+	if (!ret && !rpc_ndr_room(out, e.strings.offset))
+		ret = -ENOSPC;
+	if (!ret) {
+		memcpy(out->data + out->offset, e.strings.data,
+		       e.strings.offset);
+		out->offset += e.strings.offset;
+	}
+	kvfree(e.strings.data);
+	if (ret)
+		return ret;
+
+	/* count and the conformant array size */
+	put_unaligned_le32(e.count, out->data + count_off);
+	put_unaligned_le32(e.count, out->data + count_off + 8);
+
+	if (rpc_push_u32(out, e.count))
+		return -ENOSPC;
+	if (resume_ptr) {
+		if (rpc_push_u32(out, rpc_ref_id(rep)) || rpc_push_u32(out, 0))
+			return -ENOSPC;
+	} else if (rpc_push_u32(out, 0)) {
+		return -ENOSPC;
+	}
+	return rpc_push_u32(out, WERR_OK);
+}
+
+static int srvsvc_share_get_info(struct ndr *req, struct rpc_reply *rep)
+{
+	struct ndr *out = rep->out;
+	struct ksmbd_share_config *share;
+	char *name = NULL;
+	u32 level;
+	int ret;
+
+	if (rpc_pull_unique_unistr(req, NULL, rep->nls) ||
+	    rpc_pull_unistr(req, &name, rep->nls) ||
+	    rpc_pull_u32(req, &level)) {
+		kfree(name);
+		return -EINVAL;
+	}
+
+	if (level > 1) {
+		kfree(name);
+		return -EOPNOTSUPP;
+	}
+
+	share = ksmbd_share_config_lookup(name);
+	kfree(name);
+	if (!share && !ksmbd_share_configs_loaded())
+		return -EOPNOTSUPP;
+
+	ret = rpc_push_u32(out, level);
+	if (ret)
+		goto out;
+
+	if (!share) {
+		ret = rpc_push_u32(out, 0) ||
+		      rpc_push_u32(out, WERR_NET_NAME_NOT_FOUND);
+		goto out;
+	}
+
+	ret = rpc_push_u32(out, rpc_ref_id(rep)) ||
+	      srvsvc_push_share_info(rep, out, share, level) ||
+	      rpc_push_u32(out, WERR_OK);
+out:
+	if (share)
+		ksmbd_share_config_put(share);
+	return ret ? -ENOSPC : 0;
+}
+
+static int wkssvc_wksta_get_info(struct ndr *req, struct rpc_reply *rep)
+{
+	struct ndr *out = rep->out;
+	u32 level;
+
+	if (rpc_pull_unique_unistr(req, NULL, rep->nls) ||
+	    rpc_pull_u32(req, &level))
+		return -EINVAL;
+
+	if (level != 100)
+		return -EOPNOTSUPP;
+
+	if (rpc_push_u32(out, level) ||
+	    rpc_push_u32(out, rpc_ref_id(rep)) ||
+	    rpc_push_u32(out, WKSTA_PLATFORM_ID_NT) ||
+	    rpc_push_u32(out, rpc_ref_id(rep)) ||
+	    rpc_push_u32(out, rpc_ref_id(rep)) ||
+	    rpc_push_u32(out, WKSTA_VERSION_MAJOR) ||
+	    rpc_push_u32(out, WKSTA_VERSION_MINOR) ||
+	    rpc_push_unistr(out, ksmbd_netbios_name(), rep->nls) ||
+	    rpc_push_unistr(out, ksmbd_work_group(), rep->nls) ||
+	    rpc_push_u32(out, WERR_OK))
+		return -ENOSPC;
+	return 0;
+}
+
+/*
+ * Note the presentation contexts the client asks to speak NDR in. They
+ * are only used once the daemon accepted them, see rpc_pipe_note_ack().
+ */
+static void rpc_pipe_note_bind(struct ksmbd_rpc_pipe *pipe, u8 *pdu,
+			       size_t len)
+{
+	size_t off = DCERPC_BIND_HDR_SIZE;
+	int i, nr_items, nr_syntaxes;
+	u8 *syntaxes;
+
+	pipe->nr_bind_contexts = 0;
+	if (pdu[2] == DCERPC_PTYPE_BIND) {
+		pipe->nr_contexts = 0;
+		pipe->max_frag = DCERPC_MAX_FRAG;
+	}
+
+	if (len < DCERPC_BIND_HDR_SIZE)
+		return;
+
+	pipe->bind_ptype = pdu[2];
+	pipe->bind_max_frag = get_unaligned_le16(pdu + 18);
+	if (pipe->bind_max_frag < DCERPC_MIN_FRAG)
+		return;
+
+	nr_items = pdu[24];
+	for (i = 0; i < nr_items; i++) {
+		if (len < off + 4 + DCERPC_SYNTAX_SIZE)
+			return;
+
+		nr_syntaxes = pdu[off + 2];
+		syntaxes = pdu + off + 4 + DCERPC_SYNTAX_SIZE;
+		if (len < off + 4 + DCERPC_SYNTAX_SIZE * (1 + nr_syntaxes))
+			return;
+
+		if (nr_syntaxes == 1 &&
+		    !memcmp(pdu + off + 4, pipe->syntax, DCERPC_SYNTAX_SIZE) &&
+		    !memcmp(syntaxes, ndr_transfer_syntax, DCERPC_SYNTAX_SIZE) &&
+		    pipe->nr_bind_contexts < RPC_PIPE_MAX_CONTEXTS) {
+			pipe->bind_contexts[pipe->nr_bind_contexts] =
+				get_unaligned_le16(pdu + off);
+			pipe->bind_items[pipe->nr_bind_contexts++] = i;
+		}
+
+		off += 4 + DCERPC_SYNTAX_SIZE * (1 + nr_syntaxes);
+	}
+}
+
+/* take over the contexts of the pending bind the daemon accepted */
+static void rpc_pipe_note_ack(struct ksmbd_rpc_pipe *pipe, u8 *pdu,
+			      size_t len)
+{
+	u8 ack_ptype = pipe->bind_ptype == DCERPC_PTYPE_BIND ?
+		DCERPC_PTYPE_BIND_ACK : DCERPC_PTYPE_ALTER_CONTEXT_RESP;
+	unsigned int max_frag;
+	size_t off, res;
+	int i, nr_results;
+
+	if (len < DCERPC_ACK_HDR_SIZE || pdu[0] != 5 || pdu[1] != 0 ||
+	    pdu[2] != ack_ptype || pdu[4] != DCERPC_DREP_LE)
+		return;
+
+	max_frag = min_t(unsigned int, pipe->bind_max_frag,
+			 get_unaligned_le16(pdu + 16));
+	max_frag = min_t(unsigned int, max_frag, DCERPC_MAX_FRAG);
+	if (max_frag < DCERPC_MIN_FRAG)
+		return;
+
+	/* the secondary address, padded to 4 bytes */
+	off = ALIGN(DCERPC_ACK_HDR_SIZE + get_unaligned_le16(pdu + 24), 4);
+	if (len < off + 4)
+		return;
+	nr_results = pdu[off];
+	off += 4;
+
+	if (pipe->bind_ptype == DCERPC_PTYPE_BIND)
+		pipe->max_frag = max_frag;
+	else if (max_frag < pipe->max_frag)
+		return;
+
+	for (i = 0; i < pipe->nr_bind_contexts; i++) {
+		if (pipe->bind_items[i] >= nr_results)
+			continue;
+
+		res = off + pipe->bind_items[i] * DCERPC_RESULT_SIZE;
+		if (len < res + DCERPC_RESULT_SIZE)
+			return;
+
+		/* result 0 is acceptance */
+		if (get_unaligned_le16(pdu + res) ||
+		    memcmp(pdu + res + 4, ndr_transfer_syntax,
+			   DCERPC_SYNTAX_SIZE))
+			continue;
+
+		if (pipe->nr_contexts < RPC_PIPE_MAX_CONTEXTS)
+			pipe->contexts[pipe->nr_contexts++] =
+				pipe->bind_contexts[i];
+	}
+}
+
+static bool rpc_pipe_ndr_context(struct ksmbd_rpc_pipe *pipe, u16 ctx_id)
+{
+	int i;
+
+	for (i = 0; i < pipe->nr_contexts; i++) {
+		if (pipe->contexts[i] == ctx_id)
+			return true;
+	}
+	return false;
+}
+
+static struct ksmbd_rpc_command *
+rpc_pipe_request(struct ksmbd_session *sess, struct ksmbd_rpc_pipe *pipe,
+		 u8 *pdu, size_t len)
+{
+	struct ksmbd_rpc_command *cmd;
+	struct ndr req, out;
+	struct rpc_reply rep;
+	u16 ctx_id, opnum;
+	u32 call_id;
+	int ret = -EOPNOTSUPP;
+
+	if (len < DCERPC_REQ_HDR_SIZE ||
+	    get_unaligned_le16(pdu + 8) != len ||
+	    get_unaligned_le16(pdu + 10) ||
+	    (pdu[3] & (DCERPC_PFC_FIRST_FRAG | DCERPC_PFC_LAST_FRAG |
+		       DCERPC_PFC_OBJECT_UUID)) !=
+	    (DCERPC_PFC_FIRST_FRAG | DCERPC_PFC_LAST_FRAG))
+		return NULL;
+
+	call_id = get_unaligned_le32(pdu + 12);
+	ctx_id = get_unaligned_le16(pdu + 20);
+	opnum = get_unaligned_le16(pdu + 22);
+	if (!rpc_pipe_ndr_context(pipe, ctx_id) || user_guest(sess->user))
+		return NULL;
+
+	cmd = kvzalloc(sizeof(struct ksmbd_rpc_command) + pipe->max_frag,
+		       GFP_KERNEL);
+	if (!cmd)
+		return NULL;
+
+	req.data = pdu + DCERPC_REQ_HDR_SIZE;
+	req.offset = 0;
+	req.length = len - DCERPC_REQ_HDR_SIZE;
+	out.data = cmd->payload + DCERPC_RSP_HDR_SIZE;
+	out.offset = 0;
+	out.length = pipe->max_frag - DCERPC_RSP_HDR_SIZE;
+	rep.out = &out;
+	rep.nls = sess->conn->local_nls;
+	rep.ref_id = RPC_REF_ID_BASE;
+
+	switch (pipe->method) {
+	case KSMBD_RPC_SRVSVC_METHOD_INVOKE:
+		if (opnum == SRVSVC_OPNUM_SHARE_ENUM_ALL)
+			ret = srvsvc_share_enum_all(&req, &rep);
+		else if (opnum == SRVSVC_OPNUM_SHARE_GET_INFO)
+			ret = srvsvc_share_get_info(&req, &rep);
+		break;
+	case KSMBD_RPC_WKSSVC_METHOD_INVOKE:
+		if (opnum == WKSSVC_OPNUM_WKSTA_GET_INFO)
+			ret = wkssvc_wksta_get_info(&req, &rep);
+		break;
+	}
+
+	if (ret) {
+		kvfree(cmd);
+		return NULL;
+	}
+
+	pdu = cmd->payload;
+	pdu[0] = 5;
+	pdu[1] = 0;
+	pdu[2] = DCERPC_PTYPE_RESPONSE;
+	pdu[3] = DCERPC_PFC_FIRST_FRAG | DCERPC_PFC_LAST_FRAG;
+	pdu[4] = DCERPC_DREP_LE;
+	put_unaligned_le16(DCERPC_RSP_HDR_SIZE + out.offset, pdu + 8);
+	put_unaligned_le16(0, pdu + 10);
+	put_unaligned_le32(call_id, pdu + 12);
+	put_unaligned_le32(out.offset, pdu + 16);
+	put_unaligned_le16(ctx_id, pdu + 20);
+	cmd->payload_sz = DCERPC_RSP_HDR_SIZE + out.offset;
+	return cmd;
+}
+
+/**
+ * ksmbd_rpc_pipe_alloc() - allocate fast path state for an RPC pipe
+ * @method:	KSMBD_RPC_*_METHOD_INVOKE of the pipe
+ *
+ * Return:	pipe state, or NULL if the pipe always goes to the daemon
+ */
+struct ksmbd_rpc_pipe *ksmbd_rpc_pipe_alloc(unsigned int method)
+{
+	struct ksmbd_rpc_pipe *pipe;
+	const u8 *syntax;
+
+	if (!(server_conf.flags & KSMBD_GLOBAL_FLAG_RPC_FASTPATH))
+		return NULL;
+
+	if (method == KSMBD_RPC_SRVSVC_METHOD_INVOKE)
+		syntax = srvsvc_syntax;
+	else if (method == KSMBD_RPC_WKSSVC_METHOD_INVOKE)
+		syntax = wkssvc_syntax;
+	else
+		return NULL;
+
+	pipe = kzalloc(sizeof(struct ksmbd_rpc_pipe), GFP_KERNEL);
+	if (!pipe)
+		return NULL;
+
+	mutex_init(&pipe->lock);
+	pipe->method = method;
+	pipe->syntax = syntax;
+	pipe->max_frag = DCERPC_MAX_FRAG;
+	return pipe;
+}
+
+void ksmbd_rpc_pipe_free(struct ksmbd_rpc_pipe *pipe)
+{
+	if (!pipe)
+		return;
+
+	kvfree(pipe->rsp);
+	kfree(pipe);
+}
+
+/**
+ * ksmbd_rpc_pipe_write() - try to answer a PDU written to a pipe
+ * @sess:	session owning the pipe
+ * @pipe:	pipe fast path state
+ * @buf:	PDU written by the client
+ * @len:	length of @buf
+ * @transact:	the response is returned right away (FSCTL_PIPE_TRANSCEIVE)
+ *
+ * Return:	RPC command to hand back to the caller, or NULL if the PDU
+ *		must be forwarded to the daemon
+ */
+struct ksmbd_rpc_command *ksmbd_rpc_pipe_write(struct ksmbd_session *sess,
+					       struct ksmbd_rpc_pipe *pipe,
+					       void *buf, size_t len,
+					       bool transact)
+{
+	struct ksmbd_rpc_command *rsp = NULL, *ack;
+	u8 *pdu = buf;
+
+	mutex_lock(&pipe->lock);
+	/* a response the client never read is stale by now */
+	kvfree(pipe->rsp);
+	pipe->rsp = NULL;
+	/* only the daemon's answer to the PDU right after a bind is its ack */
+	pipe->nr_bind_contexts = 0;
+
+	if (pipe->daemon_pending || len < DCERPC_HDR_SIZE ||
+	    pdu[0] != 5 || pdu[1] != 0 || pdu[4] != DCERPC_DREP_LE)
+		goto daemon;
+
+	switch (pdu[2]) {
+	case DCERPC_PTYPE_BIND:
+	case DCERPC_PTYPE_ALTER_CONTEXT:
+		rpc_pipe_note_bind(pipe, pdu, len);
+		goto daemon;
+	case DCERPC_PTYPE_REQUEST:
+		rsp = rpc_pipe_request(sess, pipe, pdu, len);
+		if (!rsp) {
+			atomic_long_inc(&rpc_fast_fallbacks);
+			goto daemon;
+		}
+		break;
+	default:
+		goto daemon;
+	}
+
+	if (!transact) {
+		ack = kvzalloc(sizeof(struct ksmbd_rpc_command), GFP_KERNEL);
+		if (!ack) {
+			kvfree(rsp);
+			goto daemon;
+		}
+		ack->flags = KSMBD_RPC_OK;
+		pipe->rsp = rsp;
+		rsp = ack;
+	}
+	atomic_long_inc(&rpc_fast_hits);
+	mutex_unlock(&pipe->lock);
+	return rsp;
+
+daemon:
+	if (!transact)
+		pipe->daemon_pending = true;
+	mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/**
+ * ksmbd_rpc_pipe_read() - hand out a response built in the kernel
+ * @pipe:	pipe fast path state
+ *
+ * Return:	RPC command with the response, or NULL if the read must go to
+ *		the daemon
+ */
+struct ksmbd_rpc_command *ksmbd_rpc_pipe_read(struct ksmbd_rpc_pipe *pipe)
+{
+	struct ksmbd_rpc_command *rsp;
+
+	mutex_lock(&pipe->lock);
+	rsp = pipe->rsp;
+	pipe->rsp = NULL;
+	if (!rsp)
+		pipe->daemon_pending = false;
+	mutex_unlock(&pipe->lock);
+	return rsp;
+}
+
+/**
+ * ksmbd_rpc_pipe_note_response() - look at the daemon's answer on a pipe
+ * @pipe:	pipe fast path state
+ * @resp:	response the daemon returned for a read or transact, may be
+ *		NULL
+ *
+ * If the pipe waits for a bind or alter context ack, the contexts the
+ * daemon accepted may be answered in the kernel from now on.
+ */
+void ksmbd_rpc_pipe_note_response(struct ksmbd_rpc_pipe *pipe,
+				  struct ksmbd_rpc_command *resp)
+{
+	mutex_lock(&pipe->lock);
+	if (pipe->nr_bind_contexts && resp)
+		rpc_pipe_note_ack(pipe, resp->payload, resp->payload_sz);
+	pipe->nr_bind_contexts = 0;
+	mutex_unlock(&pipe->lock);
+}
+
+int ksmbd_rpc_fastpath_show(char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%s hits %ld fallbacks %ld\n",
+			 server_conf.flags & KSMBD_GLOBAL_FLAG_RPC_FASTPATH ?
+			 "enabled" : "disabled",
+			 atomic_long_read(&rpc_fast_hits),
+			 atomic_long_read(&rpc_fast_fallbacks));
+}
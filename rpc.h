@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Copyright (C) 2021 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __KSMBD_RPC_H__
+#define __KSMBD_RPC_H__
+
+#include <linux/types.h>
+
+struct ksmbd_session;
+struct ksmbd_rpc_command;
+struct ksmbd_rpc_pipe;
+
+struct ksmbd_rpc_pipe *ksmbd_rpc_pipe_alloc(unsigned int method);
+void ksmbd_rpc_pipe_free(struct ksmbd_rpc_pipe *pipe);
+struct ksmbd_rpc_command *ksmbd_rpc_pipe_write(struct ksmbd_session *sess,
+					       struct ksmbd_rpc_pipe *pipe,
+					       void *buf, size_t len,
+					       bool transact);
+struct ksmbd_rpc_command *ksmbd_rpc_pipe_read(struct ksmbd_rpc_pipe *pipe);
+void ksmbd_rpc_pipe_note_response(struct ksmbd_rpc_pipe *pipe,
+				  struct ksmbd_rpc_command *resp);
+int ksmbd_rpc_fastpath_show(char *buf, size_t size);
+#endif /* __KSMBD_RPC_H__ */
@@ -19,8 +19,13 @@
 #include "connection.h"
 #include "transport_ipc.h"
 #include "mgmt/user_session.h"
+#include "mgmt/tree_connect.h"
+#include "mgmt/share_config.h"
 #include "crypto_ctx.h"
 #include "auth.h"
+#include "dir_cache.h"
+#include "transport_rdma.h"
+#include "rpc.h"
 
 int ksmbd_debug_types;
 
@@ -105,12 +110,20 @@ static inline int check_conn_state(struct ksmbd_work *work)
 #define TCP_HANDLER_ABORT	1
 
 static int __process_request(struct ksmbd_work *work, struct ksmbd_conn *conn,
-			     u16 *cmd)
+			     u16 *cmd, bool resume)
 {
 	struct smb_version_cmds *cmds;
 	u16 command;
 	int ret;
 
+	if (resume) {
+		/* the checks below passed before the work was parked */
+		command = conn->ops->get_cmd_val(work);
+		*cmd = command;
+		cmds = &conn->cmds[command];
+		goto proc;
+	}
+
 	if (check_conn_state(work))
 		return TCP_HANDLER_CONTINUE;
 
@@ -141,7 +154,10 @@ andx_again:
 		}
 	}
 
+proc:
 	ret = cmds->proc(work);
+	if (resume)
+		kvfree(ksmbd_work_ipc_response(work));
 
 	if (ret < 0)
 		ksmbd_debug(CONN, "Failed to process %u [%d]\n", command, ret);
@@ -157,14 +173,25 @@ andx_again:
 	return TCP_HANDLER_CONTINUE;
 }
 
-static void __handle_ksmbd_work(struct ksmbd_work *work,
-				struct ksmbd_conn *conn)
+/**
+ * __handle_ksmbd_work() - process a request and prepare its response
+ * @work:	smb work containing request buffer
+ * @conn:	connection instance
+ * @resume:	@work was parked on the daemon and is picked up again
+ *
+ * Return:	true if the response in @work has to be sent
+ */
+static bool __handle_ksmbd_work(struct ksmbd_work *work,
+				struct ksmbd_conn *conn, bool resume)
 {
 	u16 command = 0;
 	int rc;
 
+	if (resume)
+		goto process;
+
 	if (conn->ops->allocate_rsp_buf(work))
-		return;
+		return false;
 
 	if (conn->ops->is_transform_hdr &&
 	    conn->ops->is_transform_hdr(work->request_buf)) {
@@ -201,8 +228,13 @@ static void __handle_ksmbd_work(struct ksmbd_work *work,
 		}
 	}
 
+process:
 	do {
-		rc = __process_request(work, conn, &command);
+		rc = __process_request(work, conn, &command, resume);
+		resume = false;
+		/* the handler waits for the daemon, see ksmbd_ipc_park_work() */
+		if (work->ipc_msg)
+			return false;
 		if (rc == TCP_HANDLER_ABORT)
 			break;
 
@@ -228,7 +260,7 @@ static void __handle_ksmbd_work(struct ksmbd_work *work,
 	} while (is_chained_smb2_message(work));
 
 	if (work->send_no_response)
-		return;
+		return false;
 
 send:
 	smb3_preauth_hash_rsp(work);
@@ -241,7 +273,7 @@ send:
 		}
 	}
 
-	ksmbd_conn_write(work);
+	return true;
 }
 
 /**
@@ -254,10 +286,36 @@ static void handle_ksmbd_work(struct work_struct *wk)
 {
 	struct ksmbd_work *work = container_of(wk, struct ksmbd_work, work);
 	struct ksmbd_conn *conn = work->conn;
+	bool resume = work->ipc_type != 0;
+	s64 wait, avg;
+
+	/* a parked work comes back here once the daemon answered */
+	if (resume) {
+		ksmbd_conn_sync_begin(work);
+		goto process;
+	}
+
+	/* feed the server load seen by the credit controller */
+	atomic_dec(&server_conf.req_backlog);
+	wait = ktime_to_ns(ktime_sub(ktime_get(), work->queued_time));
+	avg = atomic64_read(&server_conf.req_wait_ns);
+	atomic64_set(&server_conf.req_wait_ns, avg + (wait - avg) / 8);
 
 	atomic64_inc(&conn->stats.request_served);
 
-	__handle_ksmbd_work(work, conn);
+process:
+	if (__handle_ksmbd_work(work, conn, resume)) {
+		/* the sender frees the work once the response is written */
+		ksmbd_conn_write_async(work);
+		return;
+	}
+
+	if (work->ipc_msg) {
+		/* requeued on the response, @work is not ours any more */
+		ksmbd_conn_sync_done(work);
+		ksmbd_ipc_park_work(work);
+		return;
+	}
 
 	ksmbd_conn_try_dequeue_request(work);
 	ksmbd_free_work_struct(work);
@@ -283,7 +341,9 @@ static int queue_ksmbd_work(struct ksmbd_conn *conn)
 
 	work->conn = conn;
 	work->request_buf = conn->request_buf;
+	work->request_buf_ctx = conn->request_buf_ctx;
 	conn->request_buf = NULL;
+	conn->request_buf_ctx = NULL;
 
 	if (ksmbd_init_smb_server(work)) {
 		ksmbd_free_work_struct(work);
@@ -295,6 +355,8 @@ static int queue_ksmbd_work(struct ksmbd_conn *conn)
 	/* update activity on connection */
 	conn->last_active = jiffies;
 	INIT_WORK(&work->work, handle_ksmbd_work);
+	work->queued_time = ktime_get();
+	atomic_inc(&server_conf.req_backlog);
 	ksmbd_queue_work(work);
 	return 0;
 }
@@ -506,14 +568,112 @@ static ssize_t debug_store(struct class *class, struct class_attribute *attr,
 	return len;
 }
 
+static ssize_t dir_cache_show(struct class *class,
+			      struct class_attribute *attr, char *buf)
+{
+	return ksmbd_dir_cache_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t credits_show(struct class *class,
+			    struct class_attribute *attr, char *buf)
+{
+	ssize_t sz;
+
+	sz = smb2_credit_ctrl_show(buf, PAGE_SIZE);
+	sz += ksmbd_conn_credits_show(buf + sz, PAGE_SIZE - sz);
+	return sz;
+}
+
+static ssize_t credits_store(struct class *class,
+			     struct class_attribute *attr,
+			     const char *buf, size_t len)
+{
+	int ret;
+
+	ret = smb2_credit_ctrl_store(buf);
+	return ret ? ret : len;
+}
+
+static ssize_t tx_show(struct class *class, struct class_attribute *attr,
+		       char *buf)
+{
+	return ksmbd_conn_tx_show(buf, PAGE_SIZE);
+}
+
+static ssize_t ipc_show(struct class *class, struct class_attribute *attr,
+			char *buf)
+{
+	return ksmbd_ipc_stats_show(buf, PAGE_SIZE);
+}
+
+static ssize_t rpc_fastpath_show(struct class *class,
+				 struct class_attribute *attr, char *buf)
+{
+	return ksmbd_rpc_fastpath_show(buf, PAGE_SIZE);
+}
+
+static ssize_t tcon_cache_show(struct class *class,
+			       struct class_attribute *attr, char *buf)
+{
+	return ksmbd_tree_conn_cache_show(buf, PAGE_SIZE);
+}
+
+static ssize_t tcon_cache_store(struct class *class,
+				struct class_attribute *attr,
+				const char *buf, size_t len)
+{
+	int ret;
+
+	ret = ksmbd_tree_conn_cache_store(buf);
+	return ret ? ret : len;
+}
+
+static ssize_t rdma_limits_show(struct class *class,
+				struct class_attribute *attr, char *buf)
+{
+	return ksmbd_rdma_limits_show(buf, PAGE_SIZE);
+}
+
+static ssize_t rdma_limits_store(struct class *class,
+				 struct class_attribute *attr,
+				 const char *buf, size_t len)
+{
+	int ret;
+
+	ret = ksmbd_rdma_limits_store(buf);
+	return ret ? ret : len;
+}
+
+static ssize_t rdma_conns_show(struct class *class,
+			       struct class_attribute *attr, char *buf)
+{
+	return ksmbd_rdma_conns_show(buf, PAGE_SIZE);
+}
+
 static CLASS_ATTR_RO(stats);
 static CLASS_ATTR_WO(kill_server);
 static CLASS_ATTR_RW(debug);
+static CLASS_ATTR_RO(dir_cache);
+static CLASS_ATTR_RW(credits);
+static CLASS_ATTR_RO(tx);
+static CLASS_ATTR_RO(ipc);
+static CLASS_ATTR_RW(tcon_cache);
+static CLASS_ATTR_RO(rpc_fastpath);
+static CLASS_ATTR_RW(rdma_limits);
+static CLASS_ATTR_RO(rdma_conns);
 
 static struct attribute *ksmbd_control_class_attrs[] = {
 	&class_attr_stats.attr,
 	&class_attr_kill_server.attr,
 	&class_attr_debug.attr,
+	&class_attr_dir_cache.attr,
+	&class_attr_credits.attr,
+	&class_attr_tx.attr,
+	&class_attr_ipc.attr,
+	&class_attr_tcon_cache.attr,
+	&class_attr_rpc_fastpath.attr,
+	&class_attr_rdma_limits.attr,
+	&class_attr_rdma_conns.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(ksmbd_control_class);
@@ -532,11 +692,14 @@ static int ksmbd_server_shutdown(void)
 	ksmbd_workqueue_destroy();
 	ksmbd_ipc_release();
 	ksmbd_conn_transport_destroy();
+	ksmbd_tree_conn_cache_flush();
+	ksmbd_share_configs_unpin();
 	ksmbd_crypto_destroy();
 	ksmbd_free_global_file_table();
 	destroy_lease_table(NULL);
 	ksmbd_work_pool_destroy();
 	ksmbd_exit_file_cache();
+	ksmbd_dir_cache_destroy();
 	server_conf_free();
 	return 0;
 }
@@ -565,10 +728,14 @@ static int __init ksmbd_server_init(void)
 	if (ret)
 		goto err_destroy_work_pools;
 
-	ret = ksmbd_ipc_init();
+	ret = ksmbd_dir_cache_init();
 	if (ret)
 		goto err_exit_file_cache;
 
+	ret = ksmbd_ipc_init();
+	if (ret)
+		goto err_dir_cache_destroy;
+
 	ret = ksmbd_init_global_file_table();
 	if (ret)
 		goto err_ipc_release;
@@ -594,6 +761,8 @@ err_destroy_file_table:
 	ksmbd_free_global_file_table();
 err_ipc_release:
 	ksmbd_ipc_release();
+err_dir_cache_destroy:
+	ksmbd_dir_cache_destroy();
 err_exit_file_cache:
 	ksmbd_exit_file_cache();
 err_destroy_work_pools:
@@ -42,6 +42,10 @@ struct ksmbd_server_config {
 	struct smb_sid		domain_sid;
 	unsigned int		auth_mechs;
 
+	/* requests waiting for a worker, and their average wait in ns */
+	atomic_t		req_backlog;
+	atomic64_t		req_wait_ns;
+
 	char			*conf[SERVER_CONF_WORK_GROUP + 1];
 };
 
@@ -256,7 +256,7 @@ int smb_check_user_session(struct ksmbd_work *work)
 	if (!ksmbd_conn_good(work))
 		return -EINVAL;
 
-	if (list_empty(&conn->sessions)) {
+	if (xa_empty(&conn->sessions)) {
 		ksmbd_debug(SMB, "NO sessions registered\n");
 		return 0;
 	}
@@ -478,7 +478,7 @@ int smb_tree_connect_andx(struct ksmbd_work *work)
 		goto out_err;
 	}
 
-	status = ksmbd_tree_conn_connect(sess, name);
+	status = ksmbd_tree_conn_connect(NULL, sess, name);
 	if (status.ret == KSMBD_TREE_CONN_STATUS_OK)
 		rsp_hdr->Tid = cpu_to_le16(status.tree_conn->id);
 	else
@@ -759,7 +759,7 @@ int smb_rename(struct ksmbd_work *work)
 	bool file_present = true;
 	int rc = 0;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -1252,7 +1252,9 @@ int smb_session_setup_andx(struct ksmbd_work *work)
 			goto out_err;
 		}
 
-		ksmbd_session_register(conn, sess);
+		rc = ksmbd_session_register(conn, sess);
+		if (rc)
+			goto out_err;
 		rsp->resp.hdr.Uid = cpu_to_le16(sess->id);
 		ksmbd_debug(SMB, "New session ID: %llu, Uid: %u\n", sess->id,
 			uid);
@@ -2171,8 +2173,7 @@ int smb_nt_create_andx(struct ksmbd_work *work)
 	unsigned int flags = LOOKUP_FOLLOW;
 
 	rsp->hdr.Status.CifsError = STATUS_UNSUCCESSFUL;
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "create pipe on IPC\n");
 		return create_andx_pipe(work);
 	}
@@ -2419,7 +2420,7 @@ int smb_nt_create_andx(struct ksmbd_work *work)
 	 * - check req->ImpersonationLevel
 	 */
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		if (open_flags & O_CREAT) {
 			ksmbd_debug(SMB,
 				"returning as user does not have permission to write\n");
@@ -2493,8 +2494,7 @@ int smb_nt_create_andx(struct ksmbd_work *work)
 
 	share_ret = ksmbd_smb_check_shared_mode(fp->filp, fp);
 	if (smb1_oplock_enable &&
-	    test_share_config_flag(work->tcon->share_conf,
-			KSMBD_SHARE_FLAG_OPLOCKS) &&
+	    test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS) &&
 		!S_ISDIR(file_inode(fp->filp)->i_mode) && oplock_flags) {
 		/* Client cannot request levelII oplock directly */
 		err = smb_grant_oplock(work, oplock_flags, fp->volatile_id,
@@ -2567,8 +2567,8 @@ int smb_nt_create_andx(struct ksmbd_work *work)
 	else
 		fp->create_time = ksmbd_UnixTimeToNT(stat.ctime);
 	if (file_present) {
-		if (test_share_config_flag(tcon->share_conf,
-					   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+		if (test_tree_conn_fast_flag(tcon,
+					     KSMBD_TCON_STORE_DOS_ATTRS)) {
 			struct xattr_dos_attrib da;
 
 			err = ksmbd_vfs_get_dos_attrib_xattr(path.dentry, &da);
@@ -2577,8 +2577,8 @@ int smb_nt_create_andx(struct ksmbd_work *work)
 			err = 0;
 		}
 	} else {
-		if (test_share_config_flag(tcon->share_conf,
-					   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+		if (test_tree_conn_fast_flag(tcon,
+					     KSMBD_TCON_STORE_DOS_ATTRS)) {
 			struct xattr_dos_attrib da = {0};
 
 			da.version = 4;
@@ -2722,8 +2722,7 @@ int smb_close(struct ksmbd_work *work)
 
 	ksmbd_debug(SMB, "SMB_COM_CLOSE called for fid %u\n", req->FileID);
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		err = smb_close_pipe(work);
 		if (err < 0)
 			goto out;
@@ -2837,8 +2836,7 @@ int smb_read_andx(struct ksmbd_work *work)
 	ssize_t nbytes;
 	int err = 0;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE))
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE))
 		return smb_read_andx_pipe(work);
 
 	fp = ksmbd_lookup_fd_fast(work, req->Fid);
@@ -2886,7 +2884,7 @@ int smb_read_andx(struct ksmbd_work *work)
 		goto out;
 	}
 
-	nbytes = ksmbd_vfs_read(work, fp, count, &pos);
+	nbytes = ksmbd_vfs_read(work, fp, work->aux_payload_buf, count, &pos);
 	if (nbytes < 0) {
 		err = nbytes;
 		goto out;
@@ -2946,7 +2944,7 @@ int smb_write(struct ksmbd_work *work)
 	ssize_t nbytes = 0;
 	int err = 0;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -3068,15 +3066,14 @@ int smb_write_andx(struct ksmbd_work *work)
 	char *data_buf;
 	int err = 0;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
 		return -EACCES;
 	}
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "Write ANDX called for IPC$");
 		return smb_write_andx_pipe(work);
 	}
@@ -3958,8 +3955,7 @@ static int query_path_info(struct ksmbd_work *work)
 	__u64 create_time = 0, time;
 	unsigned int flags = LOOKUP_FOLLOW;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		rsp_hdr->Status.CifsError = STATUS_UNEXPECTED_IO_ERROR;
 		return 0;
 	}
@@ -4009,8 +4005,7 @@ static int query_path_info(struct ksmbd_work *work)
 		goto err_out;
 	}
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_STORE_DOS_ATTRS)) {
 		struct xattr_dos_attrib da;
 
 		rc = ksmbd_vfs_get_dos_attrib_xattr(path.dentry, &da);
@@ -4863,7 +4858,7 @@ static int smb_posix_open(struct ksmbd_work *work)
 	mode = (umode_t) le64_to_cpu(psx_req->Permissions);
 	rsp_info_level = le16_to_cpu(psx_req->Level);
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		if (posix_open_flags & O_CREAT) {
 			err = -EACCES;
 			ksmbd_debug(SMB,
@@ -4934,8 +4929,7 @@ static int smb_posix_open(struct ksmbd_work *work)
 	write_unlock(&fp->f_ci->m_lock);
 
 	if (smb1_oplock_enable &&
-	    test_share_config_flag(work->tcon->share_conf,
-			KSMBD_SHARE_FLAG_OPLOCKS) &&
+	    test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS) &&
 		!S_ISDIR(file_inode(fp->filp)->i_mode)) {
 		/* Client cannot request levelII oplock directly */
 		err = smb_grant_oplock(work, oplock_flags &
@@ -5062,7 +5056,7 @@ static int smb_posix_unlink(struct ksmbd_work *work)
 	char *name;
 	int rc = 0;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -6654,8 +6648,7 @@ static int query_file_info(struct ksmbd_work *work)
 	req_params = (struct smb_trans2_qfi_req_params *)(work->request_buf +
 			le16_to_cpu(req->ParameterOffset) + 4);
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "query file info for IPC srvsvc\n");
 		return query_file_info_pipe(work);
 	}
@@ -7147,7 +7140,7 @@ static int smb_fileinfo_rename(struct ksmbd_work *work)
 	info =  (struct set_file_rename *)
 		(((char *) &req->hdr.Protocol) + le16_to_cpu(req->DataOffset));
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -7323,8 +7316,7 @@ static int create_dir(struct ksmbd_work *work)
 	} else
 		rsp->hdr.Status.CifsError = STATUS_SUCCESS;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_STORE_DOS_ATTRS)) {
 		__u64 ctime;
 		struct path path;
 		struct xattr_dos_attrib da = {0};
@@ -7453,7 +7445,7 @@ int smb_mkdir(struct ksmbd_work *work)
 	char *name;
 	int err;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -7494,8 +7486,7 @@ int smb_mkdir(struct ksmbd_work *work)
 		rsp->ByteCount = 0;
 	}
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_STORE_DOS_ATTRS)) {
 		__u64 ctime;
 		struct path path;
 		struct xattr_dos_attrib da = {0};
@@ -7659,7 +7650,7 @@ int smb_rmdir(struct ksmbd_work *work)
 	char *name;
 	int err;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -7709,7 +7700,7 @@ int smb_unlink(struct ksmbd_work *work)
 	int err;
 	struct ksmbd_file *fp;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -7799,7 +7790,7 @@ int smb_nt_rename(struct ksmbd_work *work)
 	char *oldname, *newname;
 	int oldname_len, err;
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB,
 			"returning as user does not have permission to write\n");
 		rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
@@ -7919,8 +7910,7 @@ int smb_query_info(struct ksmbd_work *work)
 	int i;
 	__le32 err;
 
-	if (!test_share_config_flag(work->tcon->share_conf,
-				    KSMBD_SHARE_FLAG_PIPE))
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE))
 		err = smb_query_info_path(work, &st);
 	else
 		err = smb_query_info_pipe(share, &st);
@@ -8196,8 +8186,7 @@ int smb_open_andx(struct ksmbd_work *work)
 
 	share_ret = ksmbd_smb_check_shared_mode(fp->filp, fp);
 	if (smb1_oplock_enable &&
-	    test_share_config_flag(work->tcon->share_conf,
-			KSMBD_SHARE_FLAG_OPLOCKS) &&
+	    test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS) &&
 		!S_ISDIR(file_inode(fp->filp)->i_mode) &&
 		oplock_flags) {
 		/* Client cannot request levelII oplock directly */
@@ -8236,8 +8225,8 @@ int smb_open_andx(struct ksmbd_work *work)
 	else
 		fp->create_time = ksmbd_UnixTimeToNT(stat.ctime);
 	if (file_present) {
-		if (test_share_config_flag(work->tcon->share_conf,
-					   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+		if (test_tree_conn_fast_flag(work->tcon,
+					     KSMBD_TCON_STORE_DOS_ATTRS)) {
 			struct xattr_dos_attrib da;
 
 			err = ksmbd_vfs_get_dos_attrib_xattr(path.dentry, &da);
@@ -8248,8 +8237,8 @@ int smb_open_andx(struct ksmbd_work *work)
 			err = 0;
 		}
 	} else {
-		if (test_share_config_flag(work->tcon->share_conf,
-					KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+		if (test_tree_conn_fast_flag(work->tcon,
+					     KSMBD_TCON_STORE_DOS_ATTRS)) {
 			struct xattr_dos_attrib da = {0};
 
 			da.version = 4;
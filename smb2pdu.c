@@ -36,6 +36,8 @@
 #include "mgmt/user_session.h"
 #include "mgmt/ksmbd_ida.h"
 #include "ndr.h"
+#include "dir_cache.h"
+#include "transport_rdma.h"
 
 static void __wbuf(struct ksmbd_work *work, void **req, void **rsp)
 {
@@ -73,14 +75,18 @@ static inline int check_session_id(struct ksmbd_conn *conn, u64 id)
 
 struct channel *lookup_chann_list(struct ksmbd_session *sess, struct ksmbd_conn *conn)
 {
-	struct channel *chann;
+	struct channel *chann, *found = NULL;
 
+	spin_lock(&sess->chann_lock);
 	list_for_each_entry(chann, &sess->ksmbd_chann_list, chann_list) {
-		if (chann->conn == conn)
-			return chann;
+		if (chann->conn == conn) {
+			found = chann;
+			break;
+		}
 	}
+	spin_unlock(&sess->chann_lock);
 
-	return NULL;
+	return found;
 }
 
 /**
@@ -309,6 +315,130 @@ static int smb2_consume_credit_charge(struct ksmbd_work *work,
 	return rsp_credits;
 }
 
+/*
+ * SMB2 credit controller. Each connection has a credit window, the most
+ * credits its client may hold. While the server keeps up with requests,
+ * the window of a client that asks for more than it holds grows, up to
+ * max_credits. While requests wait for a worker, every window shrinks, to
+ * push back on the clients. See smb2_adjust_credit_window().
+ */
+#define SMB2_CREDIT_ADJUST_INTERVAL	(HZ / 10)
+
+/* the server is loaded beyond this many waiting requests per cpu ... */
+static unsigned int smb2_credit_backlog_per_cpu = 16;
+/* ... or when requests wait longer than this for a worker on average */
+static unsigned int smb2_credit_latency_us = 2000;
+
+static bool smb2_server_loaded(void)
+{
+	return atomic_read(&server_conf.req_backlog) >
+		num_online_cpus() * smb2_credit_backlog_per_cpu ||
+		atomic64_read(&server_conf.req_wait_ns) >
+		(s64)smb2_credit_latency_us * NSEC_PER_USEC;
+}
+
+/* must be called with conn->credits_lock */
+static void smb2_adjust_credit_window(struct ksmbd_conn *conn, bool loaded)
+{
+	unsigned int window = conn->credit_window;
+
+	if (!window) {
+		/* start with the window that used to be fixed */
+		conn->credit_window = conn->max_credits >> 4;
+		conn->credit_adjust_time = jiffies;
+		return;
+	}
+
+	if (time_before(jiffies, conn->credit_adjust_time +
+			SMB2_CREDIT_ADJUST_INTERVAL))
+		return;
+	conn->credit_adjust_time = jiffies;
+
+	if (loaded)
+		window -= window / 4;
+	else if (conn->credit_limited)
+		window *= 2;
+	conn->credit_limited = false;
+
+	/* large reads and writes are charged up to max_credits >> 6 */
+	window = clamp_t(unsigned int, window, conn->max_credits >> 5,
+			 conn->max_credits);
+	if (window != conn->credit_window)
+		ksmbd_debug(SMB, "credit window %u -> %u, %s\n",
+			    conn->credit_window, window,
+			    loaded ? "loaded" : "idle");
+	conn->credit_window = window;
+}
+
+/*
+ * A channel bound to a session starts with the largest credit window of the
+ * session's other channels, so a client that adds channels to aggregate
+ * NICs can use them at once instead of ramping each up again. The window
+ * is read under the channel lock, which keeps the other connections from
+ * tearing down their channels meanwhile.
+ */
+static void smb2_inherit_credit_window(struct ksmbd_conn *conn,
+				       struct ksmbd_session *sess)
+{
+	struct channel *chann;
+	unsigned short window = 0;
+
+	spin_lock(&sess->chann_lock);
+	list_for_each_entry(chann, &sess->ksmbd_chann_list, chann_list) {
+		if (chann->conn == conn)
+			continue;
+		window = max_t(unsigned short, window,
+			       READ_ONCE(chann->conn->credit_window));
+	}
+	spin_unlock(&sess->chann_lock);
+
+	spin_lock(&conn->credits_lock);
+	if (window > conn->credit_window) {
+		conn->credit_window = min(window, conn->max_credits);
+		conn->credit_adjust_time = jiffies;
+	}
+	spin_unlock(&conn->credits_lock);
+}
+
+/**
+ * smb2_credit_ctrl_show() - print the state of the SMB2 credit controller
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int smb2_credit_ctrl_show(char *buf, size_t size)
+{
+	return scnprintf(buf, size,
+			 "loaded %d backlog %d wait %lldus backlog_per_cpu=%u latency_us=%u\n",
+			 smb2_server_loaded(),
+			 atomic_read(&server_conf.req_backlog),
+			 div_s64(atomic64_read(&server_conf.req_wait_ns),
+				 NSEC_PER_USEC),
+			 smb2_credit_backlog_per_cpu, smb2_credit_latency_us);
+}
+
+/**
+ * smb2_credit_ctrl_store() - set a tunable of the SMB2 credit controller
+ * @buf:	"backlog_per_cpu=<n>" or "latency_us=<n>"
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb2_credit_ctrl_store(const char *buf)
+{
+	unsigned int v;
+
+	if (sscanf(buf, "backlog_per_cpu=%u", &v) == 1 && v) {
+		smb2_credit_backlog_per_cpu = v;
+		return 0;
+	}
+	if (sscanf(buf, "latency_us=%u", &v) == 1 && v) {
+		smb2_credit_latency_us = v;
+		return 0;
+	}
+	return -EINVAL;
+}
+
 /**
  * smb2_set_rsp_credits() - set number of credits in response buffer
  * @work:	smb work containing smb response buffer
@@ -320,18 +450,19 @@ int smb2_set_rsp_credits(struct ksmbd_work *work)
 	struct ksmbd_conn *conn = work->conn;
 	unsigned short credits_requested = le16_to_cpu(req_hdr->CreditRequest);
 	unsigned short credit_charge = 1, credits_granted = 0;
-	unsigned short aux_max, aux_credits, min_credits;
+	unsigned short aux_max, aux_credits;
 	int rsp_credit_charge;
+	bool loaded;
 
 	if (hdr->Command == SMB2_CANCEL)
 		goto out;
 
-	/* get default minimum credits by shifting maximum credits by 4 */
-	min_credits = conn->max_credits >> 4;
+	loaded = smb2_server_loaded();
+	smb2_adjust_credit_window(conn, loaded);
 
 	if (conn->total_credits >= conn->max_credits) {
 		pr_err("Total credits overflow: %d\n", conn->total_credits);
-		conn->total_credits = min_credits;
+		conn->total_credits = conn->credit_window;
 	}
 
 	rsp_credit_charge =
@@ -343,25 +474,28 @@ int smb2_set_rsp_credits(struct ksmbd_work *work)
 
 	if (credits_requested > 0) {
 		aux_credits = credits_requested - 1;
-		aux_max = 32;
+		/* a loaded server only hands out small increments */
+		aux_max = loaded ? 32 : max(32, conn->credit_window >> 2);
 		if (hdr->Command == SMB2_NEGOTIATE)
 			aux_max = 0;
 		aux_credits = (aux_credits < aux_max) ? aux_credits : aux_max;
 		credits_granted = aux_credits + credit_charge;
 
-		/* if credits granted per client is getting bigger than default
-		 * minimum credits then we should wrap it up within the limits.
-		 */
-		if ((conn->total_credits + credits_granted) > min_credits)
-			credits_granted = min_credits -	conn->total_credits;
-		/*
-		 * TODO: Need to adjuct CreditRequest value according to
-		 * current cpu load
-		 */
-	} else if (conn->total_credits == 0) {
-		credits_granted = 1;
+		/* keep the credits of the client within its window */
+		if (conn->total_credits + credits_granted > conn->credit_window) {
+			if (conn->total_credits < conn->credit_window)
+				credits_granted = conn->credit_window -
+						  conn->total_credits;
+			else
+				credits_granted = 0;
+			conn->credit_limited = true;
+		}
 	}
 
+	/* the client must never be left without credits */
+	if (!credits_granted && conn->total_credits == 0)
+		credits_granted = 1;
+
 	conn->total_credits += credits_granted;
 	work->credits_granted += credits_granted;
 
@@ -670,6 +804,7 @@ int setup_async_work(struct ksmbd_work *work, void (*fn)(void **), void **arg)
 		return id;
 	}
 	work->syncronous = false;
+	ksmbd_conn_sync_done(work);
 	work->async_id = id;
 	rsp_hdr->Id.AsyncId = cpu_to_le64(id);
 
@@ -1280,20 +1415,36 @@ static struct authenticate_message *user_authblob(struct ksmbd_conn *conn,
 					       + sz);
 }
 
-static struct ksmbd_user *session_user(struct ksmbd_conn *conn,
-				       struct smb2_sess_setup_req *req)
+static char *session_user_name(struct ksmbd_conn *conn,
+			       struct smb2_sess_setup_req *req)
 {
 	struct authenticate_message *authblob;
-	struct ksmbd_user *user;
-	char *name;
 	int sz;
 
 	authblob = user_authblob(conn, req);
 	sz = le32_to_cpu(authblob->UserName.BufferOffset);
-	name = smb_strndup_from_utf16((const char *)authblob + sz,
+	return smb_strndup_from_utf16((const char *)authblob + sz,
 				      le16_to_cpu(authblob->UserName.Length),
 				      true,
 				      conn->local_nls);
+}
+
+static struct ksmbd_user *session_user(struct ksmbd_work *work)
+{
+	struct ksmbd_login_response *resp;
+	struct ksmbd_user *user = NULL;
+	char *name;
+
+	/* looked up while the work was parked, see smb2_sess_setup_park() */
+	if (work->ipc_type == KSMBD_EVENT_LOGIN_REQUEST) {
+		resp = ksmbd_work_ipc_response(work);
+		if (resp && resp->status & KSMBD_USER_FLAG_OK)
+			user = ksmbd_alloc_user(resp);
+		kvfree(resp);
+		return user;
+	}
+
+	name = session_user_name(work->conn, work->request_buf);
 	if (IS_ERR(name)) {
 		pr_err("cannot allocate memory\n");
 		return NULL;
@@ -1334,7 +1485,7 @@ static int ntlm_authenticate(struct ksmbd_work *work)
 		inc_rfc1001_len(rsp, spnego_blob_len - 1);
 	}
 
-	user = session_user(conn, req);
+	user = session_user(work);
 	if (!user) {
 		ksmbd_debug(SMB, "Unknown user name or an error\n");
 		rsp->hdr.Status = STATUS_LOGON_FAILURE;
@@ -1424,8 +1575,8 @@ binding_session:
 				return -ENOMEM;
 
 			chann->conn = conn;
-			INIT_LIST_HEAD(&chann->chann_list);
-			list_add(&chann->chann_list, &sess->ksmbd_chann_list);
+			smb2_inherit_credit_window(conn, sess);
+			ksmbd_session_add_channel(sess, chann);
 		}
 	}
 
@@ -1455,6 +1606,7 @@ static int krb5_authenticate(struct ksmbd_work *work)
 	struct smb2_sess_setup_rsp *rsp = work->response_buf;
 	struct ksmbd_conn *conn = work->conn;
 	struct ksmbd_session *sess = work->sess;
+	struct ksmbd_spnego_authen_response *resp;
 	char *in_blob, *out_blob;
 	struct channel *chann = NULL;
 	u64 prev_sess_id;
@@ -1470,6 +1622,12 @@ static int krb5_authenticate(struct ksmbd_work *work)
 		offsetof(struct smb2_hdr, smb2_buf_length) -
 		le16_to_cpu(rsp->SecurityBufferOffset);
 
+	/* a parked work already has the daemon's verdict */
+	if (work->ipc_type == KSMBD_EVENT_SPNEGO_AUTHEN_REQUEST)
+		resp = ksmbd_work_ipc_response(work);
+	else
+		resp = ksmbd_ipc_spnego_authen_request(in_blob, in_len);
+
 	/* Check previous session */
 	prev_sess_id = le64_to_cpu(req->PreviousSessionId);
 	if (prev_sess_id && prev_sess_id != sess->id)
@@ -1478,8 +1636,7 @@ static int krb5_authenticate(struct ksmbd_work *work)
 	if (sess->state == SMB2_SESSION_VALID)
 		ksmbd_free_user(sess->user);
 
-	retval = ksmbd_krb5_authenticate(sess, in_blob, in_len,
-					 out_blob, &out_len);
+	retval = ksmbd_krb5_authenticate(sess, resp, out_blob, &out_len);
 	if (retval) {
 		ksmbd_debug(SMB, "krb5 authentication failed\n");
 		rsp->hdr.Status = STATUS_LOGON_FAILURE;
@@ -1514,8 +1671,8 @@ static int krb5_authenticate(struct ksmbd_work *work)
 				return -ENOMEM;
 
 			chann->conn = conn;
-			INIT_LIST_HEAD(&chann->chann_list);
-			list_add(&chann->chann_list, &sess->ksmbd_chann_list);
+			smb2_inherit_credit_window(conn, sess);
+			ksmbd_session_add_channel(sess, chann);
 		}
 	}
 
@@ -1544,6 +1701,134 @@ static int krb5_authenticate(struct ksmbd_work *work)
 }
 #endif
 
+/**
+ * smb2_sess_setup_find() - look up and validate the session a session setup
+ *			    request with a SessionId refers to
+ * @work:	smb work containing session setup request buffer
+ * @sess:	filled with the session
+ * @binding:	set if the request binds a new channel to @sess
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_sess_setup_find(struct ksmbd_work *work,
+				struct ksmbd_session **sess, bool *binding)
+{
+	struct ksmbd_conn *conn = work->conn;
+	struct smb2_sess_setup_req *req = work->request_buf;
+	u64 sess_id = le64_to_cpu(req->hdr.SessionId);
+
+	*sess = NULL;
+	*binding = false;
+
+	if (conn->dialect >= SMB30_PROT_ID &&
+	    (server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL) &&
+	    req->Flags & SMB2_SESSION_REQ_FLAG_BINDING) {
+		*sess = ksmbd_session_lookup_slowpath(sess_id);
+		if (!*sess)
+			return -ENOENT;
+
+		if (conn->dialect != (*sess)->conn->dialect)
+			return -EINVAL;
+
+		if (!(req->hdr.Flags & SMB2_FLAGS_SIGNED))
+			return -EINVAL;
+
+		if (strncmp(conn->ClientGUID, (*sess)->conn->ClientGUID,
+			    SMB2_CLIENT_GUID_SIZE))
+			return -ENOENT;
+
+		if ((*sess)->state == SMB2_SESSION_IN_PROGRESS)
+			return -EACCES;
+
+		if ((*sess)->state == SMB2_SESSION_EXPIRED)
+			return -EFAULT;
+
+		if (ksmbd_session_lookup(conn, sess_id))
+			return -EACCES;
+
+		*binding = true;
+		return 0;
+	}
+
+	if ((conn->dialect < SMB30_PROT_ID ||
+	     server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL) &&
+	    (req->Flags & SMB2_SESSION_REQ_FLAG_BINDING))
+		return -EACCES;
+
+	*sess = ksmbd_session_lookup(conn, sess_id);
+	if (!*sess)
+		return -ENOENT;
+	return 0;
+}
+
+/**
+ * smb2_sess_setup_park() - ask the daemon for the authenticate leg without
+ *			    holding the worker
+ * @work:	smb work containing session setup request buffer
+ *
+ * The login or SPNEGO request only depends on the request itself, so it is
+ * sent before any session state changes and smb2_sess_setup() runs once
+ * more with the response, see ksmbd_ipc_park_work(). A request for a
+ * session that does not validate is failed right away without bothering
+ * the daemon.
+ *
+ * Return:	true if @work was parked
+ */
+static bool smb2_sess_setup_park(struct ksmbd_work *work)
+{
+	struct ksmbd_conn *conn = work->conn;
+	struct smb2_sess_setup_req *req = work->request_buf;
+	struct negotiate_message *negblob;
+	struct ksmbd_session *sess;
+	char *name, *in_blob;
+	int in_len, rc = -EINVAL;
+	bool binding;
+
+	if (work->ipc_type)
+		return false;
+
+	if (req->hdr.SessionId &&
+	    smb2_sess_setup_find(work, &sess, &binding))
+		return false;
+
+	negblob = (struct negotiate_message *)((char *)&req->hdr.ProtocolId +
+			le16_to_cpu(req->SecurityBufferOffset));
+	if (decode_negotiation_token(work, negblob) == 0) {
+		if (conn->mechToken)
+			negblob = (struct negotiate_message *)conn->mechToken;
+	}
+
+	if (!(server_conf.auth_mechs & conn->auth_mechs))
+		goto out;
+
+	if (conn->preferred_auth_mech &
+	    (KSMBD_AUTH_KRB5 | KSMBD_AUTH_MSKRB5)) {
+		if (!IS_ENABLED(CONFIG_SMB_SERVER_KERBEROS5))
+			goto out;
+
+		in_blob = (char *)&req->hdr.ProtocolId +
+			le16_to_cpu(req->SecurityBufferOffset);
+		in_len = le16_to_cpu(req->SecurityBufferLength);
+		rc = ksmbd_ipc_spnego_authen_request_async(work, in_blob,
+							   in_len);
+	} else if (conn->preferred_auth_mech == KSMBD_AUTH_NTLMSSP &&
+		   negblob->MessageType == NtLmAuthenticate) {
+		name = session_user_name(conn, req);
+		if (IS_ERR(name))
+			goto out;
+
+		ksmbd_debug(SMB, "session setup request for user %s\n", name);
+		rc = ksmbd_ipc_login_request_async(work, name);
+		kfree(name);
+	}
+
+out:
+	/* decoded again when the request is handled */
+	kfree(conn->mechToken);
+	conn->mechToken = NULL;
+	return !rc;
+}
+
 int smb2_sess_setup(struct ksmbd_work *work)
 {
 	struct ksmbd_conn *conn = work->conn;
@@ -1551,10 +1836,14 @@ int smb2_sess_setup(struct ksmbd_work *work)
 	struct smb2_sess_setup_rsp *rsp = work->response_buf;
 	struct ksmbd_session *sess;
 	struct negotiate_message *negblob;
+	bool binding;
 	int rc = 0;
 
 	ksmbd_debug(SMB, "Received request for session setup\n");
 
+	if (smb2_sess_setup_park(work))
+		return 0;
+
 	rsp->StructureSize = cpu_to_le16(9);
 	rsp->SessionFlags = 0;
 	rsp->SecurityBufferOffset = cpu_to_le16(72);
@@ -1567,63 +1856,19 @@ int smb2_sess_setup(struct ksmbd_work *work)
 			rc = -ENOMEM;
 			goto out_err;
 		}
-		rsp->hdr.SessionId = cpu_to_le64(sess->id);
-		ksmbd_session_register(conn, sess);
-	} else if (conn->dialect >= SMB30_PROT_ID &&
-		   (server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL) &&
-		   req->Flags & SMB2_SESSION_REQ_FLAG_BINDING) {
-		u64 sess_id = le64_to_cpu(req->hdr.SessionId);
-
-		sess = ksmbd_session_lookup_slowpath(sess_id);
-		if (!sess) {
-			rc = -ENOENT;
-			goto out_err;
-		}
-
-		if (conn->dialect != sess->conn->dialect) {
-			rc = -EINVAL;
-			goto out_err;
-		}
-
-		if (!(req->hdr.Flags & SMB2_FLAGS_SIGNED)) {
-			rc = -EINVAL;
-			goto out_err;
-		}
-
-		if (strncmp(conn->ClientGUID, sess->conn->ClientGUID,
-			    SMB2_CLIENT_GUID_SIZE)) {
-			rc = -ENOENT;
-			goto out_err;
-		}
-
-		if (sess->state == SMB2_SESSION_IN_PROGRESS) {
-			rc = -EACCES;
-			goto out_err;
-		}
-
-		if (sess->state == SMB2_SESSION_EXPIRED) {
-			rc = -EFAULT;
-			goto out_err;
-		}
-
-		if (ksmbd_session_lookup(conn, sess_id)) {
-			rc = -EACCES;
+		rc = ksmbd_session_register(conn, sess);
+		if (rc)
 			goto out_err;
-		}
-
-		conn->binding = true;
-	} else if ((conn->dialect < SMB30_PROT_ID ||
-		    server_conf.flags & KSMBD_GLOBAL_FLAG_SMB3_MULTICHANNEL) &&
-		   (req->Flags & SMB2_SESSION_REQ_FLAG_BINDING)) {
-		rc = -EACCES;
-		goto out_err;
+		rsp->hdr.SessionId = cpu_to_le64(sess->id);
 	} else {
-		sess = ksmbd_session_lookup(conn,
-					    le64_to_cpu(req->hdr.SessionId));
-		if (!sess) {
-			rc = -ENOENT;
+		rc = smb2_sess_setup_find(work, &sess, &binding);
+		if (rc) {
+			/* not ours to destroy */
+			sess = NULL;
 			goto out_err;
 		}
+		if (binding)
+			conn->binding = true;
 	}
 	work->sess = sess;
 
@@ -1740,25 +1985,35 @@ int smb2_tree_connect(struct ksmbd_work *work)
 	struct ksmbd_share_config *share;
 	int rc = -EINVAL;
 
-	treename = smb_strndup_from_utf16(req->Buffer,
-					  le16_to_cpu(req->PathLength), true,
-					  conn->local_nls);
-	if (IS_ERR(treename)) {
-		pr_err("treename is NULL\n");
-		status.ret = KSMBD_TREE_CONN_STATUS_ERROR;
-		goto out_err1;
-	}
+	/* a resumed work already holds the share it was parked with */
+	if (work->ipc_type != KSMBD_EVENT_TREE_CONNECT_REQUEST) {
+		treename = smb_strndup_from_utf16(req->Buffer,
+						  le16_to_cpu(req->PathLength),
+						  true, conn->local_nls);
+		if (IS_ERR(treename)) {
+			pr_err("treename is NULL\n");
+			status.ret = KSMBD_TREE_CONN_STATUS_ERROR;
+			goto out_err1;
+		}
 
-	name = ksmbd_extract_sharename(treename);
-	if (IS_ERR(name)) {
-		status.ret = KSMBD_TREE_CONN_STATUS_ERROR;
-		goto out_err1;
+		name = ksmbd_extract_sharename(treename);
+		if (IS_ERR(name)) {
+			status.ret = KSMBD_TREE_CONN_STATUS_ERROR;
+			goto out_err1;
+		}
+
+		ksmbd_debug(SMB, "tree connect request for tree %s treename %s\n",
+			    name, treename);
 	}
 
-	ksmbd_debug(SMB, "tree connect request for tree %s treename %s\n",
-		    name, treename);
+	status = ksmbd_tree_conn_connect(work, sess, name);
+	if (status.ret == -EINPROGRESS) {
+		/* called again once the daemon answered */
+		kfree(treename);
+		kfree(name);
+		return 0;
+	}
 
-	status = ksmbd_tree_conn_connect(sess, name);
 	if (status.ret == KSMBD_TREE_CONN_STATUS_OK)
 		rsp->hdr.Id.SyncId.TreeId = cpu_to_le32(status.tree_conn->id);
 	else
@@ -1790,7 +2045,7 @@ int smb2_tree_connect(struct ksmbd_work *work)
 
 	status.tree_conn->maximal_access = le32_to_cpu(rsp->MaximalAccess);
 	if (conn->posix_ext_supported)
-		status.tree_conn->posix_extensions = true;
+		status.tree_conn->fast_flags |= KSMBD_TCON_POSIX;
 
 out_err1:
 	rsp->StructureSize = cpu_to_le16(16);
@@ -2155,9 +2410,7 @@ static noinline int smb2_set_stream_name_xattr(struct path *path,
 	fp->stream.size = xattr_stream_size;
 
 	/* Check if there is stream prefix in xattr space */
-	rc = ksmbd_vfs_casexattr_len(path->dentry,
-				     xattr_stream_name,
-				     xattr_stream_size);
+	rc = ksmbd_vfs_stream_size(fp);
 	if (rc >= 0)
 		return 0;
 
@@ -2166,7 +2419,7 @@ static noinline int smb2_set_stream_name_xattr(struct path *path,
 		return -EBADF;
 	}
 
-	rc = ksmbd_vfs_setxattr(path->dentry, xattr_stream_name, NULL, 0, 0);
+	rc = ksmbd_vfs_stream_create(fp);
 	if (rc < 0)
 		pr_err("Failed to store XATTR stream name :%d\n", rc);
 	return 0;
@@ -2205,7 +2458,7 @@ out:
 	return err;
 }
 
-static int smb2_create_truncate(struct path *path)
+static int smb2_create_truncate(struct path *path, struct ksmbd_file *fp)
 {
 	int rc = vfs_truncate(path, 0);
 
@@ -2214,6 +2467,7 @@ static int smb2_create_truncate(struct path *path)
 		return rc;
 	}
 
+	ksmbd_vfs_stream_remove_all(fp);
 	rc = smb2_remove_smb_xattrs(path->dentry);
 	if (rc == -EOPNOTSUPP)
 		rc = 0;
@@ -2230,8 +2484,7 @@ static void smb2_new_xattrs(struct ksmbd_tree_connect *tcon, struct path *path,
 	struct xattr_dos_attrib da = {0};
 	int rc;
 
-	if (!test_share_config_flag(tcon->share_conf,
-				    KSMBD_SHARE_FLAG_STORE_DOS_ATTRS))
+	if (!test_tree_conn_fast_flag(tcon, KSMBD_TCON_STORE_DOS_ATTRS))
 		return;
 
 	da.version = 4;
@@ -2254,8 +2507,7 @@ static void smb2_update_xattrs(struct ksmbd_tree_connect *tcon,
 	fp->f_ci->m_fattr &= ~(ATTR_HIDDEN_LE | ATTR_SYSTEM_LE);
 
 	/* get FileAttributes from XATTR_NAME_DOS_ATTRIBUTE */
-	if (!test_share_config_flag(tcon->share_conf,
-				    KSMBD_SHARE_FLAG_STORE_DOS_ATTRS))
+	if (!test_tree_conn_fast_flag(tcon, KSMBD_TCON_STORE_DOS_ATTRS))
 		return;
 
 	rc = ksmbd_vfs_get_dos_attrib_xattr(path->dentry, &da);
@@ -2414,8 +2666,8 @@ int smb2_open(struct ksmbd_work *work)
 
 		ksmbd_debug(SMB, "converted name = %s\n", name);
 		if (strchr(name, ':')) {
-			if (!test_share_config_flag(work->tcon->share_conf,
-						    KSMBD_SHARE_FLAG_STREAMS)) {
+			if (!test_tree_conn_fast_flag(work->tcon,
+						      KSMBD_TCON_STREAMS)) {
 				rc = -EBADF;
 				goto err_out1;
 			}
@@ -2551,7 +2803,7 @@ int smb2_open(struct ksmbd_work *work)
 			goto err_out1;
 		}
 
-		if (tcon->posix_extensions) {
+		if (test_tree_conn_fast_flag(tcon, KSMBD_TCON_POSIX)) {
 			context = smb2_find_context_vals(req,
 							 SMB2_CREATE_TAG_POSIX);
 			if (IS_ERR(context)) {
@@ -2593,7 +2845,7 @@ int smb2_open(struct ksmbd_work *work)
 				goto err_out;
 			}
 
-			if (!test_tree_conn_flag(tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+			if (!test_tree_conn_fast_flag(tcon, KSMBD_TCON_WRITABLE)) {
 				ksmbd_debug(SMB,
 					    "User does not have write permission\n");
 				rc = -EACCES;
@@ -2602,8 +2854,8 @@ int smb2_open(struct ksmbd_work *work)
 			}
 		}
 	} else {
-		if (test_share_config_flag(work->tcon->share_conf,
-					   KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS)) {
+		if (test_tree_conn_fast_flag(work->tcon,
+					     KSMBD_TCON_FOLLOW_SYMLINKS)) {
 			/*
 			 * Use LOOKUP_FOLLOW to follow the path of
 			 * symlink in path buildup
@@ -2632,6 +2884,13 @@ int smb2_open(struct ksmbd_work *work)
 			    name, rc);
 		rc = 0;
 	} else {
+		if (ksmbd_share_veto_path(share, &path)) {
+			ksmbd_debug(SMB, "Reject open(), vetoed path: %s\n",
+				    name);
+			rc = -ENOENT;
+			path_put(&path);
+			goto err_out;
+		}
 		file_present = true;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
 		generic_fillattr(&init_user_ns, d_inode(path.dentry), &stat);
@@ -2711,7 +2970,7 @@ int smb2_open(struct ksmbd_work *work)
 					    req->CreateDisposition,
 					    &may_flags);
 
-	if (!test_tree_conn_flag(tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(tcon, KSMBD_TCON_WRITABLE)) {
 		if (open_flags & O_CREAT) {
 			ksmbd_debug(SMB,
 				    "User does not have write permission\n");
@@ -2820,8 +3079,8 @@ int smb2_open(struct ksmbd_work *work)
 		if (posix_acl_rc)
 			ksmbd_debug(SMB, "inherit posix acl failed : %d\n", posix_acl_rc);
 
-		if (test_share_config_flag(work->tcon->share_conf,
-					   KSMBD_SHARE_FLAG_ACL_XATTR)) {
+		if (test_tree_conn_fast_flag(work->tcon,
+					     KSMBD_TCON_ACL_XATTR)) {
 			rc = smb_inherit_dacl(conn, path.dentry, sess->user->uid,
 					      sess->user->gid);
 		}
@@ -2832,8 +3091,8 @@ int smb2_open(struct ksmbd_work *work)
 				if (posix_acl_rc)
 					ksmbd_vfs_set_init_posix_acl(inode);
 
-				if (test_share_config_flag(work->tcon->share_conf,
-							   KSMBD_SHARE_FLAG_ACL_XATTR)) {
+				if (test_tree_conn_fast_flag(work->tcon,
+							     KSMBD_TCON_ACL_XATTR)) {
 					struct smb_fattr fattr;
 					struct smb_ntsd *pntsd;
 					int pntsd_size, ace_num = 0;
@@ -2917,7 +3176,7 @@ int smb2_open(struct ksmbd_work *work)
 	}
 
 	share_ret = ksmbd_smb_check_shared_mode(fp->filp, fp);
-	if (!test_share_config_flag(work->tcon->share_conf, KSMBD_SHARE_FLAG_OPLOCKS) ||
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_OPLOCKS) ||
 	    (req_op_level == SMB2_OPLOCK_LEVEL_LEASE &&
 	     !(conn->vals->capabilities & SMB2_GLOBAL_CAP_LEASING))) {
 		if (share_ret < 0 && !S_ISDIR(file_inode(fp->filp)->i_mode)) {
@@ -2950,7 +3209,7 @@ int smb2_open(struct ksmbd_work *work)
 		ksmbd_fd_set_delete_on_close(fp, file_info);
 
 	if (need_truncate) {
-		rc = smb2_create_truncate(&path);
+		rc = smb2_create_truncate(&path, fp);
 		if (rc)
 			goto err_out;
 	}
@@ -3455,7 +3714,7 @@ static int smb2_populate_readdir_entry(struct ksmbd_conn *conn, int info_level,
 
 struct smb2_query_dir_private {
 	struct ksmbd_work	*work;
-	char			*search_pattern;
+	struct ksmbd_pattern	search_pattern;
 	struct ksmbd_file	*dir_fp;
 
 	struct ksmbd_dir_info	*d_info;
@@ -3649,7 +3908,7 @@ static int __query_dir(struct dir_context *ctx, const char *name, int namlen,
 		return 0;
 	if (ksmbd_share_veto_filename(priv->work->tcon->share_conf, name))
 		return 0;
-	if (!match_pattern(name, namlen, priv->search_pattern))
+	if (!ksmbd_match_compiled_pattern(&priv->search_pattern, name, namlen))
 		return 0;
 
 	d_info->name		= name;
@@ -3669,6 +3928,80 @@ static void restart_ctx(struct dir_context *ctx)
 	ctx->pos = 0;
 }
 
+static bool query_dir_cacheable(char *srch_ptr, unsigned char srch_flag)
+{
+	if (!(server_conf.flags & KSMBD_GLOBAL_FLAG_DIR_CACHE))
+		return false;
+	if (srch_flag & (SMB2_RETURN_SINGLE_ENTRY | SMB2_INDEX_SPECIFIED))
+		return false;
+	return !strcmp(srch_ptr, "*");
+}
+
+/*
+ * Attach a cached enumeration to the directory handle when a scan
+ * starts, or start building one if the cache has none.
+ */
+static void query_dir_attach_snapshot(struct ksmbd_file *dir_fp,
+				      struct ksmbd_share_config *share,
+				      int info_level)
+{
+	struct inode *inode = file_inode(dir_fp->filp);
+
+	if (dir_fp->dir_snap) {
+		if (dir_fp->dir_snap->info_level != info_level)
+			ksmbd_dir_snapshot_detach(dir_fp);
+		return;
+	}
+
+	if (dir_fp->filp->f_pos || dir_fp->dot_dotdot[0] ||
+	    dir_fp->dot_dotdot[1])
+		return;
+
+	dir_fp->dir_snap_pos = 0;
+	dir_fp->dir_snap = ksmbd_dir_cache_lookup(share, inode, info_level);
+	if (dir_fp->dir_snap)
+		return;
+
+	dir_fp->dir_snap = ksmbd_dir_snapshot_alloc(share, inode, info_level);
+	dir_fp->dir_snap_building = dir_fp->dir_snap != NULL;
+}
+
+/*
+ * Copy the next entries of the attached snapshot into the response.
+ * Return -ENOSPC if not even the next entry fits.
+ */
+static int query_dir_from_snapshot(struct ksmbd_file *dir_fp,
+				   struct ksmbd_dir_info *d_info)
+{
+	struct ksmbd_dir_snapshot *snap = dir_fp->dir_snap;
+	unsigned int pos = dir_fp->dir_snap_pos;
+
+	while (pos < snap->size) {
+		struct file_directory_info *entry;
+		unsigned int next_entry_offset;
+
+		entry = (struct file_directory_info *)(snap->data + pos);
+		next_entry_offset = le32_to_cpu(entry->NextEntryOffset);
+		if (!next_entry_offset ||
+		    next_entry_offset > snap->size - pos)
+			break;
+		if ((int)next_entry_offset > d_info->out_buf_len) {
+			if (!d_info->data_count)
+				return -ENOSPC;
+			break;
+		}
+
+		memcpy(d_info->wptr, entry, next_entry_offset);
+		d_info->last_entry_offset = d_info->data_count;
+		d_info->data_count += next_entry_offset;
+		d_info->out_buf_len -= next_entry_offset;
+		d_info->wptr += next_entry_offset;
+		pos += next_entry_offset;
+	}
+	dir_fp->dir_snap_pos = pos;
+	return 0;
+}
+
 static int verify_info_level(int info_level)
 {
 	switch (info_level) {
@@ -3699,6 +4032,7 @@ int smb2_query_dir(struct ksmbd_work *work)
 	char *srch_ptr = NULL;
 	unsigned char srch_flag;
 	int buffer_sz;
+	bool dir_end;
 	struct smb2_query_dir_private query_dir_private = {NULL, };
 
 	rsp_org = work->response_buf;
@@ -3762,8 +4096,31 @@ int smb2_query_dir(struct ksmbd_work *work)
 		ksmbd_debug(SMB, "Restart directory scan\n");
 		generic_file_llseek(dir_fp->filp, 0, SEEK_SET);
 		restart_ctx(&dir_fp->readdir_data.ctx);
+		ksmbd_dir_snapshot_detach(dir_fp);
+	}
+
+	/*
+	 * The directory itself is not read while a snapshot is served, so a
+	 * scan that stops using it midway cannot resume where it stopped.
+	 * Refuse it rather than return the entries again, the client has to
+	 * restart the scan.
+	 */
+	if (dir_fp->dir_snap && !dir_fp->dir_snap_building &&
+	    dir_fp->dir_snap_pos &&
+	    (!query_dir_cacheable(srch_ptr, srch_flag) ||
+	     dir_fp->dir_snap->info_level != req->FileInformationClass)) {
+		ksmbd_debug(SMB, "scan changed while served from a snapshot\n");
+		rc = -EINVAL;
+		kfree(srch_ptr);
+		goto err_out2;
 	}
 
+	if (query_dir_cacheable(srch_ptr, srch_flag))
+		query_dir_attach_snapshot(dir_fp, share,
+					  req->FileInformationClass);
+	else
+		ksmbd_dir_snapshot_detach(dir_fp);
+
 	memset(&d_info, 0, sizeof(struct ksmbd_dir_info));
 	d_info.wptr = (char *)rsp->Buffer;
 	d_info.rptr = (char *)rsp->Buffer;
@@ -3772,6 +4129,13 @@ int smb2_query_dir(struct ksmbd_work *work)
 		sizeof(struct smb2_query_directory_rsp);
 	d_info.flags = srch_flag;
 
+	if (dir_fp->dir_snap && !dir_fp->dir_snap_building) {
+		rc = query_dir_from_snapshot(dir_fp, &d_info);
+		if (rc)
+			goto no_buf_len;
+		goto fill_rsp;
+	}
+
 	/*
 	 * reserve dot and dotdot entries in head of buffer
 	 * in first response
@@ -3790,7 +4154,7 @@ int smb2_query_dir(struct ksmbd_work *work)
 	buffer_sz				= d_info.out_buf_len;
 	d_info.rptr				= d_info.wptr;
 	query_dir_private.work			= work;
-	query_dir_private.search_pattern	= srch_ptr;
+	ksmbd_compile_pattern(&query_dir_private.search_pattern, srch_ptr, true);
 	query_dir_private.dir_fp		= dir_fp;
 	query_dir_private.d_info		= &d_info;
 	query_dir_private.info_level		= req->FileInformationClass;
@@ -3798,6 +4162,11 @@ int smb2_query_dir(struct ksmbd_work *work)
 	set_ctx_actor(&dir_fp->readdir_data.ctx, __query_dir);
 
 	rc = iterate_dir(dir_fp->filp, &dir_fp->readdir_data.ctx);
+	/*
+	 * Filesystems stop quietly when the actor refuses an entry, so the
+	 * directory only ended if the actor never ran out of room.
+	 */
+	dir_end = !rc && d_info.out_buf_len;
 	if (rc == 0)
 		restart_ctx(&dir_fp->readdir_data.ctx);
 	if (rc == -ENOSPC)
@@ -3805,12 +4174,31 @@ int smb2_query_dir(struct ksmbd_work *work)
 	if (rc)
 		goto err_out;
 
+	/* not even the first entry fits the output buffer */
+	if (!d_info.out_buf_len && !d_info.num_entry && !d_info.data_count) {
+		rc = -ENOSPC;
+		goto no_buf_len;
+	}
+
 	d_info.wptr = d_info.rptr;
 	d_info.out_buf_len = buffer_sz;
 	rc = process_query_dir_entries(&query_dir_private);
 	if (rc)
 		goto err_out;
 
+	if (dir_fp->dir_snap_building) {
+		if (ksmbd_dir_snapshot_append(dir_fp->dir_snap,
+					      (char *)rsp->Buffer,
+					      d_info.data_count)) {
+			ksmbd_dir_snapshot_detach(dir_fp);
+		} else if (dir_end) {
+			ksmbd_dir_cache_insert(dir_fp->dir_snap,
+					       file_inode(dir_fp->filp));
+			ksmbd_dir_snapshot_detach(dir_fp);
+		}
+	}
+
+fill_rsp:
 	if (!d_info.data_count && d_info.out_buf_len >= 0) {
 		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY && !is_asterisk(srch_ptr)) {
 			rsp->hdr.Status = STATUS_NO_SUCH_FILE;
@@ -3842,9 +4230,17 @@ int smb2_query_dir(struct ksmbd_work *work)
 err_out:
 	pr_err("error while processing smb2 query dir rc = %d\n", rc);
 	kfree(srch_ptr);
+	ksmbd_dir_snapshot_detach(dir_fp);
+	goto err_out2;
+
+no_buf_len:
+	/* the scan stays where it is, the client may retry with more room */
+	kfree(srch_ptr);
 
 err_out2:
-	if (rc == -EINVAL)
+	if (rc == -ENOSPC)
+		rsp->hdr.Status = STATUS_INFO_LENGTH_MISMATCH;
+	else if (rc == -EINVAL)
 		rsp->hdr.Status = STATUS_INVALID_PARAMETER;
 	else if (rc == -EACCES)
 		rsp->hdr.Status = STATUS_ACCESS_DENIED;
@@ -4321,11 +4717,10 @@ static void get_file_stream_info(struct ksmbd_work *work,
 {
 	struct ksmbd_conn *conn = work->conn;
 	struct smb2_file_stream_info *file_info;
-	char *stream_name, *xattr_list = NULL, *stream_buf;
+	struct ksmbd_stream_entry *se;
+	char *stream_name, *stream_buf;
 	struct kstat stat;
-	struct path *path = &fp->filp->f_path;
-	ssize_t xattr_list_len;
-	int nbytes = 0, streamlen, stream_name_len, next, idx = 0;
+	int nbytes = 0, streamlen, stream_name_len, next;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
 	generic_fillattr(&init_user_ns, file_inode(fp->filp), &stat);
@@ -4334,27 +4729,16 @@ static void get_file_stream_info(struct ksmbd_work *work,
 #endif
 	file_info = (struct smb2_file_stream_info *)rsp->Buffer;
 
-	xattr_list_len = ksmbd_vfs_listxattr(path->dentry, &xattr_list);
-	if (xattr_list_len < 0) {
+	if (ksmbd_vfs_stream_index_lock(fp))
 		goto out;
-	} else if (!xattr_list_len) {
-		ksmbd_debug(SMB, "empty xattr in the file\n");
-		goto out;
-	}
 
-	while (idx < xattr_list_len) {
-		stream_name = xattr_list + idx;
+	list_for_each_entry(se, &fp->f_ci->m_streams, list) {
+		stream_name = se->xattr_name;
 		streamlen = strlen(stream_name);
-		idx += streamlen + 1;
 
 		ksmbd_debug(SMB, "%s, len %d\n", stream_name, streamlen);
 
-		if (strncmp(&stream_name[XATTR_USER_PREFIX_LEN],
-			    STREAM_PREFIX, STREAM_PREFIX_LEN))
-			continue;
-
-		stream_name_len = streamlen - (XATTR_USER_PREFIX_LEN +
-				STREAM_PREFIX_LEN);
+		stream_name_len = streamlen - XATTR_NAME_STREAM_LEN;
 		streamlen = stream_name_len;
 
 		/* plus : size */
@@ -4373,13 +4757,14 @@ static void get_file_stream_info(struct ksmbd_work *work,
 		streamlen *= 2;
 		kfree(stream_buf);
 		file_info->StreamNameLength = cpu_to_le32(streamlen);
-		file_info->StreamSize = cpu_to_le64(stream_name_len);
-		file_info->StreamAllocationSize = cpu_to_le64(stream_name_len);
+		file_info->StreamSize = cpu_to_le64(se->size);
+		file_info->StreamAllocationSize = cpu_to_le64(se->size);
 
 		next = sizeof(struct smb2_file_stream_info) + streamlen;
 		nbytes += next;
 		file_info->NextEntryOffset = cpu_to_le32(next);
 	}
+	ksmbd_vfs_stream_index_unlock(fp);
 
 	if (nbytes) {
 		file_info = (struct smb2_file_stream_info *)
@@ -4398,8 +4783,6 @@ static void get_file_stream_info(struct ksmbd_work *work,
 	/* last entry offset should be 0 */
 	file_info->NextEntryOffset = 0;
 out:
-	kvfree(xattr_list);
-
 	rsp->OutputBufferLength = cpu_to_le32(nbytes);
 	inc_rfc1001_len(rsp_org, nbytes);
 }
@@ -4581,8 +4964,7 @@ static int smb2_get_info_file(struct ksmbd_work *work,
 	int file_infoclass_size;
 	unsigned int id = KSMBD_NO_FID, pid = KSMBD_NO_FID;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		/* smb2 info file called for pipe */
 		return smb2_get_info_file_pipe(work->sess, req, rsp);
 	}
@@ -4683,7 +5065,7 @@ static int smb2_get_info_file(struct ksmbd_work *work,
 		file_infoclass_size = FILE_ATTRIBUTE_TAG_INFORMATION_SIZE;
 		break;
 	case SMB_FIND_FILE_POSIX_INFO:
-		if (!work->tcon->posix_extensions) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 			pr_err("client doesn't negotiate with SMB3.1.1 POSIX Extensions\n");
 			rc = -EOPNOTSUPP;
 		} else {
@@ -4896,7 +5278,7 @@ static int smb2_get_info_filesystem(struct ksmbd_work *work,
 	{
 		struct filesystem_posix_info *info;
 
-		if (!work->tcon->posix_extensions) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 			pr_err("client doesn't negotiate with SMB3.1.1 POSIX Extensions\n");
 			rc = -EOPNOTSUPP;
 		} else {
@@ -4979,8 +5361,7 @@ static int smb2_get_info_sec(struct ksmbd_work *work,
 	inode = file_inode(fp->filp);
 	ksmbd_acls_fattr(&fattr, inode);
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_ACL_XATTR))
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_ACL_XATTR))
 		ksmbd_vfs_get_sd_xattr(work->conn, fp->filp->f_path.dentry, &ppntsd);
 
 	rc = build_sec_desc(pntsd, ppntsd, addition_info, &secdesclen, &fattr);
@@ -5104,8 +5485,7 @@ int smb2_close(struct ksmbd_work *work)
 	rsp_org = work->response_buf;
 	WORK_BUFFERS(work, req, rsp);
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "IPC pipe close request\n");
 		return smb2_close_pipe(work);
 	}
@@ -5732,7 +6112,7 @@ static int smb2_set_info_file(struct ksmbd_work *work, struct ksmbd_file *fp,
 		return set_end_of_file_info(work, fp, buf);
 
 	case FILE_RENAME_INFORMATION:
-		if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 			ksmbd_debug(SMB,
 				    "User does not have write permission\n");
 			return -EACCES;
@@ -5745,7 +6125,7 @@ static int smb2_set_info_file(struct ksmbd_work *work, struct ksmbd_file *fp,
 					work->sess->conn->local_nls);
 
 	case FILE_DISPOSITION_INFORMATION:
-		if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 			ksmbd_debug(SMB,
 				    "User does not have write permission\n");
 			return -EACCES;
@@ -5935,30 +6315,223 @@ out:
 	return err;
 }
 
+/**
+ * smb2_get_rdma_channel_info() - validate the buffer descriptors of an
+ * RDMA channel read/write
+ * @work:	smb work
+ * @hdr:	smb2 header of the request
+ * @channel:	Channel of the request
+ * @ch_offset:	ReadChannelInfoOffset/WriteChannelInfoOffset of the request
+ * @ch_len:	ReadChannelInfoLength/WriteChannelInfoLength of the request
+ * @desc_len:	length of the returned descriptor array in bytes
+ *
+ * Return:	array of buffer descriptors on success, otherwise error pointer
+ */
+static struct smb2_buffer_desc_v1 *
+smb2_get_rdma_channel_info(struct ksmbd_work *work, struct smb2_hdr *hdr,
+			   __le32 channel, __le16 ch_offset, __le16 ch_len,
+			   unsigned int *desc_len)
+{
+	struct smb2_buffer_desc_v1 *desc;
+	unsigned int offset = le16_to_cpu(ch_offset);
+	unsigned int len = le16_to_cpu(ch_len);
+	unsigned int i;
+
+	if (work->conn->dialect == SMB30_PROT_ID &&
+	    channel != SMB2_CHANNEL_RDMA_V1)
+		return ERR_PTR(-EINVAL);
+
+	len -= len % sizeof(*desc);
+	if (!offset || !len ||
+	    offset + len > get_rfc1002_len(work->request_buf) -
+			   work->next_smb2_rcv_hdr_off)
+		return ERR_PTR(-EINVAL);
+
+	desc = (struct smb2_buffer_desc_v1 *)((char *)&hdr->ProtocolId + offset);
+	for (i = 0; i < len / sizeof(*desc); i++)
+		ksmbd_debug(RDMA, "RDMA r/w descriptor %u: token %#x, length %#x\n",
+			    i, le32_to_cpu(desc[i].token),
+			    le32_to_cpu(desc[i].length));
+
+	/* only the first descriptor's key is invalidated by the response */
+	work->need_invalidate_rkey =
+		(channel == SMB2_CHANNEL_RDMA_V1_INVALIDATE);
+	work->remote_key = le32_to_cpu(desc->token);
+	*desc_len = len;
+	return desc;
+}
+
+/*
+ * RDMA channel reads/writes larger than this are streamed in chunks, so
+ * that file I/O of one chunk overlaps with the RDMA transfer of the next.
+ */
+#define SMB2_RDMA_PIPELINE_CHUNK	(1024 * 1024)
+
+static bool smb2_rdma_pipelined(struct ksmbd_work *work, size_t length)
+{
+	return length > SMB2_RDMA_PIPELINE_CHUNK &&
+		ksmbd_conn_rdma_async(work->conn);
+}
+
+/* read the next chunk from the file while the previous one is pushed */
+static ssize_t smb2_read_rdma_pipelined(struct ksmbd_work *work,
+					struct smb2_read_req *req,
+					struct ksmbd_file *fp, loff_t offset,
+					size_t length)
+{
+	struct ksmbd_conn *conn = work->conn;
+	struct ksmbd_rdma_req *rreq[2] = {NULL, NULL};
+	struct smb2_buffer_desc_v1 *desc;
+	char *bufs[2] = {NULL, NULL};
+	unsigned int desc_len;
+	size_t total = 0, chunk;
+	ssize_t nbytes;
+	loff_t pos;
+	int cur = 0, i, err = 0;
+
+	desc = smb2_get_rdma_channel_info(work, &req->hdr, req->Channel,
+					  req->ReadChannelInfoOffset,
+					  req->ReadChannelInfoLength,
+					  &desc_len);
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	for (i = 0; i < 2; i++) {
+		bufs[i] = kvmalloc(SMB2_RDMA_PIPELINE_CHUNK, GFP_KERNEL);
+		if (!bufs[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	while (total < length) {
+		if (rreq[cur]) {
+			err = ksmbd_conn_rdma_wait(conn, rreq[cur]);
+			rreq[cur] = NULL;
+			if (err)
+				goto out;
+		}
+
+		chunk = min_t(size_t, length - total, SMB2_RDMA_PIPELINE_CHUNK);
+		pos = offset + total;
+		nbytes = ksmbd_vfs_read(work, fp, bufs[cur], chunk, &pos);
+		if (nbytes < 0) {
+			err = nbytes;
+			goto out;
+		}
+		if (!nbytes)
+			break;
+
+		/*
+		 * Never wait for credits while holding the ones of the chunk
+		 * in flight, finish that chunk first if there are none left.
+		 */
+		rreq[cur] = ksmbd_conn_rdma_submit(conn, bufs[cur], nbytes,
+						   desc, desc_len, total,
+						   false, rreq[!cur] != NULL);
+		if (rreq[cur] == ERR_PTR(-EAGAIN)) {
+			err = ksmbd_conn_rdma_wait(conn, rreq[!cur]);
+			rreq[!cur] = NULL;
+			if (err) {
+				rreq[cur] = NULL;
+				goto out;
+			}
+			rreq[cur] = ksmbd_conn_rdma_submit(conn, bufs[cur],
+							   nbytes, desc,
+							   desc_len, total,
+							   false, false);
+		}
+		if (IS_ERR(rreq[cur])) {
+			err = PTR_ERR(rreq[cur]);
+			rreq[cur] = NULL;
+			goto out;
+		}
+
+		total += nbytes;
+		if (nbytes < chunk)
+			break;
+		cur = !cur;
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (rreq[i]) {
+			int ret = ksmbd_conn_rdma_wait(conn, rreq[i]);
+
+			if (!err)
+				err = ret;
+		}
+		kvfree(bufs[i]);
+	}
+	return err ? err : total;
+}
+
+/* RDMA write the page cache pages of the range, without copying them */
+static ssize_t smb2_read_rdma_pages(struct ksmbd_work *work,
+				    struct smb2_read_req *req,
+				    struct ksmbd_file *fp, loff_t offset,
+				    size_t length)
+{
+	struct ksmbd_rdma_req *rreq;
+	struct smb2_buffer_desc_v1 *desc;
+	struct page **pages;
+	unsigned int desc_len, nr_pages;
+	ssize_t nbytes;
+	int err;
+
+	desc = smb2_get_rdma_channel_info(work, &req->hdr, req->Channel,
+					  req->ReadChannelInfoOffset,
+					  req->ReadChannelInfoLength,
+					  &desc_len);
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	if (!length)
+		return 0;
+
+	nr_pages = DIV_ROUND_UP(offset_in_page(offset) + length, PAGE_SIZE);
+	pages = kvmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	nbytes = ksmbd_vfs_read_pages(work, fp, pages, length, offset);
+	if (nbytes <= 0)
+		goto out_free;
+
+	nr_pages = DIV_ROUND_UP(offset_in_page(offset) + nbytes, PAGE_SIZE);
+	rreq = ksmbd_conn_rdma_submit_pages(work->conn, pages,
+					    offset_in_page(offset), nbytes,
+					    desc, desc_len, 0);
+	if (IS_ERR(rreq))
+		err = PTR_ERR(rreq);
+	else
+		err = ksmbd_conn_rdma_wait(work->conn, rreq);
+	if (err)
+		nbytes = err;
+
+	ksmbd_vfs_put_pages(pages, nr_pages);
+out_free:
+	kvfree(pages);
+	return nbytes;
+}
+
 static ssize_t smb2_read_rdma_channel(struct ksmbd_work *work,
 				      struct smb2_read_req *req, void *data_buf,
 				      size_t length)
 {
-	struct smb2_buffer_desc_v1 *desc =
-		(struct smb2_buffer_desc_v1 *)&req->Buffer[0];
+	struct smb2_buffer_desc_v1 *desc;
+	unsigned int desc_len;
 	int err;
 
-	if (work->conn->dialect == SMB30_PROT_ID &&
-	    req->Channel != SMB2_CHANNEL_RDMA_V1)
-		return -EINVAL;
-
-	if (req->ReadChannelInfoOffset == 0 ||
-	    le16_to_cpu(req->ReadChannelInfoLength) < sizeof(*desc))
-		return -EINVAL;
-
-	work->need_invalidate_rkey =
-		(req->Channel == SMB2_CHANNEL_RDMA_V1_INVALIDATE);
-	work->remote_key = le32_to_cpu(desc->token);
+	desc = smb2_get_rdma_channel_info(work, &req->hdr, req->Channel,
+					  req->ReadChannelInfoOffset,
+					  req->ReadChannelInfoLength,
+					  &desc_len);
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
 
 	err = ksmbd_conn_rdma_write(work->conn, data_buf, length,
-				    le32_to_cpu(desc->token),
-				    le64_to_cpu(desc->offset),
-				    le32_to_cpu(desc->length));
+				    desc, desc_len);
 	if (err)
 		return err;
 
@@ -5980,17 +6553,20 @@ int smb2_read(struct ksmbd_work *work)
 	loff_t offset;
 	size_t length, mincount;
 	ssize_t nbytes = 0, remain_bytes = 0;
+	bool is_rdma_channel, rdma_direct;
 	int err = 0;
 
 	rsp_org = work->response_buf;
 	WORK_BUFFERS(work, req, rsp);
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "IPC pipe read request\n");
 		return smb2_read_pipe(work);
 	}
 
+	is_rdma_channel = req->Channel == SMB2_CHANNEL_RDMA_V1_INVALIDATE ||
+			  req->Channel == SMB2_CHANNEL_RDMA_V1;
+
 	fp = ksmbd_lookup_fd_slow(work, le64_to_cpu(req->VolatileFileId),
 				  le64_to_cpu(req->PersistentFileId));
 	if (!fp) {
@@ -6018,13 +6594,30 @@ int smb2_read(struct ksmbd_work *work)
 	ksmbd_debug(SMB, "filename %pd, offset %lld, len %zu\n",
 		    fp->filp->f_path.dentry, offset, length);
 
-	work->aux_payload_buf = kvmalloc(length, GFP_KERNEL | __GFP_ZERO);
-	if (!work->aux_payload_buf) {
-		err = -ENOMEM;
-		goto out;
-	}
+	rdma_direct = false;
+	nbytes = -EOPNOTSUPP;
+	if (is_rdma_channel && ksmbd_conn_rdma_pages(conn) &&
+	    ksmbd_vfs_can_read_pages(fp))
+		nbytes = smb2_read_rdma_pages(work, req, fp, offset, length);
+
+	/* page cache pages which do not line up are read the usual way */
+	if (nbytes != -EOPNOTSUPP) {
+		rdma_direct = true;
+	} else if (is_rdma_channel && smb2_rdma_pipelined(work, length)) {
+		rdma_direct = true;
+		nbytes = smb2_read_rdma_pipelined(work, req, fp, offset,
+						  length);
+	} else {
+		work->aux_payload_buf = kvmalloc(length,
+						 GFP_KERNEL | __GFP_ZERO);
+		if (!work->aux_payload_buf) {
+			err = -ENOMEM;
+			goto out;
+		}
 
-	nbytes = ksmbd_vfs_read(work, fp, length, &offset);
+		nbytes = ksmbd_vfs_read(work, fp, work->aux_payload_buf,
+					length, &offset);
+	}
 	if (nbytes < 0) {
 		err = nbytes;
 		goto out;
@@ -6042,8 +6635,11 @@ int smb2_read(struct ksmbd_work *work)
 	ksmbd_debug(SMB, "nbytes %zu, offset %lld mincount %zu\n",
 		    nbytes, offset, mincount);
 
-	if (req->Channel == SMB2_CHANNEL_RDMA_V1_INVALIDATE ||
-	    req->Channel == SMB2_CHANNEL_RDMA_V1) {
+	if (rdma_direct) {
+		/* data was already written to the client while reading */
+		remain_bytes = nbytes;
+		nbytes = 0;
+	} else if (is_rdma_channel) {
 		/* write data to the client using rdma channel */
 		remain_bytes = smb2_read_rdma_channel(work, req,
 						      work->aux_payload_buf,
@@ -6163,41 +6759,128 @@ out:
 	return err;
 }
 
+/* write each chunk to the file while the next one is pulled */
+static ssize_t smb2_write_rdma_pipelined(struct ksmbd_work *work,
+					 struct ksmbd_file *fp,
+					 struct smb2_buffer_desc_v1 *desc,
+					 unsigned int desc_len, loff_t offset,
+					 size_t length, bool sync)
+{
+	struct ksmbd_conn *conn = work->conn;
+	struct ksmbd_rdma_req *rreq[2] = {NULL, NULL};
+	char *bufs[2] = {NULL, NULL};
+	size_t chunk[2], pulled = 0, done = 0;
+	ssize_t nbytes, total = 0;
+	loff_t pos;
+	int cur = 0, next, i, err = 0;
+
+	for (i = 0; i < 2; i++) {
+		bufs[i] = kvmalloc(SMB2_RDMA_PIPELINE_CHUNK, GFP_KERNEL);
+		if (!bufs[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	while (done < length) {
+		/*
+		 * Keep one chunk in flight while writing the current one. The
+		 * second chunk only takes rw credits which are free right now,
+		 * never waiting for them while holding the first chunk's, and
+		 * is left for the next round otherwise.
+		 */
+		for (i = 0; i < 2; i++) {
+			next = cur ^ i;
+			if (rreq[next] || pulled >= length)
+				continue;
+
+			chunk[next] = min_t(size_t, length - pulled,
+					    SMB2_RDMA_PIPELINE_CHUNK);
+			rreq[next] = ksmbd_conn_rdma_submit(conn, bufs[next],
+							    chunk[next], desc,
+							    desc_len, pulled,
+							    true,
+							    rreq[!next] != NULL);
+			if (rreq[next] == ERR_PTR(-EAGAIN)) {
+				rreq[next] = NULL;
+				break;
+			}
+			if (IS_ERR(rreq[next])) {
+				err = PTR_ERR(rreq[next]);
+				rreq[next] = NULL;
+				goto out;
+			}
+			pulled += chunk[next];
+		}
+
+		err = ksmbd_conn_rdma_wait(conn, rreq[cur]);
+		rreq[cur] = NULL;
+		if (err)
+			goto out;
+
+		pos = offset + done;
+		err = ksmbd_vfs_write(work, fp, bufs[cur], chunk[cur], &pos,
+				      false, &nbytes);
+		if (err < 0)
+			goto out;
+
+		total += nbytes;
+		done += chunk[cur];
+		cur = !cur;
+	}
+
+	/* every chunk of a write-through request must be stable */
+	if (sync) {
+		err = vfs_fsync_range(fp->filp, offset, offset + length - 1, 0);
+		if (err < 0)
+			pr_err("fsync failed for filename = %pd, err = %d\n",
+			       fp->filp->f_path.dentry, err);
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (rreq[i])
+			ksmbd_conn_rdma_wait(conn, rreq[i]);
+		kvfree(bufs[i]);
+	}
+	return err < 0 ? err : total;
+}
+
 static ssize_t smb2_write_rdma_channel(struct ksmbd_work *work,
 				       struct smb2_write_req *req,
 				       struct ksmbd_file *fp,
 				       loff_t offset, size_t length, bool sync)
 {
 	struct smb2_buffer_desc_v1 *desc;
+	unsigned int desc_len;
 	char *data_buf;
 	int ret;
 	ssize_t nbytes;
 
-	desc = (struct smb2_buffer_desc_v1 *)&req->Buffer[0];
-
-	if (work->conn->dialect == SMB30_PROT_ID &&
-	    req->Channel != SMB2_CHANNEL_RDMA_V1)
-		return -EINVAL;
-
 	if (req->Length != 0 || req->DataOffset != 0)
 		return -EINVAL;
 
-	if (req->WriteChannelInfoOffset == 0 ||
-	    le16_to_cpu(req->WriteChannelInfoLength) < sizeof(*desc))
+	if (length > work->conn->vals->max_write_size)
 		return -EINVAL;
 
-	work->need_invalidate_rkey =
-		(req->Channel == SMB2_CHANNEL_RDMA_V1_INVALIDATE);
-	work->remote_key = le32_to_cpu(desc->token);
+	desc = smb2_get_rdma_channel_info(work, &req->hdr, req->Channel,
+					  req->WriteChannelInfoOffset,
+					  req->WriteChannelInfoLength,
+					  &desc_len);
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+
+	if (smb2_rdma_pipelined(work, length))
+		return smb2_write_rdma_pipelined(work, fp, desc, desc_len,
+						 offset, length, sync);
 
-	data_buf = kvmalloc(length, GFP_KERNEL | __GFP_ZERO);
+	/* fully overwritten by the RDMA read, no need to zero it */
+	data_buf = kvmalloc(length, GFP_KERNEL);
 	if (!data_buf)
 		return -ENOMEM;
 
 	ret = ksmbd_conn_rdma_read(work->conn, data_buf, length,
-				   le32_to_cpu(desc->token),
-				   le64_to_cpu(desc->offset),
-				   le32_to_cpu(desc->length));
+				   desc, desc_len);
 	if (ret < 0) {
 		kvfree(data_buf);
 		return ret;
@@ -6232,12 +6915,12 @@ int smb2_write(struct ksmbd_work *work)
 	rsp_org = work->response_buf;
 	WORK_BUFFERS(work, req, rsp);
 
-	if (test_share_config_flag(work->tcon->share_conf, KSMBD_SHARE_FLAG_PIPE)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_PIPE)) {
 		ksmbd_debug(SMB, "IPC pipe write request\n");
 		return smb2_write_pipe(work);
 	}
 
-	if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 		ksmbd_debug(SMB, "User does not have write permission\n");
 		err = -EACCES;
 		goto out;
@@ -7016,7 +7699,8 @@ static int fsctl_query_iface_info_ioctl(struct ksmbd_conn *conn,
 	int nbytes = 0;
 	struct net_device *netdev;
 	struct sockaddr_storage_rsp *sockaddr_storage;
-	unsigned int flags;
+	struct ethtool_link_ksettings cmd;
+	unsigned int flags, capability;
 	unsigned long long speed;
 
 	rtnl_lock();
@@ -7037,23 +7721,23 @@ static int fsctl_query_iface_info_ioctl(struct ksmbd_conn *conn,
 				&rsp->Buffer[nbytes];
 		nii_rsp->IfIndex = cpu_to_le32(netdev->ifindex);
 
-		/* TODO: specify the RDMA capabilities */
-		if (netdev->num_tx_queues > 1)
-			nii_rsp->Capability = cpu_to_le32(RSS_CAPABLE);
-		else
-			nii_rsp->Capability = 0;
+		/* RSS spreads the receives of a NIC over several queues */
+		capability = 0;
+		if (netdev->real_num_rx_queues > 1)
+			capability |= RSS_CAPABLE;
+		if (ksmbd_rdma_capable_netdev(netdev))
+			capability |= RDMA_CAPABLE;
+		nii_rsp->Capability = cpu_to_le32(capability);
 
 		nii_rsp->Next = cpu_to_le32(152);
 		nii_rsp->Reserved = 0;
 
-		if (netdev->ethtool_ops->get_link_ksettings) {
-			struct ethtool_link_ksettings cmd;
-
-			netdev->ethtool_ops->get_link_ksettings(netdev, &cmd);
+		if (!__ethtool_get_link_ksettings(netdev, &cmd) &&
+		    cmd.base.speed && cmd.base.speed != (u32)SPEED_UNKNOWN) {
 			speed = cmd.base.speed;
 		} else {
-			pr_err("%s %s\n", netdev->name,
-			       "speed is unknown, defaulting to 1Gb/sec");
+			ksmbd_debug(SMB, "%s speed is unknown, defaulting to 1Gb/sec\n",
+				    netdev->name);
 			speed = SPEED_1000;
 		}
 
@@ -7244,8 +7928,7 @@ static inline int fsctl_set_sparse(struct ksmbd_work *work, u64 id,
 		fp->f_ci->m_fattr &= ~ATTR_SPARSE_FILE_LE;
 
 	if (fp->f_ci->m_fattr != old_fattr &&
-	    test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+	    test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_STORE_DOS_ATTRS)) {
 		struct xattr_dos_attrib da;
 
 		ret = ksmbd_vfs_get_dos_attrib_xattr(fp->filp->f_path.dentry, &da);
@@ -7390,7 +8073,7 @@ int smb2_ioctl(struct ksmbd_work *work)
 		break;
 	case FSCTL_COPYCHUNK:
 	case FSCTL_COPYCHUNK_WRITE:
-		if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 			ksmbd_debug(SMB,
 				    "User does not have write permission\n");
 			ret = -EACCES;
@@ -7417,7 +8100,7 @@ int smb2_ioctl(struct ksmbd_work *work)
 		struct ksmbd_file *fp;
 		loff_t off, len;
 
-		if (!test_tree_conn_flag(work->tcon, KSMBD_TREE_CONN_FLAG_WRITABLE)) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_WRITABLE)) {
 			ksmbd_debug(SMB,
 				    "User does not have write permission\n");
 			ret = -EACCES;
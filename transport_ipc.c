@@ -8,11 +8,15 @@
 #include <linux/rwsem.h>
 #include <linux/mutex.h>
 #include <linux/wait.h>
-#include <linux/hashtable.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
 #include <net/net_namespace.h>
 #include <net/genetlink.h>
 #include <linux/socket.h>
 #include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 
 #include "vfs_cache.h"
 #include "transport_ipc.h"
@@ -25,19 +29,42 @@
 #include "mgmt/tree_connect.h"
 #include "mgmt/ksmbd_ida.h"
 #include "connection.h"
+#include "rpc.h"
 #include "transport_tcp.h"
 
 #define IPC_WAIT_TIMEOUT	(2 * HZ)
 
-#define IPC_MSG_HASH_BITS	3
-static DEFINE_HASHTABLE(ipc_msg_table, IPC_MSG_HASH_BITS);
-static DECLARE_RWSEM(ipc_msg_table_lock);
+/* requests waiting for a response, indexed by request id */
+static DEFINE_XARRAY_ALLOC1(ipc_msg_table);
+static u32 ipc_msg_next_id;
+/* daemon worker that serves each open RPC pipe, indexed by pipe handle */
+static DEFINE_XARRAY(ipc_rpc_pipes);
 static DEFINE_MUTEX(startup_lock);
 
 static DEFINE_IDA(ipc_ida);
 
 static unsigned int ksmbd_tools_pid;
 
+/* additional daemon workers, requests go round-robin over them and the daemon */
+#define IPC_MAX_WORKERS		16
+static unsigned int ipc_worker_pids[IPC_MAX_WORKERS];
+static unsigned int ipc_nr_workers;
+static atomic_t ipc_next_worker = ATOMIC_INIT(0);
+
+/* bucket n counts responses that took less than 2^n usecs, the last the rest */
+#define IPC_LAT_BUCKETS		16
+static atomic_t ipc_lat_hist[KSMBD_EVENT_MAX][IPC_LAT_BUCKETS];
+static atomic_t ipc_lat_timeouts[KSMBD_EVENT_MAX];
+
+static const char * const ipc_event_names[KSMBD_EVENT_MAX] = {
+	[KSMBD_EVENT_LOGIN_REQUEST]		= "login",
+	[KSMBD_EVENT_SHARE_CONFIG_REQUEST]	= "share_config",
+	[KSMBD_EVENT_TREE_CONNECT_REQUEST]	= "tree_connect",
+	[KSMBD_EVENT_RPC_REQUEST]		= "rpc",
+	[KSMBD_EVENT_SPNEGO_AUTHEN_REQUEST]	= "spnego_authen",
+	[KSMBD_EVENT_RING_REQUEST]		= "rpc_ring",
+};
+
 static bool ksmbd_ipc_validate_version(struct genl_info *m)
 {
 	if (m->genlhdr->version != KSMBD_GENL_VERSION) {
@@ -53,23 +80,37 @@ static bool ksmbd_ipc_validate_version(struct genl_info *m)
 
 struct ksmbd_ipc_msg {
 	unsigned int		type;
+	/* request id sent as netlink sequence number, 0 if none */
+	u32			seq;
 	unsigned int		sz;
 	unsigned char		payload[];
 };
 
 struct ipc_msg_table_entry {
+	u32			id;
 	unsigned int		handle;
 	unsigned int		type;
 	wait_queue_head_t	wait;
-	struct hlist_node	ipc_table_hlist;
 
 	void			*response;
+
+	/* parked work resumed with the response instead of a waiter */
+	struct ksmbd_work	*work;
+	struct delayed_work	timeout;
+	ktime_t			start;
 };
 
 static struct delayed_work ipc_timer_work;
 
 static int handle_startup_event(struct sk_buff *skb, struct genl_info *info);
+static int handle_worker_register_event(struct sk_buff *skb,
+					struct genl_info *info);
+static int handle_share_config_push_event(struct sk_buff *skb,
+					 struct genl_info *info);
+static int handle_ring_response_event(struct sk_buff *skb,
+				      struct genl_info *info);
 static int handle_unsupported_event(struct sk_buff *skb, struct genl_info *info);
+static bool ipc_ring_mapped(void);
 static int handle_generic_event(struct sk_buff *skb, struct genl_info *info);
 static int ksmbd_ipc_heartbeat_request(void);
 
@@ -118,6 +159,18 @@ static const struct nla_policy ksmbd_nl_policy[KSMBD_EVENT_MAX] = {
 	},
 	[KSMBD_EVENT_SPNEGO_AUTHEN_RESPONSE] = {
 	},
+	[KSMBD_EVENT_WORKER_REGISTER] = {
+		.len = sizeof(struct ksmbd_worker_register),
+	},
+	[KSMBD_EVENT_SHARE_CONFIG_PUSH] = {
+		.len = sizeof(struct ksmbd_share_config_push),
+	},
+	[KSMBD_EVENT_RING_REQUEST] = {
+		.len = sizeof(struct ksmbd_ring_desc),
+	},
+	[KSMBD_EVENT_RING_RESPONSE] = {
+		.len = sizeof(struct ksmbd_ring_desc),
+	},
 };
 
 static struct genl_ops ksmbd_genl_ops[] = {
@@ -185,6 +238,22 @@ static struct genl_ops ksmbd_genl_ops[] = {
 		.cmd	= KSMBD_EVENT_SPNEGO_AUTHEN_RESPONSE,
 		.doit	= handle_generic_event,
 	},
+	{
+		.cmd	= KSMBD_EVENT_WORKER_REGISTER,
+		.doit	= handle_worker_register_event,
+	},
+	{
+		.cmd	= KSMBD_EVENT_SHARE_CONFIG_PUSH,
+		.doit	= handle_share_config_push_event,
+	},
+	{
+		.cmd	= KSMBD_EVENT_RING_REQUEST,
+		.doit	= handle_unsupported_event,
+	},
+	{
+		.cmd	= KSMBD_EVENT_RING_RESPONSE,
+		.doit	= handle_ring_response_event,
+	},
 };
 
 static struct genl_family ksmbd_genl_family = {
@@ -244,42 +313,86 @@ static void ipc_msg_handle_free(int handle)
 		ksmbd_release_id(&ipc_ida, handle);
 }
 
-static int handle_response(int type, void *payload, size_t sz)
+static void ipc_resume_work(struct ipc_msg_table_entry *entry, void *response);
+
+/*
+ * Find the request @seq answers. A daemon that does not echo the request
+ * id may still send its own non-zero netlink seq, so when that misses,
+ * fall back to the first request still waiting on @handle. Called with
+ * the table locked.
+ */
+static struct ipc_msg_table_entry *ipc_msg_lookup(u32 seq, unsigned int handle)
 {
-	unsigned int handle = *(unsigned int *)payload;
 	struct ipc_msg_table_entry *entry;
-	int ret = 0;
+	unsigned long id;
+
+	if (seq) {
+		entry = xa_load(&ipc_msg_table, seq);
+		if (entry && entry->handle == handle && !entry->response)
+			return entry;
+	}
+
+	xa_for_each(&ipc_msg_table, id, entry) {
+		if (entry->handle == handle && !entry->response)
+			return entry;
+	}
+	return NULL;
+}
+
+/* hand @response, which starts with the request handle, to its waiter
+ * or to the work parked on it
+ */
+static int ipc_deliver_response(int type, u32 seq, void *response)
+{
+	unsigned int handle = *(unsigned int *)response;
+	struct ipc_msg_table_entry *entry;
 
 	ipc_update_last_active();
-	down_read(&ipc_msg_table_lock);
-	hash_for_each_possible(ipc_msg_table, entry, ipc_table_hlist, handle) {
-		if (handle != entry->handle)
-			continue;
 
-		entry->response = NULL;
+	xa_lock(&ipc_msg_table);
+	entry = ipc_msg_lookup(seq, handle);
+	if (entry) {
 		/*
 		 * Response message type value should be equal to
 		 * request message type + 1.
 		 */
-		if (entry->type + 1 != type) {
+		if (entry->type + 1 != type &&
+		    !(entry->type == KSMBD_EVENT_RING_REQUEST &&
+		      type == KSMBD_EVENT_RPC_RESPONSE)) {
 			pr_err("Waiting for IPC type %d, got %d. Ignore.\n",
 			       entry->type + 1, type);
 		}
 
-		entry->response = kvmalloc(sz, GFP_KERNEL | __GFP_ZERO);
-		if (!entry->response) {
-			ret = -ENOMEM;
-			break;
+		if (entry->work) {
+			__xa_erase(&ipc_msg_table, entry->id);
+			xa_unlock(&ipc_msg_table);
+
+			cancel_delayed_work_sync(&entry->timeout);
+			ipc_resume_work(entry, response);
+			return 0;
 		}
 
-		memcpy(entry->response, payload, sz);
+		entry->response = response;
+		response = NULL;
 		wake_up_interruptible(&entry->wait);
-		ret = 0;
-		break;
 	}
-	up_read(&ipc_msg_table_lock);
+	xa_unlock(&ipc_msg_table);
 
-	return ret;
+	kvfree(response);
+	return 0;
+}
+
+static int handle_response(int type, u32 seq, void *payload, size_t sz)
+{
+	void *response;
+
+	/* the waiter may go away any time, so prepare the copy up front */
+	response = kvmalloc(sz, GFP_KERNEL);
+	if (!response)
+		return -ENOMEM;
+	memcpy(response, payload, sz);
+
+	return ipc_deliver_response(type, seq, response);
 }
 
 static int ipc_server_config_on_startup(struct ksmbd_startup_request *req)
@@ -377,6 +490,109 @@ out:
 	return ret;
 }
 
+/* must be called with startup_lock held */
+static void ipc_worker_remove(unsigned int pid)
+{
+	int i;
+
+	for (i = 0; i < ipc_nr_workers; i++) {
+		if (ipc_worker_pids[i] != pid)
+			continue;
+
+		WRITE_ONCE(ipc_worker_pids[i],
+			   ipc_worker_pids[ipc_nr_workers - 1]);
+		WRITE_ONCE(ipc_nr_workers, ipc_nr_workers - 1);
+		pr_info("IPC daemon worker %u is gone\n", pid);
+		break;
+	}
+}
+
+static int handle_worker_register_event(struct sk_buff *skb,
+					struct genl_info *info)
+{
+	unsigned int pid = info->snd_portid;
+	int i, ret = 0;
+
+#ifdef CONFIG_SMB_SERVER_CHECK_CAP_NET_ADMIN
+	if (!netlink_capable(skb, CAP_NET_ADMIN))
+		return -EPERM;
+#endif
+
+	if (!ksmbd_ipc_validate_version(info))
+		return -EINVAL;
+
+	mutex_lock(&startup_lock);
+	if (!ksmbd_tools_pid || pid == ksmbd_tools_pid) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < ipc_nr_workers; i++) {
+		if (ipc_worker_pids[i] == pid)
+			goto out;
+	}
+
+	if (ipc_nr_workers == IPC_MAX_WORKERS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	WRITE_ONCE(ipc_worker_pids[ipc_nr_workers], pid);
+	WRITE_ONCE(ipc_nr_workers, ipc_nr_workers + 1);
+	ksmbd_debug(IPC, "registered IPC daemon worker %u\n", pid);
+out:
+	mutex_unlock(&startup_lock);
+	return ret;
+}
+
+static bool ipc_sender_is_daemon(unsigned int pid)
+{
+	int i;
+
+	if (pid == READ_ONCE(ksmbd_tools_pid))
+		return true;
+
+	for (i = 0; i < READ_ONCE(ipc_nr_workers); i++) {
+		if (READ_ONCE(ipc_worker_pids[i]) == pid)
+			return true;
+	}
+	return false;
+}
+
+static int handle_share_config_push_event(struct sk_buff *skb,
+					 struct genl_info *info)
+{
+	struct ksmbd_share_config_push *push;
+	int sz;
+
+#ifdef CONFIG_SMB_SERVER_CHECK_CAP_NET_ADMIN
+	if (!netlink_capable(skb, CAP_NET_ADMIN))
+		return -EPERM;
+#endif
+
+	if (!ksmbd_ipc_validate_version(info))
+		return -EINVAL;
+
+	if (!info->attrs[KSMBD_EVENT_SHARE_CONFIG_PUSH])
+		return -EINVAL;
+
+	if (!ipc_sender_is_daemon(info->snd_portid))
+		return -EPERM;
+
+	push = nla_data(info->attrs[KSMBD_EVENT_SHARE_CONFIG_PUSH]);
+	sz = nla_len(info->attrs[KSMBD_EVENT_SHARE_CONFIG_PUSH]);
+	if (sz < sizeof(struct ksmbd_share_config_push))
+		return -EINVAL;
+
+	push->share_name[KSMBD_REQ_MAX_SHARE_NAME - 1] = '\0';
+	push->comment[KSMBD_SHARE_PUSH_COMMENT_SZ - 1] = '\0';
+	return ksmbd_share_config_push((char *)push->share_name,
+				       (char *)push->comment, &push->config,
+				       sz - offsetof(struct ksmbd_share_config_push,
+						     config),
+				       push->flags);
+}
+
 static int handle_unsupported_event(struct sk_buff *skb, struct genl_info *info)
 {
 	pr_err("Unknown IPC event: %d, ignore.\n", info->genlhdr->cmd);
@@ -407,23 +623,23 @@ static int handle_generic_event(struct sk_buff *skb, struct genl_info *info)
 
 	payload = nla_data(info->attrs[info->genlhdr->cmd]);
 	sz = nla_len(info->attrs[info->genlhdr->cmd]);
-	return handle_response(type, payload, sz);
+	return handle_response(type, info->snd_seq, payload, sz);
 }
 
-static int ipc_msg_send(struct ksmbd_ipc_msg *msg)
+static int __ipc_msg_send(struct ksmbd_ipc_msg *msg, unsigned int pid)
 {
 	struct genlmsghdr *nlh;
 	struct sk_buff *skb;
 	int ret = -EINVAL;
 
-	if (!ksmbd_tools_pid)
+	if (!pid)
 		return ret;
 
 	skb = genlmsg_new(msg->sz, GFP_KERNEL);
 	if (!skb)
 		return -ENOMEM;
 
-	nlh = genlmsg_put(skb, 0, 0, &ksmbd_genl_family, 0, msg->type);
+	nlh = genlmsg_put(skb, 0, msg->seq, &ksmbd_genl_family, 0, msg->type);
 	if (!nlh)
 		goto out;
 
@@ -434,7 +650,7 @@ static int ipc_msg_send(struct ksmbd_ipc_msg *msg)
 	}
 
 	genlmsg_end(skb, nlh);
-	ret = genlmsg_unicast(&init_net, skb, ksmbd_tools_pid);
+	ret = genlmsg_unicast(&init_net, skb, pid);
 	if (!ret)
 		ipc_update_last_active();
 	return ret;
@@ -444,9 +660,116 @@ out:
 	return ret;
 }
 
-static void *ipc_msg_send_request(struct ksmbd_ipc_msg *msg, unsigned int handle)
+static unsigned int ipc_pick_pid(void)
+{
+	unsigned int nr = READ_ONCE(ipc_nr_workers);
+	unsigned int n;
+
+	if (!nr)
+		return READ_ONCE(ksmbd_tools_pid);
+
+	n = (unsigned int)atomic_inc_return(&ipc_next_worker) % (nr + 1);
+	if (!n)
+		return READ_ONCE(ksmbd_tools_pid);
+	return READ_ONCE(ipc_worker_pids[n - 1]);
+}
+
+/**
+ * ipc_msg_send() - send a message to the user IPC daemon
+ * @msg:	message to send
+ * @pid:	daemon or worker to send to, if zero one is picked and
+ *		returned here
+ *
+ * A worker that cannot be reached anymore is dropped and the message goes
+ * to the daemon instead.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int ipc_msg_send(struct ksmbd_ipc_msg *msg, unsigned int *pid)
+{
+	unsigned int tools_pid;
+	int ret;
+
+	if (!*pid)
+		*pid = ipc_pick_pid();
+
+	ret = __ipc_msg_send(msg, *pid);
+	tools_pid = READ_ONCE(ksmbd_tools_pid);
+	if (ret && *pid != tools_pid) {
+		mutex_lock(&startup_lock);
+		ipc_worker_remove(*pid);
+		mutex_unlock(&startup_lock);
+
+		*pid = tools_pid;
+		ret = __ipc_msg_send(msg, *pid);
+	}
+	return ret;
+}
+
+static void ipc_lat_account(unsigned int type, ktime_t start, bool answered)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket;
+
+	if (type >= KSMBD_EVENT_MAX)
+		return;
+
+	if (!answered) {
+		atomic_inc(&ipc_lat_timeouts[type]);
+		return;
+	}
+
+	bucket = us > 0 ? min(fls64(us), IPC_LAT_BUCKETS - 1) : 0;
+	atomic_inc(&ipc_lat_hist[type][bucket]);
+}
+
+/**
+ * ksmbd_ipc_stats_show() - print daemon workers and IPC latency histograms
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int ksmbd_ipc_stats_show(char *buf, size_t size)
+{
+	int sz, type, i;
+
+	sz = scnprintf(buf, size, "workers %u ring %s\nusecs",
+		       READ_ONCE(ipc_nr_workers),
+		       ipc_ring_mapped() ? "mapped" : "off");
+	for (i = 0; i < IPC_LAT_BUCKETS - 1; i++)
+		sz += scnprintf(buf + sz, size - sz, " <%lu", BIT(i));
+	sz += scnprintf(buf + sz, size - sz, " more timeout\n");
+
+	for (type = 0; type < KSMBD_EVENT_MAX; type++) {
+		if (!ipc_event_names[type])
+			continue;
+
+		sz += scnprintf(buf + sz, size - sz, "%s",
+				ipc_event_names[type]);
+		for (i = 0; i < IPC_LAT_BUCKETS; i++)
+			sz += scnprintf(buf + sz, size - sz, " %d",
+					atomic_read(&ipc_lat_hist[type][i]));
+		sz += scnprintf(buf + sz, size - sz, " %d\n",
+				atomic_read(&ipc_lat_timeouts[type]));
+	}
+	return sz;
+}
+
+/**
+ * __ipc_msg_send_request() - send a request and wait for its response
+ * @msg:	request to send
+ * @handle:	handle of the request, the response carries it back
+ * @pid:	daemon or worker to send to, if zero one is picked and
+ *		returned here
+ *
+ * Return:	response, NULL on error or timeout
+ */
+static void *__ipc_msg_send_request(struct ksmbd_ipc_msg *msg,
+				    unsigned int handle, unsigned int *pid)
 {
 	struct ipc_msg_table_entry entry;
+	ktime_t start;
 	int ret;
 
 	if ((int)handle < 0)
@@ -454,14 +777,16 @@ static void *ipc_msg_send_request(struct ksmbd_ipc_msg *msg, unsigned int handle
 
 	entry.type = msg->type;
 	entry.response = NULL;
+	entry.handle = handle;
 	init_waitqueue_head(&entry.wait);
 
-	down_write(&ipc_msg_table_lock);
-	entry.handle = handle;
-	hash_add(ipc_msg_table, &entry.ipc_table_hlist, entry.handle);
-	up_write(&ipc_msg_table_lock);
+	if (xa_alloc_cyclic(&ipc_msg_table, &entry.id, &entry, xa_limit_32b,
+			    &ipc_msg_next_id, GFP_KERNEL) < 0)
+		return NULL;
+	msg->seq = entry.id;
 
-	ret = ipc_msg_send(msg);
+	start = ktime_get();
+	ret = ipc_msg_send(msg, pid);
 	if (ret)
 		goto out;
 
@@ -469,12 +794,477 @@ static void *ipc_msg_send_request(struct ksmbd_ipc_msg *msg, unsigned int handle
 					       entry.response != NULL,
 					       IPC_WAIT_TIMEOUT);
 out:
-	down_write(&ipc_msg_table_lock);
-	hash_del(&entry.ipc_table_hlist);
-	up_write(&ipc_msg_table_lock);
+	xa_erase(&ipc_msg_table, entry.id);
+	if (!ret || entry.response)
+		ipc_lat_account(msg->type, start, entry.response != NULL);
 	return entry.response;
 }
 
+static void *ipc_msg_send_request(struct ksmbd_ipc_msg *msg, unsigned int handle)
+{
+	unsigned int pid = 0;
+
+	return __ipc_msg_send_request(msg, handle, &pid);
+}
+
+/*
+ * The state of an RPC pipe lives in the worker that opened it, so all the
+ * requests on the pipe go to that worker.
+ */
+static void *ipc_rpc_send_request(struct ksmbd_ipc_msg *msg, unsigned int handle,
+				  unsigned int flags)
+{
+	unsigned int pid = 0;
+	void *entry, *resp;
+
+	entry = xa_load(&ipc_rpc_pipes, handle);
+	if (entry)
+		pid = xa_to_value(entry);
+
+	resp = __ipc_msg_send_request(msg, handle, &pid);
+
+	if (flags & KSMBD_RPC_CLOSE_METHOD)
+		xa_erase(&ipc_rpc_pipes, handle);
+	else if (resp && flags & KSMBD_RPC_OPEN_METHOD)
+		xa_store(&ipc_rpc_pipes, handle, xa_mk_value(pid), GFP_KERNEL);
+	return resp;
+}
+
+/* every request payload starts with its handle, like the responses */
+static unsigned int ipc_msg_handle(struct ksmbd_ipc_msg *msg)
+{
+	return *(unsigned int *)msg->payload;
+}
+
+static void ipc_resume_work(struct ipc_msg_table_entry *entry, void *response)
+{
+	struct ksmbd_work *work = entry->work;
+
+	ipc_lat_account(entry->type, entry->start, response != NULL);
+	ipc_msg_handle_free(entry->handle);
+	kfree(entry);
+
+	work->ipc_resp = response;
+	ksmbd_queue_work(work);
+}
+
+static void ipc_park_timeout(struct work_struct *wk)
+{
+	struct ipc_msg_table_entry *entry =
+		container_of(wk, struct ipc_msg_table_entry, timeout.work);
+
+	/* lost the race against the response */
+	if (xa_cmpxchg(&ipc_msg_table, entry->id, entry, NULL, 0) != entry)
+		return;
+
+	ipc_resume_work(entry, NULL);
+}
+
+/* queue @msg for the daemon, it is sent once the handler has returned */
+static int ipc_msg_park(struct ksmbd_work *work, struct ksmbd_ipc_msg *msg)
+{
+	if ((int)ipc_msg_handle(msg) < 0) {
+		ipc_msg_free(msg);
+		return -EINVAL;
+	}
+
+	work->ipc_msg = msg;
+	work->ipc_type = msg->type;
+	return 0;
+}
+
+/**
+ * ksmbd_ipc_park_work() - send the request a work is parked on
+ * @work:	smb work whose handler queued a request with one of the
+ *		ksmbd_ipc_*_request_async() helpers
+ *
+ * Instead of sleeping on the daemon, the worker sends the request and
+ * returns. Once the response arrives, or IPC_WAIT_TIMEOUT passes without
+ * one, it is left in work->ipc_resp (NULL on error or timeout) and @work is
+ * queued again so the handler can finish the command. The caller must not
+ * touch @work after this call.
+ */
+void ksmbd_ipc_park_work(struct ksmbd_work *work)
+{
+	struct ksmbd_ipc_msg *msg = work->ipc_msg;
+	struct ipc_msg_table_entry *entry;
+	unsigned int pid = 0;
+	int ret;
+
+	work->ipc_msg = NULL;
+
+	entry = kzalloc(sizeof(struct ipc_msg_table_entry), GFP_KERNEL);
+	if (!entry)
+		goto out_resume;
+
+	entry->handle = ipc_msg_handle(msg);
+	entry->type = msg->type;
+	entry->work = work;
+	entry->start = ktime_get();
+	INIT_DELAYED_WORK(&entry->timeout, ipc_park_timeout);
+
+	if (xa_alloc_cyclic(&ipc_msg_table, &entry->id, entry, xa_limit_32b,
+			    &ipc_msg_next_id, GFP_KERNEL) < 0) {
+		kfree(entry);
+		goto out_resume;
+	}
+	msg->seq = entry->id;
+
+	schedule_delayed_work(&entry->timeout, IPC_WAIT_TIMEOUT);
+	ret = ipc_msg_send(msg, &pid);
+	ipc_msg_free(msg);
+	if (ret &&
+	    xa_cmpxchg(&ipc_msg_table, entry->id, entry, NULL, 0) == entry) {
+		cancel_delayed_work_sync(&entry->timeout);
+		ipc_resume_work(entry, NULL);
+	}
+	return;
+
+out_resume:
+	ipc_msg_handle_free(ipc_msg_handle(msg));
+	ipc_msg_free(msg);
+	work->ipc_resp = NULL;
+	ksmbd_queue_work(work);
+}
+
+/*
+ * Shared ring the daemon maps from /dev/ksmbd-ipc. RPC payloads are written
+ * into a slot and answered in place, netlink only carries slot descriptors.
+ * A slot whose waiter timed out stays reserved until the late response
+ * shows up, or, when the daemon never answers in the ring,
+ * IPC_RING_RECLAIM_TIMEOUT later. Every reuse bumps the slot generation,
+ * so a response that comes after that is ignored.
+ */
+#define IPC_RING_RECLAIM_TIMEOUT	(8 * IPC_WAIT_TIMEOUT)
+
+struct ipc_ring {
+	void			*mem;
+	spinlock_t		lock;
+	DECLARE_BITMAP(busy, KSMBD_IPC_RING_SLOTS);
+	DECLARE_BITMAP(answered, KSMBD_IPC_RING_SLOTS);
+	DECLARE_BITMAP(abandoned, KSMBD_IPC_RING_SLOTS);
+	unsigned int		handles[KSMBD_IPC_RING_SLOTS];
+	unsigned int		gens[KSMBD_IPC_RING_SLOTS];
+	unsigned long		abandoned_at[KSMBD_IPC_RING_SLOTS];
+
+	bool			ready;
+	atomic_t		users;
+	wait_queue_head_t	users_wait;
+};
+
+#define IPC_RING_SZ	(KSMBD_IPC_RING_SLOTS * KSMBD_IPC_RING_SLOT_SZ)
+
+static struct ipc_ring *ipc_ring;
+static DEFINE_SPINLOCK(ipc_ring_ref_lock);
+static bool ipc_ring_registered;
+
+static struct ipc_ring *ipc_ring_get(void)
+{
+	struct ipc_ring *ring;
+
+	spin_lock(&ipc_ring_ref_lock);
+	ring = ipc_ring;
+	if (ring && ring->ready)
+		atomic_inc(&ring->users);
+	else
+		ring = NULL;
+	spin_unlock(&ipc_ring_ref_lock);
+	return ring;
+}
+
+static void ipc_ring_put(struct ipc_ring *ring)
+{
+	if (atomic_dec_and_test(&ring->users))
+		wake_up(&ring->users_wait);
+}
+
+static bool ipc_ring_mapped(void)
+{
+	struct ipc_ring *ring = ipc_ring_get();
+
+	if (!ring)
+		return false;
+	ipc_ring_put(ring);
+	return true;
+}
+
+static struct ksmbd_ring_slot *ipc_ring_slot(struct ipc_ring *ring, int slot)
+{
+	return ring->mem + slot * KSMBD_IPC_RING_SLOT_SZ;
+}
+
+/* an abandoned slot the daemon did not answer for too long, or -ENOSPC */
+static int ipc_ring_slot_reclaim(struct ipc_ring *ring)
+{
+	int slot;
+
+	for_each_set_bit(slot, ring->abandoned, KSMBD_IPC_RING_SLOTS) {
+		if (time_after(jiffies, ring->abandoned_at[slot] +
+			       IPC_RING_RECLAIM_TIMEOUT))
+			return slot;
+	}
+	return -ENOSPC;
+}
+
+static int ipc_ring_slot_get(struct ipc_ring *ring, unsigned int handle,
+			     unsigned int *gen)
+{
+	int slot;
+
+	spin_lock(&ring->lock);
+	slot = find_first_zero_bit(ring->busy, KSMBD_IPC_RING_SLOTS);
+	if (slot >= KSMBD_IPC_RING_SLOTS)
+		slot = ipc_ring_slot_reclaim(ring);
+	if (slot >= 0) {
+		__set_bit(slot, ring->busy);
+		__clear_bit(slot, ring->answered);
+		__clear_bit(slot, ring->abandoned);
+		ring->handles[slot] = handle;
+		*gen = ++ring->gens[slot];
+	}
+	spin_unlock(&ring->lock);
+	return slot;
+}
+
+static void ipc_ring_slot_put(struct ipc_ring *ring, int slot, bool done)
+{
+	spin_lock(&ring->lock);
+	if (done || test_bit(slot, ring->answered)) {
+		__clear_bit(slot, ring->busy);
+	} else {
+		__set_bit(slot, ring->abandoned);
+		ring->abandoned_at[slot] = jiffies;
+	}
+	spin_unlock(&ring->lock);
+}
+
+/**
+ * ipc_ring_rpc_request() - send an RPC request through the shared ring
+ * @handle:	RPC handle
+ * @flags:	KSMBD_RPC_* flags of the request
+ * @payload:	request payload
+ * @payload_sz:	size of @payload
+ * @resp:	response, NULL on error or timeout
+ *
+ * Return:	0 if the request went through the ring, -EAGAIN if the ring
+ *		is not mapped, full, or the request does not fit in a slot
+ */
+static int ipc_ring_rpc_request(unsigned int handle, unsigned int flags,
+				void *payload, size_t payload_sz,
+				struct ksmbd_rpc_command **resp)
+{
+	struct ksmbd_rpc_command *req;
+	struct ksmbd_ring_desc *desc;
+	struct ksmbd_ring_slot *s;
+	struct ksmbd_ipc_msg *msg;
+	struct ipc_ring *ring;
+	unsigned int gen;
+	int slot;
+
+	if (sizeof(struct ksmbd_ring_slot) + sizeof(struct ksmbd_rpc_command) +
+	    payload_sz > KSMBD_IPC_RING_SLOT_SZ)
+		return -EAGAIN;
+
+	ring = ipc_ring_get();
+	if (!ring)
+		return -EAGAIN;
+
+	msg = ipc_msg_alloc(sizeof(struct ksmbd_ring_desc));
+	if (!msg)
+		goto out_put;
+
+	slot = ipc_ring_slot_get(ring, handle, &gen);
+	if (slot < 0) {
+		ipc_msg_free(msg);
+		goto out_put;
+	}
+
+	s = ipc_ring_slot(ring, slot);
+	req = (struct ksmbd_rpc_command *)s->data;
+	req->handle = handle;
+	req->flags = flags;
+	req->payload_sz = payload_sz;
+	memcpy(req->payload, payload, payload_sz);
+	s->handle = handle;
+	s->gen = gen;
+	s->size = sizeof(struct ksmbd_rpc_command) + payload_sz;
+
+	msg->type = KSMBD_EVENT_RING_REQUEST;
+	desc = (struct ksmbd_ring_desc *)msg->payload;
+	desc->handle = handle;
+	desc->slot = slot;
+	desc->gen = gen;
+
+	*resp = ipc_rpc_send_request(msg, handle, flags);
+	ipc_ring_slot_put(ring, slot, *resp != NULL);
+	ipc_msg_free(msg);
+	ipc_ring_put(ring);
+	return 0;
+
+out_put:
+	ipc_ring_put(ring);
+	return -EAGAIN;
+}
+
+static int handle_ring_response_event(struct sk_buff *skb,
+				      struct genl_info *info)
+{
+	struct ksmbd_rpc_command *resp;
+	struct ksmbd_ring_desc *desc;
+	struct ksmbd_ring_slot *s;
+	struct ipc_ring *ring;
+	unsigned int size;
+	int ret = -EINVAL;
+
+#ifdef CONFIG_SMB_SERVER_CHECK_CAP_NET_ADMIN
+	if (!netlink_capable(skb, CAP_NET_ADMIN))
+		return -EPERM;
+#endif
+
+	if (!ksmbd_ipc_validate_version(info))
+		return -EINVAL;
+
+	if (!info->attrs[KSMBD_EVENT_RING_RESPONSE])
+		return -EINVAL;
+
+	if (!ipc_sender_is_daemon(info->snd_portid))
+		return -EPERM;
+
+	desc = nla_data(info->attrs[KSMBD_EVENT_RING_RESPONSE]);
+
+	ring = ipc_ring_get();
+	if (!ring)
+		return -EINVAL;
+
+	if (desc->slot >= KSMBD_IPC_RING_SLOTS)
+		goto out;
+
+	spin_lock(&ring->lock);
+	if (!test_bit(desc->slot, ring->busy) ||
+	    test_bit(desc->slot, ring->answered) ||
+	    ring->handles[desc->slot] != desc->handle ||
+	    ring->gens[desc->slot] != desc->gen) {
+		spin_unlock(&ring->lock);
+		goto out;
+	}
+
+	if (test_bit(desc->slot, ring->abandoned)) {
+		/* the waiter gave up, the slot can be reused now */
+		__clear_bit(desc->slot, ring->busy);
+		spin_unlock(&ring->lock);
+		ret = 0;
+		goto out;
+	}
+	__set_bit(desc->slot, ring->answered);
+	spin_unlock(&ring->lock);
+
+	s = ipc_ring_slot(ring, desc->slot);
+	size = READ_ONCE(s->size);
+	if (size < sizeof(struct ksmbd_rpc_command) ||
+	    size > KSMBD_IPC_RING_SLOT_SZ - sizeof(struct ksmbd_ring_slot))
+		goto out;
+
+	resp = kvmalloc(size, GFP_KERNEL);
+	if (!resp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(resp, s->data, size);
+
+	/* the slot is writable by userspace, only trust the copy */
+	resp->handle = desc->handle;
+	resp->payload_sz = size - sizeof(struct ksmbd_rpc_command);
+	ret = ipc_deliver_response(KSMBD_EVENT_RING_RESPONSE, info->snd_seq,
+				   resp);
+out:
+	ipc_ring_put(ring);
+	return ret;
+}
+
+static int ipc_ring_open(struct inode *inode, struct file *filp)
+{
+	struct ipc_ring *ring;
+
+#ifdef CONFIG_SMB_SERVER_CHECK_CAP_NET_ADMIN
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+#endif
+
+	ring = kzalloc(sizeof(struct ipc_ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->mem = vmalloc_user(IPC_RING_SZ);
+	if (!ring->mem) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->users_wait);
+
+	spin_lock(&ipc_ring_ref_lock);
+	if (ipc_ring) {
+		spin_unlock(&ipc_ring_ref_lock);
+		vfree(ring->mem);
+		kfree(ring);
+		return -EBUSY;
+	}
+	ipc_ring = ring;
+	spin_unlock(&ipc_ring_ref_lock);
+
+	filp->private_data = ring;
+	return 0;
+}
+
+static int ipc_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct ipc_ring *ring = filp->private_data;
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != IPC_RING_SZ)
+		return -EINVAL;
+
+	ret = remap_vmalloc_range(vma, ring->mem, 0);
+	if (ret)
+		return ret;
+
+	spin_lock(&ipc_ring_ref_lock);
+	ring->ready = true;
+	spin_unlock(&ipc_ring_ref_lock);
+	ksmbd_debug(IPC, "IPC ring mapped by the daemon\n");
+	return 0;
+}
+
+static int ipc_ring_release(struct inode *inode, struct file *filp)
+{
+	struct ipc_ring *ring = filp->private_data;
+
+	spin_lock(&ipc_ring_ref_lock);
+	ring->ready = false;
+	ipc_ring = NULL;
+	spin_unlock(&ipc_ring_ref_lock);
+
+	/* requests in flight time out at worst */
+	wait_event(ring->users_wait, !atomic_read(&ring->users));
+	vfree(ring->mem);
+	kfree(ring);
+	return 0;
+}
+
+static const struct file_operations ipc_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ipc_ring_open,
+	.mmap		= ipc_ring_mmap,
+	.release	= ipc_ring_release,
+};
+
+static struct miscdevice ipc_ring_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= KSMBD_IPC_RING_DEV,
+	.fops		= &ipc_ring_fops,
+	.mode		= 0600,
+};
+
 static int ksmbd_ipc_heartbeat_request(void)
 {
 	struct ksmbd_ipc_msg *msg;
@@ -485,16 +1275,15 @@ static int ksmbd_ipc_heartbeat_request(void)
 		return -EINVAL;
 
 	msg->type = KSMBD_EVENT_HEARTBEAT_REQUEST;
-	ret = ipc_msg_send(msg);
+	ret = __ipc_msg_send(msg, READ_ONCE(ksmbd_tools_pid));
 	ipc_msg_free(msg);
 	return ret;
 }
 
-struct ksmbd_login_response *ksmbd_ipc_login_request(const char *account)
+static struct ksmbd_ipc_msg *ipc_login_msg(const char *account)
 {
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_login_request *req;
-	struct ksmbd_login_response *resp;
 
 	if (strlen(account) >= KSMBD_REQ_MAX_ACCOUNT_NAME_SZ)
 		return NULL;
@@ -507,18 +1296,42 @@ struct ksmbd_login_response *ksmbd_ipc_login_request(const char *account)
 	req = (struct ksmbd_login_request *)msg->payload;
 	req->handle = ksmbd_acquire_id(&ipc_ida);
 	strscpy(req->account, account, KSMBD_REQ_MAX_ACCOUNT_NAME_SZ);
-	resp = ipc_msg_send_request(msg, req->handle);
-	ipc_msg_handle_free(req->handle);
+	return msg;
+}
+
+struct ksmbd_login_response *ksmbd_ipc_login_request(const char *account)
+{
+	struct ksmbd_ipc_msg *msg;
+	struct ksmbd_login_response *resp;
+	unsigned int handle;
+
+	msg = ipc_login_msg(account);
+	if (!msg)
+		return NULL;
+
+	handle = ipc_msg_handle(msg);
+	resp = ipc_msg_send_request(msg, handle);
+	ipc_msg_handle_free(handle);
 	ipc_msg_free(msg);
 	return resp;
 }
 
-struct ksmbd_spnego_authen_response *
-ksmbd_ipc_spnego_authen_request(const char *spnego_blob, int blob_len)
+int ksmbd_ipc_login_request_async(struct ksmbd_work *work,
+				  const char *account)
+{
+	struct ksmbd_ipc_msg *msg;
+
+	msg = ipc_login_msg(account);
+	if (!msg)
+		return -ENOMEM;
+	return ipc_msg_park(work, msg);
+}
+
+static struct ksmbd_ipc_msg *ipc_spnego_authen_msg(const char *spnego_blob,
+						   int blob_len)
 {
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_spnego_authen_request *req;
-	struct ksmbd_spnego_authen_response *resp;
 
 	msg = ipc_msg_alloc(sizeof(struct ksmbd_spnego_authen_request) +
 			blob_len + 1);
@@ -530,22 +1343,47 @@ ksmbd_ipc_spnego_authen_request(const char *spnego_blob, int blob_len)
 	req->handle = ksmbd_acquire_id(&ipc_ida);
 	req->spnego_blob_len = blob_len;
 	memcpy(req->spnego_blob, spnego_blob, blob_len);
+	return msg;
+}
 
-	resp = ipc_msg_send_request(msg, req->handle);
-	ipc_msg_handle_free(req->handle);
+struct ksmbd_spnego_authen_response *
+ksmbd_ipc_spnego_authen_request(const char *spnego_blob, int blob_len)
+{
+	struct ksmbd_ipc_msg *msg;
+	struct ksmbd_spnego_authen_response *resp;
+	unsigned int handle;
+
+	msg = ipc_spnego_authen_msg(spnego_blob, blob_len);
+	if (!msg)
+		return NULL;
+
+	handle = ipc_msg_handle(msg);
+	resp = ipc_msg_send_request(msg, handle);
+	ipc_msg_handle_free(handle);
 	ipc_msg_free(msg);
 	return resp;
 }
 
-struct ksmbd_tree_connect_response *
-ksmbd_ipc_tree_connect_request(struct ksmbd_session *sess,
-			       struct ksmbd_share_config *share,
-			       struct ksmbd_tree_connect *tree_conn,
-			       struct sockaddr *peer_addr)
+int ksmbd_ipc_spnego_authen_request_async(struct ksmbd_work *work,
+					  const char *spnego_blob,
+					  int blob_len)
+{
+	struct ksmbd_ipc_msg *msg;
+
+	msg = ipc_spnego_authen_msg(spnego_blob, blob_len);
+	if (!msg)
+		return -ENOMEM;
+	return ipc_msg_park(work, msg);
+}
+
+static struct ksmbd_ipc_msg *
+ipc_tree_connect_msg(struct ksmbd_session *sess,
+		     struct ksmbd_share_config *share,
+		     struct ksmbd_tree_connect *tree_conn,
+		     struct sockaddr *peer_addr)
 {
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_tree_connect_request *req;
-	struct ksmbd_tree_connect_response *resp;
 
 	if (strlen(user_name(sess->user)) >= KSMBD_REQ_MAX_ACCOUNT_NAME_SZ)
 		return NULL;
@@ -572,18 +1410,50 @@ ksmbd_ipc_tree_connect_request(struct ksmbd_session *sess,
 		req->flags |= KSMBD_TREE_CONN_FLAG_REQUEST_IPV6;
 	if (test_session_flag(sess, CIFDS_SESSION_FLAG_SMB2))
 		req->flags |= KSMBD_TREE_CONN_FLAG_REQUEST_SMB2;
+	return msg;
+}
 
-	resp = ipc_msg_send_request(msg, req->handle);
-	ipc_msg_handle_free(req->handle);
+struct ksmbd_tree_connect_response *
+ksmbd_ipc_tree_connect_request(struct ksmbd_session *sess,
+			       struct ksmbd_share_config *share,
+			       struct ksmbd_tree_connect *tree_conn,
+			       struct sockaddr *peer_addr)
+{
+	struct ksmbd_ipc_msg *msg;
+	struct ksmbd_tree_connect_response *resp;
+	unsigned int handle;
+
+	msg = ipc_tree_connect_msg(sess, share, tree_conn, peer_addr);
+	if (!msg)
+		return NULL;
+
+	handle = ipc_msg_handle(msg);
+	resp = ipc_msg_send_request(msg, handle);
+	ipc_msg_handle_free(handle);
 	ipc_msg_free(msg);
 	return resp;
 }
 
+int ksmbd_ipc_tree_connect_request_async(struct ksmbd_work *work,
+					 struct ksmbd_session *sess,
+					 struct ksmbd_share_config *share,
+					 struct ksmbd_tree_connect *tree_conn,
+					 struct sockaddr *peer_addr)
+{
+	struct ksmbd_ipc_msg *msg;
+
+	msg = ipc_tree_connect_msg(sess, share, tree_conn, peer_addr);
+	if (!msg)
+		return -ENOMEM;
+	return ipc_msg_park(work, msg);
+}
+
 int ksmbd_ipc_tree_disconnect_request(unsigned long long session_id,
 				      unsigned long long connect_id)
 {
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_tree_disconnect_request *req;
+	unsigned int pid = 0;
 	int ret;
 
 	msg = ipc_msg_alloc(sizeof(struct ksmbd_tree_disconnect_request));
@@ -595,7 +1465,7 @@ int ksmbd_ipc_tree_disconnect_request(unsigned long long session_id,
 	req->session_id = session_id;
 	req->connect_id = connect_id;
 
-	ret = ipc_msg_send(msg);
+	ret = ipc_msg_send(msg, &pid);
 	ipc_msg_free(msg);
 	return ret;
 }
@@ -604,6 +1474,7 @@ int ksmbd_ipc_logout_request(const char *account)
 {
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_logout_request *req;
+	unsigned int pid = 0;
 	int ret;
 
 	if (strlen(account) >= KSMBD_REQ_MAX_ACCOUNT_NAME_SZ)
@@ -617,7 +1488,7 @@ int ksmbd_ipc_logout_request(const char *account)
 	req = (struct ksmbd_logout_request *)msg->payload;
 	strscpy(req->account, account, KSMBD_REQ_MAX_ACCOUNT_NAME_SZ);
 
-	ret = ipc_msg_send(msg);
+	ret = ipc_msg_send(msg, &pid);
 	ipc_msg_free(msg);
 	return ret;
 }
@@ -664,7 +1535,7 @@ struct ksmbd_rpc_command *ksmbd_rpc_open(struct ksmbd_session *sess, int handle)
 	req->flags |= KSMBD_RPC_OPEN_METHOD;
 	req->payload_sz = 0;
 
-	resp = ipc_msg_send_request(msg, req->handle);
+	resp = ipc_rpc_send_request(msg, req->handle, req->flags);
 	ipc_msg_free(msg);
 	return resp;
 }
@@ -686,7 +1557,7 @@ struct ksmbd_rpc_command *ksmbd_rpc_close(struct ksmbd_session *sess, int handle
 	req->flags |= KSMBD_RPC_CLOSE_METHOD;
 	req->payload_sz = 0;
 
-	resp = ipc_msg_send_request(msg, req->handle);
+	resp = ipc_rpc_send_request(msg, req->handle, req->flags);
 	ipc_msg_free(msg);
 	return resp;
 }
@@ -697,6 +1568,22 @@ struct ksmbd_rpc_command *ksmbd_rpc_write(struct ksmbd_session *sess, int handle
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_rpc_command *req;
 	struct ksmbd_rpc_command *resp;
+	struct ksmbd_rpc_pipe *pipe;
+	unsigned int flags;
+
+	pipe = ksmbd_session_rpc_pipe(sess, handle);
+	if (pipe) {
+		resp = ksmbd_rpc_pipe_write(sess, pipe, payload, payload_sz,
+					    false);
+		if (resp)
+			return resp;
+	}
+
+	flags = ksmbd_session_rpc_method(sess, handle);
+	flags |= rpc_context_flags(sess);
+	flags |= KSMBD_RPC_WRITE_METHOD;
+	if (!ipc_ring_rpc_request(handle, flags, payload, payload_sz, &resp))
+		return resp;
 
 	msg = ipc_msg_alloc(sizeof(struct ksmbd_rpc_command) + payload_sz + 1);
 	if (!msg)
@@ -705,13 +1592,11 @@ struct ksmbd_rpc_command *ksmbd_rpc_write(struct ksmbd_session *sess, int handle
 	msg->type = KSMBD_EVENT_RPC_REQUEST;
 	req = (struct ksmbd_rpc_command *)msg->payload;
 	req->handle = handle;
-	req->flags = ksmbd_session_rpc_method(sess, handle);
-	req->flags |= rpc_context_flags(sess);
-	req->flags |= KSMBD_RPC_WRITE_METHOD;
+	req->flags = flags;
 	req->payload_sz = payload_sz;
 	memcpy(req->payload, payload, payload_sz);
 
-	resp = ipc_msg_send_request(msg, req->handle);
+	resp = ipc_rpc_send_request(msg, req->handle, req->flags);
 	ipc_msg_free(msg);
 	return resp;
 }
@@ -721,6 +1606,21 @@ struct ksmbd_rpc_command *ksmbd_rpc_read(struct ksmbd_session *sess, int handle)
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_rpc_command *req;
 	struct ksmbd_rpc_command *resp;
+	struct ksmbd_rpc_pipe *pipe;
+	unsigned int flags;
+
+	pipe = ksmbd_session_rpc_pipe(sess, handle);
+	if (pipe) {
+		resp = ksmbd_rpc_pipe_read(pipe);
+		if (resp)
+			return resp;
+	}
+
+	flags = ksmbd_session_rpc_method(sess, handle);
+	flags |= rpc_context_flags(sess);
+	flags |= KSMBD_RPC_READ_METHOD;
+	if (!ipc_ring_rpc_request(handle, flags, NULL, 0, &resp))
+		goto out;
 
 	msg = ipc_msg_alloc(sizeof(struct ksmbd_rpc_command));
 	if (!msg)
@@ -729,13 +1629,14 @@ struct ksmbd_rpc_command *ksmbd_rpc_read(struct ksmbd_session *sess, int handle)
 	msg->type = KSMBD_EVENT_RPC_REQUEST;
 	req = (struct ksmbd_rpc_command *)msg->payload;
 	req->handle = handle;
-	req->flags = ksmbd_session_rpc_method(sess, handle);
-	req->flags |= rpc_context_flags(sess);
-	req->flags |= KSMBD_RPC_READ_METHOD;
+	req->flags = flags;
 	req->payload_sz = 0;
 
-	resp = ipc_msg_send_request(msg, req->handle);
+	resp = ipc_rpc_send_request(msg, req->handle, req->flags);
 	ipc_msg_free(msg);
+out:
+	if (pipe)
+		ksmbd_rpc_pipe_note_response(pipe, resp);
 	return resp;
 }
 
@@ -745,6 +1646,22 @@ struct ksmbd_rpc_command *ksmbd_rpc_ioctl(struct ksmbd_session *sess, int handle
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_rpc_command *req;
 	struct ksmbd_rpc_command *resp;
+	struct ksmbd_rpc_pipe *pipe;
+	unsigned int flags;
+
+	pipe = ksmbd_session_rpc_pipe(sess, handle);
+	if (pipe) {
+		resp = ksmbd_rpc_pipe_write(sess, pipe, payload, payload_sz,
+					    true);
+		if (resp)
+			return resp;
+	}
+
+	flags = ksmbd_session_rpc_method(sess, handle);
+	flags |= rpc_context_flags(sess);
+	flags |= KSMBD_RPC_IOCTL_METHOD;
+	if (!ipc_ring_rpc_request(handle, flags, payload, payload_sz, &resp))
+		goto out;
 
 	msg = ipc_msg_alloc(sizeof(struct ksmbd_rpc_command) + payload_sz + 1);
 	if (!msg)
@@ -753,14 +1670,15 @@ struct ksmbd_rpc_command *ksmbd_rpc_ioctl(struct ksmbd_session *sess, int handle
 	msg->type = KSMBD_EVENT_RPC_REQUEST;
 	req = (struct ksmbd_rpc_command *)msg->payload;
 	req->handle = handle;
-	req->flags = ksmbd_session_rpc_method(sess, handle);
-	req->flags |= rpc_context_flags(sess);
-	req->flags |= KSMBD_RPC_IOCTL_METHOD;
+	req->flags = flags;
 	req->payload_sz = payload_sz;
 	memcpy(req->payload, payload, payload_sz);
 
-	resp = ipc_msg_send_request(msg, req->handle);
+	resp = ipc_rpc_send_request(msg, req->handle, req->flags);
 	ipc_msg_free(msg);
+out:
+	if (pipe)
+		ksmbd_rpc_pipe_note_response(pipe, resp);
 	return resp;
 }
 
@@ -770,22 +1688,35 @@ struct ksmbd_rpc_command *ksmbd_rpc_rap(struct ksmbd_session *sess, void *payloa
 	struct ksmbd_ipc_msg *msg;
 	struct ksmbd_rpc_command *req;
 	struct ksmbd_rpc_command *resp;
+	unsigned int flags;
+	int handle;
 
-	msg = ipc_msg_alloc(sizeof(struct ksmbd_rpc_command) + payload_sz + 1);
-	if (!msg)
+	handle = ksmbd_acquire_id(&ipc_ida);
+	if (handle < 0)
 		return NULL;
 
+	flags = rpc_context_flags(sess);
+	flags |= KSMBD_RPC_RAP_METHOD;
+	if (!ipc_ring_rpc_request(handle, flags, payload, payload_sz, &resp))
+		goto out;
+
+	msg = ipc_msg_alloc(sizeof(struct ksmbd_rpc_command) + payload_sz + 1);
+	if (!msg) {
+		resp = NULL;
+		goto out;
+	}
+
 	msg->type = KSMBD_EVENT_RPC_REQUEST;
 	req = (struct ksmbd_rpc_command *)msg->payload;
-	req->handle = ksmbd_acquire_id(&ipc_ida);
-	req->flags = rpc_context_flags(sess);
-	req->flags |= KSMBD_RPC_RAP_METHOD;
+	req->handle = handle;
+	req->flags = flags;
 	req->payload_sz = payload_sz;
 	memcpy(req->payload, payload, payload_sz);
 
 	resp = ipc_msg_send_request(msg, req->handle);
-	ipc_msg_handle_free(req->handle);
 	ipc_msg_free(msg);
+out:
+	ipc_msg_handle_free(handle);
 	return resp;
 }
 
@@ -821,6 +1752,9 @@ static int __ipc_heartbeat(void)
 	WRITE_ONCE(server_conf.state, SERVER_STATE_RESETTING);
 	server_conf.ipc_last_active = 0;
 	ksmbd_tools_pid = 0;
+	ipc_nr_workers = 0;
+	/* the pipes died with the daemon workers that served them */
+	xa_destroy(&ipc_rpc_pipes);
 	pr_err("No IPC daemon response for %lus\n", delta / HZ);
 	mutex_unlock(&startup_lock);
 	return -EINVAL;
@@ -846,14 +1780,21 @@ void ksmbd_ipc_release(void)
 {
 	cancel_delayed_work_sync(&ipc_timer_work);
 	genl_unregister_family(&ksmbd_genl_family);
+	if (ipc_ring_registered)
+		misc_deregister(&ipc_ring_dev);
+	xa_destroy(&ipc_rpc_pipes);
 }
 
 void ksmbd_ipc_soft_reset(void)
 {
 	mutex_lock(&startup_lock);
 	ksmbd_tools_pid = 0;
+	ipc_nr_workers = 0;
+	xa_destroy(&ipc_rpc_pipes);
 	cancel_delayed_work_sync(&ipc_timer_work);
 	mutex_unlock(&startup_lock);
+	ksmbd_tree_conn_cache_flush();
+	ksmbd_share_configs_unpin();
 }
 
 int ksmbd_ipc_init(void)
@@ -867,7 +1808,13 @@ int ksmbd_ipc_init(void)
 	if (ret) {
 		pr_err("Failed to register KSMBD netlink interface %d\n", ret);
 		cancel_delayed_work_sync(&ipc_timer_work);
+		return ret;
 	}
 
-	return ret;
+	/* the ring is optional, the daemon falls back to plain netlink */
+	if (misc_register(&ipc_ring_dev))
+		pr_warn("Failed to register the IPC ring device\n");
+	else
+		ipc_ring_registered = true;
+	return 0;
 }
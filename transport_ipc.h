@@ -16,6 +16,7 @@ ksmbd_ipc_login_request(const char *account);
 struct ksmbd_session;
 struct ksmbd_share_config;
 struct ksmbd_tree_connect;
+struct ksmbd_work;
 struct sockaddr;
 
 struct ksmbd_tree_connect_response *
@@ -30,6 +31,19 @@ struct ksmbd_share_config_response *
 ksmbd_ipc_share_config_request(const char *name);
 struct ksmbd_spnego_authen_response *
 ksmbd_ipc_spnego_authen_request(const char *spnego_blob, int blob_len);
+
+int ksmbd_ipc_login_request_async(struct ksmbd_work *work,
+				  const char *account);
+int ksmbd_ipc_spnego_authen_request_async(struct ksmbd_work *work,
+					  const char *spnego_blob,
+					  int blob_len);
+int ksmbd_ipc_tree_connect_request_async(struct ksmbd_work *work,
+					 struct ksmbd_session *sess,
+					 struct ksmbd_share_config *share,
+					 struct ksmbd_tree_connect *tree_conn,
+					 struct sockaddr *peer_addr);
+void ksmbd_ipc_park_work(struct ksmbd_work *work);
+
 int ksmbd_ipc_id_alloc(void);
 void ksmbd_rpc_id_free(int handle);
 struct ksmbd_rpc_command *ksmbd_rpc_open(struct ksmbd_session *sess, int handle);
@@ -41,6 +55,7 @@ struct ksmbd_rpc_command *ksmbd_rpc_ioctl(struct ksmbd_session *sess, int handle
 					  void *payload, size_t payload_sz);
 struct ksmbd_rpc_command *ksmbd_rpc_rap(struct ksmbd_session *sess, void *payload,
 					size_t payload_sz);
+int ksmbd_ipc_stats_show(char *buf, size_t size);
 void ksmbd_ipc_release(void);
 void ksmbd_ipc_soft_reset(void);
 int ksmbd_ipc_init(void);
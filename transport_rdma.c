@@ -61,24 +61,55 @@
  * as defined in [MS-KSMBD] 3.1.1.1
  * Those may change after a SMB_DIRECT negotiation
  */
-/* The local peer's maximum number of credits to grant to the peer */
-static int smb_direct_receive_credit_max = 255;
+struct smb_direct_limits {
+	/* The local peer's maximum number of credits to grant to the peer */
+	int	receive_credit_max;
+	/* The remote peer's credit request of local peer */
+	int	send_credit_target;
+	/* The maximum single message size can be sent to remote peer */
+	int	max_send_size;
+	/*  The maximum single-message size which can be received */
+	int	max_receive_size;
+	/*  The maximum fragmented upper-layer payload receive size supported */
+	int	max_fragmented_recv_size;
+	/*
+	 * The maximum RDMA read/write size of one SMB2 READ/WRITE, which can
+	 * be split over several buffer descriptors by the client
+	 */
+	int	max_read_write_size;
+};
 
-/* The remote peer's credit request of local peer */
-static int smb_direct_send_credit_target = 255;
+static struct smb_direct_limits smb_direct_default_limits = {
+	.receive_credit_max		= 255,
+	.send_credit_target		= 255,
+	.max_send_size			= 8192,
+	.max_receive_size		= 8192,
+	.max_fragmented_recv_size	= 1024 * 1024,
+	.max_read_write_size		= 8 * 1024 * 1024,
+};
 
-/* The maximum single message size can be sent to remote peer */
-static int smb_direct_max_send_size = 8192;
+/* Limits of RDMA devices that differ from the defaults */
+#define SMB_DIRECT_MAX_DEVICE_LIMITS		16
 
-/*  The maximum fragmented upper-layer payload receive size supported */
-static int smb_direct_max_fragmented_recv_size = 1024 * 1024;
+static struct smb_direct_device_limits {
+	char				name[IB_DEVICE_NAME_MAX];
+	struct smb_direct_limits	limits;
+} smb_direct_device_limits[SMB_DIRECT_MAX_DEVICE_LIMITS];
 
-/*  The maximum single-message size which can be received */
-static int smb_direct_max_receive_size = 8192;
+static DEFINE_MUTEX(smb_direct_limits_lock);
 
-static int smb_direct_max_read_write_size = 1024 * 1024;
+/*
+ * The receive credits granted to a peer are adapted between these bounds,
+ * see smb_direct_adapt_credits().
+ */
+#define SMB_DIRECT_MIN_RECV_CREDITS		16
+#define SMB_DIRECT_RECV_CREDIT_STEP		16
+#define SMB_DIRECT_CREDIT_ADAPT_INTERVAL	(HZ / 100)
+/* receives waiting longer than this for the server mean it is saturated */
+#define SMB_DIRECT_RECV_LATENCY_HIGH		(2 * NSEC_PER_MSEC)
 
-static int smb_direct_max_outstanding_rw_ops = 8;
+static LIST_HEAD(smb_direct_transport_list);
+static DEFINE_SPINLOCK(smb_direct_transport_list_lock);
 
 static struct smb_direct_listener {
 	struct rdma_cm_id	*cm_id;
@@ -111,6 +142,10 @@ struct smb_direct_transport {
 	int			max_fragmented_send_size;
 	int			max_fragmented_recv_size;
 	int			max_rdma_rw_size;
+	int			pages_per_rw_credit;
+	int			max_rw_credits;
+	/* cpu of the last receive completion */
+	int			rx_cpu;
 
 	spinlock_t		reassembly_queue_lock;
 	struct list_head	reassembly_queue;
@@ -122,8 +157,12 @@ struct smb_direct_transport {
 	spinlock_t		receive_credit_lock;
 	int			recv_credits;
 	int			count_avail_recvmsg;
+	int			lent_recvmsgs;
 	int			recv_credit_max;
 	int			recv_credit_target;
+	int			recv_credit_ceiling;
+	s64			avg_recv_latency;
+	unsigned long		credit_adapt_time;
 
 	spinlock_t		recvmsg_queue_lock;
 	struct list_head	recvmsg_queue;
@@ -135,15 +174,17 @@ struct smb_direct_transport {
 	atomic_t		send_credits;
 	spinlock_t		lock_new_recv_credits;
 	int			new_recv_credits;
-	atomic_t		rw_avail_ops;
+	atomic_t		rw_credits;
 
 	wait_queue_head_t	wait_send_credits;
-	wait_queue_head_t	wait_rw_avail_ops;
+	wait_queue_head_t	wait_rw_credits;
 
 	mempool_t		*sendmsg_mempool;
 	struct kmem_cache	*sendmsg_cache;
 	mempool_t		*recvmsg_mempool;
 	struct kmem_cache	*recvmsg_cache;
+	mempool_t		*rwmsg_mempool;
+	struct kmem_cache	*rwmsg_cache;
 
 	wait_queue_head_t	wait_send_payload_pending;
 	atomic_t		send_payload_pending;
@@ -155,6 +196,8 @@ struct smb_direct_transport {
 	struct work_struct	disconnect_work;
 
 	bool			negotiation_requested;
+
+	struct list_head	list;
 };
 
 #define KSMBD_TRANS(t) ((struct ksmbd_transport *)&((t)->transport))
@@ -189,14 +232,18 @@ struct smb_direct_recvmsg {
 	int			type;
 	struct ib_sge		sge;
 	struct ib_cqe		cqe;
+	struct ib_recv_wr	wr;
 	bool			first_segment;
+	ktime_t			arrival;
 	u8			packet[];
 };
 
 struct smb_direct_rdma_rw_msg {
 	struct smb_direct_transport	*t;
 	struct ib_cqe		cqe;
-	struct completion	*completion;
+	int			status;
+	struct ksmbd_rdma_req	*req;
+	struct list_head	list;
 	struct rdma_rw_ctx	rw_ctx;
 	struct sg_table		sgt;
 	struct scatterlist	sg_list[0];
@@ -227,13 +274,55 @@ static inline void
 	return (void *)recvmsg->packet;
 }
 
-static inline bool is_receive_credit_post_required(int receive_credits,
+static inline bool is_receive_credit_post_required(struct smb_direct_transport *t,
+						   int receive_credits,
 						   int avail_recvmsg_count)
 {
-	return receive_credits <= (smb_direct_receive_credit_max >> 3) &&
+	return receive_credits <= (t->recv_credit_ceiling >> 2) &&
 		avail_recvmsg_count >= (receive_credits >> 2);
 }
 
+/*
+ * Adapt the number of receive credits granted to the peer to how fast the
+ * server consumes the receives, must be called with receive_credit_lock.
+ * @latency is the time a receive took from its completion until it was
+ * reposted. While the receives queue up in the server, granting more
+ * credits only makes them wait longer, so the ceiling shrinks. While they
+ * are served quickly and the peer runs low on credits, it grows.
+ */
+static void smb_direct_adapt_credits(struct smb_direct_transport *t,
+				     s64 latency)
+{
+	int queue_depth, ceiling = t->recv_credit_ceiling;
+
+	t->avg_recv_latency += (latency - t->avg_recv_latency) / 8;
+
+	if (time_before(jiffies, t->credit_adapt_time +
+			SMB_DIRECT_CREDIT_ADAPT_INTERVAL))
+		return;
+	t->credit_adapt_time = jiffies;
+
+	/* completed receives that were not reposted yet */
+	queue_depth = t->recv_credit_max - t->count_avail_recvmsg -
+		      t->recv_credits;
+
+	if (t->avg_recv_latency > SMB_DIRECT_RECV_LATENCY_HIGH ||
+	    queue_depth > ceiling / 2)
+		ceiling = ceiling * 3 / 4;
+	else if (t->recv_credits <= ceiling / 4)
+		ceiling += SMB_DIRECT_RECV_CREDIT_STEP;
+
+	ceiling = clamp_t(int, ceiling,
+			  min(SMB_DIRECT_MIN_RECV_CREDITS, t->recv_credit_max),
+			  t->recv_credit_max);
+	if (ceiling != t->recv_credit_ceiling)
+		ksmbd_debug(RDMA,
+			    "receive credit ceiling %d -> %d, queue depth %d, latency %lldns\n",
+			    t->recv_credit_ceiling, ceiling, queue_depth,
+			    t->avg_recv_latency);
+	t->recv_credit_ceiling = ceiling;
+}
+
 static struct
 smb_direct_recvmsg *get_free_recvmsg(struct smb_direct_transport *t)
 {
@@ -250,15 +339,20 @@ smb_direct_recvmsg *get_free_recvmsg(struct smb_direct_transport *t)
 	return recvmsg;
 }
 
+static void __put_recvmsg(struct smb_direct_transport *t,
+			  struct smb_direct_recvmsg *recvmsg)
+{
+	spin_lock(&t->recvmsg_queue_lock);
+	list_add(&recvmsg->list, &t->recvmsg_queue);
+	spin_unlock(&t->recvmsg_queue_lock);
+}
+
 static void put_recvmsg(struct smb_direct_transport *t,
 			struct smb_direct_recvmsg *recvmsg)
 {
 	ib_dma_unmap_single(t->cm_id->device, recvmsg->sge.addr,
 			    recvmsg->sge.length, DMA_FROM_DEVICE);
-
-	spin_lock(&t->recvmsg_queue_lock);
-	list_add(&recvmsg->list, &t->recvmsg_queue);
-	spin_unlock(&t->recvmsg_queue_lock);
+	__put_recvmsg(t, recvmsg);
 }
 
 static struct
@@ -356,6 +450,7 @@ static struct smb_direct_transport *alloc_transport(struct rdma_cm_id *cm_id)
 	cm_id->context = t;
 
 	t->status = SMB_DIRECT_CS_NEW;
+	t->rx_cpu = -1;
 	init_waitqueue_head(&t->wait_status);
 
 	spin_lock_init(&t->reassembly_queue_lock);
@@ -364,7 +459,7 @@ static struct smb_direct_transport *alloc_transport(struct rdma_cm_id *cm_id)
 	t->reassembly_queue_length = 0;
 	init_waitqueue_head(&t->wait_reassembly_queue);
 	init_waitqueue_head(&t->wait_send_credits);
-	init_waitqueue_head(&t->wait_rw_avail_ops);
+	init_waitqueue_head(&t->wait_rw_credits);
 
 	spin_lock_init(&t->receive_credit_lock);
 	spin_lock_init(&t->recvmsg_queue_lock);
@@ -391,6 +486,10 @@ static struct smb_direct_transport *alloc_transport(struct rdma_cm_id *cm_id)
 	conn->transport = KSMBD_TRANS(t);
 	KSMBD_TRANS(t)->conn = conn;
 	KSMBD_TRANS(t)->ops = &ksmbd_smb_direct_transport_ops;
+
+	spin_lock(&smb_direct_transport_list_lock);
+	list_add_tail(&t->list, &smb_direct_transport_list);
+	spin_unlock(&smb_direct_transport_list_lock);
 	return t;
 err:
 	kfree(t);
@@ -401,6 +500,10 @@ static void free_transport(struct smb_direct_transport *t)
 {
 	struct smb_direct_recvmsg *recvmsg;
 
+	spin_lock(&smb_direct_transport_list_lock);
+	list_del(&t->list);
+	spin_unlock(&smb_direct_transport_list_lock);
+
 	wake_up_interruptible(&t->wait_send_credits);
 
 	ksmbd_debug(RDMA, "wait for all send posted to IB to finish\n");
@@ -546,6 +649,8 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 
 	ib_dma_sync_single_for_cpu(wc->qp->device, recvmsg->sge.addr,
 				   recvmsg->sge.length, DMA_FROM_DEVICE);
+	recvmsg->arrival = ktime_get();
+	WRITE_ONCE(t->rx_cpu, raw_smp_processor_id());
 
 	switch (recvmsg->type) {
 	case SMB_DIRECT_MSG_NEGOTIATE_REQ:
@@ -596,7 +701,7 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 		if (atomic_read(&t->send_credits) > 0)
 			wake_up_interruptible(&t->wait_send_credits);
 
-		if (is_receive_credit_post_required(receive_credits, avail_recvmsg_count))
+		if (is_receive_credit_post_required(t, receive_credits, avail_recvmsg_count))
 			mod_delayed_work(smb_direct_wq,
 					 &t->post_recv_credits_work, 0);
 		break;
@@ -606,10 +711,9 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 	}
 }
 
-static int smb_direct_post_recv(struct smb_direct_transport *t,
-				struct smb_direct_recvmsg *recvmsg)
+static int smb_direct_map_recvmsg(struct smb_direct_transport *t,
+				  struct smb_direct_recvmsg *recvmsg)
 {
-	struct ib_recv_wr wr;
 	int ret;
 
 	recvmsg->sge.addr = ib_dma_map_single(t->cm_id->device,
@@ -622,12 +726,23 @@ static int smb_direct_post_recv(struct smb_direct_transport *t,
 	recvmsg->sge.lkey = t->pd->local_dma_lkey;
 	recvmsg->cqe.done = recv_done;
 
-	wr.wr_cqe = &recvmsg->cqe;
-	wr.next = NULL;
-	wr.sg_list = &recvmsg->sge;
-	wr.num_sge = 1;
+	recvmsg->wr.wr_cqe = &recvmsg->cqe;
+	recvmsg->wr.next = NULL;
+	recvmsg->wr.sg_list = &recvmsg->sge;
+	recvmsg->wr.num_sge = 1;
+	return 0;
+}
+
+static int smb_direct_post_recv(struct smb_direct_transport *t,
+				struct smb_direct_recvmsg *recvmsg)
+{
+	int ret;
+
+	ret = smb_direct_map_recvmsg(t, recvmsg);
+	if (ret)
+		return ret;
 
-	ret = ib_post_recv(t->qp, &wr, NULL);
+	ret = ib_post_recv(t->qp, &recvmsg->wr, NULL);
 	if (ret) {
 		pr_err("Can't post recv: %d\n", ret);
 		ib_dma_unmap_single(t->cm_id->device,
@@ -646,6 +761,7 @@ static int smb_direct_read(struct ksmbd_transport *t, char *buf,
 	struct smb_direct_data_transfer *data_transfer;
 	int to_copy, to_read, data_read, offset;
 	u32 data_length, remaining_data_length, data_offset;
+	s64 latency = 0;
 	int rc;
 	struct smb_direct_transport *st = smb_trans_direct_transfort(t);
 
@@ -723,6 +839,8 @@ again:
 					spin_unlock_irq(&st->reassembly_queue_lock);
 				}
 				queue_removed++;
+				latency = ktime_to_ns(ktime_sub(ktime_get(),
+								recvmsg->arrival));
 				put_recvmsg(st, recvmsg);
 				offset = 0;
 			} else {
@@ -740,7 +858,9 @@ again:
 
 		spin_lock(&st->receive_credit_lock);
 		st->count_avail_recvmsg += queue_removed;
-		if (is_receive_credit_post_required(st->recv_credits, st->count_avail_recvmsg)) {
+		if (queue_removed)
+			smb_direct_adapt_credits(st, latency);
+		if (is_receive_credit_post_required(st, st->recv_credits, st->count_avail_recvmsg)) {
 			spin_unlock(&st->receive_credit_lock);
 			mod_delayed_work(smb_direct_wq,
 					 &st->post_recv_credits_work, 0);
@@ -767,21 +887,114 @@ read_rfc1002_done:
 	goto again;
 }
 
+/**
+ * smb_direct_read_pdu() - hand a PDU that arrived in a single receive
+ * buffer to the upper layer without copying it
+ * @t:		transport
+ * @size:	PDU size, after its RFC1002 length was read
+ * @ctx:	set to the receive buffer, for smb_direct_release_pdu()
+ *
+ * The receive buffer is not reposted until it is released, so only part
+ * of them may be lent out at a time.
+ *
+ * Return:	the PDU preceded by 4 bytes for the RFC1002 length, or NULL if
+ *		the PDU must be read with smb_direct_read()
+ */
+static char *smb_direct_read_pdu(struct ksmbd_transport *t, unsigned int size,
+				 void **ctx)
+{
+	struct smb_direct_transport *st = smb_trans_direct_transfort(t);
+	struct smb_direct_recvmsg *recvmsg;
+	struct smb_direct_data_transfer *data_transfer;
+	u32 data_offset;
+
+	if (st->status != SMB_DIRECT_CS_CONNECTED ||
+	    st->first_entry_offset || st->reassembly_data_length < size)
+		return NULL;
+
+	/* see smb_direct_read() */
+	virt_rmb();
+	recvmsg = get_first_reassembly(st);
+	if (!recvmsg || recvmsg->first_segment)
+		return NULL;
+
+	data_transfer = smb_direct_recvmsg_payload(recvmsg);
+	data_offset = le32_to_cpu(data_transfer->data_offset);
+	if (le32_to_cpu(data_transfer->remaining_data_length) ||
+	    le32_to_cpu(data_transfer->data_length) != size ||
+	    data_offset < sizeof(struct smb_direct_data_transfer))
+		return NULL;
+
+	spin_lock(&st->receive_credit_lock);
+	if (st->lent_recvmsgs >= st->recv_credit_max / 2) {
+		spin_unlock(&st->receive_credit_lock);
+		return NULL;
+	}
+	st->lent_recvmsgs++;
+	spin_unlock(&st->receive_credit_lock);
+
+	spin_lock_irq(&st->reassembly_queue_lock);
+	list_del(&recvmsg->list);
+	st->reassembly_queue_length--;
+	st->reassembly_data_length -= size;
+	spin_unlock_irq(&st->reassembly_queue_lock);
+
+	ib_dma_unmap_single(st->cm_id->device, recvmsg->sge.addr,
+			    recvmsg->sge.length, DMA_FROM_DEVICE);
+
+	ksmbd_debug(RDMA, "lending receive buffer for PDU of %u bytes\n",
+		    size);
+	*ctx = recvmsg;
+	/* the RFC1002 length goes over the end of the data transfer header */
+	return (char *)data_transfer + data_offset - 4;
+}
+
+/**
+ * smb_direct_release_pdu() - give back a receive buffer lent out by
+ * smb_direct_read_pdu()
+ * @t:		transport
+ * @ctx:	receive buffer
+ */
+static void smb_direct_release_pdu(struct ksmbd_transport *t, void *ctx)
+{
+	struct smb_direct_transport *st = smb_trans_direct_transfort(t);
+	struct smb_direct_recvmsg *recvmsg = ctx;
+	s64 latency = ktime_to_ns(ktime_sub(ktime_get(), recvmsg->arrival));
+
+	__put_recvmsg(st, recvmsg);
+
+	spin_lock(&st->receive_credit_lock);
+	st->lent_recvmsgs--;
+	st->count_avail_recvmsg++;
+	smb_direct_adapt_credits(st, latency);
+	if (is_receive_credit_post_required(st, st->recv_credits, st->count_avail_recvmsg)) {
+		spin_unlock(&st->receive_credit_lock);
+		mod_delayed_work(smb_direct_wq,
+				 &st->post_recv_credits_work, 0);
+	} else {
+		spin_unlock(&st->receive_credit_lock);
+	}
+}
+
 static void smb_direct_post_recv_credits(struct work_struct *work)
 {
 	struct smb_direct_transport *t = container_of(work,
 		struct smb_direct_transport, post_recv_credits_work.work);
 	struct smb_direct_recvmsg *recvmsg;
-	int receive_credits, credits = 0;
+	struct ib_recv_wr *first_wr = NULL, **next_wr = &first_wr;
+	const struct ib_recv_wr *bad_wr;
+	struct ib_recv_wr *wr;
+	int receive_credits, target, credits = 0;
 	int ret;
 	int use_free = 1;
 
 	spin_lock(&t->receive_credit_lock);
 	receive_credits = t->recv_credits;
+	target = min(t->recv_credit_target, t->recv_credit_ceiling);
 	spin_unlock(&t->receive_credit_lock);
 
-	if (receive_credits < t->recv_credit_target) {
-		while (true) {
+	if (receive_credits < target) {
+		while (receive_credits + credits < target) {
 			if (use_free)
 				recvmsg = get_free_recvmsg(t);
 			else
@@ -798,16 +1011,38 @@ static void smb_direct_post_recv_credits(struct work_struct *work)
 			recvmsg->type = SMB_DIRECT_MSG_DATA_TRANSFER;
 			recvmsg->first_segment = false;
 
-			ret = smb_direct_post_recv(t, recvmsg);
+			ret = smb_direct_map_recvmsg(t, recvmsg);
 			if (ret) {
-				pr_err("Can't post recv: %d\n", ret);
-				put_recvmsg(t, recvmsg);
+				pr_err("Can't map recv buffer: %d\n", ret);
+				__put_recvmsg(t, recvmsg);
 				break;
 			}
+
+			/* collect all receives and post them in one chain */
+			*next_wr = &recvmsg->wr;
+			next_wr = &recvmsg->wr.next;
 			credits++;
 		}
 	}
 
+	if (first_wr) {
+		ret = ib_post_recv(t->qp, first_wr, &bad_wr);
+		if (ret) {
+			pr_err("Can't post recv: %d\n", ret);
+			/* the work requests from bad_wr on were not posted */
+			wr = (struct ib_recv_wr *)bad_wr;
+			while (wr) {
+				recvmsg = container_of(wr,
+						       struct smb_direct_recvmsg,
+						       wr);
+				wr = wr->next;
+				put_recvmsg(t, recvmsg);
+				credits--;
+			}
+			smb_direct_disconnect_rdma_connection(t);
+		}
+	}
+
 	spin_lock(&t->receive_credit_lock);
 	t->recv_credits += credits;
 	t->count_avail_recvmsg -= credits;
@@ -951,17 +1186,18 @@ static int smb_direct_flush_send_list(struct smb_direct_transport *t,
 }
 
 static int wait_for_credits(struct smb_direct_transport *t,
-			    wait_queue_head_t *waitq, atomic_t *credits)
+			    wait_queue_head_t *waitq, atomic_t *total_credits,
+			    int needed)
 {
 	int ret;
 
 	do {
-		if (atomic_dec_return(credits) >= 0)
+		if (atomic_sub_return(needed, total_credits) >= 0)
 			return 0;
 
-		atomic_inc(credits);
+		atomic_add(needed, total_credits);
 		ret = wait_event_interruptible(*waitq,
-					       atomic_read(credits) > 0 ||
+					       atomic_read(total_credits) >= needed ||
 						t->status != SMB_DIRECT_CS_CONNECTED);
 
 		if (t->status != SMB_DIRECT_CS_CONNECTED)
@@ -983,7 +1219,28 @@ static int wait_for_send_credits(struct smb_direct_transport *t,
 			return ret;
 	}
 
-	return wait_for_credits(t, &t->wait_send_credits, &t->send_credits);
+	return wait_for_credits(t, &t->wait_send_credits, &t->send_credits, 1);
+}
+
+static int wait_for_rw_credits(struct smb_direct_transport *t, int credits)
+{
+	return wait_for_credits(t, &t->wait_rw_credits, &t->rw_credits, credits);
+}
+
+static int try_rw_credits(struct smb_direct_transport *t, int credits)
+{
+	if (atomic_sub_return(credits, &t->rw_credits) >= 0)
+		return 0;
+
+	/* a waiter may have checked while the credits were taken */
+	atomic_add(credits, &t->rw_credits);
+	wake_up(&t->wait_rw_credits);
+	return -EAGAIN;
+}
+
+static int calc_rw_credits(struct smb_direct_transport *t, int npages)
+{
+	return DIV_ROUND_UP(npages, t->pages_per_rw_credit);
 }
 
 static int smb_direct_create_header(struct smb_direct_transport *t,
@@ -1079,6 +1336,55 @@ static int get_sg_list(void *buf, int size, struct scatterlist *sg_list, int nen
 	return i;
 }
 
+/*
+ * Local memory of an RDMA transfer, either a kernel buffer or an array of
+ * pages whose data starts at @offset into the first page.
+ */
+struct smb_direct_rdma_src {
+	char		*buf;
+	struct page	**pages;
+	unsigned int	offset;
+};
+
+static int smb_direct_src_page_count(struct smb_direct_rdma_src *src,
+				     unsigned int pos, unsigned int len)
+{
+	if (src->buf)
+		return get_buf_page_count(src->buf + pos, len);
+	return DIV_ROUND_UP(offset_in_page(src->offset + pos) + len,
+			    PAGE_SIZE);
+}
+
+static int smb_direct_src_sg_list(struct smb_direct_rdma_src *src,
+				  unsigned int pos, unsigned int len,
+				  struct scatterlist *sg_list, int nentries)
+{
+	struct page **pages;
+	unsigned int offset, size;
+	int i = 0;
+
+	if (src->buf)
+		return get_sg_list(src->buf + pos, len, sg_list, nentries);
+
+	if (nentries < smb_direct_src_page_count(src, pos, len))
+		return -EINVAL;
+
+	pages = &src->pages[(src->offset + pos) >> PAGE_SHIFT];
+	offset = offset_in_page(src->offset + pos);
+	while (len > 0) {
+		size = min_t(unsigned int, PAGE_SIZE - offset, len);
+		if (!sg_list)
+			return -EINVAL;
+		sg_set_page(sg_list, pages[i], size, offset);
+		sg_list = sg_next(sg_list);
+
+		len -= size;
+		offset = 0;
+		i++;
+	}
+	return i;
+}
+
 static int get_mapped_sg_list(struct ib_device *device, void *buf, int size,
 			      struct scatterlist *sg_list, int nentries,
 			      enum dma_data_direction dir)
@@ -1288,128 +1594,373 @@ done:
 	return ret;
 }
 
-static void read_write_done(struct ib_cq *cq, struct ib_wc *wc,
-			    enum dma_data_direction dir)
+/*
+ * One RDMA read/write request. Each buffer segment gets its own
+ * rdma_rw_ctx, and the work requests of all of them are posted as one
+ * chain.
+ */
+struct ksmbd_rdma_req {
+	struct smb_direct_transport	*t;
+	struct list_head		msg_list;
+	struct completion		completion;
+	int				credits;
+	enum dma_data_direction		dir;
+};
+
+struct smb_direct_rdma_seg {
+	u64			remote_offset;
+	u32			token;
+	unsigned int		len;
+};
+
+static void read_write_done(struct ib_cq *cq, struct ib_wc *wc)
 {
 	struct smb_direct_rdma_rw_msg *msg = container_of(wc->wr_cqe,
 							  struct smb_direct_rdma_rw_msg, cqe);
 	struct smb_direct_transport *t = msg->t;
 
 	if (wc->status != IB_WC_SUCCESS) {
+		msg->status = -EIO;
 		pr_err("read/write error. opcode = %d, status = %s(%d)\n",
 		       wc->opcode, ib_wc_status_msg(wc->status), wc->status);
-		smb_direct_disconnect_rdma_connection(t);
+		if (wc->status != IB_WC_WR_FLUSH_ERR)
+			smb_direct_disconnect_rdma_connection(t);
 	}
 
-	if (atomic_inc_return(&t->rw_avail_ops) > 0)
-		wake_up(&t->wait_rw_avail_ops);
-
-	rdma_rw_ctx_destroy(&msg->rw_ctx, t->qp, t->qp->port,
-			    msg->sg_list, msg->sgt.nents, dir);
-	sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
-
-	complete(msg->completion);
-	kfree(msg);
-}
-
-static void read_done(struct ib_cq *cq, struct ib_wc *wc)
-{
-	read_write_done(cq, wc, DMA_FROM_DEVICE);
-}
-
-static void write_done(struct ib_cq *cq, struct ib_wc *wc)
-{
-	read_write_done(cq, wc, DMA_TO_DEVICE);
+	/*
+	 * Work requests of one chain complete in order, so only the last
+	 * message of a chain completes the request.
+	 */
+	if (msg->req)
+		complete(&msg->req->completion);
 }
 
-static int smb_direct_rdma_xmit(struct smb_direct_transport *t, void *buf,
-				int buf_len, u32 remote_key, u64 remote_offset,
-				u32 remote_len, bool is_read)
+static struct smb_direct_rdma_rw_msg *
+smb_direct_alloc_rw_msg(struct smb_direct_transport *t,
+			struct smb_direct_rdma_src *src, unsigned int pos,
+			struct smb_direct_rdma_seg *seg,
+			enum dma_data_direction dir)
 {
 	struct smb_direct_rdma_rw_msg *msg;
+	int npages = smb_direct_src_page_count(src, pos, seg->len);
 	int ret;
-	DECLARE_COMPLETION_ONSTACK(completion);
-	struct ib_send_wr *first_wr = NULL;
 
-	ret = wait_for_credits(t, &t->wait_rw_avail_ops, &t->rw_avail_ops);
-	if (ret < 0)
-		return ret;
+	msg = mempool_alloc(t->rwmsg_mempool, GFP_KERNEL);
+	if (!msg)
+		return ERR_PTR(-ENOMEM);
 
-	/* TODO: mempool */
-	msg = kmalloc(offsetof(struct smb_direct_rdma_rw_msg, sg_list) +
-		      sizeof(struct scatterlist) * SG_CHUNK_SIZE, GFP_KERNEL);
-	if (!msg) {
-		atomic_inc(&t->rw_avail_ops);
-		return -ENOMEM;
-	}
+	msg->t = t;
+	msg->status = 0;
+	msg->req = NULL;
+	msg->cqe.done = read_write_done;
+	INIT_LIST_HEAD(&msg->list);
 
 	msg->sgt.sgl = &msg->sg_list[0];
-	ret = sg_alloc_table_chained(&msg->sgt,
-				     get_buf_page_count(buf, buf_len),
-				     msg->sg_list, SG_CHUNK_SIZE);
+	ret = sg_alloc_table_chained(&msg->sgt, npages, msg->sg_list,
+				     SG_CHUNK_SIZE);
 	if (ret) {
-		atomic_inc(&t->rw_avail_ops);
-		kfree(msg);
-		return -ENOMEM;
+		mempool_free(msg, t->rwmsg_mempool);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	ret = get_sg_list(buf, buf_len, msg->sgt.sgl, msg->sgt.orig_nents);
+	ret = smb_direct_src_sg_list(src, pos, seg->len, msg->sgt.sgl,
+				     msg->sgt.orig_nents);
 	if (ret <= 0) {
 		pr_err("failed to get pages\n");
+		ret = -EINVAL;
 		goto err;
 	}
 
 	ret = rdma_rw_ctx_init(&msg->rw_ctx, t->qp, t->qp->port,
-			       msg->sg_list, get_buf_page_count(buf, buf_len),
-			       0, remote_offset, remote_key,
-			       is_read ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+			       msg->sgt.sgl, npages, 0, seg->remote_offset, seg->token, dir);
 	if (ret < 0) {
 		pr_err("failed to init rdma_rw_ctx: %d\n", ret);
 		goto err;
 	}
+	return msg;
 
-	msg->t = t;
-	msg->cqe.done = is_read ? read_done : write_done;
-	msg->completion = &completion;
-	first_wr = rdma_rw_ctx_wrs(&msg->rw_ctx, t->qp, t->qp->port,
-				   &msg->cqe, NULL);
+err:
+	sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
+	mempool_free(msg, t->rwmsg_mempool);
+	return ERR_PTR(ret);
+}
+
+static void smb_direct_free_rw_msg(struct smb_direct_transport *t,
+				   struct smb_direct_rdma_rw_msg *msg,
+				   enum dma_data_direction dir)
+{
+	rdma_rw_ctx_destroy(&msg->rw_ctx, t->qp, t->qp->port,
+			    msg->sgt.sgl, msg->sgt.nents, dir);
+	sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
+	mempool_free(msg, t->rwmsg_mempool);
+}
+
+static void smb_direct_free_rdma_req(struct ksmbd_rdma_req *req)
+{
+	struct smb_direct_transport *t = req->t;
+	struct smb_direct_rdma_rw_msg *msg, *next_msg;
+
+	list_for_each_entry_safe(msg, next_msg, &req->msg_list, list) {
+		list_del(&msg->list);
+		smb_direct_free_rw_msg(t, msg, req->dir);
+	}
+	atomic_add(req->credits, &t->rw_credits);
+	wake_up(&t->wait_rw_credits);
+	kfree(req);
+}
+
+/*
+ * Get the next piece of the client buffers to transfer. *idx and *skip
+ * are the current descriptor and the offset into it.
+ */
+static int smb_direct_next_rdma_seg(struct smb2_buffer_desc_v1 *desc,
+				    unsigned int ndesc, unsigned int *idx,
+				    unsigned int *skip, unsigned int remain,
+				    struct smb_direct_rdma_seg *seg)
+{
+	unsigned int len;
+
+	while (*idx < ndesc) {
+		len = le32_to_cpu(desc[*idx].length);
+		if (!len)
+			return -EINVAL;
+
+		if (*skip >= len) {
+			*skip -= len;
+			(*idx)++;
+			continue;
+		}
+
+		seg->token = le32_to_cpu(desc[*idx].token);
+		seg->remote_offset = le64_to_cpu(desc[*idx].offset) + *skip;
+		seg->len = min_t(unsigned int, len - *skip, remain);
+		*skip += seg->len;
+		return 0;
+	}
+
+	/* the client buffers are too small for the data */
+	return -EINVAL;
+}
+
+static struct ksmbd_rdma_req *
+__smb_direct_rdma_submit(struct smb_direct_transport *t,
+			 struct smb_direct_rdma_src *src, unsigned int buf_len,
+			 struct smb2_buffer_desc_v1 *desc,
+			 unsigned int desc_len, unsigned int desc_off,
+			 bool is_read, bool nowait)
+{
+	unsigned int ndesc = desc_len / sizeof(*desc);
+	struct smb_direct_rdma_rw_msg *msg;
+	struct smb_direct_rdma_seg seg;
+	struct ksmbd_rdma_req *req;
+	struct ib_send_wr *first_wr;
+	unsigned int idx, skip, remain, pos;
+	int credits_needed = 0, nsegs = 0;
+	int ret;
+
+	if (t->status != SMB_DIRECT_CS_CONNECTED)
+		return ERR_PTR(-ENOTCONN);
+
+	if (!buf_len || buf_len > t->max_rdma_rw_size)
+		return ERR_PTR(-EINVAL);
+
+	/* the client buffers may be larger than the data to transfer */
+	idx = 0;
+	skip = desc_off;
+	pos = 0;
+	for (remain = buf_len; remain; remain -= seg.len) {
+		ret = smb_direct_next_rdma_seg(desc, ndesc, &idx, &skip,
+					       remain, &seg);
+		if (ret)
+			return ERR_PTR(ret);
+		credits_needed += calc_rw_credits(t,
+				smb_direct_src_page_count(src, pos, seg.len));
+		pos += seg.len;
+		nsegs++;
+	}
+
+	/* too fragmented to ever fit into the rw credits of the connection */
+	if (credits_needed > t->max_rw_credits)
+		return ERR_PTR(-EINVAL);
+
+	ksmbd_debug(RDMA, "RDMA %s, len %#x, segs %d, needed credits %d\n",
+		    is_read ? "read" : "write", buf_len, nsegs,
+		    credits_needed);
+
+	req = kmalloc(sizeof(struct ksmbd_rdma_req), GFP_KERNEL);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	req->t = t;
+	INIT_LIST_HEAD(&req->msg_list);
+	init_completion(&req->completion);
+	req->credits = 0;
+	req->dir = is_read ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+
+	if (nowait)
+		ret = try_rw_credits(t, credits_needed);
+	else
+		ret = wait_for_rw_credits(t, credits_needed);
+	if (ret < 0) {
+		kfree(req);
+		return ERR_PTR(ret);
+	}
+	req->credits = credits_needed;
+
+	idx = 0;
+	skip = desc_off;
+	pos = 0;
+	for (remain = buf_len; remain; remain -= seg.len) {
+		smb_direct_next_rdma_seg(desc, ndesc, &idx, &skip, remain,
+					 &seg);
+		msg = smb_direct_alloc_rw_msg(t, src, pos, &seg, req->dir);
+		if (IS_ERR(msg)) {
+			ret = PTR_ERR(msg);
+			goto err;
+		}
+		list_add_tail(&msg->list, &req->msg_list);
+		pos += seg.len;
+	}
+
+	msg = list_last_entry(&req->msg_list, struct smb_direct_rdma_rw_msg,
+			      list);
+	msg->req = req;
+
+	/* concatenate the work requests of all rdma_rw_ctxs */
+	first_wr = NULL;
+	list_for_each_entry_reverse(msg, &req->msg_list, list)
+		first_wr = rdma_rw_ctx_wrs(&msg->rw_ctx, t->qp, t->qp->port,
+					   &msg->cqe, first_wr);
 
 	ret = ib_post_send(t->qp, first_wr, NULL);
 	if (ret) {
-		pr_err("failed to post send wr: %d\n", ret);
+		pr_err("failed to post send wr for RDMA R/W: %d\n", ret);
 		goto err;
 	}
-
-	wait_for_completion(&completion);
-	return 0;
+	return req;
 
 err:
-	atomic_inc(&t->rw_avail_ops);
-	if (first_wr)
-		rdma_rw_ctx_destroy(&msg->rw_ctx, t->qp, t->qp->port,
-				    msg->sg_list, msg->sgt.nents,
-				    is_read ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
-	sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
-	kfree(msg);
+	smb_direct_free_rdma_req(req);
+	return ERR_PTR(ret);
+}
+
+/**
+ * smb_direct_rdma_submit() - start transferring a buffer from/to the
+ * client buffers
+ * @kt:		transport
+ * @buf:	local buffer
+ * @buf_len:	length of @buf
+ * @desc:	buffer descriptors of the client
+ * @desc_len:	length of @desc in bytes
+ * @desc_off:	offset into the client buffers @buf is transferred at
+ * @is_read:	RDMA read from the client if true, otherwise RDMA write
+ * @nowait:	fail with -EAGAIN instead of waiting for rw credits, for
+ *		callers which already hold credits of another request
+ *
+ * The request must be finished with smb_direct_rdma_wait(), @buf must
+ * stay valid until then.
+ *
+ * Return:	request on success, otherwise error pointer
+ */
+static struct ksmbd_rdma_req *
+smb_direct_rdma_submit(struct ksmbd_transport *kt, void *buf,
+		       unsigned int buf_len, struct smb2_buffer_desc_v1 *desc,
+		       unsigned int desc_len, unsigned int desc_off,
+		       bool is_read, bool nowait)
+{
+	struct smb_direct_rdma_src src = { .buf = buf };
+
+	return __smb_direct_rdma_submit(smb_trans_direct_transfort(kt), &src,
+					buf_len, desc, desc_len, desc_off,
+					is_read, nowait);
+}
+
+/**
+ * smb_direct_rdma_submit_pages() - start RDMA writing pages to the client
+ * buffers
+ * @kt:		transport
+ * @pages:	local pages, e.g. of the page cache
+ * @offset:	offset of the data into the first page
+ * @len:	length of the data
+ * @desc:	buffer descriptors of the client
+ * @desc_len:	length of @desc in bytes
+ * @desc_off:	offset into the client buffers the data is written at
+ *
+ * The pages are mapped for the device as they are, without a copy. The
+ * request must be finished with smb_direct_rdma_wait(), the caller keeps
+ * a reference on @pages until then.
+ *
+ * Return:	request on success, otherwise error pointer
+ */
+static struct ksmbd_rdma_req *
+smb_direct_rdma_submit_pages(struct ksmbd_transport *kt, struct page **pages,
+			     unsigned int offset, unsigned int len,
+			     struct smb2_buffer_desc_v1 *desc,
+			     unsigned int desc_len, unsigned int desc_off)
+{
+	struct smb_direct_rdma_src src = {
+		.pages = pages,
+		.offset = offset,
+	};
+
+	return __smb_direct_rdma_submit(smb_trans_direct_transfort(kt), &src,
+					len, desc, desc_len, desc_off, false,
+					false);
+}
+
+/**
+ * smb_direct_rdma_wait() - wait for a request from smb_direct_rdma_submit()
+ * to finish and release it
+ * @kt:		transport
+ * @req:	request
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb_direct_rdma_wait(struct ksmbd_transport *kt,
+				struct ksmbd_rdma_req *req)
+{
+	struct smb_direct_rdma_rw_msg *msg;
+	int ret = 0;
+
+	wait_for_completion(&req->completion);
+	list_for_each_entry(msg, &req->msg_list, list) {
+		if (msg->status) {
+			ret = msg->status;
+			break;
+		}
+	}
+	smb_direct_free_rdma_req(req);
 	return ret;
 }
 
+static int smb_direct_rdma_xmit(struct ksmbd_transport *t, void *buf,
+				unsigned int buf_len,
+				struct smb2_buffer_desc_v1 *desc,
+				unsigned int desc_len, bool is_read)
+{
+	struct ksmbd_rdma_req *req;
+
+	req = smb_direct_rdma_submit(t, buf, buf_len, desc, desc_len, 0,
+				     is_read, false);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+	return smb_direct_rdma_wait(t, req);
+}
+
 static int smb_direct_rdma_write(struct ksmbd_transport *t, void *buf,
-				 unsigned int buflen, u32 remote_key,
-				 u64 remote_offset, u32 remote_len)
+				 unsigned int buflen,
+				 struct smb2_buffer_desc_v1 *desc,
+				 unsigned int desc_len)
 {
-	return smb_direct_rdma_xmit(smb_trans_direct_transfort(t), buf, buflen,
-				    remote_key, remote_offset,
-				    remote_len, false);
+	return smb_direct_rdma_xmit(t, buf, buflen, desc, desc_len, false);
 }
 
 static int smb_direct_rdma_read(struct ksmbd_transport *t, void *buf,
-				unsigned int buflen, u32 remote_key,
-				u64 remote_offset, u32 remote_len)
+				unsigned int buflen,
+				struct smb2_buffer_desc_v1 *desc,
+				unsigned int desc_len)
 {
-	return smb_direct_rdma_xmit(smb_trans_direct_transfort(t), buf, buflen,
-				    remote_key, remote_offset,
-				    remote_len, true);
+	return smb_direct_rdma_xmit(t, buf, buflen, desc, desc_len, true);
 }
 
 static void smb_direct_disconnect(struct ksmbd_transport *t)
@@ -1630,16 +2181,48 @@ out:
 	return ret;
 }
 
+static unsigned int smb_direct_get_max_fr_pages(struct smb_direct_transport *t)
+{
+	unsigned int max_fr_pages;
+
+	max_fr_pages = t->cm_id->device->attrs.max_fast_reg_page_list_len;
+	/* without fast registration, rdma_rw posts plain sge lists */
+	if (max_fr_pages < 2)
+		max_fr_pages = 256;
+	return min_t(unsigned int, max_fr_pages, 256);
+}
+
+static void smb_direct_get_limits(struct ib_device *device,
+				  struct smb_direct_limits *limits)
+{
+	int i;
+
+	mutex_lock(&smb_direct_limits_lock);
+	*limits = smb_direct_default_limits;
+	for (i = 0; i < SMB_DIRECT_MAX_DEVICE_LIMITS; i++) {
+		if (!strcmp(smb_direct_device_limits[i].name,
+			    dev_name(&device->dev))) {
+			*limits = smb_direct_device_limits[i].limits;
+			break;
+		}
+	}
+	mutex_unlock(&smb_direct_limits_lock);
+}
+
 static int smb_direct_init_params(struct smb_direct_transport *t,
 				  struct ib_qp_cap *cap)
 {
 	struct ib_device *device = t->cm_id->device;
-	int max_send_sges, max_pages, max_rw_wrs, max_send_wrs;
+	struct smb_direct_limits limits;
+	int max_send_sges, max_rw_wrs, max_send_wrs;
+	unsigned int max_sge_per_wr, wrs_per_credit;
+
+	smb_direct_get_limits(device, &limits);
 
 	/* need 2 more sge. because a SMB_DIRECT header will be mapped,
 	 * and maybe a send buffer could be not page aligned.
 	 */
-	t->max_send_size = smb_direct_max_send_size;
+	t->max_send_size = limits.max_send_size;
 	max_send_sges = DIV_ROUND_UP(t->max_send_size, PAGE_SIZE) + 2;
 	if (max_send_sges > SMB_DIRECT_MAX_SEND_SGES) {
 		pr_err("max_send_size %d is too large\n", t->max_send_size);
@@ -1647,33 +2230,43 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 	}
 
 	/*
-	 * allow smb_direct_max_outstanding_rw_ops of in-flight RDMA
-	 * read/writes. HCA guarantees at least max_send_sge of sges for
-	 * a RDMA read/write work request, and if memory registration is used,
-	 * we need reg_mr, local_inv wrs for each read/write.
+	 * RDMA read/writes are accounted in rw credits, one credit covers
+	 * the pages of one memory registration. Enough credits are
+	 * granted for one read/write of max_rdma_rw_size, which may span
+	 * several buffer descriptors. HCA guarantees at least max_send_sge
+	 * of sges for a RDMA read/write work request, and if memory
+	 * registration is used, we need reg_mr, local_inv wrs for each
+	 * credit.
 	 */
-	t->max_rdma_rw_size = smb_direct_max_read_write_size;
-	max_pages = DIV_ROUND_UP(t->max_rdma_rw_size, PAGE_SIZE) + 1;
-	max_rw_wrs = DIV_ROUND_UP(max_pages, SMB_DIRECT_MAX_SEND_SGES);
-	max_rw_wrs += rdma_rw_mr_factor(device, t->cm_id->port_num,
-			max_pages) * 2;
-	max_rw_wrs *= smb_direct_max_outstanding_rw_ops;
-
-	max_send_wrs = smb_direct_send_credit_target + max_rw_wrs;
+	t->max_rdma_rw_size = limits.max_read_write_size;
+	t->pages_per_rw_credit = smb_direct_get_max_fr_pages(t);
+	t->max_rw_credits = DIV_ROUND_UP(t->max_rdma_rw_size,
+					 (t->pages_per_rw_credit - 1) *
+					 PAGE_SIZE);
+
+	max_sge_per_wr = min_t(unsigned int, device->attrs.max_send_sge,
+			       device->attrs.max_sge_rd);
+	max_sge_per_wr = max_t(unsigned int, max_sge_per_wr, max_send_sges);
+	wrs_per_credit = max_t(unsigned int, 4,
+			       DIV_ROUND_UP(t->pages_per_rw_credit,
+					    max_sge_per_wr) + 1);
+	max_rw_wrs = t->max_rw_credits * wrs_per_credit;
+
+	max_send_wrs = limits.send_credit_target + max_rw_wrs;
 	if (max_send_wrs > device->attrs.max_cqe ||
 	    max_send_wrs > device->attrs.max_qp_wr) {
-		pr_err("consider lowering send_credit_target = %d, or max_outstanding_rw_ops = %d\n",
-		       smb_direct_send_credit_target,
-		       smb_direct_max_outstanding_rw_ops);
+		pr_err("consider lowering send_credit_target = %d, or max_read_write_size = %d\n",
+		       limits.send_credit_target,
+		       limits.max_read_write_size);
 		pr_err("Possible CQE overrun, device reporting max_cqe %d max_qp_wr %d\n",
 		       device->attrs.max_cqe, device->attrs.max_qp_wr);
 		return -EINVAL;
 	}
 
-	if (smb_direct_receive_credit_max > device->attrs.max_cqe ||
-	    smb_direct_receive_credit_max > device->attrs.max_qp_wr) {
+	if (limits.receive_credit_max > device->attrs.max_cqe ||
+	    limits.receive_credit_max > device->attrs.max_qp_wr) {
 		pr_err("consider lowering receive_credit_max = %d\n",
-		       smb_direct_receive_credit_max);
+		       limits.receive_credit_max);
 		pr_err("Possible CQE overrun, device reporting max_cpe %d max_qp_wr %d\n",
 		       device->attrs.max_cqe, device->attrs.max_qp_wr);
 		return -EINVAL;
@@ -1692,25 +2285,33 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 
 	t->recv_credits = 0;
 	t->count_avail_recvmsg = 0;
+	t->lent_recvmsgs = 0;
 
-	t->recv_credit_max = smb_direct_receive_credit_max;
+	t->recv_credit_max = limits.receive_credit_max;
 	t->recv_credit_target = 10;
+	/* start from a quarter of the credits, and adapt to the load */
+	t->recv_credit_ceiling = max3(t->recv_credit_max / 4,
+				      t->recv_credit_target,
+				      SMB_DIRECT_MIN_RECV_CREDITS);
+	t->recv_credit_ceiling = min(t->recv_credit_ceiling,
+				     t->recv_credit_max);
+	t->avg_recv_latency = 0;
+	t->credit_adapt_time = jiffies;
 	t->new_recv_credits = 0;
 
-	t->send_credit_target = smb_direct_send_credit_target;
+	t->send_credit_target = limits.send_credit_target;
 	atomic_set(&t->send_credits, 0);
-	atomic_set(&t->rw_avail_ops, smb_direct_max_outstanding_rw_ops);
+	atomic_set(&t->rw_credits, t->max_rw_credits);
 
-	t->max_send_size = smb_direct_max_send_size;
-	t->max_recv_size = smb_direct_max_receive_size;
-	t->max_fragmented_recv_size = smb_direct_max_fragmented_recv_size;
+	t->max_recv_size = limits.max_receive_size;
+	t->max_fragmented_recv_size = limits.max_fragmented_recv_size;
 
 	cap->max_send_wr = max_send_wrs;
 	cap->max_recv_wr = t->recv_credit_max;
 	cap->max_send_sge = SMB_DIRECT_MAX_SEND_SGES;
 	cap->max_recv_sge = SMB_DIRECT_MAX_RECV_SGES;
 	cap->max_inline_data = 0;
-	cap->max_rdma_ctxs = 0;
+	cap->max_rdma_ctxs = t->max_rw_credits;
 	return 0;
 }
 
@@ -1723,6 +2324,12 @@ static void smb_direct_destroy_pools(struct smb_direct_transport *t)
 	while ((recvmsg = get_empty_recvmsg(t)))
 		mempool_free(recvmsg, t->recvmsg_mempool);
 
+	mempool_destroy(t->rwmsg_mempool);
+	t->rwmsg_mempool = NULL;
+
+	kmem_cache_destroy(t->rwmsg_cache);
+	t->rwmsg_cache = NULL;
+
 	mempool_destroy(t->recvmsg_mempool);
 	t->recvmsg_mempool = NULL;
 
@@ -1770,6 +2377,23 @@ static int smb_direct_create_pools(struct smb_direct_transport *t)
 	if (!t->recvmsg_mempool)
 		goto err;
 
+	/* every in-flight rw message holds at least one rw credit */
+	snprintf(name, sizeof(name), "smb_direct_rw_%p", t);
+	t->rwmsg_cache = kmem_cache_create(name,
+					   offsetof(struct smb_direct_rdma_rw_msg,
+						    sg_list) +
+					    sizeof(struct scatterlist) *
+					    SG_CHUNK_SIZE,
+					   0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!t->rwmsg_cache)
+		goto err;
+
+	t->rwmsg_mempool = mempool_create(t->max_rw_credits,
+					  mempool_alloc_slab,
+					  mempool_free_slab, t->rwmsg_cache);
+	if (!t->rwmsg_mempool)
+		goto err;
+
 	INIT_LIST_HEAD(&t->recvmsg_queue);
 
 	for (i = 0; i < t->recv_credit_max; i++) {
@@ -1802,7 +2426,8 @@ static int smb_direct_create_qpair(struct smb_direct_transport *t,
 	}
 
 	t->send_cq = ib_alloc_cq(t->cm_id->device, t,
-				 t->send_credit_target, 0, IB_POLL_WORKQUEUE);
+				 cap->max_send_wr + cap->max_rdma_ctxs,
+				 0, IB_POLL_WORKQUEUE);
 	if (IS_ERR(t->send_cq)) {
 		pr_err("Can't create RDMA send CQ\n");
 		ret = PTR_ERR(t->send_cq);
@@ -1811,8 +2436,7 @@ static int smb_direct_create_qpair(struct smb_direct_transport *t,
 	}
 
 	t->recv_cq = ib_alloc_cq(t->cm_id->device, t,
-				 cap->max_send_wr + cap->max_rdma_ctxs,
-				 0, IB_POLL_WORKQUEUE);
+				 cap->max_recv_wr, 0, IB_POLL_WORKQUEUE);
 	if (IS_ERR(t->recv_cq)) {
 		pr_err("Can't create RDMA recv CQ\n");
 		ret = PTR_ERR(t->recv_cq);
@@ -2036,11 +2660,243 @@ int ksmbd_rdma_destroy(void)
 	return 0;
 }
 
+static const struct {
+	const char	*name;
+	size_t		offset;
+	int		min;
+	int		max;
+} smb_direct_limit_keys[] = {
+	{ "receive_credit_max",
+	  offsetof(struct smb_direct_limits, receive_credit_max), 1, 65535 },
+	{ "send_credit_target",
+	  offsetof(struct smb_direct_limits, send_credit_target), 1, 65535 },
+	{ "max_send_size",
+	  offsetof(struct smb_direct_limits, max_send_size), 128, INT_MAX },
+	{ "max_receive_size",
+	  offsetof(struct smb_direct_limits, max_receive_size), 128, INT_MAX },
+	{ "max_fragmented_recv_size",
+	  offsetof(struct smb_direct_limits, max_fragmented_recv_size),
+	  128 * 1024 + 1, INT_MAX },
+	{ "max_read_write_size",
+	  offsetof(struct smb_direct_limits, max_read_write_size),
+	  PAGE_SIZE, INT_MAX },
+};
+
+static int smb_direct_limits_show(const char *name,
+				  struct smb_direct_limits *limits,
+				  char *buf, size_t size)
+{
+	int i, sz;
+
+	sz = scnprintf(buf, size, "%s", name);
+	for (i = 0; i < ARRAY_SIZE(smb_direct_limit_keys); i++)
+		sz += scnprintf(buf + sz, size - sz, " %s=%d",
+				smb_direct_limit_keys[i].name,
+				*(int *)((char *)limits +
+					 smb_direct_limit_keys[i].offset));
+	sz += scnprintf(buf + sz, size - sz, "\n");
+	return sz;
+}
+
+/**
+ * ksmbd_rdma_limits_show() - print the default SMB Direct limits and those
+ * of each configured RDMA device
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int ksmbd_rdma_limits_show(char *buf, size_t size)
+{
+	int i, sz;
+
+	mutex_lock(&smb_direct_limits_lock);
+	sz = smb_direct_limits_show("default", &smb_direct_default_limits,
+				    buf, size);
+	for (i = 0; i < SMB_DIRECT_MAX_DEVICE_LIMITS; i++) {
+		if (!smb_direct_device_limits[i].name[0])
+			continue;
+		sz += smb_direct_limits_show(smb_direct_device_limits[i].name,
+					     &smb_direct_device_limits[i].limits,
+					     buf + sz, size - sz);
+	}
+	mutex_unlock(&smb_direct_limits_lock);
+	return sz;
+}
+
+/**
+ * ksmbd_rdma_limits_store() - set SMB Direct limits of an RDMA device
+ * @buf:	"<device|default> [reset] [<key>=<value> ...]"
+ *
+ * Device limits start as a copy of the defaults, and "reset" drops them.
+ * They apply to connections accepted afterwards, so are meant to be set
+ * before the server is started.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_rdma_limits_store(const char *buf)
+{
+	struct smb_direct_device_limits *entry = NULL, *free_entry = NULL;
+	struct smb_direct_limits limits;
+	char *copy, *p, *name, *tok, *val;
+	bool is_default, reset = false;
+	int i, v, ret = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	p = skip_spaces(copy);
+	name = strsep(&p, " \t\n");
+	if (!*name || strlen(name) >= IB_DEVICE_NAME_MAX) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+	is_default = !strcmp(name, "default");
+
+	mutex_lock(&smb_direct_limits_lock);
+	limits = smb_direct_default_limits;
+	for (i = 0; !is_default && i < SMB_DIRECT_MAX_DEVICE_LIMITS; i++) {
+		if (!strcmp(smb_direct_device_limits[i].name, name)) {
+			entry = &smb_direct_device_limits[i];
+			limits = entry->limits;
+			break;
+		}
+		if (!free_entry && !smb_direct_device_limits[i].name[0])
+			free_entry = &smb_direct_device_limits[i];
+	}
+
+	while ((tok = strsep(&p, " \t\n"))) {
+		if (!*tok)
+			continue;
+		if (!strcmp(tok, "reset")) {
+			reset = true;
+			continue;
+		}
+
+		val = strchr(tok, '=');
+		if (!val) {
+			ret = -EINVAL;
+			goto out_unlock;
+		}
+		*val++ = '\0';
+
+		for (i = 0; i < ARRAY_SIZE(smb_direct_limit_keys); i++)
+			if (!strcmp(tok, smb_direct_limit_keys[i].name))
+				break;
+		if (i == ARRAY_SIZE(smb_direct_limit_keys) ||
+		    kstrtoint(val, 0, &v) ||
+		    v < smb_direct_limit_keys[i].min ||
+		    v > smb_direct_limit_keys[i].max) {
+			pr_err("invalid SMB Direct limit %s=%s\n", tok, val);
+			ret = -EINVAL;
+			goto out_unlock;
+		}
+		*(int *)((char *)&limits + smb_direct_limit_keys[i].offset) = v;
+	}
+
+	if (is_default) {
+		smb_direct_default_limits = limits;
+	} else if (reset) {
+		if (entry)
+			memset(entry, 0, sizeof(*entry));
+	} else {
+		if (!entry)
+			entry = free_entry;
+		if (!entry) {
+			ret = -ENOSPC;
+			goto out_unlock;
+		}
+		strscpy(entry->name, name, sizeof(entry->name));
+		entry->limits = limits;
+	}
+
+out_unlock:
+	mutex_unlock(&smb_direct_limits_lock);
+out_free:
+	kfree(copy);
+	return ret;
+}
+
+/**
+ * ksmbd_rdma_conns_show() - print the credit state of each SMB Direct
+ * connection
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written
+ */
+int ksmbd_rdma_conns_show(char *buf, size_t size)
+{
+	struct smb_direct_transport *t;
+	int recv_credits, ceiling, lent;
+	s64 latency;
+	int sz = 0;
+
+	spin_lock(&smb_direct_transport_list_lock);
+	list_for_each_entry(t, &smb_direct_transport_list, list) {
+		if (t->status != SMB_DIRECT_CS_CONNECTED)
+			continue;
+
+		spin_lock(&t->receive_credit_lock);
+		recv_credits = t->recv_credits;
+		ceiling = t->recv_credit_ceiling;
+		lent = t->lent_recvmsgs;
+		latency = t->avg_recv_latency;
+		spin_unlock(&t->receive_credit_lock);
+
+		sz += scnprintf(buf + sz, size - sz,
+				"%pISpc %s recv_credits %d/%d target %d ceiling %d lent %d latency %lldus send_credits %d/%d rw_credits %d/%d\n",
+				&t->cm_id->route.addr.dst_addr,
+				dev_name(&t->cm_id->device->dev),
+				recv_credits, t->recv_credit_max,
+				READ_ONCE(t->recv_credit_target), ceiling,
+				lent, div_s64(latency, NSEC_PER_USEC),
+				atomic_read(&t->send_credits),
+				t->send_credit_target,
+				atomic_read(&t->rw_credits), t->max_rw_credits);
+	}
+	spin_unlock(&smb_direct_transport_list_lock);
+	return sz;
+}
+
+static int smb_direct_rx_cpu(struct ksmbd_transport *t)
+{
+	return READ_ONCE(smb_trans_direct_transfort(t)->rx_cpu);
+}
+
+/**
+ * ksmbd_rdma_capable_netdev() - check if an RDMA device is bound to a
+ * network device, so SMB Direct can be reached through its addresses
+ * @netdev:	network device
+ *
+ * Return:	true if SMB Direct is listening and @netdev has an RDMA device
+ */
+bool ksmbd_rdma_capable_netdev(struct net_device *netdev)
+{
+	struct ib_device *ibdev;
+
+	if (!smb_direct_listener.cm_id)
+		return false;
+
+	ibdev = ib_device_get_by_netdev(netdev, RDMA_DRIVER_UNKNOWN);
+	if (!ibdev)
+		return false;
+	ib_device_put(ibdev);
+	return true;
+}
+
 static struct ksmbd_transport_ops ksmbd_smb_direct_transport_ops = {
 	.prepare	= smb_direct_prepare,
 	.disconnect	= smb_direct_disconnect,
 	.writev		= smb_direct_writev,
 	.read		= smb_direct_read,
+	.read_pdu	= smb_direct_read_pdu,
+	.release_pdu	= smb_direct_release_pdu,
+	.rx_cpu		= smb_direct_rx_cpu,
 	.rdma_read	= smb_direct_rdma_read,
 	.rdma_write	= smb_direct_rdma_write,
+	.rdma_submit	= smb_direct_rdma_submit,
+	.rdma_submit_pages	= smb_direct_rdma_submit_pages,
+	.rdma_wait	= smb_direct_rdma_wait,
 };
@@ -9,6 +9,8 @@
 
 #define SMB_DIRECT_PORT	5445
 
+struct net_device;
+
 /* SMB DIRECT negotiation request packet [MS-KSMBD] 2.2.1 */
 struct smb_direct_negotiate_req {
 	__le16 min_version;
@@ -53,9 +55,20 @@ struct smb_direct_data_transfer {
 #ifdef CONFIG_SMB_SERVER_SMBDIRECT
 int ksmbd_rdma_init(void);
 int ksmbd_rdma_destroy(void);
+int ksmbd_rdma_limits_show(char *buf, size_t size);
+int ksmbd_rdma_limits_store(const char *buf);
+int ksmbd_rdma_conns_show(char *buf, size_t size);
+bool ksmbd_rdma_capable_netdev(struct net_device *netdev);
 #else
 static inline int ksmbd_rdma_init(void) { return 0; }
 static inline int ksmbd_rdma_destroy(void) { return 0; }
+static inline int ksmbd_rdma_limits_show(char *buf, size_t size) { return 0; }
+static inline int ksmbd_rdma_limits_store(const char *buf) { return -EOPNOTSUPP; }
+static inline int ksmbd_rdma_conns_show(char *buf, size_t size) { return 0; }
+static inline bool ksmbd_rdma_capable_netdev(struct net_device *netdev)
+{
+	return false;
+}
 #endif
 
 #endif /* __KSMBD_TRANSPORT_RDMA_H__ */
@@ -28,11 +28,37 @@ static LIST_HEAD(iface_list);
 
 static int bind_additional_ifaces;
 
+/*
+ * Requests are received into a ring of preallocated chunks. PDUs up to
+ * KSMBD_TCP_RX_LEND_MAX are handed to the upper layer in place, larger ones
+ * (big WRITEs) are read into a buffer of their own.
+ */
+#define KSMBD_TCP_RX_CHUNK		(64 * 1024)
+#define KSMBD_TCP_RX_CHUNKS		4
+#define KSMBD_TCP_RX_LEND_MAX		(KSMBD_TCP_RX_CHUNK / 2)
+
+struct tcp_rx_chunk {
+	char				*buf;
+	/* lent PDUs, plus one while the ring receives into this chunk */
+	atomic_t			users;
+};
+
 struct tcp_transport {
 	struct ksmbd_transport		transport;
 	struct socket			*sock;
 	struct kvec			*iov;
 	unsigned int			nr_iov;
+
+	struct tcp_rx_chunk		rx_chunks[KSMBD_TCP_RX_CHUNKS];
+	/* chunk being received into, NULL if the ring is not available */
+	struct tcp_rx_chunk		*rx_cur;
+	/* received bytes not consumed yet are rx_cur->buf[rx_head..rx_tail) */
+	unsigned int			rx_head;
+	unsigned int			rx_tail;
+	wait_queue_head_t		rx_wait;
+	bool				rx_ready;
+	void				(*saved_data_ready)(struct sock *sk);
+	void				(*saved_state_change)(struct sock *sk);
 };
 
 static struct ksmbd_transport_ops ksmbd_tcp_transport_ops;
@@ -97,6 +123,57 @@ static inline void ksmbd_tcp_snd_timeout(struct socket *sock, s64 secs)
 #endif
 }
 
+static void ksmbd_tcp_data_ready(struct sock *sk)
+{
+	struct tcp_transport *t;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	t = sk->sk_user_data;
+	if (t) {
+		WRITE_ONCE(t->rx_ready, true);
+		wake_up_interruptible(&t->rx_wait);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void ksmbd_tcp_state_change(struct sock *sk)
+{
+	struct tcp_transport *t;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	t = sk->sk_user_data;
+	if (t) {
+		t->saved_state_change(sk);
+		WRITE_ONCE(t->rx_ready, true);
+		wake_up_interruptible(&t->rx_wait);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void ksmbd_tcp_set_callbacks(struct tcp_transport *t)
+{
+	struct sock *sk = t->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = t;
+	t->saved_data_ready = sk->sk_data_ready;
+	t->saved_state_change = sk->sk_state_change;
+	sk->sk_data_ready = ksmbd_tcp_data_ready;
+	sk->sk_state_change = ksmbd_tcp_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void ksmbd_tcp_restore_callbacks(struct tcp_transport *t)
+{
+	struct sock *sk = t->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_data_ready = t->saved_data_ready;
+	sk->sk_state_change = t->saved_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
 static struct tcp_transport *alloc_transport(struct socket *client_sk)
 {
 	struct tcp_transport *t;
@@ -106,9 +183,18 @@ static struct tcp_transport *alloc_transport(struct socket *client_sk)
 	if (!t)
 		return NULL;
 	t->sock = client_sk;
+	init_waitqueue_head(&t->rx_wait);
+
+	/* the other chunks are allocated once lent PDUs pin the first one */
+	t->rx_chunks[0].buf = kvmalloc(KSMBD_TCP_RX_CHUNK, GFP_KERNEL);
+	if (t->rx_chunks[0].buf) {
+		atomic_set(&t->rx_chunks[0].users, 1);
+		t->rx_cur = &t->rx_chunks[0];
+	}
 
 	conn = ksmbd_conn_alloc();
 	if (!conn) {
+		kvfree(t->rx_chunks[0].buf);
 		kfree(t);
 		return NULL;
 	}
@@ -116,16 +202,23 @@ static struct tcp_transport *alloc_transport(struct socket *client_sk)
 	conn->transport = KSMBD_TRANS(t);
 	KSMBD_TRANS(t)->conn = conn;
 	KSMBD_TRANS(t)->ops = &ksmbd_tcp_transport_ops;
+	KSMBD_TRANS(t)->coalesce_tx = true;
+	ksmbd_tcp_set_callbacks(t);
 	return t;
 }
 
 static void free_transport(struct tcp_transport *t)
 {
+	int i;
+
+	ksmbd_tcp_restore_callbacks(t);
 	kernel_sock_shutdown(t->sock, SHUT_RDWR);
 	sock_release(t->sock);
 	t->sock = NULL;
 
 	ksmbd_conn_free(KSMBD_TRANS(t)->conn);
+	for (i = 0; i < KSMBD_TCP_RX_CHUNKS; i++)
+		kvfree(t->rx_chunks[i].buf);
 	kfree(t->iov);
 	kfree(t);
 }
@@ -309,13 +402,15 @@ static int ksmbd_tcp_run_kthread(struct interface *iface)
  * @t:		TCP transport instance
  * @iov_orig:	base IO vector
  * @nr_segs:	number of segments in base iov
- * @to_read:	number of bytes to read from socket
+ * @to_read:	number of bytes that fit in iov
+ * @need:	number of bytes to wait for, at most @to_read
  *
  * Return:	on success return number of bytes read from socket,
  *		otherwise return error number
  */
 static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
-			   unsigned int nr_segs, unsigned int to_read)
+			   unsigned int nr_segs, unsigned int to_read,
+			   unsigned int need)
 {
 	int length = 0;
 	int total_read;
@@ -331,7 +426,8 @@ static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
 	ksmbd_msg.msg_control = NULL;
 	ksmbd_msg.msg_controllen = 0;
 
-	for (total_read = 0; to_read; total_read += length, to_read -= length) {
+	for (total_read = 0; total_read < need;
+	     total_read += length, to_read -= length) {
 		try_to_freeze();
 
 		if (!ksmbd_conn_alive(conn)) {
@@ -340,8 +436,9 @@ static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
 		}
 		segs = kvec_array_init(iov, iov_orig, nr_segs, total_read);
 
+		WRITE_ONCE(t->rx_ready, false);
 		length = kernel_recvmsg(t->sock, &ksmbd_msg,
-					iov, segs, to_read, 0);
+					iov, segs, to_read, MSG_DONTWAIT);
 
 		if (length == -EINTR) {
 			total_read = -ESHUTDOWN;
@@ -350,7 +447,10 @@ static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
 			total_read = -EAGAIN;
 			break;
 		} else if (length == -ERESTARTSYS || length == -EAGAIN) {
-			usleep_range(1000, 2000);
+			/* sleep until the socket reports new data */
+			wait_event_interruptible_timeout(t->rx_wait,
+							 READ_ONCE(t->rx_ready),
+							 KSMBD_TCP_RECV_TIMEOUT);
 			length = 0;
 			continue;
 		} else if (length <= 0) {
@@ -361,6 +461,91 @@ static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
 	return total_read;
 }
 
+/**
+ * ksmbd_tcp_rx_room() - make room in the receive ring
+ * @t:		TCP transport instance
+ * @keep:	offset in the current chunk of the first byte to keep
+ * @len:	bytes needed from @keep on
+ *
+ * If the current chunk has no room for @len bytes from @keep on, move the
+ * bytes from @keep to the tail to the start of a chunk that no lent PDU
+ * uses anymore.
+ *
+ * Return:	0 on success, otherwise -ENOBUFS
+ */
+static int ksmbd_tcp_rx_room(struct tcp_transport *t, unsigned int keep,
+			     unsigned int len)
+{
+	struct tcp_rx_chunk *c = t->rx_cur;
+	unsigned int n = t->rx_tail - keep;
+	int i;
+
+	if (keep + len <= KSMBD_TCP_RX_CHUNK)
+		return 0;
+
+	if (atomic_read(&c->users) == 1) {
+		memmove(c->buf, c->buf + keep, n);
+		goto out;
+	}
+
+	for (i = 0, c = NULL; i < KSMBD_TCP_RX_CHUNKS; i++) {
+		if (&t->rx_chunks[i] == t->rx_cur ||
+		    atomic_read(&t->rx_chunks[i].users))
+			continue;
+
+		if (!t->rx_chunks[i].buf) {
+			t->rx_chunks[i].buf = kvmalloc(KSMBD_TCP_RX_CHUNK,
+						       GFP_KERNEL);
+			if (!t->rx_chunks[i].buf)
+				break;
+		}
+		c = &t->rx_chunks[i];
+		break;
+	}
+	if (!c)
+		return -ENOBUFS;
+
+	/* pairs with the barrier in ksmbd_tcp_release_pdu() */
+	smp_mb();
+	memcpy(c->buf, t->rx_cur->buf + keep, n);
+	atomic_set(&c->users, 1);
+	atomic_dec(&t->rx_cur->users);
+	t->rx_cur = c;
+out:
+	t->rx_head -= keep;
+	t->rx_tail = n;
+	return 0;
+}
+
+/**
+ * ksmbd_tcp_rx_fill() - receive into the ring
+ * @t:		TCP transport instance
+ * @need:	bytes that have to be available from rx_head on
+ *
+ * Receives as much as the socket has queued, up to the end of the current
+ * chunk, which must have room for @need bytes from rx_head on.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int ksmbd_tcp_rx_fill(struct tcp_transport *t, unsigned int need)
+{
+	unsigned int avail = t->rx_tail - t->rx_head;
+	struct kvec iov;
+	int ret;
+
+	if (avail >= need)
+		return 0;
+
+	iov.iov_base = t->rx_cur->buf + t->rx_tail;
+	iov.iov_len = KSMBD_TCP_RX_CHUNK - t->rx_tail;
+	ret = ksmbd_tcp_readv(t, &iov, 1, iov.iov_len, need - avail);
+	if (ret < 0)
+		return ret;
+
+	t->rx_tail += ret;
+	return 0;
+}
+
 /**
  * ksmbd_tcp_read() - read data from socket in given buffer
  * @t:		TCP transport instance
@@ -372,12 +557,76 @@ static int ksmbd_tcp_readv(struct tcp_transport *t, struct kvec *iov_orig,
  */
 static int ksmbd_tcp_read(struct ksmbd_transport *t, char *buf, unsigned int to_read)
 {
+	struct tcp_transport *tt = TCP_TRANS(t);
+	unsigned int total = 0, n;
 	struct kvec iov;
+	int ret;
 
-	iov.iov_base = buf;
-	iov.iov_len = to_read;
+	while (tt->rx_cur && total < to_read) {
+		n = min(tt->rx_tail - tt->rx_head, to_read - total);
+		if (n) {
+			memcpy(buf + total, tt->rx_cur->buf + tt->rx_head, n);
+			tt->rx_head += n;
+			total += n;
+			continue;
+		}
+
+		/* large payloads go straight to the caller's buffer */
+		if (to_read - total > KSMBD_TCP_RX_LEND_MAX ||
+		    ksmbd_tcp_rx_room(tt, tt->rx_head, to_read - total))
+			break;
 
-	return ksmbd_tcp_readv(TCP_TRANS(t), &iov, 1, to_read);
+		ret = ksmbd_tcp_rx_fill(tt, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (total == to_read)
+		return total;
+
+	iov.iov_base = buf + total;
+	iov.iov_len = to_read - total;
+	ret = ksmbd_tcp_readv(tt, &iov, 1, iov.iov_len, iov.iov_len);
+	return ret < 0 ? ret : total + ret;
+}
+
+/**
+ * ksmbd_tcp_read_pdu() - lend the next PDU from the receive ring
+ * @t:		TCP transport instance
+ * @size:	PDU size from the RFC1002 header that was just read
+ * @ctx:	set to the chunk holding the PDU
+ *
+ * Return:	buffer holding the RFC1002 header and the PDU, NULL if the PDU
+ *		has to be read into a buffer of its own
+ */
+static char *ksmbd_tcp_read_pdu(struct ksmbd_transport *t, unsigned int size,
+				void **ctx)
+{
+	struct tcp_transport *tt = TCP_TRANS(t);
+	char *buf;
+
+	if (!tt->rx_cur || size > KSMBD_TCP_RX_LEND_MAX || tt->rx_head < 4)
+		return NULL;
+
+	/* keep the header in front of the PDU, the caller writes it there */
+	if (ksmbd_tcp_rx_room(tt, tt->rx_head - 4, size + 4) ||
+	    ksmbd_tcp_rx_fill(tt, size))
+		return NULL;
+
+	buf = tt->rx_cur->buf + tt->rx_head - 4;
+	tt->rx_head += size;
+	atomic_inc(&tt->rx_cur->users);
+	*ctx = tt->rx_cur;
+	return buf;
+}
+
+static void ksmbd_tcp_release_pdu(struct ksmbd_transport *t, void *ctx)
+{
+	struct tcp_rx_chunk *c = ctx;
+
+	/* the PDU must be read before the ring may reuse the chunk */
+	smp_mb__before_atomic();
+	atomic_dec(&c->users);
 }
 
 static int ksmbd_tcp_writev(struct ksmbd_transport *t, struct kvec *iov,
@@ -652,8 +901,16 @@ int ksmbd_tcp_set_interfaces(char *ifc_list, int ifc_list_sz)
 	return 0;
 }
 
+static int ksmbd_tcp_rx_cpu(struct ksmbd_transport *t)
+{
+	return READ_ONCE(TCP_TRANS(t)->sock->sk->sk_incoming_cpu);
+}
+
 static struct ksmbd_transport_ops ksmbd_tcp_transport_ops = {
 	.read		= ksmbd_tcp_read,
+	.read_pdu	= ksmbd_tcp_read_pdu,
+	.release_pdu	= ksmbd_tcp_release_pdu,
+	.rx_cpu		= ksmbd_tcp_rx_cpu,
 	.writev		= ksmbd_tcp_writev,
 	.disconnect	= ksmbd_tcp_disconnect,
 };
@@ -19,6 +19,10 @@
 #include <linux/vmalloc.h>
 #include <linux/crc32c.h>
 #include <linux/sched/xacct.h>
+#include <linux/cred.h>
+#include <linux/pagemap.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
 
 #include "glob.h"
 #include "oplock.h"
@@ -29,6 +33,8 @@
 #include "ndr.h"
 #include "auth.h"
 #include "misc.h"
+#include "dir_cache.h"
+#include "crypto_ctx.h"
 
 #include "smb_common.h"
 #include "mgmt/share_config.h"
@@ -36,6 +42,8 @@
 #include "mgmt/user_session.h"
 #include "mgmt/user_config.h"
 
+static ssize_t ksmbd_vfs_xattr_len(struct dentry *dentry, char *xattr_name);
+
 static char *extract_last_component(char *path)
 {
 	char *p = strrchr(path, '/');
@@ -54,8 +62,7 @@ static void ksmbd_vfs_inherit_owner(struct ksmbd_work *work,
 				    struct inode *parent_inode,
 				    struct inode *inode)
 {
-	if (!test_share_config_flag(work->tcon->share_conf,
-				    KSMBD_SHARE_FLAG_INHERIT_OWNER))
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_INHERIT_OWNER))
 		return;
 
 	i_uid_write(inode, i_uid_read(parent_inode));
@@ -202,6 +209,7 @@ int ksmbd_vfs_create(struct ksmbd_work *work, const char *name, umode_t mode)
 	if (!err) {
 		ksmbd_vfs_inherit_owner(work, d_inode(path.dentry),
 					d_inode(dentry));
+		ksmbd_dir_cache_invalidate(d_inode(path.dentry));
 	} else {
 		pr_err("File(%s): creation failed (err:%d)\n", name, err);
 	}
@@ -238,9 +246,11 @@ int ksmbd_vfs_mkdir(struct ksmbd_work *work, const char *name, umode_t mode)
 #else
 	err = vfs_mkdir(d_inode(path.dentry), dentry, mode);
 #endif
-	if (err) {
+	if (err)
 		goto out;
-	} else if (d_unhashed(dentry)) {
+
+	ksmbd_dir_cache_invalidate(d_inode(path.dentry));
+	if (d_unhashed(dentry)) {
 		struct dentry *d;
 
 		d = lookup_one_len(dentry->d_name.name, dentry->d_parent,
@@ -265,64 +275,905 @@ out:
 	return err;
 }
 
-static ssize_t ksmbd_vfs_getcasexattr(struct dentry *dentry, char *attr_name,
-				      int attr_name_len, char **attr_value)
+/*
+ * The DosStream xattrs of an inode are listed once and kept in its
+ * ksmbd_inode, so stream opens, reads and FileStreamInformation queries
+ * don't walk the whole xattr list every time. Stream values are loaded
+ * on first access and kept for reads; writes update the cached value
+ * and store it into the xattr before they complete. An xattr can only
+ * be set as a whole, so every write to an xattr backed stream, however
+ * small, still rewrites the whole value.
+ *
+ * On shares with KSMBD_SHARE_FLAG_STREAM_SIDECAR, a stream growing past
+ * KSMBD_STREAM_SIDECAR_THRESHOLD is moved into a sidecar file below
+ * KSMBD_SHARE_STREAM_DIR and accessed with regular offset based I/O.
+ * Its xattr is kept empty so the stream is still listed. The stream
+ * size is stored in a XATTR_NAME_SIDECAR xattr, which lives in the
+ * trusted namespace so it can never be set through stream data or EAs.
+ */
+#define KSMBD_STREAM_SIDECAR_THRESHOLD	(4 * 1024)
+#define KSMBD_STREAM_SIDECAR_DIGEST_SIZE	32
+
+static void ksmbd_stream_entry_free(struct ksmbd_stream_entry *se)
+{
+	list_del(&se->list);
+	if (se->sidecar)
+		fput(se->sidecar);
+	kvfree(se->data);
+	kfree(se->xattr_name);
+	kfree(se);
+}
+
+void ksmbd_vfs_stream_index_free(struct ksmbd_inode *ci)
+{
+	struct ksmbd_stream_entry *se, *tmp;
+
+	list_for_each_entry_safe(se, tmp, &ci->m_streams, list)
+		ksmbd_stream_entry_free(se);
+	ci->m_streams_loaded = false;
+}
+
+/* closing handles are unlinked from m_fp_list before they get here */
+static bool ksmbd_stream_held(struct ksmbd_inode *ci,
+			      struct ksmbd_stream_entry *se)
+{
+	struct ksmbd_file *lfp;
+	bool held = false;
+
+	read_lock(&ci->m_lock);
+	list_for_each_entry(lfp, &ci->m_fp_list, node) {
+		if (ksmbd_stream_fd(lfp) &&
+		    !strcasecmp(lfp->stream.name, se->xattr_name)) {
+			held = true;
+			break;
+		}
+	}
+	read_unlock(&ci->m_lock);
+	return held;
+}
+
+static void ksmbd_stream_entry_drop_data(struct ksmbd_stream_entry *se)
+{
+	kvfree(se->data);
+	se->data = NULL;
+	se->data_alloc = 0;
+}
+
+/*
+ * Forget the index before it is reloaded. Entries which another handle
+ * still has open are kept, without their cached value, and marked stale
+ * until the reload finds their xattr again.
+ */
+static void ksmbd_stream_index_drop(struct ksmbd_inode *ci)
+{
+	struct ksmbd_stream_entry *se, *tmp;
+
+	list_for_each_entry_safe(se, tmp, &ci->m_streams, list) {
+		if (!ksmbd_stream_held(ci, se)) {
+			ksmbd_stream_entry_free(se);
+			continue;
+		}
+
+		ksmbd_stream_entry_drop_data(se);
+		if (se->sidecar) {
+			fput(se->sidecar);
+			se->sidecar = NULL;
+		}
+		se->stale = true;
+	}
+	ci->m_streams_loaded = false;
+}
+
+static void ksmbd_stream_index_stamp(struct ksmbd_inode *ci)
+{
+	ci->m_streams_ctime = ci->m_inode->i_ctime;
+}
+
+static struct ksmbd_stream_entry *
+ksmbd_stream_index_add(struct ksmbd_inode *ci, const char *xattr_name,
+		       size_t size)
+{
+	struct ksmbd_stream_entry *se;
+
+	se = kzalloc(sizeof(struct ksmbd_stream_entry), GFP_KERNEL);
+	if (!se)
+		return NULL;
+
+	se->xattr_name = kstrdup(xattr_name, GFP_KERNEL);
+	if (!se->xattr_name) {
+		kfree(se);
+		return NULL;
+	}
+	se->size = size;
+	list_add_tail(&se->list, &ci->m_streams);
+	return se;
+}
+
+static struct ksmbd_stream_entry *
+ksmbd_stream_index_find(struct ksmbd_inode *ci, const char *xattr_name)
+{
+	struct ksmbd_stream_entry *se;
+
+	list_for_each_entry(se, &ci->m_streams, list) {
+		if (!strcasecmp(se->xattr_name, xattr_name))
+			return se;
+	}
+	return NULL;
+}
+
+static char *ksmbd_stream_sidecar_xattr(const char *xattr_name)
+{
+	char *name;
+
+	name = kasprintf(GFP_KERNEL, "%s%s", XATTR_NAME_SIDECAR,
+			 xattr_name + XATTR_NAME_STREAM_LEN);
+	if (!name)
+		return ERR_PTR(-ENOMEM);
+
+	if (strlen(name) > XATTR_NAME_MAX) {
+		kfree(name);
+		return ERR_PTR(-ENAMETOOLONG);
+	}
+	return name;
+}
+
+static int ksmbd_stream_sidecar_size(struct dentry *dentry, char *name,
+				     size_t *size)
+{
+	char *buf = NULL;
+	ssize_t len;
+	int err = -EINVAL;
+
+	len = ksmbd_vfs_getxattr(dentry, name, &buf);
+	if (len == sizeof(__le64)) {
+		*size = le64_to_cpu(*(__le64 *)buf);
+		err = 0;
+	}
+	kfree(buf);
+	return err;
+}
+
+static int ksmbd_stream_sidecar_mark(struct dentry *dentry,
+				     struct ksmbd_stream_entry *se)
+{
+	__le64 size = cpu_to_le64(se->size);
+	char *name;
+	int err;
+
+	name = ksmbd_stream_sidecar_xattr(se->xattr_name);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	err = ksmbd_vfs_setxattr(dentry, name, &size, sizeof(size), 0);
+	kfree(name);
+	return err;
+}
+
+static void ksmbd_stream_sidecar_unmark(struct dentry *dentry,
+					struct ksmbd_stream_entry *se)
+{
+	char *name;
+
+	name = ksmbd_stream_sidecar_xattr(se->xattr_name);
+	if (IS_ERR(name))
+		return;
+
+	ksmbd_vfs_remove_xattr(dentry, name);
+	kfree(name);
+}
+
+static int ksmbd_stream_index_load(struct ksmbd_inode *ci,
+				   struct dentry *dentry)
 {
+	struct ksmbd_stream_entry *se;
 	char *name, *xattr_list = NULL;
-	ssize_t value_len = -ENOENT, xattr_list_len;
+	ssize_t xattr_list_len, size;
+	int err = 0;
+
+	if (ci->m_streams_loaded) {
+		/* xattrs changed behind our back, unless we changed them */
+		if (timespec64_equal(&ci->m_inode->i_ctime,
+				     &ci->m_streams_ctime))
+			return 0;
+		ksmbd_stream_index_drop(ci);
+	}
 
 	xattr_list_len = ksmbd_vfs_listxattr(dentry, &xattr_list);
-	if (xattr_list_len <= 0)
-		goto out;
+	if (xattr_list_len < 0)
+		return xattr_list_len;
 
 	for (name = xattr_list; name - xattr_list < xattr_list_len;
 			name += strlen(name) + 1) {
-		ksmbd_debug(VFS, "%s, len %zd\n", name, strlen(name));
-		if (strncasecmp(attr_name, name, attr_name_len))
+		if (strncmp(name, XATTR_NAME_STREAM, XATTR_NAME_STREAM_LEN))
 			continue;
 
-		value_len = ksmbd_vfs_getxattr(dentry,
-					       name,
-					       attr_value);
-		if (value_len < 0)
-			pr_err("failed to get xattr in file\n");
-		break;
+		size = ksmbd_vfs_xattr_len(dentry, name);
+		if (size < 0)
+			continue;
+
+		se = ksmbd_stream_index_find(ci, name);
+		if (se) {
+			se->size = size;
+			se->stale = false;
+		} else {
+			se = ksmbd_stream_index_add(ci, name, size);
+			if (!se) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		se->in_sidecar = false;
 	}
 
-out:
+	/* a sidecar xattr names the stream it belongs to after its prefix */
+	for (name = xattr_list; !err && name - xattr_list < xattr_list_len;
+			name += strlen(name) + 1) {
+		if (strncmp(name, XATTR_NAME_SIDECAR, XATTR_NAME_SIDECAR_LEN))
+			continue;
+
+		list_for_each_entry(se, &ci->m_streams, list) {
+			if (se->stale ||
+			    strcmp(se->xattr_name + XATTR_NAME_STREAM_LEN,
+				   name + XATTR_NAME_SIDECAR_LEN))
+				continue;
+
+			if (!ksmbd_stream_sidecar_size(dentry, name,
+						       &se->size))
+				se->in_sidecar = true;
+			break;
+		}
+	}
 	kvfree(xattr_list);
-	return value_len;
+
+	if (err) {
+		ksmbd_stream_index_drop(ci);
+		return err;
+	}
+
+	ci->m_streams_loaded = true;
+	ksmbd_stream_index_stamp(ci);
+	return 0;
+}
+
+static struct ksmbd_stream_entry *ksmbd_stream_lookup(struct ksmbd_file *fp)
+{
+	struct ksmbd_stream_entry *se;
+	int err;
+
+	err = ksmbd_stream_index_load(fp->f_ci, fp->filp->f_path.dentry);
+	if (err)
+		return ERR_PTR(err);
+
+	se = ksmbd_stream_index_find(fp->f_ci, fp->stream.name);
+	if (!se || se->stale)
+		return ERR_PTR(-ENOENT);
+	return se;
+}
+
+/*
+ * Store the value or, for a sidecar backed stream, the size of @se, so
+ * that a write is persistent once it is acknowledged.
+ */
+static int ksmbd_stream_store(struct ksmbd_inode *ci,
+			      struct ksmbd_stream_entry *se,
+			      struct dentry *dentry)
+{
+	int err;
+
+	if (se->in_sidecar)
+		err = ksmbd_stream_sidecar_mark(dentry, se);
+	else
+		err = ksmbd_vfs_setxattr(dentry, se->xattr_name,
+					 (void *)se->data, se->size, 0);
+	if (!err)
+		ksmbd_stream_index_stamp(ci);
+	return err;
 }
 
-static int ksmbd_vfs_stream_read(struct ksmbd_file *fp, char *buf, loff_t *pos,
-				 size_t count)
+static int ksmbd_stream_load_data(struct ksmbd_stream_entry *se,
+				  struct dentry *dentry)
 {
 	ssize_t v_len;
-	char *stream_buf = NULL;
+	char *buf = NULL;
+
+	if (se->data || !se->size)
+		return 0;
+
+	v_len = ksmbd_vfs_getxattr(dentry, se->xattr_name, &buf);
+	if (v_len < 0)
+		return v_len;
+
+	se->data = buf;
+	se->data_alloc = buf ? v_len + 1 : 0;
+	se->size = v_len;
+	return 0;
+}
+
+static int ksmbd_stream_reserve(struct ksmbd_stream_entry *se, size_t size)
+{
+	size_t new_alloc;
+	char *data;
+
+	if (size <= se->data_alloc)
+		return 0;
+
+	new_alloc = max_t(size_t, se->data_alloc * 2, size);
+	new_alloc = min_t(size_t, new_alloc, XATTR_SIZE_MAX);
+
+	data = kvmalloc(new_alloc, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	if (se->data) {
+		memcpy(data, se->data, se->size);
+		kvfree(se->data);
+	}
+	se->data = data;
+	se->data_alloc = new_alloc;
+	return 0;
+}
+
+static bool ksmbd_stream_sidecar_enabled(struct ksmbd_file *fp)
+{
+	return fp->tcon &&
+		test_share_config_flag(fp->tcon->share_conf,
+				       KSMBD_SHARE_FLAG_STREAM_SIDECAR);
+}
+
+/*
+ * Sidecar files are kept in a directory named after the inode number and
+ * generation of the base file, so they survive renames of the base file,
+ * and are named after a digest of the stream name, so no byte of a client
+ * supplied name ends up in a path. Their directories are private to
+ * root and created with the credentials of the ksmbd worker itself, but
+ * only through lookups relative to the share root which never follow a
+ * symlink. The sidecar files are created, read and written with the
+ * credentials of the session, so they are owned and charged to quota
+ * like the base file data of that user.
+ *
+ * Sidecars are only reclaimed when the base file or stream is removed
+ * through ksmbd. A base file deleted outside ksmbd leaves its per-inode
+ * directory behind until an administrator removes it. Such leftovers
+ * are never read through a new file reusing the inode number and
+ * generation: a sidecar is only opened for a stream whose base file
+ * carries its XATTR_NAME_SIDECAR size, which ksmbd sets only after it
+ * created and truncated that sidecar. Only a copy of a base file which
+ * kept its trusted xattrs could still point at a stale sidecar.
+ */
+static char *ksmbd_stream_sidecar_name(const char *xattr_name)
+{
+	struct ksmbd_crypto_ctx *ctx;
+	u8 digest[KSMBD_STREAM_SIDECAR_DIGEST_SIZE];
+	char *name;
+	int err;
+
+	ctx = ksmbd_crypto_ctx_find_sha256();
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+
+	err = crypto_shash_digest(CRYPTO_SHA256(ctx), xattr_name,
+				  strlen(xattr_name), digest);
+	ksmbd_release_crypto_ctx(ctx);
+	if (err)
+		return ERR_PTR(err);
+
+	name = kasprintf(GFP_KERNEL, "%*phN", (int)sizeof(digest), digest);
+	if (!name)
+		return ERR_PTR(-ENOMEM);
+	return name;
+}
+
+static const struct cred *ksmbd_stream_sidecar_creds(void)
+{
+	/* only the session credentials are overridden, not the real ones */
+	return override_creds(current->real_cred);
+}
+
+/* the session credentials, allowed to reach into the root-only directory */
+static const struct cred *ksmbd_stream_sidecar_file_creds(void)
+{
+	const struct cred *old_cred;
+	struct cred *cred;
+
+	cred = prepare_creds();
+	if (!cred)
+		return NULL;
+
+	cap_raise(cred->cap_effective, CAP_DAC_READ_SEARCH);
+	cap_raise(cred->cap_effective, CAP_DAC_OVERRIDE);
+	old_cred = override_creds(cred);
+	put_cred(cred);
+	return old_cred;
+}
+
+/*
+ * Look up the directory @name below @parent, creating it if @create is
+ * set. A symlink, anything else which is not a directory, or a directory
+ * not private to root is refused: files below it are created and
+ * truncated with root credentials, so nobody else may plant links there.
+ */
+static struct dentry *ksmbd_stream_sidecar_dir(struct dentry *parent,
+					       const char *name, bool create)
+{
+	struct dentry *dentry;
+	int err = 0;
+
+	inode_lock_nested(d_inode(parent), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, strlen(name));
+	if (IS_ERR(dentry))
+		goto out;
+
+	if (d_is_negative(dentry) && create) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		err = vfs_mkdir(&init_user_ns, d_inode(parent), dentry, 0700);
+#else
+		err = vfs_mkdir(d_inode(parent), dentry, 0700);
+#endif
+		if (!err && d_unhashed(dentry)) {
+			dput(dentry);
+			dentry = lookup_one_len(name, parent, strlen(name));
+			if (IS_ERR(dentry))
+				goto out;
+		}
+	}
+
+	if (!err && d_is_negative(dentry))
+		err = -ENOENT;
+	else if (!err && !d_is_dir(dentry))
+		err = -ENOTDIR;
+	else if (!err &&
+		 (!uid_eq(d_inode(dentry)->i_uid, GLOBAL_ROOT_UID) ||
+		  (d_inode(dentry)->i_mode & S_IRWXUGO) != S_IRWXU)) {
+		pr_err("refusing sidecar directory %pd not owned by root with mode 0700\n",
+		       dentry);
+		err = -EPERM;
+	}
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+	}
+out:
+	inode_unlock(d_inode(parent));
+	return dentry;
+}
+
+/* resolve the per-inode sidecar directory of @fp */
+static int ksmbd_stream_sidecar_path(struct ksmbd_file *fp, struct path *path,
+				     bool create)
+{
+	struct inode *inode = file_inode(fp->filp);
+	struct dentry *streams, *dir;
+	struct path root;
+	char name[32];
+	int err;
+
+	err = kern_path(fp->tcon->share_conf->path, LOOKUP_DIRECTORY, &root);
+	if (err)
+		return err;
+
+	streams = ksmbd_stream_sidecar_dir(root.dentry, KSMBD_SHARE_STREAM_DIR,
+					   create);
+	if (IS_ERR(streams)) {
+		err = PTR_ERR(streams);
+		goto out;
+	}
+
+	snprintf(name, sizeof(name), "%lx-%x", inode->i_ino,
+		 inode->i_generation);
+	dir = ksmbd_stream_sidecar_dir(streams, name, create);
+	dput(streams);
+	if (IS_ERR(dir)) {
+		err = PTR_ERR(dir);
+		goto out;
+	}
+
+	path->mnt = mntget(root.mnt);
+	path->dentry = dir;
+out:
+	path_put(&root);
+	return err;
+}
+
+/*
+ * Open the sidecar file of @se, creating (and truncating) it if @create
+ * is set. Called with the stream index lock held and the session
+ * credentials in effect.
+ */
+static int ksmbd_stream_sidecar_open(struct ksmbd_file *fp,
+				     struct ksmbd_stream_entry *se, bool create)
+{
+	const struct cred *old_cred;
+	struct file *filp;
+	struct path dir;
+	char *name;
+	int flags = O_RDWR | O_LARGEFILE | O_NOFOLLOW;
+	int err;
+
+	if (se->sidecar)
+		return 0;
+
+	name = ksmbd_stream_sidecar_name(se->xattr_name);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	if (create)
+		flags |= O_CREAT | O_TRUNC;
+
+	old_cred = ksmbd_stream_sidecar_creds();
+	err = ksmbd_stream_sidecar_path(fp, &dir, create);
+	revert_creds(old_cred);
+	if (err)
+		goto out;
+
+	old_cred = ksmbd_stream_sidecar_file_creds();
+	if (!old_cred) {
+		err = -ENOMEM;
+		path_put(&dir);
+		goto out;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	filp = file_open_root(&dir, name, flags, 0600);
+#else
+	filp = file_open_root(dir.dentry, dir.mnt, name, flags, 0600);
+#endif
+	revert_creds(old_cred);
+	path_put(&dir);
+
+	if (IS_ERR(filp)) {
+		err = PTR_ERR(filp);
+	} else {
+		se->sidecar = filp;
+		if (!create)
+			se->size = i_size_read(file_inode(filp));
+	}
+out:
+	if (err)
+		pr_err("failed to open sidecar of stream %s, err %d\n",
+		       se->xattr_name, err);
+	kfree(name);
+	return err;
+}
+
+/*
+ * Remove the sidecar file and size xattr of @se and, if it was the last
+ * stream of the inode, the per-inode directory. Called with the stream
+ * index lock held.
+ */
+static void ksmbd_stream_sidecar_remove(struct ksmbd_file *fp,
+					struct ksmbd_stream_entry *se)
+{
+	const struct cred *old_cred;
+	struct dentry *dentry, *parent;
+	struct path dir;
+	char *name;
+
+	if (se->sidecar) {
+		fput(se->sidecar);
+		se->sidecar = NULL;
+	}
+	ksmbd_stream_sidecar_unmark(fp->filp->f_path.dentry, se);
+
+	name = ksmbd_stream_sidecar_name(se->xattr_name);
+	if (IS_ERR(name))
+		return;
+
+	old_cred = ksmbd_stream_sidecar_creds();
+	if (!ksmbd_stream_sidecar_path(fp, &dir, false)) {
+		dentry = lookup_one_len_unlocked(name, dir.dentry,
+						 strlen(name));
+		if (!IS_ERR(dentry)) {
+			if (d_is_reg(dentry))
+				ksmbd_vfs_unlink(dir.dentry, dentry);
+			dput(dentry);
+		}
+
+		parent = dget_parent(dir.dentry);
+		ksmbd_vfs_unlink(parent, dir.dentry);
+		dput(parent);
+		path_put(&dir);
+	}
+	revert_creds(old_cred);
+	kfree(name);
+}
+
+/*
+ * Move a stream which outgrew its xattr into a sidecar file. Called with
+ * the stream index lock held.
+ */
+static int ksmbd_stream_sidecar_migrate(struct ksmbd_work *work,
+					struct ksmbd_file *fp,
+					struct ksmbd_stream_entry *se)
+{
+	struct dentry *dentry = fp->filp->f_path.dentry;
+	size_t size;
+	loff_t pos = 0;
+	ssize_t written;
+	char *name;
+	int err;
+
+	name = ksmbd_stream_sidecar_xattr(se->xattr_name);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	kfree(name);
+
+	err = ksmbd_stream_load_data(se, dentry);
+	if (err)
+		return err;
+
+	size = se->size;
+	err = ksmbd_override_fsids(work);
+	if (err)
+		return err;
+
+	err = ksmbd_stream_sidecar_open(fp, se, true);
+	if (!err && size) {
+		written = kernel_write(se->sidecar, se->data, size, &pos);
+		if (written != (ssize_t)size)
+			err = written < 0 ? written : -EIO;
+	}
+	ksmbd_revert_fsids(work);
+	if (err) {
+		if (se->sidecar)
+			goto out_remove;
+		return err;
+	}
+
+	err = ksmbd_stream_sidecar_mark(dentry, se);
+	if (err)
+		goto out_remove;
+
+	/* the value now lives in the sidecar, the empty xattr lists it */
+	err = ksmbd_vfs_setxattr(dentry, se->xattr_name, NULL, 0, 0);
+	if (err)
+		goto out_remove;
+
+	ksmbd_debug(VFS, "moved stream %s (%zu bytes) to sidecar\n",
+		    se->xattr_name, size);
+	ksmbd_stream_entry_drop_data(se);
+	se->in_sidecar = true;
+	ksmbd_stream_index_stamp(fp->f_ci);
+	return 0;
+
+out_remove:
+	ksmbd_stream_sidecar_remove(fp, se);
+	return err;
+}
+
+/**
+ * ksmbd_vfs_stream_index_lock() - lock the stream index of an inode
+ * @fp:		ksmbd file of the inode
+ *
+ * On success the index at fp->f_ci->m_streams is loaded and stays
+ * stable until ksmbd_vfs_stream_index_unlock().
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_vfs_stream_index_lock(struct ksmbd_file *fp)
+{
+	int err;
+
+	mutex_lock(&fp->f_ci->m_stream_lock);
+	err = ksmbd_stream_index_load(fp->f_ci, fp->filp->f_path.dentry);
+	if (err)
+		mutex_unlock(&fp->f_ci->m_stream_lock);
+	return err;
+}
+
+void ksmbd_vfs_stream_index_unlock(struct ksmbd_file *fp)
+{
+	mutex_unlock(&fp->f_ci->m_stream_lock);
+}
+
+/**
+ * ksmbd_vfs_stream_remove_all() - drop the stream index and the sidecar
+ * files of an inode whose streams are about to be removed, e.g. on
+ * overwrite or delete
+ * @fp:		ksmbd file of the inode
+ *
+ * Entries held open by other stream handles stay in the index, marked
+ * stale, so those handles see the stream gone instead of a freed entry.
+ */
+void ksmbd_vfs_stream_remove_all(struct ksmbd_file *fp)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct ksmbd_stream_entry *se;
+
+	mutex_lock(&ci->m_stream_lock);
+	if (ksmbd_stream_sidecar_enabled(fp) &&
+	    !ksmbd_stream_index_load(ci, fp->filp->f_path.dentry)) {
+		list_for_each_entry(se, &ci->m_streams, list) {
+			if (se->in_sidecar && !se->stale)
+				ksmbd_stream_sidecar_remove(fp, se);
+		}
+	}
+	ksmbd_stream_index_drop(ci);
+	mutex_unlock(&ci->m_stream_lock);
+}
+
+/**
+ * ksmbd_vfs_stream_size() - look up the stream opened by @fp
+ * @fp:		ksmbd file of the stream
+ *
+ * Return:	stream size on success, otherwise error
+ */
+ssize_t ksmbd_vfs_stream_size(struct ksmbd_file *fp)
+{
+	struct ksmbd_stream_entry *se;
+	ssize_t size;
+
+	mutex_lock(&fp->f_ci->m_stream_lock);
+	se = ksmbd_stream_lookup(fp);
+	if (IS_ERR(se))
+		size = PTR_ERR(se);
+	else
+		size = se->size;
+	mutex_unlock(&fp->f_ci->m_stream_lock);
+	return size;
+}
+
+/**
+ * ksmbd_vfs_stream_create() - create an empty stream opened by @fp
+ * @fp:		ksmbd file of the stream
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_vfs_stream_create(struct ksmbd_file *fp)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct ksmbd_stream_entry *se;
+	int err;
+
+	mutex_lock(&ci->m_stream_lock);
+	err = ksmbd_vfs_setxattr(fp->filp->f_path.dentry, fp->stream.name,
+				 NULL, 0, 0);
+	if (err < 0)
+		goto out;
+
+	se = ksmbd_stream_index_find(ci, fp->stream.name);
+	if (se && se->stale) {
+		se->size = 0;
+		se->in_sidecar = false;
+		se->stale = false;
+	} else if (!se && ci->m_streams_loaded) {
+		se = ksmbd_stream_index_add(ci, fp->stream.name, 0);
+		if (!se)
+			ksmbd_stream_index_drop(ci);
+	}
+	if (se && ci->m_streams_loaded)
+		ksmbd_stream_index_stamp(ci);
+out:
+	mutex_unlock(&ci->m_stream_lock);
+	return err;
+}
+
+/**
+ * ksmbd_vfs_stream_flush() - write back the sidecar file of the stream
+ * opened by @fp; xattr backed streams are stored by every write already
+ * @fp:		ksmbd file of the stream
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_vfs_stream_flush(struct ksmbd_file *fp)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct ksmbd_stream_entry *se;
+	int err = 0;
+
+	if (!ksmbd_stream_fd(fp))
+		return 0;
+
+	mutex_lock(&ci->m_stream_lock);
+	se = ksmbd_stream_index_find(ci, fp->stream.name);
+	if (se && se->sidecar)
+		err = vfs_fsync(se->sidecar, 0);
+	mutex_unlock(&ci->m_stream_lock);
+	return err;
+}
+
+/**
+ * ksmbd_vfs_stream_release() - drop the cached value of the stream on
+ * close, unless another handle still has it open
+ * @fp:		ksmbd file of the stream, already unlinked from its inode
+ */
+void ksmbd_vfs_stream_release(struct ksmbd_file *fp)
+{
+	struct ksmbd_stream_entry *se;
+
+	mutex_lock(&fp->f_ci->m_stream_lock);
+	se = ksmbd_stream_index_find(fp->f_ci, fp->stream.name);
+	if (se && !ksmbd_stream_held(fp->f_ci, se)) {
+		if (se->stale) {
+			ksmbd_stream_entry_free(se);
+		} else {
+			ksmbd_stream_entry_drop_data(se);
+			if (se->sidecar) {
+				fput(se->sidecar);
+				se->sidecar = NULL;
+			}
+		}
+	}
+	mutex_unlock(&fp->f_ci->m_stream_lock);
+}
+
+/**
+ * ksmbd_vfs_stream_remove() - remove the stream opened by @fp
+ * @fp:		ksmbd file of the stream
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_vfs_stream_remove(struct ksmbd_file *fp)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct ksmbd_stream_entry *se;
+	int err;
+
+	mutex_lock(&ci->m_stream_lock);
+	se = ksmbd_stream_index_find(ci, fp->stream.name);
+	err = ksmbd_vfs_remove_xattr(fp->filp->f_path.dentry,
+				     se ? se->xattr_name : fp->stream.name);
+	if (err)
+		goto out;
+
+	if (se) {
+		if (se->in_sidecar)
+			ksmbd_stream_sidecar_remove(fp, se);
+		if (ksmbd_stream_held(ci, se)) {
+			ksmbd_stream_entry_drop_data(se);
+			se->stale = true;
+		} else {
+			ksmbd_stream_entry_free(se);
+		}
+	}
+	if (ci->m_streams_loaded)
+		ksmbd_stream_index_stamp(ci);
+out:
+	mutex_unlock(&ci->m_stream_lock);
+	return err;
+}
+
+static int ksmbd_vfs_stream_read(struct ksmbd_work *work, struct ksmbd_file *fp,
+				 char *buf, loff_t *pos, size_t count)
+{
+	struct ksmbd_stream_entry *se;
+	int err;
 
 	ksmbd_debug(VFS, "read stream data pos : %llu, count : %zd\n",
 		    *pos, count);
 
-	v_len = ksmbd_vfs_getcasexattr(fp->filp->f_path.dentry,
-				       fp->stream.name,
-				       fp->stream.size,
-				       &stream_buf);
-	if ((int)v_len <= 0)
-		return (int)v_len;
+	mutex_lock(&fp->f_ci->m_stream_lock);
+	se = ksmbd_stream_lookup(fp);
+	if (IS_ERR(se)) {
+		err = PTR_ERR(se);
+		goto out;
+	}
 
-	if (v_len <= *pos) {
-		count = -EINVAL;
-		goto free_buf;
+	if (se->in_sidecar) {
+		err = ksmbd_override_fsids(work);
+		if (err)
+			goto out;
+		err = ksmbd_stream_sidecar_open(fp, se, false);
+		if (!err)
+			err = kernel_read(se->sidecar, buf, count, pos);
+		ksmbd_revert_fsids(work);
+		goto out;
 	}
 
-	if (v_len - *pos < count)
-		count = v_len - *pos;
+	err = ksmbd_stream_load_data(se, fp->filp->f_path.dentry);
+	if (err)
+		goto out;
+
+	/* end of stream, as for a sidecar backed one */
+	if (*pos >= se->size)
+		goto out;
 
-	memcpy(buf, &stream_buf[*pos], count);
+	if (se->size - *pos < count)
+		count = se->size - *pos;
 
-free_buf:
-	kvfree(stream_buf);
-	return count;
+	memcpy(buf, &se->data[*pos], count);
+	err = count;
+out:
+	mutex_unlock(&fp->f_ci->m_stream_lock);
+	return err;
 }
 
 /**
@@ -373,17 +1224,17 @@ out:
  * ksmbd_vfs_read() - vfs helper for smb file read
  * @work:	smb work
  * @fid:	file id of open file
+ * @rbuf:	buffer to read into
  * @count:	read byte count
  * @pos:	file pos
  *
  * Return:	number of read bytes on success, otherwise error
  */
-int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, size_t count,
-		   loff_t *pos)
+int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, char *rbuf,
+		   size_t count, loff_t *pos)
 {
 	struct file *filp = fp->filp;
 	ssize_t nbytes = 0;
-	char *rbuf = work->aux_payload_buf;
 	struct inode *inode = file_inode(filp);
 
 	if (S_ISDIR(inode->i_mode))
@@ -401,9 +1252,9 @@ int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, size_t count,
 	}
 
 	if (ksmbd_stream_fd(fp))
-		return ksmbd_vfs_stream_read(fp, rbuf, pos, count);
+		return ksmbd_vfs_stream_read(work, fp, rbuf, pos, count);
 
-	if (!work->tcon->posix_extensions) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 		int ret;
 
 		ret = check_lock_range(filp, *pos, *pos + count - 1, READ);
@@ -424,59 +1275,242 @@ int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, size_t count,
 	return nbytes;
 }
 
-static int ksmbd_vfs_stream_write(struct ksmbd_file *fp, char *buf, loff_t *pos,
-				  size_t count)
+/**
+ * ksmbd_vfs_can_read_pages() - check if a file can be read into pages
+ * with ksmbd_vfs_read_pages()
+ * @fp:		ksmbd file pointer
+ *
+ * Return:	true if the page cache pages of the file can be taken
+ */
+bool ksmbd_vfs_can_read_pages(struct ksmbd_file *fp)
+{
+	return S_ISREG(file_inode(fp->filp)->i_mode) && !ksmbd_stream_fd(fp) &&
+		fp->filp->f_op->splice_read;
+}
+
+struct ksmbd_read_pages {
+	struct page	**pages;
+	unsigned int	nr_pages;
+	unsigned int	nr;
+	/* where the next byte goes, in pages[nr - 1] or a new page */
+	unsigned int	off;
+};
+
+/*
+ * Take a reference on the page of @buf instead of copying it. The pages
+ * must line up as one run starting at the offset of the read into the
+ * first page, which is how the page cache hands them out.
+ */
+static int ksmbd_splice_pages_actor(struct pipe_inode_info *pipe,
+				    struct pipe_buffer *buf,
+				    struct splice_desc *sd)
+{
+	struct ksmbd_read_pages *rp = sd->u.data;
+	struct page *page = nth_page(buf->page, buf->offset >> PAGE_SHIFT);
+	unsigned int off = offset_in_page(buf->offset);
+	unsigned int len = min_t(unsigned int, sd->len, PAGE_SIZE - off);
+
+	if (!rp->nr || rp->off == PAGE_SIZE) {
+		if (rp->nr == rp->nr_pages || off != (rp->nr ? 0 : rp->off))
+			return -EOPNOTSUPP;
+		get_page(page);
+		rp->pages[rp->nr++] = page;
+	} else if (page != rp->pages[rp->nr - 1] || off != rp->off) {
+		return -EOPNOTSUPP;
+	}
+
+	rp->off = off + len;
+	return len;
+}
+
+static int ksmbd_splice_direct_actor(struct pipe_inode_info *pipe,
+				     struct splice_desc *sd)
+{
+	return __splice_from_pipe(pipe, sd, ksmbd_splice_pages_actor);
+}
+
+/**
+ * ksmbd_vfs_read_pages() - take the page cache pages of a file range
+ * @work:	smb work
+ * @fp:		ksmbd file pointer, see ksmbd_vfs_can_read_pages()
+ * @pages:	array to store the pages, large enough for the range
+ * @count:	read byte count
+ * @pos:	file pos
+ *
+ * The range is read through ->splice_read() like nfsd does, so
+ * rw_verify_area(), the permission hooks and filesystem locking all
+ * apply, but the page cache pages themselves are referenced instead of
+ * being copied, and can be mapped for RDMA as they are. The caller must
+ * release the pages with ksmbd_vfs_put_pages(). The data starts at
+ * offset_in_page(@pos) into the first page.
+ *
+ * Return:	number of bytes available in @pages, -EOPNOTSUPP if the file
+ *		did not hand out pages that line up, otherwise error
+ */
+ssize_t ksmbd_vfs_read_pages(struct ksmbd_work *work, struct ksmbd_file *fp,
+			     struct page **pages, size_t count, loff_t pos)
+{
+	struct file *filp = fp->filp;
+	struct ksmbd_read_pages rp = {
+		.pages		= pages,
+		.nr_pages	= DIV_ROUND_UP(offset_in_page(pos) + count,
+					       PAGE_SIZE),
+		.off		= offset_in_page(pos),
+	};
+	struct splice_desc sd = {
+		.len		= 0,
+		.total_len	= count,
+		.flags		= 0,
+		.pos		= pos,
+		.u.data		= &rp,
+	};
+	ssize_t nbytes;
+
+	if (work->conn->connection_type) {
+		if (!(fp->daccess & (FILE_READ_DATA_LE | FILE_EXECUTE_LE))) {
+			pr_err("no right to read(%pd)\n",
+			       fp->filp->f_path.dentry);
+			return -EACCES;
+		}
+	}
+
+	if (!count)
+		return 0;
+
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
+		int ret;
+
+		ret = check_lock_range(filp, pos, pos + count - 1, READ);
+		if (ret) {
+			pr_err("unable to read due to lock\n");
+			return -EAGAIN;
+		}
+	}
+
+	nbytes = splice_direct_to_actor(filp, &sd, ksmbd_splice_direct_actor);
+	if (nbytes < 0) {
+		ksmbd_vfs_put_pages(pages, rp.nr);
+		if (nbytes != -EOPNOTSUPP)
+			pr_err("smb read failed for (%s), err = %zd\n",
+			       fp->filename, nbytes);
+		return nbytes;
+	}
+
+	/* the pages taken always hold exactly the bytes returned */
+	fsnotify_access(filp);
+	filp->f_pos = pos + nbytes;
+	return nbytes;
+}
+
+/**
+ * ksmbd_vfs_put_pages() - release pages from ksmbd_vfs_read_pages()
+ * @pages:	page array
+ * @nr_pages:	number of pages
+ */
+void ksmbd_vfs_put_pages(struct page **pages, unsigned int nr_pages)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_pages; i++)
+		put_page(pages[i]);
+}
+
+static int ksmbd_vfs_stream_write(struct ksmbd_work *work, struct ksmbd_file *fp,
+				  char *buf, loff_t *pos, size_t count)
 {
-	char *stream_buf = NULL, *wbuf;
-	size_t size, v_len;
+	struct ksmbd_stream_entry *se;
+	loff_t off = *pos;
+	ssize_t written;
+	size_t size, old_size;
 	int err = 0;
 
 	ksmbd_debug(VFS, "write stream data pos : %llu, count : %zd\n",
 		    *pos, count);
 
-	size = *pos + count;
-	if (size > XATTR_SIZE_MAX) {
-		size = XATTR_SIZE_MAX;
-		count = (*pos + count) - XATTR_SIZE_MAX;
+	mutex_lock(&fp->f_ci->m_stream_lock);
+	se = ksmbd_stream_lookup(fp);
+	if (IS_ERR(se)) {
+		err = PTR_ERR(se);
+		pr_err("not found stream in xattr : %d\n", err);
+		goto out;
 	}
 
-	v_len = ksmbd_vfs_getcasexattr(fp->filp->f_path.dentry,
-				       fp->stream.name,
-				       fp->stream.size,
-				       &stream_buf);
-	if ((int)v_len < 0) {
-		pr_err("not found stream in xattr : %zd\n", v_len);
-		err = (int)v_len;
-		goto out;
+	if (!se->in_sidecar && ksmbd_stream_sidecar_enabled(fp) &&
+	    *pos + count > KSMBD_STREAM_SIDECAR_THRESHOLD) {
+		err = ksmbd_stream_sidecar_migrate(work, fp, se);
+		/* a name too long for the sidecar xattr stays in its xattr */
+		if (err && err != -ENAMETOOLONG)
+			goto out;
+		err = 0;
 	}
 
-	if (v_len < size) {
-		wbuf = kvmalloc(size, GFP_KERNEL | __GFP_ZERO);
-		if (!wbuf) {
-			err = -ENOMEM;
+	if (se->in_sidecar) {
+		err = ksmbd_override_fsids(work);
+		if (err)
+			goto out;
+		err = ksmbd_stream_sidecar_open(fp, se, false);
+		if (!err) {
+			written = kernel_write(se->sidecar, buf, count, &off);
+			if (written < 0)
+				err = written;
+			else if (written != (ssize_t)count)
+				err = -ENOSPC;
+		}
+		ksmbd_revert_fsids(work);
+		if (err)
 			goto out;
+
+		if (off > se->size) {
+			old_size = se->size;
+			se->size = off;
+			err = ksmbd_stream_store(fp->f_ci, se,
+						 fp->filp->f_path.dentry);
+			if (err) {
+				se->size = old_size;
+				goto out;
+			}
 		}
+		fp->filp->f_pos = *pos;
+		goto out;
+	}
 
-		if (v_len > 0)
-			memcpy(wbuf, stream_buf, v_len);
-		kvfree(stream_buf);
-		stream_buf = wbuf;
+	if (*pos >= XATTR_SIZE_MAX) {
+		err = -ENOSPC;
+		goto out;
 	}
 
-	memcpy(&stream_buf[*pos], buf, count);
+	size = *pos + count;
+	if (size > XATTR_SIZE_MAX) {
+		size = XATTR_SIZE_MAX;
+		count = XATTR_SIZE_MAX - *pos;
+	}
 
-	err = ksmbd_vfs_setxattr(fp->filp->f_path.dentry,
-				 fp->stream.name,
-				 (void *)stream_buf,
-				 size,
-				 0);
-	if (err < 0)
+	err = ksmbd_stream_load_data(se, fp->filp->f_path.dentry);
+	if (err)
 		goto out;
 
+	err = ksmbd_stream_reserve(se, size);
+	if (err)
+		goto out;
+
+	old_size = se->size;
+	if (*pos > se->size)
+		memset(&se->data[se->size], 0, *pos - se->size);
+	memcpy(&se->data[*pos], buf, count);
+	if (size > se->size)
+		se->size = size;
+
+	err = ksmbd_stream_store(fp->f_ci, se, fp->filp->f_path.dentry);
+	if (err) {
+		/* the cached value no longer matches the xattr */
+		ksmbd_stream_entry_drop_data(se);
+		se->size = old_size;
+		goto out;
+	}
+
 	fp->filp->f_pos = *pos;
-	err = 0;
 out:
-	kvfree(stream_buf);
+	mutex_unlock(&fp->f_ci->m_stream_lock);
 	return err;
 }
 
@@ -513,13 +1547,19 @@ int ksmbd_vfs_write(struct ksmbd_work *work, struct ksmbd_file *fp,
 	filp = fp->filp;
 
 	if (ksmbd_stream_fd(fp)) {
-		err = ksmbd_vfs_stream_write(fp, buf, pos, count);
-		if (!err)
-			*written = count;
+		err = ksmbd_vfs_stream_write(work, fp, buf, pos, count);
+		if (err)
+			goto out;
+		*written = count;
+		if (sync) {
+			err = ksmbd_vfs_stream_flush(fp);
+			if (!err)
+				err = vfs_fsync(filp, 0);
+		}
 		goto out;
 	}
 
-	if (!work->tcon->posix_extensions) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 		err = check_lock_range(filp, *pos, *pos + count - 1, WRITE);
 		if (err) {
 			pr_err("unable to write due to lock\n");
@@ -738,6 +1778,8 @@ int ksmbd_vfs_symlink(struct ksmbd_work *work, const char *name,
 #endif
 	if (err && (err != -EEXIST || err != -ENOSPC))
 		ksmbd_debug(VFS, "failed to create symlink, err %d\n", err);
+	else if (!err)
+		ksmbd_dir_cache_invalidate(d_inode(path.dentry));
 
 	done_path_create(&path, dentry);
 	ksmbd_revert_fsids(work);
@@ -849,7 +1891,9 @@ int ksmbd_vfs_fsync(struct ksmbd_work *work, u64 fid, u64 p_id)
 		pr_err("failed to get filp for fid %llu\n", fid);
 		return -ENOENT;
 	}
-	err = vfs_fsync(fp->filp, 0);
+	err = ksmbd_vfs_stream_flush(fp);
+	if (!err)
+		err = vfs_fsync(fp->filp, 0);
 	if (err < 0)
 		pr_err("smb fsync failed, err = %d\n", err);
 	ksmbd_fd_put(work, fp);
@@ -872,8 +1916,7 @@ int ksmbd_vfs_remove_file(struct ksmbd_work *work, char *name)
 	if (ksmbd_override_fsids(work))
 		return -ENOMEM;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS))
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_FOLLOW_SYMLINKS))
 		flags = LOOKUP_FOLLOW;
 
 	err = kern_path(name, flags, &path);
@@ -917,6 +1960,8 @@ int ksmbd_vfs_remove_file(struct ksmbd_work *work, char *name)
 			ksmbd_debug(VFS, "%s: unlink failed, err %d\n", name,
 				    err);
 	}
+	if (!err)
+		ksmbd_dir_cache_invalidate(d_inode(parent));
 
 out_err:
 	inode_unlock(d_inode(parent));
@@ -944,8 +1989,7 @@ int ksmbd_vfs_link(struct ksmbd_work *work, const char *oldname,
 	if (ksmbd_override_fsids(work))
 		return -ENOMEM;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS))
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_FOLLOW_SYMLINKS))
 		flags = LOOKUP_FOLLOW;
 
 	err = kern_path(oldname, flags, &oldpath);
@@ -977,6 +2021,8 @@ int ksmbd_vfs_link(struct ksmbd_work *work, const char *oldname,
 #endif
 	if (err)
 		ksmbd_debug(VFS, "vfs_link failed err %d\n", err);
+	else
+		ksmbd_dir_cache_invalidate(d_inode(newpath.dentry));
 
 out3:
 	done_path_create(&newpath, dentry);
@@ -1020,7 +2066,7 @@ static int __ksmbd_vfs_rename(struct ksmbd_work *work,
 	struct dentry *dst_dent;
 	int err;
 
-	if (!work->tcon->posix_extensions) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 		err = ksmbd_validate_entry_in_use(src_dent);
 		if (err)
 			return err;
@@ -1066,8 +2112,12 @@ static int __ksmbd_vfs_rename(struct ksmbd_work *work,
 				 0);
 #endif
 	}
-	if (err)
+	if (err) {
 		pr_err("vfs_rename failed err %d\n", err);
+	} else {
+		ksmbd_dir_cache_invalidate(d_inode(src_dent_parent));
+		ksmbd_dir_cache_invalidate(d_inode(dst_dent_parent));
+	}
 	if (dst_dent)
 		dput(dst_dent);
 out:
@@ -1093,8 +2143,7 @@ int ksmbd_vfs_fp_rename(struct ksmbd_work *work, struct ksmbd_file *fp,
 	src_dent = fp->filp->f_path.dentry;
 
 	flags = LOOKUP_DIRECTORY;
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS))
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_FOLLOW_SYMLINKS))
 		flags |= LOOKUP_FOLLOW;
 
 	err = kern_path(newname, flags, &dst_path);
@@ -1238,7 +2287,7 @@ int ksmbd_vfs_truncate(struct ksmbd_work *work, const char *name,
 		/* Do we need to break any of a levelII oplock? */
 		smb_break_all_levII_oplock(work, fp, 1);
 
-		if (!work->tcon->posix_extensions) {
+		if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 			struct inode *inode = file_inode(filp);
 
 			if (size < inode->i_size) {
@@ -1827,6 +2876,8 @@ int ksmbd_vfs_unlink(struct dentry *dir, struct dentry *dentry)
 #endif
 
 	dput(dentry);
+	if (!err)
+		ksmbd_dir_cache_invalidate(d_inode(dir));
 	inode_unlock(d_inode(dir));
 	if (err)
 		ksmbd_debug(VFS, "failed to delete, err %d\n", err);
@@ -1965,6 +3016,8 @@ static int ksmbd_vfs_lookup_in_dir(struct path *dir, char *name, size_t namelen)
 {
 	int ret;
 	struct file *dfilp;
+	struct inode *dir_inode = d_inode(dir->dentry);
+	struct ksmbd_neg_entry *ne;
 	int flags = O_RDONLY | O_LARGEFILE;
 	struct ksmbd_readdir_data readdir_data = {
 		.ctx.actor	= __caseless_lookup,
@@ -1973,13 +3026,35 @@ static int ksmbd_vfs_lookup_in_dir(struct path *dir, char *name, size_t namelen)
 		.dirent_count	= 0,
 	};
 
+	/*
+	 * The negative cache is shared by all users, so the caller must be
+	 * allowed to read the directory before it may learn from it.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	ret = inode_permission(&init_user_ns, dir_inode, MAY_READ);
+#else
+	ret = inode_permission(dir_inode, MAY_READ);
+#endif
+	if (ret)
+		return ret;
+
+	if (ksmbd_neg_cache_lookup(dir_inode, name, namelen))
+		return -ENOENT;
+
 	dfilp = dentry_open(dir, flags, current_cred());
 	if (IS_ERR(dfilp))
 		return PTR_ERR(dfilp);
 
+	ne = ksmbd_neg_entry_alloc(dir_inode, name, namelen);
 	ret = iterate_dir(dfilp, &readdir_data.ctx);
-	if (readdir_data.dirent_count > 0)
+	if (readdir_data.dirent_count > 0) {
 		ret = 0;
+		ksmbd_neg_entry_free(ne);
+	} else if (!ret && ne) {
+		ksmbd_neg_cache_insert(ne, dir_inode);
+	} else {
+		ksmbd_neg_entry_free(ne);
+	}
 	fput(dfilp);
 	return ret;
 }
@@ -2118,8 +3193,7 @@ int ksmbd_vfs_fill_dentry_attrs(struct ksmbd_work *work, struct dentry *dentry,
 	else
 		ksmbd_kstat->file_attributes = ATTR_ARCHIVE_LE;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   KSMBD_SHARE_FLAG_STORE_DOS_ATTRS)) {
+	if (test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_STORE_DOS_ATTRS)) {
 		struct xattr_dos_attrib da;
 
 		rc = ksmbd_vfs_get_dos_attrib_xattr(dentry, &da);
@@ -2227,7 +3301,7 @@ int ksmbd_vfs_copy_file_ranges(struct ksmbd_work *work,
 
 	smb_break_all_levII_oplock(work, dst_fp, 1);
 
-	if (!work->tcon->posix_extensions) {
+	if (!test_tree_conn_fast_flag(work->tcon, KSMBD_TCON_POSIX)) {
 		for (i = 0; i < chunk_count; i++) {
 			src_off = le64_to_cpu(chunks[i].SourceOffset);
 			dst_off = le64_to_cpu(chunks[i].TargetOffset);
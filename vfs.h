@@ -116,7 +116,11 @@ int ksmbd_vfs_query_maximal_access(struct dentry *dentry, __le32 *daccess);
 int ksmbd_vfs_create(struct ksmbd_work *work, const char *name, umode_t mode);
 int ksmbd_vfs_mkdir(struct ksmbd_work *work, const char *name, umode_t mode);
 int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp,
-		   size_t count, loff_t *pos);
+		   char *rbuf, size_t count, loff_t *pos);
+bool ksmbd_vfs_can_read_pages(struct ksmbd_file *fp);
+ssize_t ksmbd_vfs_read_pages(struct ksmbd_work *work, struct ksmbd_file *fp,
+			     struct page **pages, size_t count, loff_t pos);
+void ksmbd_vfs_put_pages(struct page **pages, unsigned int nr_pages);
 int ksmbd_vfs_write(struct ksmbd_work *work, struct ksmbd_file *fp,
 		    char *buf, size_t count, loff_t *pos, bool sync,
 		    ssize_t *written);
@@ -166,6 +170,16 @@ int ksmbd_vfs_fsetxattr(struct ksmbd_work *work, const char *filename,
 int ksmbd_vfs_xattr_stream_name(char *stream_name, char **xattr_stream_name,
 				size_t *xattr_stream_name_size, int s_type);
 int ksmbd_vfs_remove_xattr(struct dentry *dentry, char *attr_name);
+struct ksmbd_inode;
+void ksmbd_vfs_stream_index_free(struct ksmbd_inode *ci);
+int ksmbd_vfs_stream_index_lock(struct ksmbd_file *fp);
+void ksmbd_vfs_stream_index_unlock(struct ksmbd_file *fp);
+void ksmbd_vfs_stream_remove_all(struct ksmbd_file *fp);
+ssize_t ksmbd_vfs_stream_size(struct ksmbd_file *fp);
+int ksmbd_vfs_stream_create(struct ksmbd_file *fp);
+int ksmbd_vfs_stream_flush(struct ksmbd_file *fp);
+void ksmbd_vfs_stream_release(struct ksmbd_file *fp);
+int ksmbd_vfs_stream_remove(struct ksmbd_file *fp);
 int ksmbd_vfs_kern_path(char *name, unsigned int flags, struct path *path,
 			bool caseless);
 int ksmbd_vfs_empty_dir(struct ksmbd_file *fp);
@@ -16,6 +16,7 @@
 #include "mgmt/tree_connect.h"
 #include "mgmt/user_session.h"
 #include "smb_common.h"
+#include "dir_cache.h"
 
 #define S_DEL_PENDING			1
 #define S_DEL_ON_CLS			2
@@ -165,6 +166,9 @@ static int ksmbd_inode_init(struct ksmbd_inode *ci, struct ksmbd_file *fp)
 	INIT_LIST_HEAD(&ci->m_fp_list);
 	INIT_LIST_HEAD(&ci->m_op_list);
 	rwlock_init(&ci->m_lock);
+	mutex_init(&ci->m_stream_lock);
+	INIT_LIST_HEAD(&ci->m_streams);
+	ci->m_streams_loaded = false;
 	return 0;
 }
 
@@ -205,6 +209,7 @@ static struct ksmbd_inode *ksmbd_inode_get(struct ksmbd_file *fp)
 static void ksmbd_inode_free(struct ksmbd_inode *ci)
 {
 	ksmbd_inode_unhash(ci);
+	ksmbd_vfs_stream_index_free(ci);
 	kfree(ci);
 }
 
@@ -251,11 +256,12 @@ static void __ksmbd_inode_close(struct ksmbd_file *fp)
 	filp = fp->filp;
 	if (ksmbd_stream_fd(fp) && (ci->m_flags & S_DEL_ON_CLS_STREAM)) {
 		ci->m_flags &= ~S_DEL_ON_CLS_STREAM;
-		err = ksmbd_vfs_remove_xattr(filp->f_path.dentry,
-					     fp->stream.name);
+		err = ksmbd_vfs_stream_remove(fp);
 		if (err)
 			pr_err("remove xattr failed : %s\n",
 			       fp->stream.name);
+	} else if (ksmbd_stream_fd(fp)) {
+		ksmbd_vfs_stream_release(fp);
 	}
 
 	if (atomic_dec_and_test(&ci->m_count)) {
@@ -265,6 +271,8 @@ static void __ksmbd_inode_close(struct ksmbd_file *fp)
 			dir = dentry->d_parent;
 			ci->m_flags &= ~(S_DEL_ON_CLS | S_DEL_PENDING);
 			write_unlock(&ci->m_lock);
+			if (d_inode(dentry)->i_nlink == 1)
+				ksmbd_vfs_stream_remove_all(fp);
 			ksmbd_vfs_unlink(dir, dentry);
 			write_lock(&ci->m_lock);
 		}
@@ -310,6 +318,7 @@ static void __ksmbd_close_fd(struct ksmbd_file_table *ft, struct ksmbd_file *fp)
 	filp = fp->filp;
 
 	__ksmbd_inode_close(fp);
+	ksmbd_dir_snapshot_detach(fp);
 	if (!IS_ERR_OR_NULL(filp))
 		fput(filp);
 	kfree(fp->filename);
@@ -11,6 +11,7 @@
 #include <linux/fs.h>
 #include <linux/rwsem.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/idr.h>
 #include <linux/workqueue.h>
 
@@ -28,6 +29,7 @@
 
 struct ksmbd_conn;
 struct ksmbd_session;
+struct ksmbd_dir_snapshot;
 
 struct ksmbd_lock {
 	struct file_lock *fl;
@@ -45,6 +47,21 @@ struct stream {
 	ssize_t size;
 };
 
+/* one DosStream xattr of an inode, see ksmbd_vfs_stream_index_lock() */
+struct ksmbd_stream_entry {
+	struct list_head		list;
+	char				*xattr_name;
+	size_t				size;
+	/* stream value, loaded on first access and stored by every write */
+	char				*data;
+	size_t				data_alloc;
+	/* xattr is gone, kept only while other handles have it open */
+	bool				stale;
+	/* large streams live in a sidecar file, the xattr only holds a marker */
+	bool				in_sidecar;
+	struct file			*sidecar;
+};
+
 struct ksmbd_inode {
 	rwlock_t			m_lock;
 	atomic_t			m_count;
@@ -58,6 +75,11 @@ struct ksmbd_inode {
 	struct list_head		m_op_list;
 	struct oplock_info		*m_opinfo;
 	__le32				m_fattr;
+
+	struct mutex			m_stream_lock;
+	struct list_head		m_streams;
+	bool				m_streams_loaded;
+	struct timespec64		m_streams_ctime;
 };
 
 struct ksmbd_file {
@@ -109,6 +131,10 @@ struct ksmbd_file {
 	/* if ls is happening on directory, below is valid*/
 	struct ksmbd_readdir_data	readdir_data;
 	int				dot_dotdot[2];
+	/* cached enumeration being served, or built by this scan */
+	struct ksmbd_dir_snapshot	*dir_snap;
+	unsigned int			dir_snap_pos;
+	bool				dir_snap_building;
 };
 
 static inline void set_ctx_actor(struct dir_context *ctx,
@@ -112,6 +112,11 @@ struct xattr_ntacl {
 #define XATTR_NAME_STREAM		(XATTR_USER_PREFIX STREAM_PREFIX)
 #define XATTR_NAME_STREAM_LEN		(sizeof(XATTR_NAME_STREAM) - 1)
 
+/* STREAM SIDECAR XATTR PREFIX, followed by the stream name */
+#define SIDECAR_PREFIX			"ksmbd.Sidecar."
+#define XATTR_NAME_SIDECAR		(XATTR_TRUSTED_PREFIX SIDECAR_PREFIX)
+#define XATTR_NAME_SIDECAR_LEN		(sizeof(XATTR_NAME_SIDECAR) - 1)
+
 /* SECURITY DESCRIPTOR(NTACL) XATTR PREFIX */
 #define SD_PREFIX			"NTACL"
 #define SD_PREFIX_LEN	(sizeof(SD_PREFIX) - 1)